@@ -0,0 +1,348 @@
+// Codec microbenchmark: decode, resize, encode and the whole process() path,
+// single-threaded, over synthetic JPEG, PNG and WebP sources of several
+// sizes, with and without alpha, at several output scales. Sources are
+// generated in-process from a fixed seed, so runs on different commits see
+// the same bytes.
+//
+//   cmake -DIMGBOOST_BUILD_BENCH=ON .. && make codec-bench
+//   ./codec-bench [--iterations N] [--filter TEXT] [--csv FILE]
+//                 [--compare BASELINE_CSV] [--threshold PERCENT]
+//
+// --csv writes one row per case; --compare reads such a file from an earlier
+// run and exits with status 1 when a case got slower by more than the
+// threshold (default 10%) or allocates more per op.
+//
+// ns/pixel and MB/s are per source pixel and per input byte: compressed
+// bytes for decode and process, raw pixels for resize and encode. Allocations
+// count operator new calls, which covers the pixel buffer pool's misses and
+// every C++ container; malloc calls inside libjpeg, libpng and libwebp are
+// not included.
+
+#include "image_processor.h"
+#include "resampler.h"
+#include "synthetic_images.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace imgboost;
+using namespace imgboost::bench;
+
+static std::atomic<uint64_t> g_allocations{0};
+
+void *operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t alignment = static_cast<size_t>(align);
+  size_t rounded =
+      (std::max<size_t>(size, 1) + alignment - 1) & ~(alignment - 1);
+  if (void *p = std::aligned_alloc(alignment, rounded)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+// ---------------------------------------------------------------------------
+// Measurement
+
+struct Result {
+  std::string op;
+  std::string format;
+  int width = 0;
+  int height = 0;
+  bool alpha = false;
+  double scale = 1;
+  double best_ms = 0;
+  double ns_per_pixel = 0;
+  double mb_per_s = 0;
+  double allocs_per_op = 0;
+
+  std::string key() const {
+    char buf[128];
+    std::snprintf(buf, sizeof(buf), "%s/%s %dx%d %s x%.2f", op.c_str(),
+                  format.c_str(), width, height, alpha ? "rgba" : "rgb",
+                  scale);
+    return buf;
+  }
+};
+
+// One warm-up run, which also fills the buffer pool so the allocation count
+// reflects steady state, then the best of N timed runs
+template <typename Fn>
+static void measure(Result &result, int iterations, uint64_t pixels,
+                    uint64_t bytes, Fn &&fn) {
+  fn();
+  double best = 1e300;
+  uint64_t allocations = g_allocations.load(std::memory_order_relaxed);
+  for (int i = 0; i < iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(
+        best, std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  allocations = g_allocations.load(std::memory_order_relaxed) - allocations;
+  result.best_ms = best;
+  result.ns_per_pixel = best * 1e6 / static_cast<double>(pixels);
+  result.mb_per_s = static_cast<double>(bytes) / (best * 1000.0);
+  result.allocs_per_op = static_cast<double>(allocations) / iterations;
+}
+
+static void print_result(const Result &r) {
+  std::printf("%-36s %10.2f ms %9.2f ns/px %9.1f MB/s %8.1f allocs/op\n",
+              r.key().c_str(), r.best_ms, r.ns_per_pixel, r.mb_per_s,
+              r.allocs_per_op);
+  std::fflush(stdout);
+}
+
+static const char *kCsvHeader =
+    "op,format,width,height,alpha,scale,best_ms,ns_per_pixel,mb_per_s,"
+    "allocs_per_op";
+
+static void write_csv(const std::string &path,
+                      const std::vector<Result> &results) {
+  std::ofstream out(path);
+  out << kCsvHeader << "\n";
+  char buf[256];
+  for (const Result &r : results) {
+    std::snprintf(buf, sizeof(buf), "%s,%s,%d,%d,%d,%.2f,%.4f,%.4f,%.2f,%.2f",
+                  r.op.c_str(), r.format.c_str(), r.width, r.height,
+                  r.alpha ? 1 : 0, r.scale, r.best_ms, r.ns_per_pixel,
+                  r.mb_per_s, r.allocs_per_op);
+    out << buf << "\n";
+  }
+}
+
+static std::map<std::string, Result> read_csv(const std::string &path) {
+  std::map<std::string, Result> results;
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line); // header
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, ',')) {
+      fields.push_back(field);
+    }
+    if (fields.size() != 10) {
+      continue;
+    }
+    Result r;
+    r.op = fields[0];
+    r.format = fields[1];
+    r.width = std::atoi(fields[2].c_str());
+    r.height = std::atoi(fields[3].c_str());
+    r.alpha = fields[4] == "1";
+    r.scale = std::atof(fields[5].c_str());
+    r.best_ms = std::atof(fields[6].c_str());
+    r.ns_per_pixel = std::atof(fields[7].c_str());
+    r.mb_per_s = std::atof(fields[8].c_str());
+    r.allocs_per_op = std::atof(fields[9].c_str());
+    results[r.key()] = r;
+  }
+  return results;
+}
+
+// Prints every case next to its baseline; returns the number of regressions
+static int compare(const std::vector<Result> &results,
+                   const std::map<std::string, Result> &baseline,
+                   double threshold) {
+  int regressions = 0;
+  std::printf("\n%-36s %12s %12s %8s %s\n", "case", "base ns/px", "ns/px",
+              "delta", "allocs");
+  for (const Result &r : results) {
+    auto it = baseline.find(r.key());
+    if (it == baseline.end()) {
+      continue;
+    }
+    const Result &base = it->second;
+    double delta = (r.ns_per_pixel / base.ns_per_pixel - 1) * 100;
+    bool slower = delta > threshold;
+    bool allocs = r.allocs_per_op > base.allocs_per_op + 0.5;
+    std::printf("%-36s %12.2f %12.2f %+7.1f%% %.1f -> %.1f%s\n",
+                r.key().c_str(), base.ns_per_pixel, r.ns_per_pixel, delta,
+                base.allocs_per_op, r.allocs_per_op,
+                slower || allocs ? "  REGRESSION" : "");
+    if (slower || allocs) {
+      regressions++;
+    }
+  }
+  return regressions;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  int iterations = 5;
+  std::string filter, csv_path, baseline_path;
+  double threshold = 10;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--iterations" && has_value) {
+      iterations = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--filter" && has_value) {
+      filter = argv[++i];
+    } else if (arg == "--csv" && has_value) {
+      csv_path = argv[++i];
+    } else if (arg == "--compare" && has_value) {
+      baseline_path = argv[++i];
+    } else if (arg == "--threshold" && has_value) {
+      threshold = std::atof(argv[++i]);
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--iterations N] [--filter TEXT] [--csv FILE] "
+                   "[--compare BASELINE_CSV] [--threshold PERCENT]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+
+  struct Size {
+    int width, height;
+  };
+  const Size sizes[] = {{640, 480}, {1920, 1080}, {4000, 3000}};
+  const double scales[] = {1.0, 0.5, 0.25};
+  const ImageFormat formats[] = {ImageFormat::JPEG, ImageFormat::PNG,
+                                 ImageFormat::WEBP};
+  const char *format_names[] = {"jpeg", "png", "webp"};
+
+  std::printf("resampler kernels: %s, best of %d runs, single-threaded\n\n",
+              resampler_isa(), iterations);
+
+  std::vector<Result> results;
+  ImageProcessor processor;
+  auto run = [&](Result result, uint64_t pixels, uint64_t bytes,
+                 auto &&fn) {
+    if (!filter.empty() && result.key().find(filter) == std::string::npos) {
+      return;
+    }
+    try {
+      measure(result, iterations, pixels, bytes, fn);
+    } catch (const std::exception &e) {
+      std::printf("%-36s failed: %s\n", result.key().c_str(), e.what());
+      return;
+    }
+    print_result(result);
+    results.push_back(result);
+  };
+
+  for (const Size &size : sizes) {
+    uint64_t src_pixels = static_cast<uint64_t>(size.width) * size.height;
+    for (bool alpha : {false, true}) {
+      int channels = alpha ? 4 : 3;
+      std::vector<uint8_t> pixels =
+          synthetic_pixels(size.width, size.height, channels);
+      PixelBuffer source(pixels.size());
+      std::memcpy(source.data(), pixels.data(), pixels.size());
+
+      Result base;
+      base.width = size.width;
+      base.height = size.height;
+      base.alpha = alpha;
+
+      for (size_t f = 0; f < 3; ++f) {
+        // JPEG has no alpha channel
+        if (alpha && formats[f] == ImageFormat::JPEG) {
+          continue;
+        }
+        std::vector<uint8_t> encoded = encode_source(
+            formats[f], pixels, size.width, size.height, channels);
+        if (encoded.empty()) {
+          std::fprintf(stderr, "failed to encode %s source\n",
+                       format_names[f]);
+          return 1;
+        }
+        Result result = base;
+        result.format = format_names[f];
+        for (double scale : scales) {
+          result.scale = scale;
+          int req_width = static_cast<int>(size.width * scale);
+
+          // Only JPEG decodes differ by target size, through DCT scaling
+          if (scale == 1.0 || formats[f] == ImageFormat::JPEG) {
+            result.op = "decode";
+            run(result, src_pixels, encoded.size(), [&]() {
+              processor.decode(encoded.data(), encoded.size(), req_width, 0);
+            });
+          }
+
+          result.op = "process";
+          ImageOptions options(req_width, 0, 80);
+          run(result, src_pixels, encoded.size(), [&]() {
+            processor.process(encoded.data(), encoded.size(), options);
+          });
+        }
+      }
+
+      // Resize and encode work on raw pixels, their format is the layout
+      Result raw = base;
+      raw.format = alpha ? "rgba" : "rgb";
+      for (double scale : scales) {
+        raw.scale = scale;
+        int dst_width = std::max(1, static_cast<int>(size.width * scale));
+        int dst_height = std::max(1, static_cast<int>(size.height * scale));
+        PixelBuffer resized;
+        processor.resize_image(source, size.width, size.height, channels,
+                               resized, dst_width, dst_height);
+
+        if (scale != 1.0) {
+          raw.op = "resize";
+          run(raw, src_pixels, pixels.size(), [&]() {
+            PixelBuffer dst;
+            processor.resize_image(source, size.width, size.height, channels,
+                                   dst, dst_width, dst_height);
+          });
+        }
+
+        raw.op = "encode";
+        uint64_t dst_pixels = static_cast<uint64_t>(dst_width) * dst_height;
+        run(raw, dst_pixels, dst_pixels * channels, [&]() {
+          processor.encode_webp(resized, dst_width, dst_height, channels, 80);
+        });
+      }
+    }
+  }
+
+  if (!csv_path.empty()) {
+    write_csv(csv_path, results);
+    std::printf("\nwrote %zu cases to %s\n", results.size(), csv_path.c_str());
+  }
+  if (!baseline_path.empty()) {
+    std::map<std::string, Result> baseline = read_csv(baseline_path);
+    if (baseline.empty()) {
+      std::fprintf(stderr, "no cases read from %s\n", baseline_path.c_str());
+      return 2;
+    }
+    int regressions = compare(results, baseline, threshold);
+    std::printf("\n%d regression(s) above %.0f%%\n", regressions, threshold);
+    return regressions > 0 ? 1 : 0;
+  }
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Connection reuse benchmark: downloads from a local origin stand-in, first
+// with a new httplib::Client per download as AsyncDownloader used to, then
+// through the ConnectionPool. The origin counts the TCP connections it
+// accepted by distinct client ports.
+//
+//   cmake -DIMGBOOST_BUILD_BENCH=ON .. && make connection-bench
+//   ./connection-bench [downloads] [threads]
+
+#include "connection_pool.h"
+#include "httplib.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace imgboost;
+
+class Origin {
+public:
+  Origin() : body_(64 * 1024, 'x') {
+    server_.Get("/image", [this](const httplib::Request &req,
+                                 httplib::Response &res) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ports_.insert(req.remote_port);
+      }
+      res.set_content(body_, "application/octet-stream");
+    });
+    port_ = server_.bind_to_any_port("127.0.0.1");
+    thread_ = std::thread([this]() { server_.listen_after_bind(); });
+    server_.wait_until_ready();
+  }
+
+  ~Origin() {
+    server_.stop();
+    thread_.join();
+  }
+
+  std::string url() const {
+    return "http://127.0.0.1:" + std::to_string(port_);
+  }
+
+  size_t take_connections() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = ports_.size();
+    ports_.clear();
+    return count;
+  }
+
+private:
+  std::string body_;
+  httplib::Server server_;
+  int port_ = 0;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::set<int> ports_;
+};
+
+// Runs downloads spread over threads, returns the failures
+template <typename Fetch>
+static int run(int downloads, int threads, Fetch fetch, double &ms) {
+  std::atomic<int> next{0}, failed{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&]() {
+      while (next.fetch_add(1) < downloads) {
+        if (!fetch()) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  ms = std::chrono::duration<double, std::milli>(
+           std::chrono::steady_clock::now() - start)
+           .count();
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  int downloads = argc >= 2 ? std::atoi(argv[1]) : 2000;
+  int threads = argc >= 3 ? std::atoi(argv[2]) : 4;
+  if (downloads <= 0 || threads <= 0) {
+    std::fprintf(stderr, "usage: %s [downloads] [threads]\n", argv[0]);
+    return 1;
+  }
+
+  Origin origin;
+  double ms = 0;
+
+  int failed = run(downloads, threads, [&origin]() {
+    httplib::Client cli(origin.url());
+    auto res = cli.Get("/image");
+    return res && res->status == 200;
+  }, ms);
+  std::printf("%-12s %6d downloads %6zu connections %9.1f ms %d failed\n",
+              "per-request", downloads, origin.take_connections(), ms, failed);
+
+  ConnectionPoolConfig config;
+  config.max_per_host = static_cast<size_t>(threads);
+  ConnectionPool pool(config);
+  failed = run(downloads, threads, [&origin, &pool]() {
+    ConnectionPool::Lease lease = pool.acquire(origin.url(), "127.0.0.1");
+    auto res = lease.client().Get("/image");
+    if (!res) {
+      lease.discard();
+      return false;
+    }
+    return res->status == 200;
+  }, ms);
+  std::printf("%-12s %6d downloads %6zu connections %9.1f ms %d failed\n",
+              "pooled", downloads, origin.take_connections(), ms, failed);
+
+  ConnectionPoolStats stats = pool.stats();
+  std::printf("\npool: %llu created, %llu reused, %llu waits, "
+              "dns %llu hits / %llu misses\n",
+              static_cast<unsigned long long>(stats.created),
+              static_cast<unsigned long long>(stats.reused),
+              static_cast<unsigned long long>(stats.waited),
+              static_cast<unsigned long long>(stats.dns_hits),
+              static_cast<unsigned long long>(stats.dns_misses));
+
+  // Each worker holds at most one connection at a time
+  return failed == 0 && stats.created <= config.max_per_host ? 0 : 1;
+}
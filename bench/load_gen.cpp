@@ -0,0 +1,586 @@
+// End-to-end load generator: serves a corpus of synthetic JPEG, PNG and WebP
+// images from a local origin stand-in with configurable latency and
+// bandwidth, drives a running img-boost (or one it spawns) with a mix of
+// widths, qualities and repeated requests, and reports throughput, latency
+// percentiles and the server's resident memory.
+//
+//   cmake -DIMGBOOST_BUILD_BENCH=ON .. && make load-gen
+//   ./load-gen --server ./img-boost --mode open --rate 200 --duration 60
+//   ./load-gen --target http://127.0.0.1:8080 --server-pid 1234 --mode closed
+//
+// Open loop issues requests on a fixed schedule whatever the responses do;
+// closed loop keeps --concurrency requests outstanding, paced at --rate when
+// one is given. Whenever there is a schedule, latency is measured from the
+// time a request was due rather than the time it was sent, so a stalled
+// server is charged for the requests it held back (coordinated omission).
+//
+// Every request is either for one of a fixed set of outputs, which the
+// server answers from its cache once it has produced them, or, with
+// probability 1 - --repeat, for a source URL never seen before, which it
+// downloads, decodes and encodes.
+
+#include "httplib.h"
+#include "synthetic_images.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <arpa/inet.h>
+#include <csignal>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace imgboost;
+using namespace imgboost::bench;
+using Clock = std::chrono::steady_clock;
+
+struct LoadOptions {
+  std::string target;        // running server, http://host:port
+  std::string server_binary; // or a server to spawn on a free port
+  int server_pid = 0;        // whose RSS is reported, set when spawning
+  bool open_loop = false;
+  int concurrency = 16;   // workers, i.e. requests in flight at most
+  double rate = 0;        // requests per second; required by open loop
+  double duration = 30;   // seconds measured
+  double warmup = 5;      // seconds run before measuring
+  int images = 24;        // corpus size
+  int origin_latency_ms = 0;
+  int64_t origin_bandwidth = 0; // bytes per second per response, 0 == line
+  int origin_threads = 64;
+  std::vector<int> widths{160, 320, 640, 1280};
+  std::vector<int> qualities{75, 85};
+  double repeat = 0.8; // share of requests for an output seen before
+  uint64_t seed = 1;
+  std::string csv; // summary row appended here
+};
+
+// ---------------------------------------------------------------------------
+// Origin
+
+struct CorpusImage {
+  std::string data;
+  const char *extension;
+  const char *content_type;
+};
+
+// Sizes cycle through common camera and web dimensions, formats through
+// JPEG, PNG and WebP; every other PNG and WebP set has alpha
+static std::vector<CorpusImage> make_corpus(int count) {
+  struct Size {
+    int width, height;
+  };
+  const Size sizes[] = {{640, 480}, {1280, 960}, {2048, 1536}, {4000, 3000}};
+  const ImageFormat formats[] = {ImageFormat::JPEG, ImageFormat::PNG,
+                                 ImageFormat::WEBP};
+  std::vector<CorpusImage> corpus;
+  for (int i = 0; i < count; ++i) {
+    ImageFormat format = formats[i % 3];
+    Size size = sizes[(i / 3) % 4];
+    bool alpha = format != ImageFormat::JPEG && (i / 12) % 2 == 1;
+    int channels = alpha ? 4 : 3;
+    std::vector<uint8_t> encoded = encode_source(
+        format, synthetic_pixels(size.width, size.height, channels),
+        size.width, size.height, channels);
+    CorpusImage image;
+    image.data.assign(encoded.begin(), encoded.end());
+    if (format == ImageFormat::JPEG) {
+      image.extension = "jpg";
+      image.content_type = "image/jpeg";
+    } else if (format == ImageFormat::PNG) {
+      image.extension = "png";
+      image.content_type = "image/png";
+    } else {
+      image.extension = "webp";
+      image.content_type = "image/webp";
+    }
+    corpus.push_back(std::move(image));
+  }
+  return corpus;
+}
+
+// Serves /img/<index>.<ext>, ignoring the query, after the configured
+// latency and at the configured bandwidth
+class Origin {
+public:
+  Origin(std::vector<CorpusImage> corpus, const LoadOptions &options)
+      : corpus_(std::move(corpus)), latency_ms_(options.origin_latency_ms),
+        bandwidth_(options.origin_bandwidth) {
+    int threads = options.origin_threads;
+    server_.new_task_queue = [threads]() {
+      return new httplib::ThreadPool(threads);
+    };
+    server_.Get(R"(/img/(\d+)\.\w+)", [this](const httplib::Request &req,
+                                             httplib::Response &res) {
+      size_t index = std::stoul(req.matches[1]) % corpus_.size();
+      const CorpusImage &image = corpus_[index];
+      if (latency_ms_ > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms_));
+      }
+      if (bandwidth_ <= 0) {
+        res.set_content(image.data, image.content_type);
+        return;
+      }
+      // One slice per 10 ms tick
+      size_t slice =
+          std::max<size_t>(1, static_cast<size_t>(bandwidth_ / 100));
+      res.set_content_provider(
+          image.data.size(), image.content_type,
+          [&image, slice](size_t offset, size_t length,
+                          httplib::DataSink &sink) {
+            size_t chunk = std::min(length, slice);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return sink.write(image.data.data() + offset, chunk);
+          });
+    });
+    port_ = server_.bind_to_any_port("127.0.0.1");
+    thread_ = std::thread([this]() { server_.listen_after_bind(); });
+    server_.wait_until_ready();
+  }
+
+  ~Origin() {
+    server_.stop();
+    thread_.join();
+  }
+
+  std::string image_url(size_t index, uint64_t version) const {
+    const CorpusImage &image = corpus_[index % corpus_.size()];
+    return "http://127.0.0.1:" + std::to_string(port_) + "/img/" +
+           std::to_string(index % corpus_.size()) + "." + image.extension +
+           "?v=" + std::to_string(version);
+  }
+
+  size_t size() const { return corpus_.size(); }
+
+private:
+  std::vector<CorpusImage> corpus_;
+  int latency_ms_;
+  int64_t bandwidth_;
+  httplib::Server server_;
+  int port_ = 0;
+  std::thread thread_;
+};
+
+// ---------------------------------------------------------------------------
+// Server under test
+
+#if defined(__linux__)
+static int free_port() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  int port = 0;
+  if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr *>(&addr), len) == 0 &&
+      getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) == 0) {
+    port = ntohs(addr.sin_port);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return port;
+}
+
+// Starts the server on a free port, returns its pid or 0
+static int spawn_server(const std::string &binary, std::string &target) {
+  int port = free_port();
+  if (port == 0) {
+    return 0;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // The per-request log lines would drown the report
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+    }
+    std::string port_arg = std::to_string(port);
+    execl(binary.c_str(), binary.c_str(), port_arg.c_str(),
+          static_cast<char *>(nullptr));
+    _exit(127);
+  }
+  if (pid < 0) {
+    return 0;
+  }
+  target = "http://127.0.0.1:" + std::to_string(port);
+  return pid;
+}
+
+static void stop_server(int pid) {
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+}
+
+// Resident set size in bytes from /proc, 0 when unavailable
+static uint64_t read_rss(int pid) {
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+    }
+  }
+  return 0;
+}
+#else
+static int spawn_server(const std::string &, std::string &) { return 0; }
+static void stop_server(int) {}
+static uint64_t read_rss(int) { return 0; }
+#endif
+
+static bool wait_healthy(const std::string &target, double seconds) {
+  httplib::Client cli(target);
+  cli.set_connection_timeout(1);
+  Clock::time_point deadline =
+      Clock::now() +
+      std::chrono::milliseconds(static_cast<int>(seconds * 1000));
+  while (Clock::now() < deadline) {
+    auto res = cli.Get("/health");
+    if (res && res->status == 200) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return false;
+}
+
+// Samples the server's RSS every 100 ms while the run lasts
+class RssSampler {
+public:
+  explicit RssSampler(int pid) : pid_(pid) {
+    if (pid_ <= 0) {
+      return;
+    }
+    start_ = read_rss(pid_);
+    thread_ = std::thread([this]() {
+      while (!stop_.load()) {
+        uint64_t rss = read_rss(pid_);
+        peak_ = std::max(peak_.load(), rss);
+        last_ = rss;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    });
+  }
+
+  ~RssSampler() { stop(); }
+
+  void stop() {
+    stop_ = true;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  uint64_t start() const { return start_; }
+  uint64_t peak() const { return peak_.load(); }
+  uint64_t last() const { return last_.load(); }
+
+private:
+  int pid_;
+  uint64_t start_ = 0;
+  std::atomic<uint64_t> peak_{0};
+  std::atomic<uint64_t> last_{0};
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+// ---------------------------------------------------------------------------
+// Load
+
+static uint64_t splitmix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+// The path of request number index, the same on every run with one seed.
+// Repeats draw from every (image, width, quality) at version 0; the rest
+// get a version of their own, a source URL the server has never fetched.
+static std::string request_path(const LoadOptions &options,
+                                const Origin &origin, uint64_t index) {
+  uint64_t r = splitmix64(options.seed * 0x100000001B3ull + index);
+  bool repeat = static_cast<double>(r % 1000000) / 1e6 < options.repeat;
+  r = splitmix64(r);
+  size_t image = r % origin.size();
+  int width = options.widths[(r >> 16) % options.widths.size()];
+  int quality = options.qualities[(r >> 32) % options.qualities.size()];
+  std::string url = origin.image_url(image, repeat ? 0 : index + 1);
+  return "/?src=" + url_encode(base64_encode(url)) +
+         "&width=" + std::to_string(width) +
+         "&quality=" + std::to_string(quality);
+}
+
+struct WorkerStats {
+  std::vector<uint64_t> latencies_us;
+  std::map<int, uint64_t> statuses; // 0 == no response
+  uint64_t bytes = 0;
+};
+
+// Each worker keeps one keep-alive connection. intended is when the request
+// was due; without a schedule it is the time it was sent.
+static void run_worker(const LoadOptions &options, const Origin &origin,
+                       int worker, std::atomic<uint64_t> &next,
+                       Clock::time_point start, WorkerStats &stats) {
+  httplib::Client cli(options.target);
+  cli.set_keep_alive(true);
+  cli.set_read_timeout(120);
+  Clock::time_point measure_from =
+      start + std::chrono::microseconds(
+                  static_cast<int64_t>(options.warmup * 1e6));
+  Clock::time_point end =
+      measure_from + std::chrono::microseconds(
+                         static_cast<int64_t>(options.duration * 1e6));
+
+  // Paced closed loop: each worker owns an evenly offset share of the rate
+  double worker_interval =
+      options.rate > 0 ? options.concurrency / options.rate : 0;
+  uint64_t sent = 0;
+
+  while (true) {
+    uint64_t index = next.fetch_add(1);
+    Clock::time_point intended;
+    if (options.open_loop) {
+      intended = start + std::chrono::microseconds(static_cast<int64_t>(
+                             index * 1e6 / options.rate));
+    } else if (worker_interval > 0) {
+      intended = start + std::chrono::microseconds(static_cast<int64_t>(
+                             (sent + static_cast<double>(worker) /
+                                         options.concurrency) *
+                             worker_interval * 1e6));
+    } else {
+      intended = Clock::now();
+    }
+    if (intended >= end) {
+      return;
+    }
+    std::this_thread::sleep_until(intended);
+    sent++;
+
+    auto res = cli.Get(request_path(options, origin, index));
+    Clock::time_point done = Clock::now();
+    if (intended < measure_from) {
+      continue;
+    }
+    int status = res ? res->status : 0;
+    stats.statuses[status]++;
+    if (res && res->status == 200) {
+      stats.bytes += res->body.size();
+    }
+    stats.latencies_us.push_back(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(done - intended)
+            .count()));
+  }
+}
+
+static double percentile_ms(const std::vector<uint64_t> &sorted, double q) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+  return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)] /
+         1000.0;
+}
+
+// ---------------------------------------------------------------------------
+
+static std::vector<int> parse_list(const char *value) {
+  std::vector<int> list = parse_int_list(value, 1, 8192, 64);
+  if (list.empty()) {
+    std::fprintf(stderr, "invalid list '%s'\n", value);
+    std::exit(2);
+  }
+  return list;
+}
+
+static void usage(const char *name) {
+  std::fprintf(
+      stderr,
+      "usage: %s (--target URL [--server-pid PID] | --server BINARY)\n"
+      "  [--mode open|closed] [--concurrency N] [--rate REQ_PER_S]\n"
+      "  [--duration S] [--warmup S] [--images N] [--widths 160,320,...]\n"
+      "  [--qualities 75,85] [--repeat 0..1] [--seed N]\n"
+      "  [--origin-latency-ms MS] [--origin-bandwidth-kbps KBPS]\n"
+      "  [--origin-threads N] [--csv FILE]\n",
+      name);
+  std::exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  LoadOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+    }
+    const char *value = argv[++i];
+    if (arg == "--target") {
+      options.target = value;
+    } else if (arg == "--server") {
+      options.server_binary = value;
+    } else if (arg == "--server-pid") {
+      options.server_pid = std::atoi(value);
+    } else if (arg == "--mode") {
+      options.open_loop = std::string(value) == "open";
+    } else if (arg == "--concurrency") {
+      options.concurrency = std::max(1, std::atoi(value));
+    } else if (arg == "--rate") {
+      options.rate = std::atof(value);
+    } else if (arg == "--duration") {
+      options.duration = std::atof(value);
+    } else if (arg == "--warmup") {
+      options.warmup = std::max(0.0, std::atof(value));
+    } else if (arg == "--images") {
+      options.images = std::max(1, std::atoi(value));
+    } else if (arg == "--widths") {
+      options.widths = parse_list(value);
+    } else if (arg == "--qualities") {
+      options.qualities = parse_list(value);
+    } else if (arg == "--repeat") {
+      options.repeat = std::min(1.0, std::max(0.0, std::atof(value)));
+    } else if (arg == "--seed") {
+      options.seed = std::strtoull(value, nullptr, 10);
+    } else if (arg == "--origin-latency-ms") {
+      options.origin_latency_ms = std::max(0, std::atoi(value));
+    } else if (arg == "--origin-bandwidth-kbps") {
+      options.origin_bandwidth =
+          static_cast<int64_t>(std::atof(value) * 1000 / 8);
+    } else if (arg == "--origin-threads") {
+      options.origin_threads = std::max(1, std::atoi(value));
+    } else if (arg == "--csv") {
+      options.csv = value;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (options.target.empty() == options.server_binary.empty() ||
+      (options.open_loop && options.rate <= 0) || options.duration <= 0) {
+    usage(argv[0]);
+  }
+
+  std::printf("generating %d source images...\n", options.images);
+  std::fflush(stdout);
+  Origin origin(make_corpus(options.images), options);
+
+  if (!options.server_binary.empty()) {
+    options.server_pid = spawn_server(options.server_binary, options.target);
+    if (options.server_pid == 0) {
+      std::fprintf(stderr, "failed to start %s\n",
+                   options.server_binary.c_str());
+      return 1;
+    }
+  }
+  if (!wait_healthy(options.target, 15)) {
+    std::fprintf(stderr, "%s is not answering /health\n",
+                 options.target.c_str());
+    if (!options.server_binary.empty()) {
+      stop_server(options.server_pid);
+    }
+    return 1;
+  }
+
+  bool corrected = options.open_loop || options.rate > 0;
+  std::printf("%s loop, %d workers, %s, %.0f s after %.0f s warmup, "
+              "repeat %.0f%%\n",
+              options.open_loop ? "open" : "closed", options.concurrency,
+              options.rate > 0
+                  ? (std::to_string(static_cast<int>(options.rate)) + " req/s")
+                        .c_str()
+                  : "unpaced",
+              options.duration, options.warmup, options.repeat * 100);
+  std::fflush(stdout);
+
+  RssSampler rss(options.server_pid);
+  std::atomic<uint64_t> next{0};
+  std::vector<WorkerStats> stats(options.concurrency);
+  std::vector<std::thread> workers;
+  Clock::time_point start = Clock::now();
+  for (int w = 0; w < options.concurrency; ++w) {
+    workers.emplace_back([&, w]() {
+      run_worker(options, origin, w, next, start, stats[w]);
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  rss.stop();
+  if (!options.server_binary.empty()) {
+    stop_server(options.server_pid);
+  }
+
+  std::vector<uint64_t> latencies;
+  std::map<int, uint64_t> statuses;
+  uint64_t bytes = 0;
+  for (const WorkerStats &s : stats) {
+    latencies.insert(latencies.end(), s.latencies_us.begin(),
+                     s.latencies_us.end());
+    for (const auto &status : s.statuses) {
+      statuses[status.first] += status.second;
+    }
+    bytes += s.bytes;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  uint64_t ok = statuses.count(200) ? statuses[200] : 0;
+  std::printf("\nrequests %zu, ok %llu", latencies.size(),
+              static_cast<unsigned long long>(ok));
+  for (const auto &status : statuses) {
+    if (status.first != 200) {
+      std::printf(", %s %llu",
+                  status.first == 0 ? "no response"
+                                    : std::to_string(status.first).c_str(),
+                  static_cast<unsigned long long>(status.second));
+    }
+  }
+  double throughput = latencies.size() / options.duration;
+  double mb_per_s = bytes / options.duration / 1e6;
+  std::printf("\nthroughput %.1f req/s, %.2f MB/s served\n", throughput,
+              mb_per_s);
+  double p50 = percentile_ms(latencies, 0.50);
+  double p99 = percentile_ms(latencies, 0.99);
+  double p999 = percentile_ms(latencies, 0.999);
+  double max = latencies.empty() ? 0 : latencies.back() / 1000.0;
+  std::printf("latency%s: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+              "p99.9 %.2f ms, max %.2f ms\n",
+              corrected ? " from schedule" : " (closed loop, uncorrected)",
+              p50, percentile_ms(latencies, 0.90), p99, p999, max);
+  if (options.server_pid > 0 && rss.peak() > 0) {
+    std::printf("server rss: start %.1f MB, peak %.1f MB, end %.1f MB\n",
+                rss.start() / 1e6, rss.peak() / 1e6, rss.last() / 1e6);
+  }
+
+  if (!options.csv.empty()) {
+    bool fresh = !std::ifstream(options.csv).good();
+    std::ofstream out(options.csv, std::ios::app);
+    if (fresh) {
+      out << "mode,concurrency,rate,repeat,requests,ok,throughput,"
+             "mb_per_s,p50_ms,p99_ms,p999_ms,max_ms,peak_rss_mb\n";
+    }
+    char row[256];
+    std::snprintf(row, sizeof(row),
+                  "%s,%d,%.1f,%.2f,%zu,%llu,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f",
+                  options.open_loop ? "open" : "closed", options.concurrency,
+                  options.rate, options.repeat, latencies.size(),
+                  static_cast<unsigned long long>(ok), throughput, mb_per_s,
+                  p50, p99, p999, max, rss.peak() / 1e6);
+    out << row << "\n";
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+// Resize microbenchmark: the previous per-pixel bilinear resize_image against
+// the separable resampler, for every filter and every available kernel set.
+//
+//   cmake -DIMGBOOST_BUILD_BENCH=ON .. && make resize-bench
+//   ./resize-bench [iterations]
+
+#include "resampler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace imgboost;
+
+// Verbatim copy of ImageProcessor::resize_image before the resampler
+static void legacy_resize(const std::vector<uint8_t> &src_rgba, int src_width,
+                          int src_height, std::vector<uint8_t> &dst_rgba,
+                          int dst_width, int dst_height) {
+  dst_rgba.resize(dst_width * dst_height * 4);
+
+  float x_ratio = static_cast<float>(src_width - 1) / dst_width;
+  float y_ratio = static_cast<float>(src_height - 1) / dst_height;
+
+  for (int y = 0; y < dst_height; y++) {
+    for (int x = 0; x < dst_width; x++) {
+      float gx = x * x_ratio;
+      float gy = y * y_ratio;
+      int gxi = static_cast<int>(gx);
+      int gyi = static_cast<int>(gy);
+
+      float c00[4], c10[4], c01[4], c11[4];
+      for (int c = 0; c < 4; c++) {
+        c00[c] = src_rgba[(gyi * src_width + gxi) * 4 + c];
+        c10[c] = (gxi + 1 < src_width)
+                     ? src_rgba[(gyi * src_width + gxi + 1) * 4 + c]
+                     : c00[c];
+        c01[c] = (gyi + 1 < src_height)
+                     ? src_rgba[((gyi + 1) * src_width + gxi) * 4 + c]
+                     : c00[c];
+        c11[c] = (gxi + 1 < src_width && gyi + 1 < src_height)
+                     ? src_rgba[((gyi + 1) * src_width + gxi + 1) * 4 + c]
+                     : c00[c];
+      }
+
+      float x_weight = gx - gxi;
+      float y_weight = gy - gyi;
+
+      for (int c = 0; c < 4; c++) {
+        float val = c00[c] * (1 - x_weight) * (1 - y_weight) +
+                    c10[c] * x_weight * (1 - y_weight) +
+                    c01[c] * (1 - x_weight) * y_weight +
+                    c11[c] * x_weight * y_weight;
+        dst_rgba[(y * dst_width + x) * 4 + c] = static_cast<uint8_t>(val);
+      }
+    }
+  }
+}
+
+// Best of N wall-clock runs, in milliseconds
+template <typename Fn> static double time_best(int iterations, Fn &&fn) {
+  double best = 1e300;
+  for (int i = 0; i < iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(
+        best, std::chrono::duration<double, std::milli>(end - start).count());
+  }
+  return best;
+}
+
+static void report(const char *name, const char *isa, int sw, int sh, int dw,
+                   int dh, double ms) {
+  // Throughput is counted in source pixels, which is what the work scales with
+  double mpix = static_cast<double>(sw) * sh / (ms * 1000.0);
+  std::printf("%-10s %-7s %5dx%-5d -> %5dx%-5d %9.2f ms %9.1f MPix/s\n", name,
+              isa, sw, sh, dw, dh, ms, mpix);
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = argc >= 2 ? std::max(1, std::atoi(argv[1])) : 5;
+
+  struct Case {
+    int src_width, src_height, dst_width, dst_height;
+  };
+  const Case cases[] = {
+      {4000, 3000, 320, 240},   // thumbnail
+      {4000, 3000, 1280, 960},  // typical web size
+      {1920, 1080, 1280, 720},  // mild downscale
+      {640, 480, 1280, 960},    // upscale
+  };
+  const ResampleFilter filters[] = {ResampleFilter::BOX,
+                                    ResampleFilter::BILINEAR,
+                                    ResampleFilter::BICUBIC,
+                                    ResampleFilter::LANCZOS3};
+  const char *isas[] = {"scalar", "sse4.1", "avx2"};
+
+  std::mt19937 rng(42);
+  std::printf("detected kernels: %s, best of %d runs\n\n", resampler_isa(),
+              iterations);
+
+  for (const Case &c : cases) {
+    std::vector<uint8_t> src(static_cast<size_t>(c.src_width) * c.src_height *
+                             4);
+    for (uint8_t &byte : src) {
+      byte = static_cast<uint8_t>(rng());
+    }
+    std::vector<uint8_t> dst(static_cast<size_t>(c.dst_width) * c.dst_height *
+                             4);
+
+    double ms = time_best(iterations, [&]() {
+      legacy_resize(src, c.src_width, c.src_height, dst, c.dst_width,
+                    c.dst_height);
+    });
+    report("legacy", "-", c.src_width, c.src_height, c.dst_width, c.dst_height,
+           ms);
+
+    for (const char *isa : isas) {
+      if (!select_resampler_isa(isa)) {
+        continue;
+      }
+      for (ResampleFilter filter : filters) {
+        ms = time_best(iterations, [&]() {
+          resample(src.data(), c.src_width, c.src_height, c.src_width * 4,
+                   dst.data(), c.dst_width, c.dst_height, c.dst_width * 4, 4,
+                   filter);
+        });
+        report(resample_filter_name(filter), isa, c.src_width, c.src_height,
+               c.dst_width, c.dst_height, ms);
+      }
+      // Opaque sources are resized as RGB
+      ms = time_best(iterations, [&]() {
+        resample(src.data(), c.src_width, c.src_height, c.src_width * 3,
+                 dst.data(), c.dst_width, c.dst_height, c.dst_width * 3, 3,
+                 ResampleFilter::BILINEAR);
+      });
+      report("rgb", isa, c.src_width, c.src_height, c.dst_width, c.dst_height,
+             ms);
+    }
+    std::printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Deterministic synthetic images, and JPEG, PNG and WebP encodings of them,
+// shared by the benchmarks
+
+#pragma once
+
+#include "image_processor.h"
+#include <algorithm>
+#include <cmath>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <jpeglib.h>
+#include <png.h>
+#include <vector>
+
+namespace imgboost {
+namespace bench {
+
+// Smooth gradients, a checkerboard of hard edges and a little noise, roughly
+// the entropy of a photo. Alpha is opaque in the middle and fades to fully
+// transparent corners, so both the premultiply and the cutout paths run.
+inline std::vector<uint8_t> synthetic_pixels(int width, int height,
+                                             int channels) {
+  std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * channels);
+  uint32_t state = 0x9E3779B9u ^ static_cast<uint32_t>(width * 31 + height);
+  auto noise = [&state]() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return static_cast<int>(state & 15) - 8;
+  };
+  auto clamp = [](int v) {
+    return static_cast<uint8_t>(std::min(255, std::max(0, v)));
+  };
+  double cx = width / 2.0, cy = height / 2.0;
+  double radius = std::min(width, height) / 2.0;
+  uint8_t *p = pixels.data();
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, p += channels) {
+      int check = ((x / 64 + y / 64) & 1) * 96;
+      p[0] = clamp(x * 255 / width + noise());
+      p[1] = clamp(y * 255 / height + noise());
+      p[2] = clamp(64 + check + noise());
+      if (channels == 4) {
+        double d = std::sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+        p[3] = clamp(static_cast<int>((1.4 - d / radius) * 255));
+      }
+    }
+  }
+  return pixels;
+}
+
+struct JpegError {
+  jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+inline void jpeg_bench_error_exit(j_common_ptr cinfo) {
+  longjmp(reinterpret_cast<JpegError *>(cinfo->err)->jump, 1);
+}
+
+inline std::vector<uint8_t> encode_jpeg(const std::vector<uint8_t> &rgb,
+                                        int width, int height) {
+  jpeg_compress_struct cinfo;
+  JpegError err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = jpeg_bench_error_exit;
+  unsigned char *out = nullptr;
+  unsigned long out_size = 0;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    std::free(out);
+    return {};
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &out, &out_size);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 85, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<JSAMPROW>(
+        rgb.data() + static_cast<size_t>(cinfo.next_scanline) * width * 3);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  std::vector<uint8_t> jpeg(out, out + out_size);
+  std::free(out);
+  return jpeg;
+}
+
+inline void png_bench_write(png_structp png_ptr, png_bytep data,
+                            png_size_t length) {
+  auto *out = static_cast<std::vector<uint8_t> *>(png_get_io_ptr(png_ptr));
+  out->insert(out->end(), data, data + length);
+}
+
+inline std::vector<uint8_t> encode_png(const std::vector<uint8_t> &pixels,
+                                       int width, int height, int channels) {
+  std::vector<uint8_t> out;
+  png_structp png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : nullptr;
+  if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return {};
+  }
+  png_set_write_fn(png_ptr, &out, png_bench_write, nullptr);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8,
+               channels == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  for (int y = 0; y < height; ++y) {
+    png_write_row(png_ptr, const_cast<png_bytep>(
+                               pixels.data() +
+                               static_cast<size_t>(y) * width * channels));
+  }
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return out;
+}
+
+inline std::vector<uint8_t> encode_source(ImageFormat format,
+                                          const std::vector<uint8_t> &pixels,
+                                          int width, int height,
+                                          int channels) {
+  if (format == ImageFormat::JPEG) {
+    return encode_jpeg(pixels, width, height);
+  }
+  if (format == ImageFormat::PNG) {
+    return encode_png(pixels, width, height, channels);
+  }
+  PixelBuffer buffer(pixels.size());
+  std::memcpy(buffer.data(), pixels.data(), pixels.size());
+  ImageProcessor processor;
+  SharedBuffer webp =
+      processor.encode_webp(buffer, width, height, channels, 80);
+  return std::vector<uint8_t>(webp.data(), webp.data() + webp.size());
+}
+
+} // namespace bench
+} // namespace imgboost
@@ -1,9 +1,20 @@
 #pragma once
 
+#include "cancel_token.h"
+#include "connection_pool.h"
 #include "httplib.h"
+#include "logger.h"
+#include "metrics.h"
+#include "shared_buffer.h"
+#include "single_flight.h"
+#include "source_cache.h"
+#include "stage_gate.h"
 #include "thread_pool.h"
+#include "tracer.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <functional>
-#include <iostream>
 #include <memory>
 #include <string>
 #include <vector>
@@ -13,34 +24,181 @@ namespace imgboost {
 struct DownloadResult {
   bool success;
   int status_code;
-  std::vector<uint8_t> data;
+  SharedBuffer data;
   std::string error_message;
+  int retry_after = 0; // seconds, set when the download queue was full
+  // Nanoseconds the fetch waited for a download slot and then ran; requests
+  // joining a fetch in flight see the leader's
+  uint64_t queue_ns = 0;
+  uint64_t fetch_ns = 0;
+  bool cancelled = false; // dropped or aborted, no request wanted it
 };
 
+// Called on the download thread after each received chunk with every byte
+// of the body so far; the buffer may move between calls
+using ChunkObserver = std::function<void(const uint8_t *, size_t)>;
+
 class AsyncDownloader {
 public:
-  explicit AsyncDownloader(size_t num_threads = 4)
-      : thread_pool_(num_threads) {}
+  // source_cache_bytes == 0 disables the source image cache
+  explicit AsyncDownloader(
+      size_t num_threads = 4, size_t source_cache_bytes = 0,
+      int64_t source_default_ttl = 0,
+      const ConnectionPoolConfig &pool_config = ConnectionPoolConfig(),
+      const StageLimits &limits = StageLimits())
+      : gate_(thread_pool_, resolve_limits(limits, num_threads)),
+        connections_(pool_config), thread_pool_(num_threads) {
+    if (source_cache_bytes > 0) {
+      source_cache_ = std::make_unique<SourceCache>(source_cache_bytes,
+                                                    source_default_ttl);
+    }
+  }
 
   std::future<DownloadResult> download_async(const std::string &url) {
     return thread_pool_.enqueue(
-        [url]() -> DownloadResult { return download_sync(url); });
+        [this, url]() -> DownloadResult { return download_sync(url); });
   }
 
+  // Fresh cached originals are answered at once, never queued. Concurrent
+  // downloads of the same URL share one fetch. Fetches beyond the
+  // concurrency cap queue in the download gate; when its byte budget is
+  // full every waiter gets a 503 instead. The observer sees a 200 body as
+  // it arrives, but only when this call starts the fetch: requests joining
+  // one in flight, and sources served from the cache, are not observed.
+  // The queue wait and the fetch are traced under the trace id of the
+  // request that starts the fetch. Once every caller's cancel token is
+  // cancelled, a queued fetch is dropped and a running one aborted.
   void download_async(const std::string &url,
-                      std::function<void(DownloadResult)> callback) {
-    thread_pool_.enqueue([url, callback]() {
-      DownloadResult result = download_sync(url);
-      callback(result);
+                      std::function<void(DownloadResult)> callback,
+                      ChunkObserver observer = nullptr, uint64_t trace = 0,
+                      CancelTokenPtr cancel = nullptr) {
+    SharedBuffer cached;
+    if (source_cache_ && source_cache_->get_fresh(url, cached)) {
+      DownloadResult result;
+      result.success = true;
+      result.status_code = 200;
+      result.data = std::move(cached);
+      callback(std::move(result));
+      return;
+    }
+
+    CancelTokenPtr flight_cancel =
+        in_flight_.join(url, std::move(callback), std::move(cancel));
+    if (!flight_cancel) {
+      return;
+    }
+    MetricClock::time_point queued_at = MetricClock::now();
+    bool queued = gate_.submit(expected_bytes(), [this, url, observer,
+                                                  queued_at, trace,
+                                                  flight_cancel]() {
+      if (flight_cancel->cancelled()) {
+        in_flight_.complete(url, flight_cancel, cancelled_result());
+        return;
+      }
+      MetricClock::time_point started = MetricClock::now();
+      DownloadResult result =
+          download_sync(url, observer, flight_cancel.get());
+      MetricClock::time_point finished = MetricClock::now();
+      result.queue_ns = static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(started -
+                                                               queued_at)
+              .count());
+      result.fetch_ns = static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(finished -
+                                                               started)
+              .count());
+      if (trace) {
+        Tracer &tracer = Tracer::instance();
+        tracer.record_async(trace, "download_queue", queued_at, started);
+        tracer.record(trace, "download", "download", started, finished);
+      }
+      in_flight_.complete(url, flight_cancel, result);
     });
+    if (!queued) {
+      DownloadResult result;
+      result.success = false;
+      result.status_code = 503;
+      result.error_message = "Download queue full";
+      result.retry_after =
+          std::max(1, static_cast<int>(gate_.estimated_wait() + 0.5));
+      in_flight_.complete(url, flight_cancel, result);
+    }
+  }
+
+  // Seconds a download started now would wait for a slot
+  double estimated_wait() const { return gate_.estimated_wait(); }
+  StageStats stage_stats() const { return gate_.stats(); }
+  ThreadPoolStats pool_stats() const { return thread_pool_.stats(); }
+
+  // Number of downloads that piggybacked on an in-flight fetch
+  uint64_t coalesced() const { return in_flight_.coalesced(); }
+
+  CacheStats source_cache_stats() const {
+    return source_cache_ ? source_cache_->stats() : CacheStats();
+  }
+
+  uint64_t source_revalidations() const {
+    return source_cache_ ? source_cache_->revalidations() : 0;
   }
 
+  ConnectionPoolStats connection_stats() const { return connections_.stats(); }
+
 private:
-  static DownloadResult download_sync(const std::string &url) {
+  static StageLimits resolve_limits(StageLimits limits, size_t num_threads) {
+    if (limits.max_concurrency == 0) {
+      limits.max_concurrency = num_threads;
+    }
+    return limits;
+  }
+
+  static DownloadResult cancelled_result() {
+    DownloadResult result;
+    result.success = false;
+    result.status_code = 504;
+    result.error_message = "Request cancelled";
+    result.cancelled = true;
+    return result;
+  }
+
+  // Upper bound on what a Content-Length header can make us preallocate
+  static constexpr size_t kMaxReserveBytes = 64 * 1024 * 1024;
+
+  // A download is queued before its size is known, so it is accounted at
+  // the running average of recent response sizes
+  size_t expected_bytes() const { return average_bytes_.load(); }
+
+  void record_size(size_t bytes) {
+    size_t average = average_bytes_.load();
+    average_bytes_.store(average - average / 8 + bytes / 8);
+  }
+
+  // Host without the port, the name httplib resolves; bracketed IPv6
+  // literals are returned as is
+  static std::string host_name(const std::string &host) {
+    if (!host.empty() && host[0] == '[') {
+      return host;
+    }
+    return host.substr(0, host.find(':'));
+  }
+
+  DownloadResult download_sync(const std::string &url,
+                               const ChunkObserver &observer = nullptr,
+                               const CancelToken *cancel = nullptr) {
     DownloadResult result;
     result.success = false;
     result.status_code = 0;
 
+    // Fresh originals skip the network entirely. download_async answers
+    // them before the queue; this catches one stored while the fetch waited.
+    SourceEntry cached;
+    bool have_cached = source_cache_ && source_cache_->get(url, cached);
+    if (have_cached && cached.is_fresh()) {
+      result.success = true;
+      result.status_code = 200;
+      result.data = cached.data;
+      return result;
+    }
+
     try {
       std::string protocol, host, path;
       size_t protocol_end = url.find("://");
@@ -61,35 +219,120 @@ private:
         path = url.substr(path_start);
       }
 
-      std::cout << "[AsyncDownloader] Downloading from host: " << host
-                << ", path: " << path << std::endl;
+      IMGBOOST_LOG(DEBUG, "AsyncDownloader", "Downloading")
+          .field("host", host)
+          .field("path", path);
 
-      httplib::Client cli(protocol + "://" + host);
-      cli.set_follow_location(true);
-      cli.set_connection_timeout(10, 0); // 10 seconds
-      cli.set_read_timeout(30, 0);       // 30 seconds
+      // Keep-alive connection to the origin, shared across downloads
+      ConnectionPool::Lease lease = connections_.acquire(
+          protocol + "://" + host, host_name(host), cancel);
+      httplib::Client &cli = lease.client();
 
-      auto download_res = cli.Get(path.c_str());
+      // Stale entries are revalidated, a 304 costs no body transfer
+      httplib::Headers headers;
+      if (have_cached && cached.can_revalidate()) {
+        if (!cached.etag.empty()) {
+          headers.emplace("If-None-Match", cached.etag);
+        }
+        if (!cached.last_modified.empty()) {
+          headers.emplace("If-Modified-Since", cached.last_modified);
+        }
+      }
+
+      // Polled as each chunk arrives, false aborts the transfer
+      httplib::Progress progress;
+      if (cancel) {
+        progress = [cancel](uint64_t, uint64_t) {
+          return !cancel->cancelled();
+        };
+      }
+
+      httplib::Result download_res;
+      if (observer) {
+        // Receive the body chunk by chunk, so the observer can start on it
+        std::string body;
+        bool observe = false;
+        download_res = cli.Get(
+            path, headers,
+            [&](const httplib::Response &response) {
+              observe = response.status == 200;
+              if (observe && response.has_header("Content-Length")) {
+                size_t length = static_cast<size_t>(std::strtoull(
+                    response.get_header_value("Content-Length").c_str(),
+                    nullptr, 10));
+                body.reserve(std::min(length, kMaxReserveBytes));
+              }
+              return true;
+            },
+            [&](const char *data, size_t length) {
+              body.append(data, length);
+              if (observe) {
+                observer(reinterpret_cast<const uint8_t *>(body.data()),
+                         body.size());
+              }
+              return true;
+            },
+            progress);
+        if (download_res) {
+          download_res->body = std::move(body);
+        }
+      } else {
+        download_res = cli.Get(path, headers, progress);
+      }
 
       if (!download_res) {
+        // An aborted transfer leaves the connection mid-body
+        lease.discard();
+        if (download_res.error() == httplib::Error::Canceled) {
+          return cancelled_result();
+        }
         result.error_message = "Failed to connect or download";
         return result;
       }
 
       result.status_code = download_res->status;
 
+      SourceFreshness freshness =
+          parse_freshness(download_res->get_header_value("Cache-Control"),
+                          download_res->get_header_value("Age"));
+
+      if (download_res->status == 304 && have_cached) {
+        source_cache_->refresh(url, freshness);
+        result.status_code = 200;
+        result.data = cached.data;
+        result.success = true;
+        IMGBOOST_LOG(INFO, "AsyncDownloader", "Revalidated cached source")
+            .field("host", host)
+            .field("bytes", result.data.size());
+        return result;
+      }
+
       if (download_res->status != 200) {
         result.error_message =
             "HTTP status: " + std::to_string(download_res->status);
         return result;
       }
 
-      result.data.assign(download_res->body.begin(), download_res->body.end());
+      result.data = SharedBuffer::from_string(std::move(download_res->body));
       result.success = true;
+      record_size(result.data.size());
+      Metrics::instance().add_downloaded(result.data.size());
+
+      if (source_cache_) {
+        SourceEntry entry;
+        entry.data = result.data;
+        entry.etag = download_res->get_header_value("ETag");
+        entry.last_modified = download_res->get_header_value("Last-Modified");
+        source_cache_->put(url, std::move(entry), freshness);
+      }
 
-      std::cout << "[AsyncDownloader] Downloaded " << result.data.size()
-                << " bytes" << std::endl;
+      IMGBOOST_LOG(INFO, "AsyncDownloader", "Downloaded")
+          .field("host", host)
+          .field("bytes", result.data.size());
 
+    } catch (const RequestCancelled &) {
+      // Gave up waiting for a connection to the origin
+      return cancelled_result();
     } catch (const std::exception &e) {
       result.error_message = std::string("Exception: ") + e.what();
     }
@@ -97,6 +340,12 @@ private:
     return result;
   }
 
+  std::unique_ptr<SourceCache> source_cache_;
+  SingleFlight<DownloadResult> in_flight_;
+  std::atomic<size_t> average_bytes_{256 * 1024};
+  StageGate gate_; // before the pool, whose last tasks call back into it
+  // Declared before the pool so leases are returned before it is destroyed
+  ConnectionPool connections_;
   ThreadPool thread_pool_;
 };
 
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace imgboost {
+
+struct BufferPoolStats {
+  uint64_t hits = 0;    // acquisitions served from a recycled buffer
+  uint64_t misses = 0;  // acquisitions that went to the allocator
+  size_t shared_bytes = 0;
+};
+
+// Recycles the large pixel and scratch buffers of the image pipeline, which
+// the allocator would otherwise map and unmap (and page-fault in) on every
+// request. Sizes are rounded up to classes four per power of two, so at most
+// ~20% is wasted. Each thread caches a few buffers per class; buffers freed
+// on a thread whose cache is full go to a shared, byte-bounded pool.
+class BufferPool {
+public:
+  // Never destroyed, thread caches may return buffers during exit
+  static BufferPool &instance() {
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+  }
+
+  // Returns at least size bytes, uninitialized; capacity receives the size
+  // that must be passed back to release()
+  uint8_t *acquire(size_t size, size_t &capacity) {
+    int cls = size_class(size, capacity);
+    if (cls >= 0) {
+      if (uint8_t *data = thread_cache().pop(cls, capacity)) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return data;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!shared_[cls].empty()) {
+        uint8_t *data = shared_[cls].back();
+        shared_[cls].pop_back();
+        shared_bytes_ -= capacity;
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return data;
+      }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<uint8_t *>(::operator new(capacity));
+  }
+
+  void release(uint8_t *data, size_t capacity) {
+    size_t class_capacity;
+    int cls = size_class(capacity, class_capacity);
+    if (cls < 0 || class_capacity != capacity) {
+      ::operator delete(data);
+      return;
+    }
+    if (thread_cache().push(cls, data, capacity)) {
+      return;
+    }
+    release_shared(cls, data, capacity);
+  }
+
+  BufferPoolStats stats() const {
+    BufferPoolStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.shared_bytes = shared_bytes_;
+    return stats;
+  }
+
+private:
+  // Buffers of 4 KB or less come cheaply from malloc, and ones above 1 GB
+  // are too rare to keep around
+  static constexpr int kMinShift = 12;
+  static constexpr int kMaxShift = 30;
+  static constexpr int kClassesPerShift = 4;
+  static constexpr int kNumClasses =
+      (kMaxShift - kMinShift) * kClassesPerShift;
+
+  static constexpr size_t kThreadSlots = 2; // buffers per class per thread
+  static constexpr size_t kThreadBytes = 64 * 1024 * 1024;
+  static constexpr size_t kSharedBytes = 256 * 1024 * 1024;
+
+  BufferPool() = default;
+
+  // Class index for size, or -1 when it is not pooled; capacity receives the
+  // class size (or size itself)
+  static int size_class(size_t size, size_t &capacity) {
+    capacity = size;
+    if (size <= (size_t(1) << kMinShift) || size > (size_t(1) << kMaxShift)) {
+      return -1;
+    }
+    int shift = kMinShift;
+    while ((size_t(1) << (shift + 1)) < size) {
+      shift++;
+    }
+    // size lies in (2^shift, 2^(shift+1)], split into quarters
+    size_t base = size_t(1) << shift;
+    size_t step = base / kClassesPerShift;
+    size_t quarter = (size - base + step - 1) / step; // 1 .. 4
+    capacity = base + quarter * step;
+    return (shift - kMinShift) * kClassesPerShift + static_cast<int>(quarter) -
+           1;
+  }
+
+  void release_shared(int cls, uint8_t *data, size_t capacity) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (shared_bytes_ + capacity <= kSharedBytes) {
+        shared_[cls].push_back(data);
+        shared_bytes_ += capacity;
+        return;
+      }
+    }
+    ::operator delete(data);
+  }
+
+  struct ThreadCache {
+    std::vector<uint8_t *> slots[kNumClasses];
+    size_t bytes = 0;
+
+    uint8_t *pop(int cls, size_t capacity) {
+      if (slots[cls].empty()) {
+        return nullptr;
+      }
+      uint8_t *data = slots[cls].back();
+      slots[cls].pop_back();
+      bytes -= capacity;
+      return data;
+    }
+
+    bool push(int cls, uint8_t *data, size_t capacity) {
+      if (slots[cls].size() >= kThreadSlots ||
+          bytes + capacity > kThreadBytes) {
+        return false;
+      }
+      slots[cls].push_back(data);
+      bytes += capacity;
+      return true;
+    }
+
+    // Hand the cache to the other threads when this one exits
+    ~ThreadCache() {
+      for (int cls = 0; cls < kNumClasses; ++cls) {
+        for (uint8_t *data : slots[cls]) {
+          BufferPool::instance().release_shared(cls, data,
+                                                class_capacity(cls));
+        }
+      }
+    }
+  };
+
+  static size_t class_capacity(int cls) {
+    size_t base = size_t(1) << (kMinShift + cls / kClassesPerShift);
+    return base + (cls % kClassesPerShift + 1) * (base / kClassesPerShift);
+  }
+
+  static ThreadCache &thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+
+  mutable std::mutex mutex_;
+  std::vector<uint8_t *> shared_[kNumClasses];
+  size_t shared_bytes_ = 0;
+};
+
+// Move-only byte buffer drawn from the BufferPool. Contents are neither
+// initialized nor preserved across a growing resize().
+class PixelBuffer {
+public:
+  PixelBuffer() = default;
+  explicit PixelBuffer(size_t size) { resize(size); }
+
+  PixelBuffer(PixelBuffer &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        size_(std::exchange(other.size_, 0)),
+        capacity_(std::exchange(other.capacity_, 0)) {}
+
+  PixelBuffer &operator=(PixelBuffer &&other) noexcept {
+    if (this != &other) {
+      reset();
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+      capacity_ = std::exchange(other.capacity_, 0);
+    }
+    return *this;
+  }
+
+  // Disable copy
+  PixelBuffer(const PixelBuffer &) = delete;
+  PixelBuffer &operator=(const PixelBuffer &) = delete;
+
+  ~PixelBuffer() { reset(); }
+
+  void resize(size_t size) {
+    if (size > capacity_) {
+      reset();
+      data_ = BufferPool::instance().acquire(size, capacity_);
+    }
+    size_ = size;
+  }
+
+  void reset() {
+    if (data_) {
+      BufferPool::instance().release(data_, capacity_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    capacity_ = 0;
+  }
+
+  uint8_t *data() { return data_; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+} // namespace imgboost
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace imgboost {
+
+class CancelToken;
+using CancelTokenPtr = std::shared_ptr<CancelToken>;
+
+// Thrown by a stage that gave up because its token was cancelled
+class RequestCancelled : public std::runtime_error {
+public:
+  RequestCancelled() : std::runtime_error("Request cancelled") {}
+};
+
+// Tells the stages working for a request that nobody wants the result any
+// more: the client hung up, or the deadline passed. Stages poll cancelled()
+// between units of work and stop early. Work shared by coalesced requests
+// gets a shared token, cancelled only once every member is; a member that
+// cannot be cancelled keeps it alive for good.
+class CancelToken {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  CancelToken() = default;
+
+  // Token of work shared by several requests
+  static CancelTokenPtr shared() {
+    CancelTokenPtr token = std::make_shared<CancelToken>();
+    token->shared_ = true;
+    return token;
+  }
+
+  // Disable copy
+  CancelToken(const CancelToken &) = delete;
+  CancelToken &operator=(const CancelToken &) = delete;
+
+  // Thread-safe
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  // Call before the token is handed to other threads
+  void set_deadline(Clock::time_point deadline) {
+    deadline_ = deadline;
+    has_deadline_ = true;
+  }
+
+  // Only on shared tokens; null is a member that never cancels
+  void add_member(CancelTokenPtr member) {
+    if (!member) {
+      pinned_.store(true, std::memory_order_relaxed);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    members_.push_back(std::move(member));
+  }
+
+  // Once true, stays true
+  bool cancelled() const {
+    if (cancelled_.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    if (has_deadline_ && Clock::now() >= deadline_) {
+      cancelled_.store(true, std::memory_order_relaxed);
+      return true;
+    }
+    if (!shared_ || pinned_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (members_.empty()) {
+      return false;
+    }
+    for (const CancelTokenPtr &member : members_) {
+      if (!member->cancelled()) {
+        return false;
+      }
+    }
+    cancelled_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+private:
+  mutable std::atomic<bool> cancelled_{false};
+  bool has_deadline_ = false;
+  Clock::time_point deadline_;
+  bool shared_ = false;
+  std::atomic<bool> pinned_{false};
+  mutable std::mutex mutex_; // guards members_
+  std::vector<CancelTokenPtr> members_;
+};
+
+} // namespace imgboost
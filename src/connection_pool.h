@@ -0,0 +1,389 @@
+#pragma once
+
+#include "cancel_token.h"
+#include "httplib.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace imgboost {
+
+struct ConnectionPoolConfig {
+  size_t max_per_host = 8;  // connections per origin, idle or in use
+  int64_t idle_timeout = 30; // seconds an unused connection is kept open
+  int64_t dns_ttl = 60;      // seconds a resolved address is reused
+  time_t connection_timeout = 10;
+  time_t read_timeout = 30;
+};
+
+struct ConnectionPoolStats {
+  uint64_t created = 0;  // clients opened
+  uint64_t reused = 0;   // downloads served by an already open client
+  uint64_t waited = 0;   // downloads that waited for a free connection
+  uint64_t dns_hits = 0;
+  uint64_t dns_misses = 0;
+  uint64_t tls_resumed = 0; // handshakes the server resumed from a session
+};
+
+// Resolves host names once per TTL; the result is handed to httplib through
+// set_hostname_addr_map, so the Host header and SNI keep the name.
+class DnsCache {
+public:
+  explicit DnsCache(int64_t ttl_seconds) : ttl_(ttl_seconds) {}
+
+  // Numeric address for host, or empty when it does not resolve (httplib
+  // then reports the failure itself)
+  std::string resolve(const std::string &host) {
+    auto now = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(host);
+      if (it != entries_.end() && now < it->second.expires) {
+        hits_++;
+        return it->second.address;
+      }
+      misses_++;
+    }
+
+    std::string address = lookup(host);
+    if (!address.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_[host] = {address, now + std::chrono::seconds(ttl_)};
+    }
+    return address;
+  }
+
+  uint64_t hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+  }
+  uint64_t misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+  }
+
+private:
+  struct Entry {
+    std::string address;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  static std::string lookup(const std::string &host) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result) {
+      return std::string();
+    }
+
+    char buffer[INET6_ADDRSTRLEN] = {0};
+    const void *addr = nullptr;
+    if (result->ai_family == AF_INET) {
+      addr = &reinterpret_cast<sockaddr_in *>(result->ai_addr)->sin_addr;
+    } else if (result->ai_family == AF_INET6) {
+      addr = &reinterpret_cast<sockaddr_in6 *>(result->ai_addr)->sin6_addr;
+    }
+    std::string address;
+    if (addr && inet_ntop(result->ai_family, addr, buffer, sizeof(buffer))) {
+      address = buffer;
+    }
+    freeaddrinfo(result);
+    return address;
+  }
+
+  int64_t ttl_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+// Last TLS session per server name. httplib gives every client its own
+// SSL_CTX and never calls SSL_set_session, so the callbacks below store the
+// tickets servers send and offer them again when a new connection starts
+// its handshake, turning full handshakes into resumptions. Only handshakes
+// the server actually resumed are counted, it may refuse an offered ticket.
+class TlsSessionCache {
+public:
+  ~TlsSessionCache() {
+    for (auto &entry : sessions_) {
+      SSL_SESSION_free(entry.second);
+    }
+  }
+
+  // Install the callbacks on a client's context
+  void attach(SSL_CTX *ctx) {
+    SSL_CTX_set_app_data(ctx, this);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                            SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &TlsSessionCache::on_new_session);
+    SSL_CTX_set_info_callback(ctx, &TlsSessionCache::on_info);
+  }
+
+  uint64_t resumed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resumed_;
+  }
+
+private:
+  static TlsSessionCache *from(const SSL *ssl) {
+    return static_cast<TlsSessionCache *>(
+        SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  }
+
+  static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    TlsSessionCache *cache = from(ssl);
+    if (!name || !cache) {
+      return 0; // not kept, OpenSSL frees it
+    }
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    SSL_SESSION *&slot = cache->sessions_[name];
+    if (slot) {
+      SSL_SESSION_free(slot);
+    }
+    slot = session;
+    return 1; // we own the reference now
+  }
+
+  // The handshake-start notification comes before the ClientHello is built,
+  // the last point where a session can still be set
+  static void on_info(const SSL *ssl, int where, int) {
+    TlsSessionCache *cache = from(ssl);
+    if (!cache) {
+      return;
+    }
+    if (where & SSL_CB_HANDSHAKE_DONE) {
+      if (SSL_session_reused(const_cast<SSL *>(ssl))) {
+        std::lock_guard<std::mutex> lock(cache->mutex_);
+        cache->resumed_++;
+      }
+      return;
+    }
+    if (!(where & SSL_CB_HANDSHAKE_START) ||
+        SSL_session_reused(const_cast<SSL *>(ssl))) {
+      return;
+    }
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!name) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    auto it = cache->sessions_.find(name);
+    if (it != cache->sessions_.end() && SSL_SESSION_is_resumable(it->second)) {
+      SSL_set_session(const_cast<SSL *>(ssl), it->second);
+    }
+  }
+
+  mutable std::mutex mutex_;
+  std::map<std::string, SSL_SESSION *> sessions_;
+  uint64_t resumed_ = 0;
+};
+#endif
+
+// Keep-alive httplib clients per origin ("scheme://host[:port]"), shared by
+// all download threads. A client is used by one thread at a time through a
+// Lease; idle clients are closed after idle_timeout, and at most
+// max_per_host exist per origin, further downloads wait for a free one, or
+// until their cancel token is cancelled.
+class ConnectionPool {
+public:
+  class Lease {
+  public:
+    Lease(ConnectionPool *pool, std::string origin,
+          std::unique_ptr<httplib::Client> client)
+        : pool_(pool), origin_(std::move(origin)), client_(std::move(client)) {}
+    Lease(Lease &&other) noexcept
+        : pool_(other.pool_), origin_(std::move(other.origin_)),
+          client_(std::move(other.client_)) {
+      other.pool_ = nullptr;
+    }
+    Lease &operator=(Lease &&) = delete;
+    ~Lease() {
+      if (pool_) {
+        pool_->release(origin_, std::move(client_));
+      }
+    }
+
+    httplib::Client &client() { return *client_; }
+
+    // The connection failed midway, close it instead of reusing it
+    void discard() { client_.reset(); }
+
+  private:
+    ConnectionPool *pool_;
+    std::string origin_;
+    std::unique_ptr<httplib::Client> client_;
+  };
+
+  explicit ConnectionPool(const ConnectionPoolConfig &config)
+      : config_(config), dns_(config.dns_ttl) {}
+
+  // Disable copy
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+  // Throws RequestCancelled when cancel is cancelled while waiting
+  Lease acquire(const std::string &origin, const std::string &host,
+                const CancelToken *cancel = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    expire_idle(std::chrono::steady_clock::now());
+    // Stays valid while waiting, origins with waiters are never expired
+    Origin &entry = origins_[origin];
+
+    if (entry.idle.empty() && entry.open >= config_.max_per_host) {
+      stats_.waited++;
+      entry.waiters++;
+      while (entry.idle.empty() && entry.open >= config_.max_per_host) {
+        if (!cancel) {
+          available_.wait(lock);
+          continue;
+        }
+        // Nothing notifies on cancellation, so the token is polled
+        available_.wait_for(lock, kCancelPoll);
+        if (cancel->cancelled()) {
+          entry.waiters--;
+          throw RequestCancelled();
+        }
+      }
+      entry.waiters--;
+    }
+
+    std::unique_ptr<httplib::Client> client;
+    if (!entry.idle.empty()) {
+      client = std::move(entry.idle.back().client);
+      entry.idle.pop_back();
+      stats_.reused++;
+    } else {
+      entry.open++;
+      stats_.created++;
+    }
+    lock.unlock();
+
+    if (!client) {
+      try {
+        client = create_client(origin);
+      } catch (...) {
+        release(origin, nullptr);
+        throw;
+      }
+    }
+
+    // Refresh the address on every lease, it only matters on reconnect
+    std::string address = dns_.resolve(host);
+    if (!address.empty()) {
+      client->set_hostname_addr_map({{host, address}});
+    }
+    return Lease(this, origin, std::move(client));
+  }
+
+  ConnectionPoolStats stats() const {
+    ConnectionPoolStats stats;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats = stats_;
+    }
+    stats.dns_hits = dns_.hits();
+    stats.dns_misses = dns_.misses();
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    stats.tls_resumed = tls_sessions_.resumed();
+#endif
+    return stats;
+  }
+
+private:
+  struct IdleClient {
+    std::unique_ptr<httplib::Client> client;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  struct Origin {
+    std::vector<IdleClient> idle; // back == most recently used
+    size_t open = 0;              // idle plus leased
+    size_t waiters = 0;           // acquire() calls waiting for a client
+  };
+
+  static constexpr std::chrono::milliseconds kCancelPoll{50};
+
+  std::unique_ptr<httplib::Client> create_client(const std::string &origin) {
+    auto client = std::make_unique<httplib::Client>(origin);
+    client->set_keep_alive(true);
+    client->set_follow_location(true);
+    client->set_connection_timeout(config_.connection_timeout, 0);
+    client->set_read_timeout(config_.read_timeout, 0);
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    if (SSL_CTX *ctx = client->ssl_context()) {
+      tls_sessions_.attach(ctx);
+    }
+#endif
+    return client;
+  }
+
+  void release(const std::string &origin,
+               std::unique_ptr<httplib::Client> client) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Origin &entry = origins_[origin];
+      if (client) {
+        entry.idle.push_back(
+            {std::move(client), std::chrono::steady_clock::now()});
+      } else {
+        entry.open--;
+      }
+    }
+    available_.notify_all();
+  }
+
+  // Called with mutex_ held; at most once a second
+  void expire_idle(std::chrono::steady_clock::time_point now) {
+    if (now - last_sweep_ < std::chrono::seconds(1)) {
+      return;
+    }
+    last_sweep_ = now;
+    auto limit = std::chrono::seconds(config_.idle_timeout);
+    for (auto it = origins_.begin(); it != origins_.end();) {
+      Origin &entry = it->second;
+      // Oldest first, so stop at the first one still in use recently
+      size_t expired = 0;
+      while (expired < entry.idle.size() &&
+             now - entry.idle[expired].since >= limit) {
+        expired++;
+      }
+      if (expired > 0) {
+        entry.idle.erase(entry.idle.begin(), entry.idle.begin() + expired);
+        entry.open -= expired;
+      }
+      if (entry.open == 0 && entry.waiters == 0) {
+        it = origins_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  ConnectionPoolConfig config_;
+  DnsCache dns_;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  // Declared before the clients so it outlives their contexts
+  TlsSessionCache tls_sessions_;
+#endif
+
+  mutable std::mutex mutex_;
+  std::condition_variable available_;
+  std::unordered_map<std::string, Origin> origins_;
+  std::chrono::steady_clock::time_point last_sweep_;
+  ConnectionPoolStats stats_;
+};
+
+} // namespace imgboost
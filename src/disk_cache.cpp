@@ -0,0 +1,509 @@
+#include "disk_cache.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace imgboost {
+
+namespace {
+
+// Format 2 adds the payload length, files of format 1 are discarded
+const char kMagic[4] = {'I', 'B', 'C', '2'};
+
+// Magic, key length and payload length, followed by the key
+const size_t kFixedHeaderSize =
+    sizeof(kMagic) + sizeof(uint32_t) + sizeof(uint64_t);
+
+// Writes are dropped rather than queued once this much is waiting
+const size_t kMaxPendingBytes = 64 * 1024 * 1024;
+
+// Eviction frees space down to this fraction of the budget
+const double kLowWatermark = 0.9;
+
+// Stable across builds and platforms, unlike std::hash
+uint64_t fnv1a_64(const std::string &s) {
+  uint64_t h = 1469598103934665603ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string to_hex(uint64_t value) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out(16, '0');
+  for (int i = 15; i >= 0; --i) {
+    out[i] = digits[value & 0xF];
+    value >>= 4;
+  }
+  return out;
+}
+
+bool parse_hex(const std::string &s, uint64_t &value) {
+  if (s.size() != 16)
+    return false;
+  value = 0;
+  for (char c : s) {
+    value <<= 4;
+    if (c >= '0' && c <= '9')
+      value |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      value |= c - 'a' + 10;
+    else
+      return false;
+  }
+  return true;
+}
+
+size_t header_size(const std::string &key) {
+  return kFixedHeaderSize + key.size();
+}
+
+// Whether the fixed header is this format's and the file holds exactly the
+// key and payload it announces; a write cut short fails the check
+bool parse_header(const uint8_t *data, uint64_t file_size, uint32_t &key_size,
+                  uint64_t &payload_size) {
+  if (file_size < kFixedHeaderSize ||
+      std::memcmp(data, kMagic, sizeof(kMagic)) != 0)
+    return false;
+  std::memcpy(&key_size, data + sizeof(kMagic), sizeof(key_size));
+  std::memcpy(&payload_size, data + sizeof(kMagic) + sizeof(key_size),
+              sizeof(payload_size));
+  return file_size - kFixedHeaderSize >= key_size &&
+         file_size - kFixedHeaderSize - key_size == payload_size;
+}
+
+// Writes the chunks and flushes them to stable storage before returning, so
+// a rename that follows never publishes a file whose data is still cached
+bool write_durably(const fs::path &path,
+                   const std::vector<std::pair<const void *, size_t>> &chunks) {
+#ifdef _WIN32
+  HANDLE handle = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+  bool ok = true;
+  for (const auto &chunk : chunks) {
+    const char *data = static_cast<const char *>(chunk.first);
+    size_t left = chunk.second;
+    while (ok && left > 0) {
+      DWORD written = 0;
+      DWORD part = static_cast<DWORD>(std::min<size_t>(left, 1 << 30));
+      ok = WriteFile(handle, data, part, &written, nullptr) && written > 0;
+      data += written;
+      left -= written;
+    }
+  }
+  ok = ok && FlushFileBuffers(handle);
+  CloseHandle(handle);
+  return ok;
+#else
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = true;
+  for (const auto &chunk : chunks) {
+    const char *data = static_cast<const char *>(chunk.first);
+    size_t left = chunk.second;
+    while (ok && left > 0) {
+      ssize_t written = ::write(fd, data, left);
+      if (written < 0 && errno == EINTR)
+        continue;
+      ok = written > 0;
+      if (ok) {
+        data += written;
+        left -= static_cast<size_t>(written);
+      }
+    }
+  }
+  ok = ok && ::fsync(fd) == 0;
+  return ::close(fd) == 0 && ok;
+#endif
+}
+
+// Makes a rename into dir durable; NTFS journals renames itself
+void sync_directory(const fs::path &dir) {
+#ifndef _WIN32
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    ::fsync(fd);
+    ::close(fd);
+  }
+#else
+  (void)dir;
+#endif
+}
+
+// Reads the fixed header of an entry file found at startup
+bool valid_entry_file(const fs::path &path, uint64_t file_size) {
+  uint8_t header[kFixedHeaderSize];
+  std::ifstream in(path, std::ios::binary);
+  if (!in.read(reinterpret_cast<char *>(header), sizeof(header)))
+    return false;
+  uint32_t key_size;
+  uint64_t payload_size;
+  return parse_header(header, file_size, key_size, payload_size);
+}
+
+} // namespace
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string &path) {
+  std::shared_ptr<MappedFile> file(new MappedFile());
+
+#ifdef _WIN32
+  // FILE_SHARE_DELETE lets eviction unlink the file while it is mapped
+  HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE)
+    return nullptr;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+    CloseHandle(handle);
+    return nullptr;
+  }
+
+  HANDLE mapping =
+      CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(handle);
+  if (!mapping)
+    return nullptr;
+
+  void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    CloseHandle(mapping);
+    return nullptr;
+  }
+
+  file->mapping_ = mapping;
+  file->data_ = static_cast<const uint8_t *>(view);
+  file->size_ = static_cast<size_t>(size.QuadPart);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return nullptr;
+
+  file->data_ = static_cast<const uint8_t *>(addr);
+  file->size_ = static_cast<size_t>(st.st_size);
+#endif
+
+  return file;
+}
+
+MappedFile::~MappedFile() {
+  if (!data_)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_);
+#else
+  munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+}
+
+DiskCache::DiskCache(const std::string &root_dir, size_t max_bytes)
+    : root_dir_(root_dir), max_bytes_(max_bytes) {
+  std::error_code ec;
+  fs::create_directories(fs::path(root_dir_) / "tmp", ec);
+  if (ec) {
+    throw std::runtime_error("Cannot create disk cache directory " +
+                             root_dir_ + ": " + ec.message());
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  sweep_temp_files();
+  rebuild_index();
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  IMGBOOST_LOG(INFO, "DiskCache", "Indexed")
+      .field("entries", index_.size())
+      .field("bytes", bytes_)
+      .field("dir", root_dir_)
+      .field("duration_ms", elapsed.count());
+
+  maintenance_thread_ = std::thread([this] { maintenance_loop(); });
+}
+
+DiskCache::~DiskCache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  if (maintenance_thread_.joinable()) {
+    maintenance_thread_.join();
+  }
+}
+
+std::string DiskCache::path_for(uint64_t hash) const {
+  std::string name = to_hex(hash);
+  return (fs::path(root_dir_) / name.substr(0, 2) / (name + ".bin")).string();
+}
+
+void DiskCache::rebuild_index() {
+  struct Found {
+    uint64_t hash;
+    size_t size;
+    fs::file_time_type mtime;
+  };
+  std::vector<Found> found;
+
+  std::error_code ec;
+  for (const auto &dir : fs::directory_iterator(root_dir_, ec)) {
+    if (!dir.is_directory() || dir.path().filename() == "tmp")
+      continue;
+    for (const auto &entry : fs::directory_iterator(dir.path(), ec)) {
+      uint64_t hash;
+      if (entry.path().extension() != ".bin" ||
+          !parse_hex(entry.path().stem().string(), hash))
+        continue;
+      std::error_code stat_ec;
+      size_t size = entry.file_size(stat_ec);
+      auto mtime = entry.last_write_time(stat_ec);
+      if (stat_ec)
+        continue;
+      // Truncated files and files of an older format are never served
+      if (!valid_entry_file(entry.path(), size)) {
+        fs::remove(entry.path(), stat_ec);
+        continue;
+      }
+      found.push_back({hash, size, mtime});
+    }
+  }
+
+  // Most recently written first, so older files are evicted first
+  std::sort(found.begin(), found.end(),
+            [](const Found &a, const Found &b) { return a.mtime > b.mtime; });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const Found &f : found) {
+    lru_.push_back({f.hash, f.size});
+    index_[f.hash] = std::prev(lru_.end());
+    bytes_ += f.size;
+  }
+}
+
+bool DiskCache::get(const std::string &key, SharedBuffer &value) {
+  uint64_t hash = fnv1a_64(key);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(hash);
+    if (it == index_.end()) {
+      misses_++;
+      return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+  }
+
+  // Mapping happens outside the lock, a concurrent eviction simply turns
+  // this into a miss
+  auto file = MappedFile::open(path_for(hash));
+  size_t header = header_size(key);
+  uint32_t key_size = 0;
+  uint64_t payload_size = 0;
+  bool intact = file && parse_header(file->data(), file->size(), key_size,
+                                     payload_size);
+  bool valid = intact && key_size == key.size() &&
+               std::memcmp(file->data() + kFixedHeaderSize, key.data(),
+                           key.size()) == 0;
+
+  if (!valid) {
+    std::error_code ec;
+    if (file && !intact) {
+      fs::remove(path_for(hash), ec);
+    }
+    // Hash collision with another key is kept, anything else is stale
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!intact) {
+      drop_index_entry(hash);
+    }
+    misses_++;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const uint8_t *payload = file->data() + header;
+  value = SharedBuffer(std::move(file), payload,
+                       static_cast<size_t>(payload_size));
+  hits_++;
+  return true;
+}
+
+void DiskCache::put(const std::string &key, SharedBuffer value) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_ || pending_bytes_ + value.size() > kMaxPendingBytes ||
+        header_size(key) + value.size() > max_bytes_) {
+      return;
+    }
+    pending_bytes_ += value.size();
+    pending_.push_back({key, std::move(value)});
+  }
+  condition_.notify_one();
+}
+
+CacheStats DiskCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.insertions = insertions_;
+  stats.evictions = evictions_;
+  stats.entries = index_.size();
+  stats.bytes = bytes_;
+  stats.capacity = max_bytes_;
+  return stats;
+}
+
+void DiskCache::maintenance_loop() {
+  auto last_sweep = std::chrono::steady_clock::now();
+
+  while (true) {
+    std::deque<PendingWrite> writes;
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait_for(lock, std::chrono::seconds(10),
+                          [this] { return stop_ || !pending_.empty(); });
+      writes.swap(pending_);
+      pending_bytes_ = 0;
+      stopping = stop_;
+    }
+
+    for (const PendingWrite &write : writes) {
+      write_entry(write);
+    }
+
+    size_t bytes;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      bytes = bytes_;
+    }
+    if (bytes > max_bytes_) {
+      evict_to(static_cast<size_t>(max_bytes_ * kLowWatermark));
+    }
+
+    if (stopping)
+      return;
+
+    // Temp files can only be left behind by a crash mid-write
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_sweep > std::chrono::minutes(10)) {
+      sweep_temp_files();
+      last_sweep = now;
+    }
+  }
+}
+
+void DiskCache::write_entry(const PendingWrite &write) {
+  uint64_t hash = fnv1a_64(write.key);
+  std::string final_path = path_for(hash);
+  fs::path temp_path = fs::path(root_dir_) / "tmp" /
+                       (to_hex(hash) + "." + std::to_string(temp_counter_++));
+
+  std::error_code ec;
+  fs::create_directories(fs::path(final_path).parent_path(), ec);
+
+  uint32_t key_size = static_cast<uint32_t>(write.key.size());
+  uint64_t payload_size = write.value.size();
+  if (!write_durably(temp_path, {{kMagic, sizeof(kMagic)},
+                                 {&key_size, sizeof(key_size)},
+                                 {&payload_size, sizeof(payload_size)},
+                                 {write.key.data(), write.key.size()},
+                                 {write.value.data(), write.value.size()}})) {
+    fs::remove(temp_path, ec);
+    return;
+  }
+
+  // Atomic replace, readers see either the old or the new file. The data
+  // is on disk before the rename, and the rename once the directory is
+  // synced, so a crash leaves the old file, the new one or a temp file.
+  fs::rename(temp_path, final_path, ec);
+  if (ec) {
+    fs::remove(temp_path, ec);
+    return;
+  }
+  sync_directory(fs::path(final_path).parent_path());
+
+  size_t size = header_size(write.key) + write.value.size();
+  std::lock_guard<std::mutex> lock(mutex_);
+  drop_index_entry(hash);
+  lru_.push_front({hash, size});
+  index_[hash] = lru_.begin();
+  bytes_ += size;
+  insertions_++;
+}
+
+void DiskCache::evict_to(size_t target_bytes) {
+  std::vector<uint64_t> victims;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (bytes_ > target_bytes && !lru_.empty()) {
+      uint64_t hash = lru_.back().hash;
+      victims.push_back(hash);
+      drop_index_entry(hash);
+      evictions_++;
+    }
+  }
+
+  std::error_code ec;
+  for (uint64_t hash : victims) {
+    fs::remove(path_for(hash), ec);
+  }
+}
+
+void DiskCache::sweep_temp_files() {
+  std::error_code ec;
+  for (const auto &entry :
+       fs::directory_iterator(fs::path(root_dir_) / "tmp", ec)) {
+    std::error_code remove_ec;
+    fs::remove(entry.path(), remove_ec);
+  }
+}
+
+void DiskCache::drop_index_entry(uint64_t hash) {
+  auto it = index_.find(hash);
+  if (it == index_.end())
+    return;
+  bytes_ -= it->second->size;
+  lru_.erase(it->second);
+  index_.erase(it);
+}
+
+} // namespace imgboost
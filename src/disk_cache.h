@@ -0,0 +1,109 @@
+#pragma once
+
+#include "result_cache.h"
+#include "shared_buffer.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace imgboost {
+
+// Read-only memory mapping of a whole file. The mapping stays valid after the
+// file is unlinked, so evicting an entry never invalidates an in-flight
+// response.
+class MappedFile {
+public:
+  static std::shared_ptr<MappedFile> open(const std::string &path);
+  ~MappedFile();
+
+  // Disable copy
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  MappedFile() = default;
+
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  void *mapping_ = nullptr;
+#endif
+};
+
+// Persistent second cache tier for encoded outputs.
+//
+// Every entry is one content-addressed file <dir>/<xx>/<hash>.bin holding a
+// small header with the full key and the payload length, followed by the
+// WebP payload. The index is rebuilt at startup from a directory listing and
+// the entry headers, hits are returned as SharedBuffers backed by an mmap of
+// the file, and a background thread writes new entries and evicts the least
+// recently used ones once the size budget is exceeded. Entries are synced to
+// disk before they are renamed into place; a file shorter or longer than its
+// header says, left by a crash, is deleted when indexed or read.
+class DiskCache {
+public:
+  DiskCache(const std::string &root_dir, size_t max_bytes);
+  ~DiskCache();
+
+  // Disable copy
+  DiskCache(const DiskCache &) = delete;
+  DiskCache &operator=(const DiskCache &) = delete;
+
+  bool get(const std::string &key, SharedBuffer &value);
+
+  // Queue an entry for writing, never blocks on disk I/O
+  void put(const std::string &key, SharedBuffer value);
+
+  CacheStats stats() const;
+
+private:
+  struct IndexEntry {
+    uint64_t hash;
+    size_t size;
+  };
+
+  struct PendingWrite {
+    std::string key;
+    SharedBuffer value;
+  };
+
+  using LruList = std::list<IndexEntry>;
+
+  std::string path_for(uint64_t hash) const;
+  void rebuild_index();
+  void maintenance_loop();
+  void write_entry(const PendingWrite &write);
+  void evict_to(size_t target_bytes);
+  void sweep_temp_files();
+  void drop_index_entry(uint64_t hash);
+
+  std::string root_dir_;
+  size_t max_bytes_;
+
+  mutable std::mutex mutex_;
+  LruList lru_; // front == most recently used
+  std::unordered_map<uint64_t, LruList::iterator> index_;
+  size_t bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t insertions_ = 0;
+  uint64_t evictions_ = 0;
+
+  std::deque<PendingWrite> pending_;
+  size_t pending_bytes_ = 0;
+  uint64_t temp_counter_ = 0;
+  std::condition_variable condition_;
+  bool stop_ = false;
+  std::thread maintenance_thread_;
+};
+
+} // namespace imgboost
@@ -0,0 +1,748 @@
+#include "http_server.h"
+#include "logger.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace imgboost {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+#ifdef _WIN32
+using socket_t = SOCKET;
+const socket_t kInvalidSocket = INVALID_SOCKET;
+
+int poll_sockets(pollfd *fds, size_t count, int timeout_ms) {
+  return WSAPoll(fds, static_cast<ULONG>(count), timeout_ms);
+}
+void close_socket(socket_t s) { closesocket(s); }
+bool would_block() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+bool interrupted() { return false; }
+bool set_nonblocking(socket_t s) {
+  u_long mode = 1;
+  return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+#else
+using socket_t = int;
+const socket_t kInvalidSocket = -1;
+
+int poll_sockets(pollfd *fds, size_t count, int timeout_ms) {
+  return poll(fds, static_cast<nfds_t>(count), timeout_ms);
+}
+void close_socket(socket_t s) { close(s); }
+bool would_block() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+bool interrupted() { return errno == EINTR; }
+bool set_nonblocking(socket_t s) {
+  int flags = fcntl(s, F_GETFL, 0);
+  return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+#endif
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+long send_some(socket_t s, const uint8_t *data, size_t size) {
+  return static_cast<long>(send(s, reinterpret_cast<const char *>(data),
+                                static_cast<int>(std::min<size_t>(
+                                    size, 1 << 30)),
+                                kSendFlags));
+}
+
+long recv_some(socket_t s, char *buffer, size_t size) {
+  return static_cast<long>(recv(s, buffer, static_cast<int>(size), 0));
+}
+
+void disable_sigpipe(socket_t s) {
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+  (void)s;
+#endif
+}
+
+const char *reason_phrase(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 413: return "Payload Too Large";
+  case 431: return "Request Header Fields Too Large";
+  case 500: return "Internal Server Error";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  case 504: return "Gateway Timeout";
+  default: return status < 400 ? "OK" : "Error";
+  }
+}
+
+std::string to_lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+std::string trim(const std::string &s) {
+  size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  size_t end = s.find_last_not_of(" \t");
+  return s.substr(begin, end - begin + 1);
+}
+
+// Percent-decoding of the path only; '+' is a literal there
+std::string decode_path(const std::string &path) {
+  std::string result;
+  for (size_t i = 0; i < path.size(); ++i) {
+    if (path[i] == '%' && i + 2 < path.size() &&
+        std::isxdigit(static_cast<unsigned char>(path[i + 1])) &&
+        std::isxdigit(static_cast<unsigned char>(path[i + 2]))) {
+      result += static_cast<char>(std::stoi(path.substr(i + 1, 2), nullptr,
+                                            16));
+      i += 2;
+    } else {
+      result += path[i];
+    }
+  }
+  return result;
+}
+
+void parse_query(const std::string &query,
+                 std::unordered_map<std::string, std::string> &params) {
+  size_t pos = 0;
+  while (pos <= query.size()) {
+    size_t end = query.find('&', pos);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    std::string pair = query.substr(pos, end - pos);
+    if (!pair.empty()) {
+      size_t eq = pair.find('=');
+      std::string key = url_decode(pair.substr(0, eq));
+      std::string value = eq == std::string::npos
+                              ? std::string()
+                              : url_decode(pair.substr(eq + 1));
+      params.emplace(std::move(key), std::move(value)); // first one wins
+    }
+    pos = end + 1;
+  }
+}
+
+} // namespace
+
+int parse_request_head(const std::string &head, HttpRequest &request,
+                       bool &keep_alive, std::string &error) {
+  keep_alive = false;
+  size_t line_end = head.find("\r\n");
+  std::string request_line = head.substr(0, line_end);
+  size_t sp1 = request_line.find(' ');
+  size_t sp2 = request_line.rfind(' ');
+  if (sp1 == std::string::npos || sp2 == sp1) {
+    error = "Malformed request line";
+    return 400;
+  }
+  request.method = request_line.substr(0, sp1);
+  std::string target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+  std::string version = request_line.substr(sp2 + 1);
+  if (version != "HTTP/1.1" && version != "HTTP/1.0") {
+    error = "Unsupported HTTP version";
+    return 400;
+  }
+
+  size_t pos = line_end == std::string::npos ? head.size() : line_end + 2;
+  while (pos < head.size()) {
+    size_t next = head.find("\r\n", pos);
+    if (next == std::string::npos) {
+      next = head.size();
+    }
+    std::string line = head.substr(pos, next - pos);
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      error = "Malformed header";
+      return 400;
+    }
+    request.headers[to_lower(trim(line.substr(0, colon)))] =
+        trim(line.substr(colon + 1));
+    pos = next + 2;
+  }
+
+  std::string length = request.get_header_value("content-length");
+  if ((!length.empty() && length != "0") ||
+      request.headers.count("transfer-encoding")) {
+    error = "Request bodies are not supported";
+    return 413;
+  }
+
+  std::string connection = to_lower(request.get_header_value("connection"));
+  keep_alive = version == "HTTP/1.1" ? connection != "close"
+                                     : connection == "keep-alive";
+
+  size_t question = target.find('?');
+  request.path = decode_path(target.substr(0, question));
+  if (question != std::string::npos) {
+    parse_query(target.substr(question + 1), request.params);
+  }
+  return 0;
+}
+
+struct HttpServer::Connection {
+  uint64_t id = 0;
+  socket_t socket = kInvalidSocket;
+  std::string input;                 // received, not yet parsed
+  std::vector<SharedBuffer> output;  // response being written
+  size_t output_index = 0;
+  size_t output_offset = 0;
+  bool awaiting = false;  // a request was dispatched, no response yet
+  bool head = false;      // the pending request is a HEAD
+  bool keep_alive = true; // of the pending request
+  bool closing = false;   // close once the output is written
+  bool peer_closed = false; // the client shut down its side, nothing to read
+  Clock::time_point deadline;
+  CancelTokenPtr cancel; // of the request awaiting its response
+  size_t slot = 0;       // index in the PollSet
+};
+
+// What poll() watches, kept from one iteration to the next: the listener,
+// the mailbox, then one entry per connection at its slot. A connection
+// updates its own entry when its state changes, and closing one moves the
+// last entry into its slot, so nothing is rebuilt per iteration.
+struct HttpServer::PollSet {
+  static constexpr size_t kFirstConnection = 2;
+
+  std::vector<pollfd> fds;
+  std::vector<Connection *> connections; // of fds[kFirstConnection + i]
+
+  void reset(socket_t listener, socket_t wake) {
+    fds.assign({{listener, 0, 0}, {wake, POLLIN, 0}});
+    connections.clear();
+  }
+
+  void add(Connection &conn) {
+    conn.slot = connections.size();
+    fds.push_back({conn.socket, POLLIN, 0});
+    connections.push_back(&conn);
+  }
+
+  void remove(Connection &conn) {
+    size_t last = connections.size() - 1;
+    if (conn.slot != last) {
+      fds[kFirstConnection + conn.slot] = fds[kFirstConnection + last];
+      connections[conn.slot] = connections[last];
+      connections[conn.slot]->slot = conn.slot;
+    }
+    fds.pop_back();
+    connections.pop_back();
+  }
+
+  pollfd &entry(const Connection &conn) {
+    return fds[kFirstConnection + conn.slot];
+  }
+};
+
+// Completed responses travel from worker threads to the event loop through
+// this queue. A datagram sent to a loopback socket connected to itself
+// wakes the loop, the same way on every platform.
+struct HttpServer::Mailbox {
+  std::mutex mutex;
+  std::vector<std::pair<uint64_t, HttpResponse>> ready;
+  bool closed = false;
+  std::atomic<bool> signalled{false};
+  socket_t wake_socket = kInvalidSocket;
+
+  Mailbox() {
+    wake_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wake_socket == kInvalidSocket) {
+      throw std::runtime_error("Cannot create the event loop wake socket");
+    }
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(wake_socket, reinterpret_cast<sockaddr *>(&addr), len) != 0 ||
+        getsockname(wake_socket, reinterpret_cast<sockaddr *>(&addr), &len) !=
+            0 ||
+        connect(wake_socket, reinterpret_cast<sockaddr *>(&addr), len) != 0 ||
+        !set_nonblocking(wake_socket)) {
+      close_socket(wake_socket);
+      throw std::runtime_error("Cannot set up the event loop wake socket");
+    }
+  }
+
+  ~Mailbox() { close_socket(wake_socket); }
+
+  void post(uint64_t id, HttpResponse response) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (closed) {
+        return;
+      }
+      ready.emplace_back(id, std::move(response));
+    }
+    wake();
+  }
+
+  // One datagram per batch, however many responses are posted meanwhile
+  void wake() {
+    if (!signalled.exchange(true)) {
+      char byte = 0;
+      send(wake_socket, &byte, 1, 0);
+    }
+  }
+
+  // Loop side: rearm the wakeup before taking the batch so nothing is missed
+  std::vector<std::pair<uint64_t, HttpResponse>> take() {
+    signalled.store(false);
+    char buffer[64];
+    while (recv_some(wake_socket, buffer, sizeof(buffer)) > 0) {
+    }
+    std::vector<std::pair<uint64_t, HttpResponse>> batch;
+    std::lock_guard<std::mutex> lock(mutex);
+    batch.swap(ready);
+    return batch;
+  }
+};
+
+HttpServer::HttpServer(const HttpServerConfig &config) : config_(config) {
+#ifdef _WIN32
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+  mailbox_ = std::make_shared<Mailbox>();
+  poll_set_ = std::make_unique<PollSet>();
+  handlers_ = std::make_unique<ThreadPool>(config_.handler_threads);
+}
+
+HttpServer::~HttpServer() {
+  stop();
+  handlers_.reset();
+  std::lock_guard<std::mutex> lock(mailbox_->mutex);
+  mailbox_->closed = true;
+  mailbox_->ready.clear();
+}
+
+void HttpServer::get(const std::string &path, HttpHandler handler) {
+  routes_[path] = std::move(handler);
+}
+
+bool HttpServer::listen(const std::string &host, int port) {
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  addrinfo *result = nullptr;
+  std::string service = std::to_string(port);
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0) {
+    return false;
+  }
+
+  socket_t listener = kInvalidSocket;
+  for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+    listener = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (listener == kInvalidSocket) {
+      continue;
+    }
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char *>(&on), sizeof(on));
+    if (bind(listener, ai->ai_addr, static_cast<socklen_t>(ai->ai_addrlen)) ==
+            0 &&
+        ::listen(listener, SOMAXCONN) == 0 && set_nonblocking(listener)) {
+      break;
+    }
+    close_socket(listener);
+    listener = kInvalidSocket;
+  }
+  freeaddrinfo(result);
+  if (listener == kInvalidSocket) {
+    return false;
+  }
+
+  listen_socket_ = static_cast<intptr_t>(listener);
+  running_ = true;
+  run();
+
+  for (auto &entry : connections_) {
+    if (entry.second->cancel) {
+      entry.second->cancel->cancel();
+    }
+    close_socket(entry.second->socket);
+  }
+  connections_.clear();
+  poll_set_->reset(kInvalidSocket, kInvalidSocket);
+  open_connections_ = 0;
+  close_socket(listener);
+  listen_socket_ = -1;
+  return true;
+}
+
+void HttpServer::stop() {
+  running_ = false;
+  mailbox_->wake();
+}
+
+HttpServerStats HttpServer::stats() const {
+  HttpServerStats stats;
+  stats.connections = open_connections_.load();
+  stats.in_flight = in_flight_.load();
+  stats.requests = requests_.load();
+  return stats;
+}
+
+void HttpServer::run() {
+  PollSet &set = *poll_set_;
+  set.reset(static_cast<socket_t>(listen_socket_), mailbox_->wake_socket);
+
+  while (running_) {
+    set.fds[0].events =
+        connections_.size() < config_.max_connections ? POLLIN : 0;
+
+    // The timeout bounds how late idle connections are expired
+    if (poll_sockets(set.fds.data(), set.fds.size(), 1000) < 0) {
+      if (interrupted()) {
+        continue;
+      }
+      IMGBOOST_LOG(ERR, "HttpServer", "poll failed, stopping");
+      break;
+    }
+
+    if (set.fds[1].revents) {
+      deliver_responses();
+    }
+
+    // Closing a connection moves the last one, not yet visited, into its
+    // slot, which is then visited in turn
+    for (size_t i = 0; i < set.connections.size();) {
+      Connection &conn = *set.connections[i];
+      short revents = set.entry(conn).revents;
+      if (!revents) {
+        ++i;
+        continue;
+      }
+      bool open = !(revents & (POLLERR | POLLNVAL));
+      if (open && (revents & (POLLIN | POLLHUP))) {
+        open = read_from(conn);
+      }
+      if (open && (revents & POLLOUT)) {
+        open = write_to(conn);
+      }
+      if (!open) {
+        close_connection(conn.id);
+        continue;
+      }
+      watch(conn);
+      ++i;
+    }
+
+    if (set.fds[0].revents & POLLIN) {
+      accept_clients();
+    }
+    expire_connections();
+  }
+}
+
+void HttpServer::watch(Connection &conn) {
+  // A connection waiting on its handler keeps reading up to the limit, so a
+  // connection that fails is closed before its response is ready. One whose
+  // client shut down its side is only written to.
+  short events = 0;
+  if (!conn.output.empty()) {
+    events = POLLOUT;
+  } else if (!conn.peer_closed &&
+             (!conn.awaiting || conn.input.size() < read_limit())) {
+    events = POLLIN;
+  }
+  poll_set_->entry(conn).events = events;
+}
+
+void HttpServer::accept_clients() {
+  socket_t listener = static_cast<socket_t>(listen_socket_);
+  while (connections_.size() < config_.max_connections) {
+    socket_t client = accept(listener, nullptr, nullptr);
+    if (client == kInvalidSocket) {
+      return; // drained, or a transient error retried on the next poll
+    }
+    if (!set_nonblocking(client)) {
+      close_socket(client);
+      continue;
+    }
+    int on = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY,
+               reinterpret_cast<const char *>(&on), sizeof(on));
+    disable_sigpipe(client);
+
+    auto conn = std::make_unique<Connection>();
+    conn->id = next_id_++;
+    conn->socket = client;
+    conn->deadline = Clock::now() + std::chrono::seconds(config_.io_timeout);
+    poll_set_->add(*conn);
+    connections_.emplace(conn->id, std::move(conn));
+    open_connections_++;
+  }
+}
+
+bool HttpServer::read_from(Connection &conn) {
+  char buffer[16 * 1024];
+  while (conn.input.size() < read_limit()) {
+    long n = recv_some(conn.socket, buffer, sizeof(buffer));
+    if (n > 0) {
+      conn.input.append(buffer, static_cast<size_t>(n));
+      continue;
+    }
+    if (n < 0 && would_block()) {
+      break;
+    }
+    if (n < 0) {
+      return false;
+    }
+    // End of input. A client may shut down its side right after sending
+    // its request and still wait for the reply, so requests already
+    // received are answered before the connection is closed.
+    conn.peer_closed = true;
+    break;
+  }
+
+  conn.deadline = Clock::now() + std::chrono::seconds(config_.io_timeout);
+  dispatch_next(conn);
+  if (finished(conn)) {
+    return false; // hung up without a complete request
+  }
+  return conn.output.empty() || write_to(conn);
+}
+
+bool HttpServer::finished(const Connection &conn) const {
+  return conn.peer_closed && !conn.awaiting && conn.output.empty();
+}
+
+bool HttpServer::write_to(Connection &conn) {
+  for (;;) {
+    while (conn.output_index < conn.output.size()) {
+      const SharedBuffer &piece = conn.output[conn.output_index];
+      size_t remaining = piece.size() - conn.output_offset;
+      if (remaining == 0) {
+        conn.output_index++;
+        conn.output_offset = 0;
+        continue;
+      }
+      long n = send_some(conn.socket, piece.data() + conn.output_offset,
+                         remaining);
+      if (n < 0) {
+        return would_block();
+      }
+      conn.output_offset += static_cast<size_t>(n);
+      // The timeout measures a stalled client, not a long transfer
+      if (n > 0) {
+        conn.deadline =
+            Clock::now() + std::chrono::seconds(config_.io_timeout);
+      }
+    }
+
+    conn.output.clear();
+    conn.output_index = 0;
+    conn.output_offset = 0;
+    if (conn.closing) {
+      return false;
+    }
+    conn.deadline =
+        Clock::now() + std::chrono::seconds(conn.input.empty()
+                                                ? config_.keep_alive_timeout
+                                                : config_.io_timeout);
+
+    // A pipelined request may already be buffered
+    dispatch_next(conn);
+    if (finished(conn)) {
+      return false;
+    }
+    if (conn.output.empty()) {
+      return true;
+    }
+  }
+}
+
+void HttpServer::dispatch_next(Connection &conn) {
+  if (conn.awaiting || conn.closing || !conn.output.empty()) {
+    return;
+  }
+
+  auto reject = [this, &conn](int status, const std::string &message) {
+    HttpResponse response;
+    response.status = status;
+    response.set_content(message, "text/plain");
+    conn.keep_alive = false;
+    conn.head = false;
+    queue_response(conn, std::move(response));
+  };
+
+  size_t end = conn.input.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    if (conn.input.size() > config_.max_header_bytes) {
+      reject(431, "Request headers too large");
+    }
+    return;
+  }
+  std::string head = conn.input.substr(0, end);
+  conn.input.erase(0, end + 4);
+
+  HttpRequest request;
+  std::string error;
+  if (int status =
+          parse_request_head(head, request, conn.keep_alive, error)) {
+    reject(status, error);
+    return;
+  }
+  conn.head = request.method == "HEAD";
+
+  if (request.method != "GET" && request.method != "HEAD") {
+    HttpResponse response;
+    response.status = 405;
+    response.set_header("Allow", "GET, HEAD");
+    response.set_content("Method not allowed", "text/plain");
+    queue_response(conn, std::move(response));
+    return;
+  }
+
+  auto route = routes_.find(request.path);
+  if (route == routes_.end()) {
+    HttpResponse response;
+    response.status = 404;
+    response.set_content("Not found", "text/plain");
+    queue_response(conn, std::move(response));
+    return;
+  }
+
+  request.cancel = std::make_shared<CancelToken>();
+  conn.cancel = request.cancel;
+  conn.awaiting = true;
+  in_flight_++;
+  requests_++;
+  std::shared_ptr<Mailbox> mailbox = mailbox_;
+  uint64_t id = conn.id;
+  HttpResponder respond = [mailbox, id](HttpResponse response) {
+    mailbox->post(id, std::move(response));
+  };
+  // Routes are not changed once the loop runs, the handler stays put
+  const HttpHandler *handler = &route->second;
+  handlers_->execute([handler, request = std::move(request),
+                      respond = std::move(respond)]() {
+    try {
+      (*handler)(request, respond);
+    } catch (const std::exception &e) {
+      IMGBOOST_LOG(ERR, "HttpServer", "Handler failed")
+          .field("error", e.what());
+      HttpResponse response;
+      response.status = 500;
+      response.set_content(std::string("Internal error: ") + e.what(),
+                           "text/plain");
+      respond(std::move(response));
+    }
+  });
+}
+
+void HttpServer::deliver_responses() {
+  for (auto &entry : mailbox_->take()) {
+    in_flight_--;
+    auto it = connections_.find(entry.first);
+    if (it == connections_.end()) {
+      continue; // the client hung up while the request was processed
+    }
+    Connection &conn = *it->second;
+    conn.awaiting = false;
+    conn.cancel.reset();
+    queue_response(conn, std::move(entry.second));
+    if (!write_to(conn)) {
+      close_connection(entry.first);
+    } else {
+      watch(conn);
+    }
+  }
+}
+
+void HttpServer::queue_response(Connection &conn, HttpResponse response) {
+  std::string header = "HTTP/1.1 " + std::to_string(response.status) + " " +
+                       reason_phrase(response.status) + "\r\n";
+  if (!response.content_type.empty()) {
+    header += "Content-Type: " + response.content_type + "\r\n";
+  }
+  header +=
+      "Content-Length: " + std::to_string(response.content_length()) + "\r\n";
+  for (const auto &field : response.headers) {
+    header += field.first + ": " + field.second + "\r\n";
+  }
+  header += conn.keep_alive ? "Connection: keep-alive\r\n\r\n"
+                            : "Connection: close\r\n\r\n";
+
+  conn.output.clear();
+  conn.output.push_back(SharedBuffer::from_string(std::move(header)));
+  if (!conn.head) {
+    for (SharedBuffer &piece : response.body) {
+      conn.output.push_back(std::move(piece));
+    }
+  }
+  conn.output_index = 0;
+  conn.output_offset = 0;
+  conn.closing = !conn.keep_alive;
+  conn.deadline = Clock::now() + std::chrono::seconds(config_.io_timeout);
+}
+
+void HttpServer::expire_connections() {
+  Clock::time_point now = Clock::now();
+  std::vector<uint64_t> expired;
+  for (auto &entry : connections_) {
+    if (!entry.second->awaiting && now >= entry.second->deadline) {
+      expired.push_back(entry.first);
+    }
+  }
+  for (uint64_t id : expired) {
+    close_connection(id);
+  }
+}
+
+void HttpServer::close_connection(uint64_t id) {
+  auto it = connections_.find(id);
+  if (it == connections_.end()) {
+    return;
+  }
+  // Work still running for the client is no longer wanted
+  if (it->second->cancel) {
+    it->second->cancel->cancel();
+  }
+  close_socket(it->second->socket);
+  poll_set_->remove(*it->second);
+  connections_.erase(it);
+  open_connections_--;
+}
+
+} // namespace imgboost
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "cancel_token.h"
+#include "shared_buffer.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace imgboost {
+
+struct HttpRequest {
+  std::string method; // GET or HEAD
+  std::string path;
+  std::unordered_map<std::string, std::string> params; // decoded query
+  std::unordered_map<std::string, std::string> headers; // lower-case names
+  // Cancelled when the connection fails before the response is ready, not
+  // when the client only shuts down its sending side; the handler may give
+  // it a deadline
+  CancelTokenPtr cancel;
+
+  bool has_param(const std::string &name) const {
+    return params.count(name) > 0;
+  }
+  // Empty when absent
+  std::string get_param_value(const std::string &name) const {
+    auto it = params.find(name);
+    return it == params.end() ? std::string() : it->second;
+  }
+  std::string get_header_value(const std::string &name) const {
+    auto it = headers.find(name);
+    return it == headers.end() ? std::string() : it->second;
+  }
+};
+
+// The body is a list of shared buffers written one after the other, so
+// cached outputs and multipart parts go out without being copied
+struct HttpResponse {
+  int status = 200;
+  std::string content_type;
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::vector<SharedBuffer> body;
+
+  void set_content(std::string content, const std::string &type) {
+    content_type = type;
+    body.clear();
+    body.push_back(SharedBuffer::from_string(std::move(content)));
+  }
+  void set_header(const std::string &name, const std::string &value) {
+    headers.emplace_back(name, value);
+  }
+  size_t content_length() const {
+    size_t total = 0;
+    for (const SharedBuffer &piece : body) {
+      total += piece.size();
+    }
+    return total;
+  }
+};
+
+// Completes a request. Call exactly once, from any thread; the response is
+// dropped if the client has gone away in the meantime.
+using HttpResponder = std::function<void(HttpResponse)>;
+
+// Runs on one of the server's handler threads, never on the event loop, so
+// a cache lookup that maps a file or faults pages in stalls no other client.
+// Work that waits on the network should hand the responder to whatever
+// finishes it rather than hold the thread.
+using HttpHandler =
+    std::function<void(const HttpRequest &, HttpResponder)>;
+
+struct HttpServerConfig {
+  size_t max_connections = 4096;  // further clients wait in the backlog
+  int64_t keep_alive_timeout = 5; // seconds an idle connection is kept
+  int64_t io_timeout = 30;        // seconds to receive headers or send a reply
+  size_t max_header_bytes = 16 * 1024;
+  size_t handler_threads = 4;     // run the handlers off the event loop
+};
+
+struct HttpServerStats {
+  uint64_t connections = 0; // currently open
+  uint64_t in_flight = 0;   // requests dispatched and not yet answered
+  uint64_t requests = 0;    // total dispatched
+};
+
+// Parses the request line and header fields of one request, without the
+// blank line that ends them. Returns 0 after filling method, path, params and
+// headers of request and whether the connection is kept alive, otherwise the
+// status to reject the request with and the reason in error. Requests with a
+// body get 413: bodies are never read, so the stream could not be
+// resynchronised.
+int parse_request_head(const std::string &head, HttpRequest &request,
+                       bool &keep_alive, std::string &error);
+
+class ThreadPool;
+
+// Event driven HTTP/1.1 front end. One thread multiplexes every connection
+// with poll(), so a request waiting on a slow origin holds a socket and a
+// responder, not a thread; concurrency is bounded by the download and
+// processing pools behind the handlers, which run on a small pool of their
+// own. Only GET and HEAD without a request body are served, with keep-alive
+// and pipelining.
+class HttpServer {
+public:
+  explicit HttpServer(const HttpServerConfig &config = HttpServerConfig());
+  ~HttpServer();
+
+  // Disable copy
+  HttpServer(const HttpServer &) = delete;
+  HttpServer &operator=(const HttpServer &) = delete;
+
+  // Exact path match, HEAD is answered by the GET handler
+  void get(const std::string &path, HttpHandler handler);
+
+  // Runs the event loop on the calling thread until stop(); false when the
+  // address cannot be bound
+  bool listen(const std::string &host, int port);
+
+  // Thread-safe; open connections are closed, late responses are dropped
+  void stop();
+
+  HttpServerStats stats() const;
+
+private:
+  struct Connection;
+  struct Mailbox;
+  struct PollSet;
+
+  void run();
+  void accept_clients();
+  // Both return false when the connection is to be closed
+  bool read_from(Connection &conn);
+  bool write_to(Connection &conn);
+  void dispatch_next(Connection &conn);
+  void deliver_responses();
+  void queue_response(Connection &conn, HttpResponse response);
+  void expire_connections();
+  void close_connection(uint64_t id);
+  // Recomputes the events polled for conn from its state
+  void watch(Connection &conn);
+  // The client shut down its side and every request it sent is answered
+  bool finished(const Connection &conn) const;
+
+  // Pipelined requests beyond a few headers' worth wait in the kernel
+  size_t read_limit() const { return config_.max_header_bytes * 4; }
+
+  HttpServerConfig config_;
+  std::unordered_map<std::string, HttpHandler> routes_;
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+  std::shared_ptr<Mailbox> mailbox_; // shared with outstanding responders
+  std::unique_ptr<PollSet> poll_set_;
+  intptr_t listen_socket_ = -1;
+  uint64_t next_id_ = 1;
+  std::atomic<bool> running_{false};
+  std::atomic<uint64_t> open_connections_{0};
+  std::atomic<uint64_t> in_flight_{0};
+  std::atomic<uint64_t> requests_{0};
+  // Declared last and so destroyed first: running handlers finish before
+  // anything they use goes away
+  std::unique_ptr<ThreadPool> handlers_;
+};
+
+} // namespace imgboost
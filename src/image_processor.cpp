@@ -1,5 +1,6 @@
 #include "image_processor.h"
 #include <algorithm>
+#include <cmath>
 #include <csetjmp>
 #include <cstring>
 #include <jpeglib.h>
@@ -10,6 +11,52 @@
 
 namespace imgboost {
 
+// Below this many pixels a single thread finishes before helpers would start
+static const size_t kParallelMinPixels = 1024 * 1024;
+
+// Decodes at least this large go through the band pipeline. Smaller ones
+// are cheap to hold whole and resize faster in parallel stripes.
+static const uint64_t kBandMinPixels = 4 * 1024 * 1024;
+
+// Scanlines per libjpeg read in the band pipeline
+static const int kBandRows = 16;
+
+// Rows held by a RowResampler window: two vertical filter supports, at most
+// Lanczos3's three source rows per output row on each side
+static uint64_t window_rows(uint64_t src_height, uint64_t dst_height) {
+  uint64_t ratio = (src_height + dst_height - 1) / dst_height;
+  return 2 * (2 * 3 * std::max<uint64_t>(ratio, 1) + 1);
+}
+
+// JFIF stores full-range YCbCr, WebP expects BT.601 studio range: luma in
+// 16..235 and chroma in 16..240 around 128
+struct StudioRange {
+  uint8_t luma[256];
+  uint8_t chroma[256];
+
+  StudioRange() {
+    for (int i = 0; i < 256; ++i) {
+      luma[i] = static_cast<uint8_t>(16 + (i * 219 + 127) / 255);
+      chroma[i] = static_cast<uint8_t>(
+          128 + static_cast<int>(std::lround((i - 128) * 224.0 / 255.0)));
+    }
+  }
+};
+
+static const StudioRange &studio_range() {
+  static const StudioRange range;
+  return range;
+}
+
+// Row y of a picture plane from a resampled row, through a range table
+static void map_row(const uint8_t *row, uint8_t *plane, int plane_stride,
+                    int y, int width, const uint8_t *table) {
+  uint8_t *out = plane + static_cast<size_t>(y) * plane_stride;
+  for (int x = 0; x < width; ++x) {
+    out[x] = table[row[x]];
+  }
+}
+
 struct jpeg_error_mgr_ext {
   struct jpeg_error_mgr pub;
   jmp_buf setjmp_buffer;
@@ -20,6 +67,18 @@ static void jpeg_error_exit(j_common_ptr cinfo) {
   longjmp(err->setjmp_buffer, 1);
 }
 
+// YCbCr with luma sampled 2x2 and each chroma plane once per 2x2 block, the
+// layout of nearly every camera and web JPEG
+static bool is_chroma_420(const jpeg_decompress_struct &cinfo) {
+  if (cinfo.jpeg_color_space != JCS_YCbCr || cinfo.num_components != 3) {
+    return false;
+  }
+  const jpeg_component_info *comp = cinfo.comp_info;
+  return comp[0].h_samp_factor == 2 && comp[0].v_samp_factor == 2 &&
+         comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1 &&
+         comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1;
+}
+
 struct PNGReadState {
   const uint8_t *data;
   size_t size;
@@ -37,9 +96,46 @@ static void png_read_callback(png_structp png_ptr, png_bytep data,
   state->offset += length;
 }
 
-ImageProcessor::ImageFormat
-ImageProcessor::detect_format(const std::vector<uint8_t> &data) {
-  if (data.size() < 12)
+// Convert any PNG color type and depth to 8-bit RGB, or RGBA when the image
+// has an alpha channel or a transparent color. Returns the channel count.
+static int png_set_rgb_transforms(png_structp png_ptr, png_infop info_ptr) {
+  png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+  png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+  bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) != 0;
+
+  if (bit_depth == 16)
+    png_set_strip_16(png_ptr);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(png_ptr);
+
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+    png_set_expand_gray_1_2_4_to_8(png_ptr);
+
+  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+    png_set_tRNS_to_alpha(png_ptr);
+    alpha = true;
+  }
+
+  if (color_type == PNG_COLOR_TYPE_GRAY ||
+      color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+    png_set_gray_to_rgb(png_ptr);
+
+  png_read_update_info(png_ptr, info_ptr);
+  return alpha ? 4 : 3;
+}
+
+void strip_opaque_alpha(DecodedImage &image) {
+  size_t count = static_cast<size_t>(image.width) * image.height;
+  if (image.channels == 4 && rgba_opaque(image.pixels.data(), count)) {
+    rgba_to_rgb(image.pixels.data(), count);
+    image.pixels.resize(count * 3);
+    image.channels = 3;
+  }
+}
+
+ImageFormat ImageProcessor::detect_format(const uint8_t *data, size_t size) {
+  if (size < 12)
     return ImageFormat::UNKNOWN;
 
   // JPEG: FF D8 (JPEG SOI marker)
@@ -63,9 +159,9 @@ ImageProcessor::detect_format(const std::vector<uint8_t> &data) {
   return ImageFormat::UNKNOWN;
 }
 
-bool ImageProcessor::decode_jpeg(const std::vector<uint8_t> &data,
-                                 std::vector<uint8_t> &rgba_data, int &width,
-                                 int &height) {
+bool ImageProcessor::decode_jpeg(const uint8_t *data, size_t size,
+                                 DecodedImage &image, int req_width,
+                                 int req_height) {
   struct jpeg_decompress_struct cinfo;
   jpeg_error_mgr_ext jerr;
 
@@ -78,31 +174,42 @@ bool ImageProcessor::decode_jpeg(const std::vector<uint8_t> &data,
   }
 
   jpeg_create_decompress(&cinfo);
-  jpeg_mem_src(&cinfo, data.data(), data.size());
+  jpeg_mem_src(&cinfo, data, size);
   jpeg_read_header(&cinfo, TRUE);
 
+  image.source_width = cinfo.image_width;
+  image.source_height = cinfo.image_height;
+
+  int num = jpeg_scale(image.source_width, image.source_height, req_width,
+                       req_height);
+  if (num < 8) {
+    cinfo.scale_num = num;
+    cinfo.scale_denom = 8;
+  }
+
+  // JPEG has no alpha, three channels are all there is to resize
   cinfo.out_color_space = JCS_RGB;
   jpeg_start_decompress(&cinfo);
 
-  width = cinfo.output_width;
-  height = cinfo.output_height;
-  int channels = cinfo.output_components;
+  image.width = cinfo.output_width;
+  image.height = cinfo.output_height;
+  image.channels = 3;
+  size_t stride = static_cast<size_t>(image.width) * 3;
+  image.pixels.resize(stride * image.height);
 
-  std::vector<uint8_t> row_buffer(width * channels);
-  rgba_data.resize(width * height * 4);
-
-  int row = 0;
+  const int batch = 16;
+  JSAMPROW rows[batch];
   while (cinfo.output_scanline < cinfo.output_height) {
-    uint8_t *row_ptr = row_buffer.data();
-    jpeg_read_scanlines(&cinfo, &row_ptr, 1);
-
-    for (int x = 0; x < width; ++x) {
-      rgba_data[(row * width + x) * 4 + 0] = row_buffer[x * channels + 0];
-      rgba_data[(row * width + x) * 4 + 1] = row_buffer[x * channels + 1];
-      rgba_data[(row * width + x) * 4 + 2] = row_buffer[x * channels + 2];
-      rgba_data[(row * width + x) * 4 + 3] = 255; // Alpha
+    if (stop_requested()) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    JDIMENSION first = cinfo.output_scanline;
+    int count = std::min<int>(batch, cinfo.output_height - first);
+    for (int i = 0; i < count; ++i) {
+      rows[i] = image.pixels.data() + (first + i) * stride;
     }
-    row++;
+    jpeg_read_scanlines(&cinfo, rows, count);
   }
 
   jpeg_finish_decompress(&cinfo);
@@ -111,9 +218,28 @@ bool ImageProcessor::decode_jpeg(const std::vector<uint8_t> &data,
   return true;
 }
 
-bool ImageProcessor::decode_png(const std::vector<uint8_t> &data,
-                                std::vector<uint8_t> &rgba_data, int &width,
-                                int &height) {
+// Scale in the DCT domain by the smallest M/8 whose output still covers the
+// target, the resampler then only does the remaining fraction
+int ImageProcessor::jpeg_scale(int source_width, int source_height,
+                               int req_width, int req_height) {
+  if (req_width == 0 && req_height == 0) {
+    return 8;
+  }
+  int dst_width, dst_height;
+  calculate_dimensions(source_width, source_height, req_width, req_height,
+                       dst_width, dst_height);
+  for (int num = 1; num < 8; ++num) {
+    long scaled_width = (static_cast<long>(source_width) * num + 7) / 8;
+    long scaled_height = (static_cast<long>(source_height) * num + 7) / 8;
+    if (scaled_width >= dst_width && scaled_height >= dst_height) {
+      return num;
+    }
+  }
+  return 8;
+}
+
+bool ImageProcessor::decode_png(const uint8_t *data, size_t size,
+                                DecodedImage &image) {
   png_structp png_ptr =
       png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
   if (!png_ptr)
@@ -130,64 +256,303 @@ bool ImageProcessor::decode_png(const std::vector<uint8_t> &data,
     return false;
   }
 
-  PNGReadState state = {data.data(), data.size(), 0};
+  PNGReadState state = {data, size, 0};
   png_set_read_fn(png_ptr, &state, png_read_callback);
 
   png_read_info(png_ptr, info_ptr);
 
-  width = png_get_image_width(png_ptr, info_ptr);
-  height = png_get_image_height(png_ptr, info_ptr);
-  png_byte color_type = png_get_color_type(png_ptr, info_ptr);
-  png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+  image.width = image.source_width = png_get_image_width(png_ptr, info_ptr);
+  image.height = image.source_height = png_get_image_height(png_ptr, info_ptr);
+  // Before the transforms update the row info; an interlaced image is then
+  // read once per pass
+  int passes = png_set_interlace_handling(png_ptr);
+  image.channels = png_set_rgb_transforms(png_ptr, info_ptr);
 
-  // Convert to RGBA
-  if (bit_depth == 16)
-    png_set_strip_16(png_ptr);
+  size_t stride = static_cast<size_t>(image.width) * image.channels;
+  image.pixels.resize(stride * image.height);
+  std::vector<png_bytep> row_pointers(image.height);
+  for (int y = 0; y < image.height; y++) {
+    row_pointers[y] = image.pixels.data() + static_cast<size_t>(y) * stride;
+  }
 
-  if (color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_palette_to_rgb(png_ptr);
+  // Row by row rather than png_read_image, to stop between batches
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int y = 0; y < image.height; y++) {
+      if (y % kBandRows == 0 && stop_requested()) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+        return false;
+      }
+      png_read_row(png_ptr, row_pointers[y], nullptr);
+    }
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
 
-  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-    png_set_expand_gray_1_2_4_to_8(png_ptr);
+  return true;
+}
 
-  if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
-    png_set_tRNS_to_alpha(png_ptr);
+bool ImageProcessor::decode_jpeg_rows(const uint8_t *data, size_t size,
+                                      int scale_num, PixelBuffer &band,
+                                      RowResampler &rows) {
+  struct jpeg_decompress_struct cinfo;
+  jpeg_error_mgr_ext jerr;
 
-  if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY ||
-      color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_filler(png_ptr, 0xFF, PNG_FILLER_AFTER);
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
 
-  if (color_type == PNG_COLOR_TYPE_GRAY ||
-      color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    png_set_gray_to_rgb(png_ptr);
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
 
-  png_read_update_info(png_ptr, info_ptr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, data, size);
+  jpeg_read_header(&cinfo, TRUE);
+  if (scale_num < 8) {
+    cinfo.scale_num = scale_num;
+    cinfo.scale_denom = 8;
+  }
+  cinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&cinfo);
 
-  rgba_data.resize(width * height * 4);
-  std::vector<png_bytep> row_pointers(height);
-  for (int y = 0; y < height; y++) {
-    row_pointers[y] = rgba_data.data() + y * width * 4;
+  if (static_cast<int>(cinfo.output_width) != rows.src_width() ||
+      static_cast<int>(cinfo.output_height) != rows.src_height() ||
+      rows.channels() != 3) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
   }
 
-  png_read_image(png_ptr, row_pointers.data());
-  png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+  // Only kBandRows scanlines are ever held
+  size_t stride = static_cast<size_t>(cinfo.output_width) * 3;
+  band.resize(stride * kBandRows);
+  JSAMPROW band_rows[kBandRows];
+  while (cinfo.output_scanline < cinfo.output_height) {
+    if (stop_requested()) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    int count =
+        std::min<int>(kBandRows, cinfo.output_height - cinfo.output_scanline);
+    for (int i = 0; i < count; ++i) {
+      band_rows[i] = band.data() + i * stride;
+    }
+    JDIMENSION read = jpeg_read_scanlines(&cinfo, band_rows, count);
+    for (JDIMENSION i = 0; i < read; ++i) {
+      rows.push(band_rows[i]);
+    }
+  }
 
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
   return true;
 }
 
-bool ImageProcessor::decode_webp(const std::vector<uint8_t> &data,
-                                 std::vector<uint8_t> &rgba_data, int &width,
-                                 int &height) {
-  uint8_t *decoded = WebPDecodeRGBA(data.data(), data.size(), &width, &height);
-  if (!decoded)
+bool ImageProcessor::decode_jpeg_planes(const uint8_t *data, size_t size,
+                                        int scale_num, PixelBuffer &band,
+                                        RowResampler &y_rows,
+                                        RowResampler &u_rows,
+                                        RowResampler &v_rows) {
+  struct jpeg_decompress_struct cinfo;
+  jpeg_error_mgr_ext jerr;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
     return false;
+  }
 
-  rgba_data.assign(decoded, decoded + width * height * 4);
-  WebPFree(decoded);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, data, size);
+  jpeg_read_header(&cinfo, TRUE);
+  if (scale_num < 8) {
+    cinfo.scale_num = scale_num;
+    cinfo.scale_denom = 8;
+  }
+  // libjpeg leaves the color transform to us. Stored 4:2:0 chroma is read
+  // raw; other layouts are upsampled by libjpeg to the luma size.
+  bool gray = cinfo.jpeg_color_space == JCS_GRAYSCALE;
+  if (!gray && cinfo.jpeg_color_space != JCS_YCbCr) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  bool raw = !gray && u_rows.src_width() < y_rows.src_width();
+  if (raw && (scale_num != 8 || !is_chroma_420(cinfo))) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  cinfo.raw_data_out = raw ? TRUE : FALSE;
+  cinfo.out_color_space = gray ? JCS_GRAYSCALE : JCS_YCbCr;
+  jpeg_start_decompress(&cinfo);
+
+  int width = cinfo.output_width;
+  if (width != y_rows.src_width() ||
+      static_cast<int>(cinfo.output_height) != y_rows.src_height()) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  if (raw) {
+    // One iMCU row per call: 16 luma rows and 8 rows of each chroma plane,
+    // written as whole blocks, so rows are padded to the MCU width
+    const jpeg_component_info *comp = cinfo.comp_info;
+    int chroma_height = u_rows.src_height();
+    if (static_cast<int>(comp[1].downsampled_width) != u_rows.src_width() ||
+        static_cast<int>(comp[1].downsampled_height) != chroma_height) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    size_t y_stride = (static_cast<size_t>(width) + 15) / 16 * 16;
+    size_t uv_stride = y_stride / 2;
+    band.resize(y_stride * 2 * DCTSIZE + uv_stride * 2 * DCTSIZE);
+    JSAMPROW y_band[2 * DCTSIZE], u_band[DCTSIZE], v_band[DCTSIZE];
+    uint8_t *chroma = band.data() + y_stride * 2 * DCTSIZE;
+    for (int i = 0; i < 2 * DCTSIZE; ++i) {
+      y_band[i] = band.data() + i * y_stride;
+    }
+    for (int i = 0; i < DCTSIZE; ++i) {
+      u_band[i] = chroma + i * uv_stride;
+      v_band[i] = chroma + (DCTSIZE + i) * uv_stride;
+    }
+    JSAMPARRAY planes[3] = {y_band, u_band, v_band};
+    int luma_rows = 0, chroma_rows = 0;
+    while (cinfo.output_scanline < cinfo.output_height) {
+      if (stop_requested() ||
+          jpeg_read_raw_data(&cinfo, planes, 2 * DCTSIZE) == 0) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+      }
+      // The last iMCU row may run past the bottom of the image
+      for (int i = 0; i < 2 * DCTSIZE && luma_rows < y_rows.src_height();
+           ++i, ++luma_rows) {
+        y_rows.push(y_band[i]);
+      }
+      for (int i = 0; i < DCTSIZE && chroma_rows < chroma_height;
+           ++i, ++chroma_rows) {
+        u_rows.push(u_band[i]);
+        v_rows.push(v_band[i]);
+      }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+  }
+
+  // kBandRows interleaved scanlines, then one row of each split plane
+  int components = gray ? 1 : 3;
+  size_t stride = static_cast<size_t>(width) * components;
+  band.resize(stride * kBandRows + static_cast<size_t>(width) * 3);
+  uint8_t *planes = band.data() + stride * kBandRows;
+  JSAMPROW band_rows[kBandRows];
+  while (cinfo.output_scanline < cinfo.output_height) {
+    if (stop_requested()) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    int count =
+        std::min<int>(kBandRows, cinfo.output_height - cinfo.output_scanline);
+    for (int i = 0; i < count; ++i) {
+      band_rows[i] = band.data() + i * stride;
+    }
+    JDIMENSION read = jpeg_read_scanlines(&cinfo, band_rows, count);
+    for (JDIMENSION i = 0; i < read; ++i) {
+      if (gray) {
+        y_rows.push(band_rows[i]);
+        continue;
+      }
+      const uint8_t *in = band_rows[i];
+      uint8_t *y = planes, *u = planes + width, *v = planes + 2 * width;
+      for (int x = 0; x < width; ++x, in += 3) {
+        y[x] = in[0];
+        u[x] = in[1];
+        v[x] = in[2];
+      }
+      y_rows.push(y);
+      u_rows.push(u);
+      v_rows.push(v);
+    }
+  }
 
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
   return true;
 }
 
+bool ImageProcessor::decode_png_rows(const uint8_t *data, size_t size,
+                                     PixelBuffer &band, RowResampler &rows) {
+  png_structp png_ptr =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (!png_ptr)
+    return false;
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_read_struct(&png_ptr, nullptr, nullptr);
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    return false;
+  }
+
+  PNGReadState state = {data, size, 0};
+  png_set_read_fn(png_ptr, &state, png_read_callback);
+
+  png_read_info(png_ptr, info_ptr);
+  int width = png_get_image_width(png_ptr, info_ptr);
+  int height = png_get_image_height(png_ptr, info_ptr);
+  if (width != rows.src_width() || height != rows.src_height() ||
+      png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    return false;
+  }
+  int channels = png_set_rgb_transforms(png_ptr, info_ptr);
+  if (channels != rows.channels()) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    return false;
+  }
+
+  // One row at a time, straight into the resampler
+  band.resize(static_cast<size_t>(width) * channels);
+  for (int y = 0; y < height; y++) {
+    if (y % kBandRows == 0 && stop_requested()) {
+      png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+      return false;
+    }
+    png_read_row(png_ptr, band.data(), nullptr);
+    if (channels == 4) {
+      premultiply_alpha(band.data(), width);
+    }
+    rows.push(band.data());
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+
+  return true;
+}
+
+bool ImageProcessor::decode_webp(const uint8_t *data, size_t size,
+                                 DecodedImage &image) {
+  WebPBitstreamFeatures features;
+  if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK)
+    return false;
+
+  image.width = image.source_width = features.width;
+  image.height = image.source_height = features.height;
+  image.channels = features.has_alpha ? 4 : 3;
+
+  // Decode into the pooled buffer instead of a libwebp allocation
+  size_t stride = static_cast<size_t>(image.width) * image.channels;
+  image.pixels.resize(stride * image.height);
+  uint8_t *out =
+      features.has_alpha
+          ? WebPDecodeRGBAInto(data, size, image.pixels.data(),
+                               image.pixels.size(), static_cast<int>(stride))
+          : WebPDecodeRGBInto(data, size, image.pixels.data(),
+                              image.pixels.size(), static_cast<int>(stride));
+  return out != nullptr;
+}
+
 void ImageProcessor::calculate_dimensions(int src_width, int src_height,
                                           int req_width, int req_height,
                                           int &dst_width, int &dst_height) {
@@ -212,112 +577,569 @@ void ImageProcessor::calculate_dimensions(int src_width, int src_height,
     dst_height = 1;
 }
 
-void ImageProcessor::resize_image(const std::vector<uint8_t> &src_rgba,
-                                  int src_width, int src_height,
-                                  std::vector<uint8_t> &dst_rgba, int dst_width,
-                                  int dst_height) {
-  dst_rgba.resize(dst_width * dst_height * 4);
-
-  float x_ratio = static_cast<float>(src_width - 1) / dst_width;
-  float y_ratio = static_cast<float>(src_height - 1) / dst_height;
-
-  for (int y = 0; y < dst_height; y++) {
-    for (int x = 0; x < dst_width; x++) {
-      float gx = x * x_ratio;
-      float gy = y * y_ratio;
-      int gxi = static_cast<int>(gx);
-      int gyi = static_cast<int>(gy);
-
-      float c00[4], c10[4], c01[4], c11[4];
-      for (int c = 0; c < 4; c++) {
-        c00[c] = src_rgba[(gyi * src_width + gxi) * 4 + c];
-        c10[c] = (gxi + 1 < src_width)
-                     ? src_rgba[(gyi * src_width + gxi + 1) * 4 + c]
-                     : c00[c];
-        c01[c] = (gyi + 1 < src_height)
-                     ? src_rgba[((gyi + 1) * src_width + gxi) * 4 + c]
-                     : c00[c];
-        c11[c] = (gxi + 1 < src_width && gyi + 1 < src_height)
-                     ? src_rgba[((gyi + 1) * src_width + gxi + 1) * 4 + c]
-                     : c00[c];
-      }
+void ImageProcessor::resize_image(const PixelBuffer &src, int src_width,
+                                  int src_height, int channels,
+                                  PixelBuffer &dst, int dst_width,
+                                  int dst_height, ResampleFilter filter) {
+  dst.resize(static_cast<size_t>(dst_width) * dst_height * channels);
+
+  ParallelFor parallel;
+  if (pool_ && static_cast<size_t>(src_width) * src_height >=
+                   kParallelMinPixels) {
+    parallel = [this](size_t count, const std::function<void(size_t)> &fn) {
+      pool_->parallel_for(count, fn);
+    };
+  }
+  resample(src.data(), src_width, src_height, src_width * channels, dst.data(),
+           dst_width, dst_height, dst_width * channels, channels, filter,
+           parallel);
+}
+
+bool parse_encode_profile(const std::string &name, EncodeProfile &profile) {
+  if (name == "fast") {
+    profile = EncodeProfile::FAST;
+  } else if (name == "balanced") {
+    profile = EncodeProfile::BALANCED;
+  } else if (name == "max") {
+    profile = EncodeProfile::MAX;
+  } else if (name == "lossless") {
+    profile = EncodeProfile::LOSSLESS;
+  } else if (name == "auto") {
+    profile = EncodeProfile::AUTO;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *encode_profile_name(EncodeProfile profile) {
+  switch (profile) {
+  case EncodeProfile::FAST:
+    return "fast";
+  case EncodeProfile::MAX:
+    return "max";
+  case EncodeProfile::LOSSLESS:
+    return "lossless";
+  case EncodeProfile::AUTO:
+    return "auto";
+  case EncodeProfile::BALANCED:
+  default:
+    return "balanced";
+  }
+}
+
+SharedBuffer ImageProcessor::encode_webp(const PixelBuffer &pixels,
+                                         int width, int height, int channels,
+                                         int quality, EncodeProfile profile) {
+  // The RGB to YUV import counts as encoding
+  ScopedTimer timer(timings_ ? &timings_->encode : nullptr);
+  ScopedSpan span(trace(), "processing", "encode");
+  WebPPicture picture;
+  if (!WebPPictureInit(&picture)) {
+    throw std::runtime_error("WebP encoder version mismatch");
+  }
+  // Imported as YUV unless kept as ARGB, which lossless needs and which
+  // lets the encoder apply sharp YUV conversion
+  picture.use_argb = profile == EncodeProfile::LOSSLESS ||
+                     profile == EncodeProfile::MAX;
+  picture.width = width;
+  picture.height = height;
+  int imported =
+      channels == 4
+          ? WebPPictureImportRGBA(&picture, pixels.data(), width * 4)
+          : WebPPictureImportRGB(&picture, pixels.data(), width * 3);
+  if (!imported) {
+    WebPPictureFree(&picture);
+    throw std::runtime_error("WebP encoding failed");
+  }
+  return encode_picture(picture, quality, profile);
+}
+
+int ImageProcessor::adaptive_method() const {
+  // Spare cores buy the smallest output; every queued task per slot costs
+  // one step of effort, down to libwebp's fastest method
+  if (backlog_ <= 0) {
+    return pool_ && pool_->pending() == 0 && pool_->idle() > 0 ? 6 : 4;
+  }
+  if (backlog_ < 1) {
+    return 3;
+  }
+  if (backlog_ < 4) {
+    return 2;
+  }
+  return backlog_ < 8 ? 1 : 0;
+}
+
+SharedBuffer ImageProcessor::encode_picture(WebPPicture &picture, int quality,
+                                            EncodeProfile profile) {
+  WebPConfig config;
+  // Clamped like the cache key, which treats out-of-range values as the bound
+  bool ok = WebPConfigPreset(&config, WEBP_PRESET_DEFAULT,
+                             static_cast<float>(std::clamp(quality, 0, 100)));
+  switch (profile) {
+  case EncodeProfile::FAST:
+    // Single partition search and no alpha plane filtering
+    config.method = 1;
+    config.alpha_filtering = 0;
+    break;
+  case EncodeProfile::MAX:
+    // Slowest search, sharper chroma downsampling and the best alpha filter
+    config.method = 6;
+    config.use_sharp_yuv = 1;
+    config.alpha_filtering = 2;
+    break;
+  case EncodeProfile::LOSSLESS:
+    // quality is ignored, libwebp's default lossless effort
+    ok = ok && WebPConfigLosslessPreset(&config, 6);
+    break;
+  case EncodeProfile::AUTO:
+    config.method = adaptive_method();
+    config.alpha_filtering = config.method >= 4 ? 1 : 0;
+    break;
+  case EncodeProfile::BALANCED:
+  default:
+    break;
+  }
+  if (!ok) {
+    WebPPictureFree(&picture);
+    throw std::runtime_error("WebP encoder version mismatch");
+  }
+  // The extra encoder thread only pays off on big pictures, and only when it
+  // would otherwise idle a core; a busy pool keeps one thread per request
+  if (pool_ &&
+      static_cast<size_t>(picture.width) * picture.height >=
+          kParallelMinPixels &&
+      pool_->pending() == 0 && pool_->idle() > 0) {
+    config.thread_level = 1;
+  }
+
+  WebPMemoryWriter writer;
+  WebPMemoryWriterInit(&writer);
+  picture.writer = WebPMemoryWrite;
+  picture.custom_ptr = &writer;
+  // A zero from the hook aborts the encode
+  if (cancel_) {
+    picture.progress_hook = [](int, const WebPPicture *picture) {
+      return static_cast<const CancelToken *>(picture->user_data)->cancelled()
+                 ? 0
+                 : 1;
+    };
+    picture.user_data = const_cast<CancelToken *>(cancel_);
+  }
+
+  ok = WebPEncode(&config, &picture);
+  WebPPictureFree(&picture);
 
-      float x_weight = gx - gxi;
-      float y_weight = gy - gyi;
+  if (!ok || writer.size == 0) {
+    WebPMemoryWriterClear(&writer);
+    throw_if_cancelled();
+    throw std::runtime_error("WebP encoding failed");
+  }
+
+  // Hand libwebp's buffer to the caches and responses as is
+  std::shared_ptr<uint8_t> owner(writer.mem, WebPFree);
+  return SharedBuffer(owner, writer.mem, writer.size);
+}
+
+ImageHeader ImageProcessor::probe(const uint8_t *data, size_t size) {
+  ImageHeader header;
+  header.format = detect_format(data, size);
 
-      for (int c = 0; c < 4; c++) {
-        float val = c00[c] * (1 - x_weight) * (1 - y_weight) +
-                    c10[c] * x_weight * (1 - y_weight) +
-                    c01[c] * (1 - x_weight) * y_weight +
-                    c11[c] * x_weight * y_weight;
-        dst_rgba[(y * dst_width + x) * 4 + c] = static_cast<uint8_t>(val);
+  switch (header.format) {
+  case ImageFormat::JPEG: {
+    // Stops at the first scan, no coefficient is decoded
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_mgr_ext jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+      jpeg_destroy_decompress(&cinfo);
+      throw std::runtime_error("Corrupt JPEG header");
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+    header.width = cinfo.image_width;
+    header.height = cinfo.image_height;
+    header.ycbcr = cinfo.jpeg_color_space == JCS_YCbCr ||
+                   cinfo.jpeg_color_space == JCS_GRAYSCALE;
+    header.chroma_420 = is_chroma_420(cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    break;
+  }
+  case ImageFormat::PNG: {
+    // IHDR is always the first chunk: length, type, then big-endian sizes
+    if (size < 29 || std::memcmp(data + 12, "IHDR", 4) != 0) {
+      throw std::runtime_error("Corrupt PNG header");
+    }
+    auto be32 = [](const uint8_t *p) {
+      return (static_cast<uint32_t>(p[0]) << 24) |
+             (static_cast<uint32_t>(p[1]) << 16) |
+             (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    };
+    uint32_t width = be32(data + 16);
+    uint32_t height = be32(data + 20);
+    if (width > 0x7FFFFFFF || height > 0x7FFFFFFF) {
+      throw std::runtime_error("Corrupt PNG header");
+    }
+    header.width = static_cast<int>(width);
+    header.height = static_cast<int>(height);
+    header.interlaced = data[28] != 0;
+    header.alpha = (data[25] & PNG_COLOR_MASK_ALPHA) != 0;
+    // A tRNS chunk, which adds alpha, can only come before the image data
+    for (size_t offset = 33; !header.alpha && offset + 8 <= size;) {
+      const uint8_t *chunk = data + offset;
+      if (std::memcmp(chunk + 4, "IDAT", 4) == 0) {
+        break;
       }
+      header.alpha = std::memcmp(chunk + 4, "tRNS", 4) == 0;
+      offset += 12 + static_cast<size_t>(be32(chunk));
     }
+    break;
+  }
+  case ImageFormat::WEBP: {
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK) {
+      throw std::runtime_error("Corrupt WebP header");
+    }
+    header.width = features.width;
+    header.height = features.height;
+    header.alpha = features.has_alpha != 0;
+    break;
   }
+  default:
+    throw std::runtime_error("Unknown image format");
+  }
+
+  if (header.width <= 0 || header.height <= 0) {
+    throw std::runtime_error("Invalid image dimensions");
+  }
+  return header;
 }
 
-std::vector<uint8_t>
-ImageProcessor::encode_webp(const std::vector<uint8_t> &rgba_data, int width,
-                            int height, int quality) {
-  uint8_t *output = nullptr;
-  size_t output_size = WebPEncodeRGBA(rgba_data.data(), width, height,
-                                      width * 4, quality, &output);
+size_t ImageProcessor::estimate_peak_bytes(const ImageHeader &header,
+                                           int req_width, int req_height) {
+  int dst_width, dst_height;
+  calculate_dimensions(header.width, header.height, req_width, req_height,
+                       dst_width, dst_height);
 
-  if (output_size == 0 || !output) {
-    throw std::runtime_error("WebP encoding failed");
+  uint64_t decoded_width = header.width;
+  uint64_t decoded_height = header.height;
+  if (header.format == ImageFormat::JPEG) {
+    int num = jpeg_scale(header.width, header.height, req_width, req_height);
+    decoded_width = (decoded_width * num + 7) / 8;
+    decoded_height = (decoded_height * num + 7) / 8;
   }
+  uint64_t decoded = decoded_width * decoded_height;
+  uint64_t output = static_cast<uint64_t>(dst_width) * dst_height;
 
-  std::vector<uint8_t> result(output, output + output_size);
-  WebPFree(output);
+  uint64_t window = window_rows(decoded_height, dst_height);
+  bool band = banded(header, req_width, req_height);
+  if (band && header.format == ImageFormat::JPEG && header.ycbcr) {
+    // The YUV picture plus encoder state, one scanline band with its split
+    // planes, and the windows of the luma and two half-size chroma planes,
+    // whose vertical ratio is twice the luma one
+    return static_cast<size_t>(output * 4 + decoded_width * 3 * kBandRows +
+                               decoded_width * 3 +
+                               static_cast<uint64_t>(dst_width) * 3 * window);
+  }
+  if (band) {
+    // The picture's ARGB plane, YUVA plus encoder state, one scanline band
+    // and the resampler window
+    return static_cast<size_t>(output * 8 + decoded_width * 4 * kBandRows +
+                               static_cast<uint64_t>(dst_width) * 4 * window);
+  }
 
-  return result;
+  // RGB or RGBA decode, a resize target of the same layout unless sizes
+  // match, and about four bytes per output pixel for the YUVA picture plus
+  // encoder state
+  uint64_t channels = header.alpha ? 4 : 3;
+  uint64_t bytes = decoded * channels + output * 4;
+  if (output != decoded) {
+    bytes += output * channels;
+  }
+  return static_cast<size_t>(bytes);
+}
+
+bool ImageProcessor::banded(const ImageHeader &header, int req_width,
+                            int req_height) {
+  switch (header.format) {
+  case ImageFormat::JPEG: {
+    int num = jpeg_scale(header.width, header.height, req_width, req_height);
+    uint64_t width = (static_cast<uint64_t>(header.width) * num + 7) / 8;
+    uint64_t height = (static_cast<uint64_t>(header.height) * num + 7) / 8;
+    return width * height >= kBandMinPixels;
+  }
+  case ImageFormat::PNG:
+    return !header.interlaced && header.pixels() >= kBandMinPixels;
+  default:
+    // WebP decodes whole frames
+    return false;
+  }
 }
 
-std::vector<uint8_t>
-ImageProcessor::process(const std::vector<uint8_t> &input_data,
-                        const ImageOptions &options) {
+DecodedImage ImageProcessor::decode(const uint8_t *input_data,
+                                    size_t input_size, int req_width,
+                                    int req_height) {
   // Detect format
-  ImageFormat format = detect_format(input_data);
+  ImageFormat format = detect_format(input_data, input_size);
   if (format == ImageFormat::UNKNOWN) {
     throw std::runtime_error("Unknown image format");
   }
 
-  // 2. Decode
-  std::vector<uint8_t> rgba_data;
-  int width = 0, height = 0;
+  throw_if_cancelled();
+  DecodedImage image;
   bool success = false;
+  ScopedTimer timer(timings_ ? &timings_->decode : nullptr);
+  ScopedSpan span(trace(), "processing", "decode");
 
   switch (format) {
   case ImageFormat::JPEG:
-    success = decode_jpeg(input_data, rgba_data, width, height);
+    success =
+        decode_jpeg(input_data, input_size, image, req_width, req_height);
     break;
   case ImageFormat::PNG:
-    success = decode_png(input_data, rgba_data, width, height);
+    success = decode_png(input_data, input_size, image);
     break;
   case ImageFormat::WEBP:
-    success = decode_webp(input_data, rgba_data, width, height);
+    success = decode_webp(input_data, input_size, image);
     break;
   default:
     break;
   }
 
   if (!success) {
+    throw_if_cancelled();
     throw std::runtime_error("Failed to decode image");
   }
+  // Many PNGs and WebPs carry an alpha channel they never use
+  strip_opaque_alpha(image);
+  return image;
+}
+
+SharedBuffer ImageProcessor::process(const uint8_t *input_data,
+                                     size_t input_size,
+                                     const ImageOptions &options) {
+  ImageHeader header = probe(input_data, input_size);
+  if (banded(header, options.width, options.height)) {
+    // Lossless output needs the RGB samples, not 4:2:0 planes
+    if (header.format == ImageFormat::JPEG && header.ycbcr &&
+        options.profile != EncodeProfile::LOSSLESS) {
+      return process_jpeg_planes(input_data, input_size, header, options);
+    }
+    return process_banded(input_data, input_size, header, options);
+  }
+  return process_decoded(
+      decode(input_data, input_size, options.width, options.height), options);
+}
 
-  // Compute target size
+SharedBuffer ImageProcessor::process_banded(const uint8_t *data, size_t size,
+                                            const ImageHeader &header,
+                                            const ImageOptions &options) {
   int dst_width, dst_height;
-  calculate_dimensions(width, height, options.width, options.height, dst_width,
-                       dst_height);
+  calculate_dimensions(header.width, header.height, options.width,
+                       options.height, dst_width, dst_height);
 
-  std::vector<uint8_t> final_rgba;
-  if (dst_width != width || dst_height != height) {
-    resize_image(rgba_data, width, height, final_rgba, dst_width, dst_height);
+  int scale_num = 8;
+  int width = header.width, height = header.height;
+  if (header.format == ImageFormat::JPEG) {
+    scale_num = jpeg_scale(header.width, header.height, options.width,
+                           options.height);
+    width = static_cast<int>((static_cast<int64_t>(width) * scale_num + 7) / 8);
+    height =
+        static_cast<int>((static_cast<int64_t>(height) * scale_num + 7) / 8);
+  }
+
+  // Output rows are converted into the picture's ARGB plane as soon as the
+  // resampler emits them; libwebp converts that to YUV itself. Rows with
+  // alpha are resized premultiplied and converted back on the way.
+  int channels = header.format == ImageFormat::PNG && header.alpha ? 4 : 3;
+  PixelBuffer straight(channels == 4 ? static_cast<size_t>(dst_width) * 4 : 0);
+  WebPPicture picture;
+  RowResampler rows(
+      width, height, dst_width, dst_height, channels, options.filter,
+      [&picture, &straight, channels](int y, const uint8_t *row) {
+        uint32_t *argb =
+            picture.argb + static_cast<size_t>(y) * picture.argb_stride;
+        if (channels == 3) {
+          for (int x = 0; x < picture.width; ++x, row += 3) {
+            argb[x] = 0xFF000000u | (static_cast<uint32_t>(row[0]) << 16) |
+                      (static_cast<uint32_t>(row[1]) << 8) | row[2];
+          }
+          return;
+        }
+        unpremultiply_alpha(row, straight.data(), picture.width);
+        row = straight.data();
+        for (int x = 0; x < picture.width; ++x, row += 4) {
+          argb[x] = (static_cast<uint32_t>(row[3]) << 24) |
+                    (static_cast<uint32_t>(row[0]) << 16) |
+                    (static_cast<uint32_t>(row[1]) << 8) | row[2];
+        }
+      });
+
+  if (!WebPPictureInit(&picture)) {
+    throw std::runtime_error("WebP encoder version mismatch");
+  }
+  picture.use_argb = 1;
+  picture.width = dst_width;
+  picture.height = dst_height;
+  if (!WebPPictureAlloc(&picture)) {
+    throw std::runtime_error("WebP picture allocation failed");
+  }
+
+  if (timings_) {
+    timings_->output_width = dst_width;
+    timings_->output_height = dst_height;
+  }
+
+  PixelBuffer band;
+  bool ok;
+  try {
+    ScopedTimer timer(timings_ ? &timings_->decode : nullptr);
+    ScopedSpan span(trace(), "processing", "banded_decode_resize");
+    ok = header.format == ImageFormat::JPEG
+             ? decode_jpeg_rows(data, size, scale_num, band, rows)
+             : decode_png_rows(data, size, band, rows);
+  } catch (...) {
+    WebPPictureFree(&picture);
+    throw;
+  }
+  if (!ok || rows.rows_emitted() != dst_height) {
+    WebPPictureFree(&picture);
+    throw_if_cancelled();
+    throw std::runtime_error("Failed to decode image");
+  }
+  ScopedTimer timer(timings_ ? &timings_->encode : nullptr);
+  ScopedSpan span(trace(), "processing", "encode");
+  return encode_picture(picture, options.quality, options.profile);
+}
+
+SharedBuffer ImageProcessor::process_jpeg_planes(const uint8_t *data,
+                                                 size_t size,
+                                                 const ImageHeader &header,
+                                                 const ImageOptions &options) {
+  int dst_width, dst_height;
+  calculate_dimensions(header.width, header.height, options.width,
+                       options.height, dst_width, dst_height);
+  int uv_width = (dst_width + 1) / 2;
+  int uv_height = (dst_height + 1) / 2;
+
+  int scale_num = jpeg_scale(header.width, header.height, options.width,
+                             options.height);
+  int width =
+      static_cast<int>((static_cast<int64_t>(header.width) * scale_num + 7) / 8);
+  int height = static_cast<int>(
+      (static_cast<int64_t>(header.height) * scale_num + 7) / 8);
+
+  // At full scale 4:2:0 chroma is read as stored, half the luma size. At
+  // smaller DCT scales libjpeg decodes the chroma blocks less reduced, so
+  // they come out at the luma size without being interpolated.
+  int chroma_width = width, chroma_height = height;
+  if (header.chroma_420 && scale_num == 8) {
+    chroma_width = (width + 1) / 2;
+    chroma_height = (height + 1) / 2;
+  }
+
+  // Each plane is resized on its own, chroma straight to the 4:2:0 size,
+  // and mapped to studio range while it is copied into the picture
+  WebPPicture picture;
+  const StudioRange &range = studio_range();
+  RowResampler y_rows(width, height, dst_width, dst_height, 1, options.filter,
+                      [&](int y, const uint8_t *row) {
+                        map_row(row, picture.y, picture.y_stride, y,
+                                dst_width, range.luma);
+                      });
+  RowResampler u_rows(chroma_width, chroma_height, uv_width, uv_height, 1,
+                      options.filter, [&](int y, const uint8_t *row) {
+                        map_row(row, picture.u, picture.uv_stride, y, uv_width,
+                                range.chroma);
+                      });
+  RowResampler v_rows(chroma_width, chroma_height, uv_width, uv_height, 1,
+                      options.filter, [&](int y, const uint8_t *row) {
+                        map_row(row, picture.v, picture.uv_stride, y, uv_width,
+                                range.chroma);
+                      });
+
+  if (!WebPPictureInit(&picture)) {
+    throw std::runtime_error("WebP encoder version mismatch");
+  }
+  picture.use_argb = 0;
+  picture.colorspace = WEBP_YUV420;
+  picture.width = dst_width;
+  picture.height = dst_height;
+  if (!WebPPictureAlloc(&picture)) {
+    throw std::runtime_error("WebP picture allocation failed");
+  }
+  // Neutral chroma, kept as is for grayscale sources
+  for (int y = 0; y < uv_height; ++y) {
+    std::memset(picture.u + static_cast<size_t>(y) * picture.uv_stride, 128,
+                uv_width);
+    std::memset(picture.v + static_cast<size_t>(y) * picture.uv_stride, 128,
+                uv_width);
+  }
+
+  if (timings_) {
+    timings_->output_width = dst_width;
+    timings_->output_height = dst_height;
+  }
+
+  PixelBuffer band;
+  bool ok;
+  try {
+    ScopedTimer timer(timings_ ? &timings_->decode : nullptr);
+    ScopedSpan span(trace(), "processing", "planar_decode_resize");
+    ok = decode_jpeg_planes(data, size, scale_num, band, y_rows, u_rows,
+                            v_rows);
+  } catch (...) {
+    WebPPictureFree(&picture);
+    throw;
+  }
+  bool gray = u_rows.rows_emitted() == 0;
+  if (!ok || y_rows.rows_emitted() != dst_height ||
+      (!gray && (u_rows.rows_emitted() != uv_height ||
+                 v_rows.rows_emitted() != uv_height))) {
+    WebPPictureFree(&picture);
+    throw_if_cancelled();
+    throw std::runtime_error("Failed to decode image");
+  }
+  ScopedTimer timer(timings_ ? &timings_->encode : nullptr);
+  ScopedSpan span(trace(), "processing", "encode");
+  return encode_picture(picture, options.quality, options.profile);
+}
+
+SharedBuffer ImageProcessor::process_decoded(DecodedImage image,
+                                             const ImageOptions &options) {
+  // Compute target size from the source, not the DCT-scaled decode
+  int dst_width, dst_height;
+  calculate_dimensions(image.source_width, image.source_height, options.width,
+                       options.height, dst_width, dst_height);
+
+  if (timings_) {
+    timings_->output_width = dst_width;
+    timings_->output_height = dst_height;
+  }
+
+  throw_if_cancelled();
+  PixelBuffer final_pixels;
+  if (dst_width != image.width || dst_height != image.height) {
+    ScopedTimer timer(timings_ ? &timings_->resize : nullptr);
+    ScopedSpan span(trace(), "processing", "resize");
+    size_t count = static_cast<size_t>(image.width) * image.height;
+    if (image.channels == 4) {
+      premultiply_alpha(image.pixels.data(), count);
+    }
+    resize_image(image.pixels, image.width, image.height, image.channels,
+                 final_pixels, dst_width, dst_height, options.filter);
+    if (image.channels == 4) {
+      unpremultiply_alpha(final_pixels.data(), final_pixels.data(),
+                          static_cast<size_t>(dst_width) * dst_height);
+    }
   } else {
-    final_rgba = std::move(rgba_data);
+    final_pixels = std::move(image.pixels);
   }
 
-  return encode_webp(final_rgba, dst_width, dst_height, options.quality);
+  return encode_webp(final_pixels, dst_width, dst_height, image.channels,
+                     options.quality, options.profile);
 }
 
 } // namespace imgboost
@@ -1,54 +1,245 @@
 #pragma once
 
+#include "buffer_pool.h"
+#include "cancel_token.h"
+#include "metrics.h"
+#include "resampler.h"
+#include "shared_buffer.h"
+#include "thread_pool.h"
+#include "tracer.h"
+#include <algorithm>
 #include <cstdint>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+struct WebPPicture;
+
 namespace imgboost {
 
+// How much CPU the WebP encoder spends per image. BALANCED is libwebp's
+// default preset; AUTO lowers or raises its effort with the processing
+// backlog, trading bytes for CPU under load.
+enum class EncodeProfile { FAST, BALANCED, MAX, LOSSLESS, AUTO };
+
+// "fast", "balanced", "max", "lossless" or "auto"
+bool parse_encode_profile(const std::string &name, EncodeProfile &profile);
+const char *encode_profile_name(EncodeProfile profile);
+
 struct ImageOptions {
   // 0 == auto
   int width = 0;
   int height = 0;
   int quality = 80; // WebP quality (0-100)
+  ResampleFilter filter = ResampleFilter::BILINEAR;
+  EncodeProfile profile = EncodeProfile::BALANCED;
 
   ImageOptions() = default;
   ImageOptions(int w, int h, int q) : width(w), height(h), quality(q) {}
+
+  // Form used in cache keys. Settings with no effect on the output are
+  // folded: quality is clamped and ignored when lossless, the filter when
+  // nothing is resized. Keys are built before the source is downloaded, so
+  // options that only match once its size is known, such as an explicit
+  // width equal to the source width and width 0, still get different keys.
+  std::string to_key() const {
+    int key_quality = profile == EncodeProfile::LOSSLESS
+                          ? 100
+                          : std::clamp(quality, 0, 100);
+    ResampleFilter key_filter =
+        width == 0 && height == 0 ? ResampleFilter::BILINEAR : filter;
+    return "w" + std::to_string(width) + "h" + std::to_string(height) + "q" +
+           std::to_string(key_quality) + "f" +
+           resample_filter_name(key_filter) + "p" +
+           encode_profile_name(profile);
+  }
+};
+
+// Decoded pixels, interleaved RGB or straight (not premultiplied) RGBA. Only
+// sources with a translucent pixel keep their alpha channel, so opaque
+// images are resized and encoded with three channels. JPEG sources may be
+// scaled down in the DCT domain while decoding, so width/height can be
+// smaller than the source dimensions.
+struct DecodedImage {
+  PixelBuffer pixels;
+  int channels = 4;
+  int width = 0;
+  int height = 0;
+  int source_width = 0;
+  int source_height = 0;
+};
+
+// Repacks a 4-channel image whose alpha is 255 everywhere as RGB
+void strip_opaque_alpha(DecodedImage &image);
+
+enum class ImageFormat { UNKNOWN, JPEG, PNG, WEBP };
+
+// Dimensions read from the file header alone, before anything is decoded
+struct ImageHeader {
+  ImageFormat format = ImageFormat::UNKNOWN;
+  int width = 0;
+  int height = 0;
+  bool interlaced = false; // Adam7 PNG, no row is final before the last pass
+  bool ycbcr = false;      // JPEG coded as YCbCr or grayscale
+  bool chroma_420 = false; // YCbCr JPEG with both chroma planes halved
+  bool alpha = false;      // PNG or WebP with an alpha channel or tRNS chunk
+
+  uint64_t pixels() const {
+    return static_cast<uint64_t>(width) * static_cast<uint64_t>(height);
+  }
+};
+
+// Nanoseconds an ImageProcessor spent per stage, accumulated across its
+// calls, and the size of the last output. The band pipeline resizes while it
+// decodes; that time counts as decode. With a trace id, each stage is also
+// recorded as a span of that trace.
+struct StageTimings {
+  uint64_t decode = 0;
+  uint64_t resize = 0;
+  uint64_t encode = 0;
+  int output_width = 0;
+  int output_height = 0;
+  uint64_t trace = 0;
+};
+
+// The source has more pixels than the configured limit
+class ImageTooLarge : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
 };
 
 class ImageProcessor {
 public:
   ImageProcessor() = default;
+  // Large images are resized in row stripes on the pool, and encoded with
+  // libwebp's extra thread, whenever it has idle workers
+  explicit ImageProcessor(ThreadPool *pool) : pool_(pool) {}
   ~ImageProcessor() = default;
 
-  std::vector<uint8_t> process(const std::vector<uint8_t> &input_data,
-                               const ImageOptions &options);
+  // Queued processing tasks per running slot when this task started, read
+  // by the AUTO profile
+  void set_backlog(double backlog) { backlog_ = backlog; }
 
-private:
-  // Detect format
-  enum class ImageFormat { UNKNOWN, JPEG, PNG, WEBP };
+  // Stage times are added to timings while it is set
+  void set_timings(StageTimings *timings) { timings_ = timings; }
+
+  // Once cancel is cancelled, decoding stops between scanline batches and
+  // encoding at libwebp's next progress report, and the call throws
+  // RequestCancelled
+  void set_cancel(const CancelToken *cancel) { cancel_ = cancel; }
+
+  SharedBuffer process(const uint8_t *input_data, size_t input_size,
+                       const ImageOptions &options);
 
-  ImageFormat detect_format(const std::vector<uint8_t> &data);
+  SharedBuffer process(const std::vector<uint8_t> &input_data,
+                       const ImageOptions &options) {
+    return process(input_data.data(), input_data.size(), options);
+  }
 
-  // Decode image
-  bool decode_jpeg(const std::vector<uint8_t> &data,
-                   std::vector<uint8_t> &rgba_data, int &width, int &height);
+  // Individual stages, used to share one decode between several outputs.
+  // req_width/req_height are the requested output size (0 == auto); the
+  // decoded image never ends up smaller than the size they resolve to.
+  DecodedImage decode(const uint8_t *data, size_t size, int req_width = 0,
+                      int req_height = 0);
 
-  bool decode_png(const std::vector<uint8_t> &data,
-                  std::vector<uint8_t> &rgba_data, int &width, int &height);
+  // Reads only the header; throws when the format is unknown or the header
+  // is corrupt
+  ImageHeader probe(const uint8_t *data, size_t size);
 
-  bool decode_webp(const std::vector<uint8_t> &data,
-                   std::vector<uint8_t> &rgba_data, int &width, int &height);
+  // Peak pixel memory of decoding, resizing and encoding one output of the
+  // requested size, including libwebp's YUV picture and working buffers
+  size_t estimate_peak_bytes(const ImageHeader &header, int req_width,
+                             int req_height);
 
-  void resize_image(const std::vector<uint8_t> &src_rgba, int src_width,
-                    int src_height, std::vector<uint8_t> &dst_rgba,
-                    int dst_width, int dst_height);
+  // Whether process() runs this source through the band pipeline: JPEGs
+  // and non-interlaced PNGs whose decode would be large are decoded a few
+  // scanlines at a time, resized row by row and written straight into the
+  // encoder's picture, so no full-size RGBA image is ever held. Banded
+  // YCbCr JPEGs take the planar form, which never converts to RGB, unless
+  // the output is lossless. Sources that are not banded stay eligible for
+  // the streaming decoder, which decodes to RGB while downloading.
+  bool banded(const ImageHeader &header, int req_width, int req_height);
+
+  // Interleaved RGB or RGBA; RGBA should be premultiplied (see
+  // premultiply_alpha) so transparent pixels do not tint their neighbours
+  void resize_image(const PixelBuffer &src, int src_width, int src_height,
+                    int channels, PixelBuffer &dst, int dst_width,
+                    int dst_height,
+                    ResampleFilter filter = ResampleFilter::BILINEAR);
 
   void calculate_dimensions(int src_width, int src_height, int req_width,
                             int req_height, int &dst_width, int &dst_height);
 
-  std::vector<uint8_t> encode_webp(const std::vector<uint8_t> &rgba_data,
-                                   int width, int height, int quality);
+  // RGB or straight RGBA. The result wraps libwebp's output buffer, it is
+  // not copied.
+  SharedBuffer encode_webp(const PixelBuffer &pixels, int width, int height,
+                           int channels, int quality,
+                           EncodeProfile profile = EncodeProfile::BALANCED);
+
+  // libwebp method (0 fastest .. 6 smallest) the AUTO profile picks for the
+  // current backlog
+  int adaptive_method() const;
+
+  // Resize and encode an image decoded elsewhere, e.g. while downloading
+  SharedBuffer process_decoded(DecodedImage image, const ImageOptions &options);
+
+  // From the magic bytes; UNKNOWN until at least 12 bytes are available
+  ImageFormat detect_format(const uint8_t *data, size_t size);
+
+  // M in the M/8 DCT scale a JPEG is decoded at for the requested size
+  int jpeg_scale(int source_width, int source_height, int req_width,
+                 int req_height);
+
+private:
+  SharedBuffer process_banded(const uint8_t *data, size_t size,
+                              const ImageHeader &header,
+                              const ImageOptions &options);
+
+  // JPEG YCbCr planes resized separately into a YUV420 picture
+  SharedBuffer process_jpeg_planes(const uint8_t *data, size_t size,
+                                   const ImageHeader &header,
+                                   const ImageOptions &options);
+
+  // Scanline decoders feeding the band pipeline; false on corrupt data or a
+  // channel count other than the resampler's. PNG rows with alpha are
+  // premultiplied before they are pushed.
+  bool decode_jpeg_rows(const uint8_t *data, size_t size, int scale_num,
+                        PixelBuffer &band, RowResampler &rows);
+  bool decode_png_rows(const uint8_t *data, size_t size, PixelBuffer &band,
+                       RowResampler &rows);
+  // Chroma rows are only pushed for color sources. When u_rows is narrower
+  // than y_rows, the 4:2:0 chroma planes are read as stored, without
+  // libjpeg upsampling them first.
+  bool decode_jpeg_planes(const uint8_t *data, size_t size, int scale_num,
+                          PixelBuffer &band, RowResampler &y_rows,
+                          RowResampler &u_rows, RowResampler &v_rows);
+
+  // Encodes and frees a filled picture
+  SharedBuffer encode_picture(WebPPicture &picture, int quality,
+                              EncodeProfile profile);
+
+  // Decode image, JPEG always as RGB, PNG and WebP as RGBA when they have
+  // an alpha channel
+  bool decode_jpeg(const uint8_t *data, size_t size, DecodedImage &image,
+                   int req_width, int req_height);
+
+  bool decode_png(const uint8_t *data, size_t size, DecodedImage &image);
+
+  bool decode_webp(const uint8_t *data, size_t size, DecodedImage &image);
+
+  uint64_t trace() const { return timings_ ? timings_->trace : 0; }
+
+  bool stop_requested() const { return cancel_ && cancel_->cancelled(); }
+  void throw_if_cancelled() const {
+    if (stop_requested()) {
+      throw RequestCancelled();
+    }
+  }
+
+  ThreadPool *pool_ = nullptr;
+  double backlog_ = 0;
+  StageTimings *timings_ = nullptr;
+  const CancelToken *cancel_ = nullptr;
 };
 
 } // namespace imgboost
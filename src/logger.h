@@ -0,0 +1,427 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace imgboost {
+
+// ERR rather than ERROR, which windows.h defines as a macro
+enum class LogLevel { DEBUG, INFO, WARN, ERR, OFF };
+
+// "debug", "info", "warn", "error" or "off"
+inline bool parse_log_level(const std::string &name, LogLevel &level) {
+  static const char *names[] = {"debug", "info", "warn", "error", "off"};
+  for (int i = 0; i <= static_cast<int>(LogLevel::OFF); ++i) {
+    if (name == names[i]) {
+      level = static_cast<LogLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+inline const char *log_level_name(LogLevel level) {
+  static const char *names[] = {"debug", "info", "warn", "error", "off"};
+  return names[static_cast<int>(level)];
+}
+
+struct LoggerStats {
+  uint64_t written = 0;
+  uint64_t dropped = 0; // records lost to a full ring
+};
+
+// Asynchronous logfmt logger. Each thread formats its records straight into
+// a ring of its own, which a background writer drains every few
+// milliseconds, ordering each batch by time, in one write per stream: debug
+// and info to stdout, warn and error to stderr. Nothing on the logging
+// thread takes a lock, allocates or flushes, and a full ring drops the
+// record instead of waiting. Records below the level cost one relaxed load.
+class Logger {
+public:
+  // Records of one thread the writer has not drained yet
+  static constexpr size_t kRingSlots = 128;
+  // Longer records are cut short, ending in "..."
+  static constexpr size_t kRecordBytes = 512;
+
+  static Logger &instance() {
+    static Logger *logger = new Logger();
+    return *logger;
+  }
+
+  // Disable copy
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  static bool enabled(LogLevel level) {
+    return static_cast<int>(level) >=
+           instance().level_.load(std::memory_order_relaxed);
+  }
+
+  void set_level(LogLevel level) {
+    level_.store(static_cast<int>(level), std::memory_order_relaxed);
+  }
+  LogLevel level() const {
+    return static_cast<LogLevel>(level_.load(std::memory_order_relaxed));
+  }
+
+  LoggerStats stats() const {
+    LoggerStats stats;
+    stats.written = written_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    for (const std::unique_ptr<Ring> &ring : rings_) {
+      stats.dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+  // Writes everything logged so far; also runs at exit
+  void flush() {
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    drain();
+  }
+
+private:
+  friend class LogRecord;
+
+  struct Slot {
+    int64_t time_us; // wall clock
+    LogLevel level;
+    uint16_t length;
+    char text[kRecordBytes];
+  };
+
+  // Single producer, the owning thread; single consumer, the writer
+  struct Ring {
+    std::atomic<uint64_t> head{0}; // next slot to drain
+    std::atomic<uint64_t> tail{0}; // next slot to fill
+    std::atomic<uint64_t> dropped{0};
+    bool open = false; // a record of the owner is being built
+    Slot slots[kRingSlots];
+  };
+
+  // Hands the thread's ring back for reuse when the thread exits; the
+  // writer still drains what it left behind
+  struct Handle {
+    Ring *ring = nullptr;
+    ~Handle() {
+      if (ring) {
+        Logger &logger = Logger::instance();
+        std::lock_guard<std::mutex> lock(logger.rings_mutex_);
+        logger.free_.push_back(ring);
+      }
+    }
+  };
+
+  Logger() {
+    writer_ = std::thread([this]() { run(); });
+    std::atexit([]() { Logger::instance().shutdown(); });
+  }
+
+  // Null when the ring is full, the drop is counted, or while the thread
+  // builds another record (logging from inside a field's argument)
+  Slot *reserve() {
+    Ring &ring = local();
+    if (ring.open) {
+      return nullptr;
+    }
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) >= kRingSlots) {
+      ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+      return nullptr;
+    }
+    ring.open = true;
+    return &ring.slots[tail % kRingSlots];
+  }
+
+  void commit() {
+    Ring &ring = local();
+    ring.open = false;
+    ring.tail.store(ring.tail.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+  }
+
+  Ring &local() {
+    static thread_local Handle handle;
+    if (!handle.ring) {
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      if (!free_.empty()) {
+        handle.ring = free_.back();
+        free_.pop_back();
+      } else {
+        rings_.push_back(std::make_unique<Ring>());
+        handle.ring = rings_.back().get();
+      }
+    }
+    return *handle.ring;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    while (!stop_) {
+      stop_cv_.wait_for(lock, std::chrono::milliseconds(5));
+      lock.unlock();
+      flush();
+      lock.lock();
+    }
+  }
+
+  void shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex_);
+      if (stop_) {
+        return;
+      }
+      stop_ = true;
+    }
+    stop_cv_.notify_one();
+    if (writer_.joinable()) {
+      writer_.join();
+    }
+    flush();
+  }
+
+
+  // Called under drain_mutex_
+  void drain() {
+    std::vector<Ring *> rings;
+    {
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      for (const std::unique_ptr<Ring> &ring : rings_) {
+        rings.push_back(ring.get());
+      }
+    }
+
+    // Every ring is read up to the tail seen here, records logged meanwhile
+    // wait for the next pass
+    pending_.clear();
+    std::vector<uint64_t> tails;
+    uint64_t dropped = 0;
+    for (Ring *ring : rings) {
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      for (uint64_t i = head; i < tail; ++i) {
+        pending_.push_back(&ring->slots[i % kRingSlots]);
+      }
+      tails.push_back(tail);
+      dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    std::stable_sort(pending_.begin(), pending_.end(),
+                     [](const Slot *a, const Slot *b) {
+                       return a->time_us < b->time_us;
+                     });
+
+    out_.clear();
+    err_.clear();
+    for (const Slot *slot : pending_) {
+      std::string &stream = slot->level >= LogLevel::WARN ? err_ : out_;
+      append_time(stream, slot->time_us);
+      stream += " level=";
+      stream += log_level_name(slot->level);
+      stream += ' ';
+      stream.append(slot->text, slot->length);
+      stream += '\n';
+    }
+    if (dropped > reported_dropped_) {
+      append_time(err_, wall_time_us());
+      err_ += " level=warn component=Logger msg=\"Log rings full, records "
+              "dropped\" count=" +
+              std::to_string(dropped - reported_dropped_) + "\n";
+      reported_dropped_ = dropped;
+    }
+
+    // Slots are released only after their text has been copied out
+    for (size_t i = 0; i < rings.size(); ++i) {
+      rings[i]->head.store(tails[i], std::memory_order_release);
+    }
+    written_.fetch_add(pending_.size(), std::memory_order_relaxed);
+
+    if (!out_.empty()) {
+      std::fwrite(out_.data(), 1, out_.size(), stdout);
+      std::fflush(stdout);
+    }
+    if (!err_.empty()) {
+      std::fwrite(err_.data(), 1, err_.size(), stderr);
+      std::fflush(stderr);
+    }
+  }
+
+  static int64_t wall_time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // RFC 3339 in UTC with microseconds
+  static void append_time(std::string &out, int64_t time_us) {
+    std::time_t seconds = static_cast<std::time_t>(time_us / 1000000);
+    std::tm tm;
+#if defined(_WIN32)
+    gmtime_s(&tm, &seconds);
+#else
+    gmtime_r(&seconds, &tm);
+#endif
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                  tm.tm_min, tm.tm_sec, static_cast<int>(time_us % 1000000));
+    out += buf;
+  }
+
+  std::atomic<int> level_{static_cast<int>(LogLevel::INFO)};
+  std::atomic<uint64_t> written_{0};
+
+  mutable std::mutex rings_mutex_; // guards rings_ and free_
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::vector<Ring *> free_;
+
+  std::mutex drain_mutex_; // one drain at a time, writer or flush()
+  std::vector<const Slot *> pending_;
+  std::string out_;
+  std::string err_;
+  uint64_t reported_dropped_ = 0;
+
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stop_ = false;
+  std::thread writer_;
+};
+
+// One log record, formatted in place in the thread's ring and published
+// when it goes out of scope. Use through IMGBOOST_LOG, which skips building
+// it entirely below the current level:
+//
+//   IMGBOOST_LOG(INFO, "AsyncDownloader", "Downloaded")
+//       .field("bytes", size)
+//       .field("host", host);
+class LogRecord {
+public:
+  LogRecord(LogLevel level, const char *component, std::string_view message)
+      : slot_(Logger::instance().reserve()) {
+    if (!slot_) {
+      return;
+    }
+    slot_->time_us = Logger::wall_time_us();
+    slot_->level = level;
+    slot_->length = 0;
+    append("component=");
+    append(component);
+    append(" msg=");
+    append_quoted(message);
+  }
+
+  ~LogRecord() {
+    if (slot_) {
+      Logger::instance().commit();
+    }
+  }
+
+  // Disable copy
+  LogRecord(const LogRecord &) = delete;
+  LogRecord &operator=(const LogRecord &) = delete;
+
+  LogRecord &field(const char *key, std::string_view value) {
+    if (slot_) {
+      begin_field(key);
+      bool plain = !value.empty() &&
+                   value.find_first_of(" =\"\\\n") == std::string_view::npos;
+      if (plain) {
+        append(value);
+      } else {
+        append_quoted(value);
+      }
+    }
+    return *this;
+  }
+
+  LogRecord &field(const char *key, const std::string &value) {
+    return field(key, std::string_view(value));
+  }
+
+  LogRecord &field(const char *key, const char *value) {
+    return field(key, std::string_view(value));
+  }
+
+  template <typename T, typename = typename std::enable_if<
+                            std::is_integral<T>::value>::type>
+  LogRecord &field(const char *key, T value) {
+    if (slot_) {
+      begin_field(key);
+      char buf[24];
+      int n = std::is_signed<T>::value
+                  ? std::snprintf(buf, sizeof(buf), "%lld",
+                                  static_cast<long long>(value))
+                  : std::snprintf(buf, sizeof(buf), "%llu",
+                                  static_cast<unsigned long long>(value));
+      append(std::string_view(buf, static_cast<size_t>(n)));
+    }
+    return *this;
+  }
+
+  LogRecord &field(const char *key, double value) {
+    if (slot_) {
+      begin_field(key);
+      char buf[32];
+      int n = std::snprintf(buf, sizeof(buf), "%.3f", value);
+      append(std::string_view(buf, static_cast<size_t>(n)));
+    }
+    return *this;
+  }
+
+private:
+  void begin_field(const char *key) {
+    append(" ");
+    append(key);
+    append("=");
+  }
+
+  // Bytes beyond the slot are cut, the record then ends in "..."
+  void append(std::string_view text) {
+    size_t room = Logger::kRecordBytes - slot_->length;
+    size_t n = std::min(room, text.size());
+    std::memcpy(slot_->text + slot_->length, text.data(), n);
+    slot_->length = static_cast<uint16_t>(slot_->length + n);
+    if (n < text.size()) {
+      std::memcpy(slot_->text + Logger::kRecordBytes - 3, "...", 3);
+    }
+  }
+
+  void append_quoted(std::string_view text) {
+    append("\"");
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      char c = text[i];
+      if (c == '"' || c == '\\' || c == '\n') {
+        append(text.substr(start, i - start));
+        append(c == '\n' ? "\\n" : c == '"' ? "\\\"" : "\\\\");
+        start = i + 1;
+      }
+    }
+    append(text.substr(start));
+    append("\"");
+  }
+
+  Logger::Slot *slot_;
+};
+
+} // namespace imgboost
+
+// Builds the record only when its level is enabled
+#define IMGBOOST_LOG(level, component, message)                               \
+  if (!::imgboost::Logger::enabled(::imgboost::LogLevel::level)) {            \
+  } else                                                                      \
+    ::imgboost::LogRecord(::imgboost::LogLevel::level, component, message)
@@ -1,15 +1,146 @@
-#include "httplib.h"
+#include "http_server.h"
+#include "logger.h"
+#include "metrics.h"
 #include "task_scheduler.h"
+#include "tracer.h"
 #include "utils.h"
-#include <condition_variable>
+#include <atomic>
+#include <cstdio>
 #include <cstdlib>
-#include <future>
-#include <iostream>
-#include <mutex>
 #include <string>
 
 using namespace imgboost;
 
+// Serve a set of images as multipart/mixed without copying their bytes: the
+// part headers and the shared buffers are written one after the other.
+static void set_multipart_content(HttpResponse &res,
+                                  const std::vector<SrcsetImage> &images) {
+  const std::string boundary = "imgboost-srcset-boundary";
+  res.content_type = "multipart/mixed; boundary=" + boundary;
+  res.body.clear();
+  for (const SrcsetImage &image : images) {
+    std::string header = "--" + boundary + "\r\n";
+    header += "Content-Type: image/webp\r\n";
+    header += "Content-Length: " + std::to_string(image.data.size()) + "\r\n";
+    header += "X-Image-Width: " + std::to_string(image.width) + "\r\n\r\n";
+    res.body.push_back(SharedBuffer::from_string(std::move(header)));
+    res.body.push_back(image.data);
+    res.body.push_back(SharedBuffer::from_string("\r\n"));
+  }
+  res.body.push_back(SharedBuffer::from_string("--" + boundary + "--\r\n"));
+}
+
+static HttpResponse text_response(int status, std::string message,
+                                  int retry_after = 0) {
+  HttpResponse res;
+  res.status = status;
+  res.set_content(std::move(message), "text/plain");
+  if (retry_after > 0) {
+    res.set_header("Retry-After", std::to_string(retry_after));
+  }
+  return res;
+}
+
+// Ties the log records of one request together
+static uint64_t next_request_id() {
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+static double elapsed_ms(MetricClock::time_point since) {
+  return elapsed_ns(since) / 1e6;
+}
+
+static HttpResponse bad_request(std::string message) {
+  Metrics::instance().count_error(ErrorCause::BAD_REQUEST);
+  return text_response(400, std::move(message));
+}
+
+// Gauges and derived values read from their owners at scrape time, in the
+// Prometheus text format
+static std::string render_gauges(const TaskScheduler &scheduler,
+                                 const HttpServer &svr) {
+  std::string out;
+  auto family = [&out](const std::string &name, const std::string &help) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " gauge\n";
+  };
+  auto sample = [&out](const std::string &name, const std::string &labels,
+                       double value) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", value);
+    out += name + (labels.empty() ? "" : "{" + labels + "}") + " " + buf +
+           "\n";
+  };
+
+  StageStats download = scheduler.download_stage_stats();
+  StageStats processing = scheduler.processing_stage_stats();
+  family("imgboost_stage_running", "Tasks running in each stage");
+  sample("imgboost_stage_running", "stage=\"download\"", download.running);
+  sample("imgboost_stage_running", "stage=\"processing\"", processing.running);
+  family("imgboost_stage_queued", "Tasks waiting for a slot in each stage");
+  sample("imgboost_stage_queued", "stage=\"download\"", download.queued);
+  sample("imgboost_stage_queued", "stage=\"processing\"", processing.queued);
+  family("imgboost_stage_queued_bytes", "Estimated bytes waiting per stage");
+  sample("imgboost_stage_queued_bytes", "stage=\"download\"",
+         download.queued_bytes);
+  sample("imgboost_stage_queued_bytes", "stage=\"processing\"",
+         processing.queued_bytes);
+
+  ThreadPoolStats download_pool = scheduler.download_pool_stats();
+  ThreadPoolStats processing_pool = scheduler.processing_pool_stats();
+  family("imgboost_pool_threads", "Worker threads per pool");
+  sample("imgboost_pool_threads", "pool=\"download\"", download_pool.threads);
+  sample("imgboost_pool_threads", "pool=\"processing\"",
+         processing_pool.threads);
+  family("imgboost_pool_busy_threads", "Workers running a task");
+  sample("imgboost_pool_busy_threads", "pool=\"download\"",
+         download_pool.busy);
+  sample("imgboost_pool_busy_threads", "pool=\"processing\"",
+         processing_pool.busy);
+  family("imgboost_pool_pending_tasks", "Tasks waiting for a worker");
+  sample("imgboost_pool_pending_tasks", "pool=\"download\"",
+         download_pool.pending);
+  sample("imgboost_pool_pending_tasks", "pool=\"processing\"",
+         processing_pool.pending);
+
+  // Counters exposed as gauges, so the ratio sits next to what it is
+  // computed from
+  const std::pair<const char *, CacheStats> caches[] = {
+      {"memory", scheduler.cache_stats()},
+      {"disk", scheduler.disk_cache_stats()},
+      {"source", scheduler.source_cache_stats()}};
+  family("imgboost_cache_hits", "Lookups answered by each cache tier");
+  for (const auto &cache : caches) {
+    sample("imgboost_cache_hits",
+           std::string("tier=\"") + cache.first + "\"", cache.second.hits);
+  }
+  family("imgboost_cache_misses", "Lookups each cache tier could not answer");
+  for (const auto &cache : caches) {
+    sample("imgboost_cache_misses",
+           std::string("tier=\"") + cache.first + "\"", cache.second.misses);
+  }
+  family("imgboost_cache_hit_ratio", "Hits over lookups per cache tier");
+  for (const auto &cache : caches) {
+    uint64_t lookups = cache.second.hits + cache.second.misses;
+    sample("imgboost_cache_hit_ratio",
+           std::string("tier=\"") + cache.first + "\"",
+           lookups > 0 ? static_cast<double>(cache.second.hits) / lookups
+                       : 0.0);
+  }
+
+  PixelBudgetStats pixels = scheduler.pixel_budget_stats();
+  family("imgboost_pixel_budget_in_use_bytes",
+         "Decoded pixel memory reserved by requests in flight");
+  sample("imgboost_pixel_budget_in_use_bytes", "", pixels.in_use);
+  HttpServerStats server = svr.stats();
+  family("imgboost_http_connections", "Open client connections");
+  sample("imgboost_http_connections", "", server.connections);
+  family("imgboost_http_requests_in_flight", "Requests not yet answered");
+  sample("imgboost_http_requests_in_flight", "", server.in_flight);
+  return out;
+}
+
 int main(int argc, char *argv[]) {
   std::string host = "0.0.0.0";
   int port = 8080;
@@ -21,89 +152,424 @@ int main(int argc, char *argv[]) {
     port = std::atoi(argv[1]);
   }
 
+  // Records below this level are dropped before they are formatted; the
+  // level can also be changed at runtime through /debug/log
+  if (const char *level_name = std::getenv("LOG_LEVEL")) {
+    LogLevel level;
+    if (parse_log_level(level_name, level)) {
+      Logger::instance().set_level(level);
+    } else {
+      IMGBOOST_LOG(WARN, "main", "Invalid LOG_LEVEL, using info")
+          .field("value", level_name);
+    }
+  }
+
   // Async task handler
   // By default, it uses 4 download threads and a number of processing threads
   // equal to the number of CPU cores
-  TaskScheduler scheduler(4, 0);
+  SchedulerConfig config;
+  config.download_threads = 4;
+  config.processing_threads = 0;
+
+  // Result cache budgets in megabytes (0 disables a tier). Defaults that
+  // only save time or memory (the caches, the pixel budget and streaming
+  // decode) are on; limits that refuse requests (shedding, the queue bounds
+  // and the image size limit) are off unless configured.
+  const size_t mb = 1024 * 1024;
+  config.cache_bytes = env_int_param("CACHE_MAX_MB", 256, 0, 1 << 20) * mb;
+  if (const char *disk_dir = std::getenv("DISK_CACHE_DIR")) {
+    config.disk_cache_dir = disk_dir;
+  }
+  config.disk_cache_bytes =
+      env_int_param("DISK_CACHE_MAX_MB", 4096, 0, 1 << 24) * mb;
+  config.source_cache_bytes =
+      env_int_param("SOURCE_CACHE_MAX_MB", 256, 0, 1 << 20) * mb;
+  config.source_default_ttl =
+      env_int_param("SOURCE_CACHE_DEFAULT_TTL", 0, 0, 1 << 30);
+
+  // Origin connection reuse
+  config.connections.max_per_host =
+      env_int_param("ORIGIN_MAX_CONNECTIONS", 8, 1, 1024);
+  config.connections.idle_timeout =
+      env_int_param("ORIGIN_IDLE_TIMEOUT", 30, 0, 1 << 20);
+  config.connections.dns_ttl = env_int_param("DNS_CACHE_TTL", 60, 0, 1 << 20);
+
+  // Stage concurrency caps (0 = one per thread), queued bytes and the
+  // queueing delay past which new requests are shed. Both refuse requests
+  // with 503, so they are off (0) unless configured.
+  config.download_limits.max_concurrency =
+      env_int_param("DOWNLOAD_CONCURRENCY", 0, 0, 4096);
+  config.download_limits.max_queued_bytes =
+      env_int_param("DOWNLOAD_QUEUE_MAX_MB", 0, 0, 1 << 20) * mb;
+  config.processing_limits.max_concurrency =
+      env_int_param("PROCESSING_CONCURRENCY", 0, 0, 4096);
+  config.processing_limits.max_queued_bytes =
+      env_int_param("PROCESSING_QUEUE_MAX_MB", 0, 0, 1 << 20) * mb;
+  config.admission_deadline =
+      env_int_param("ADMISSION_DEADLINE_MS", 0, 0, 1 << 30) / 1000.0;
 
-  httplib::Server svr;
+  // Decoded pixel memory: largest accepted source and the budget shared by
+  // all decodes in flight
+  config.max_image_pixels =
+      static_cast<uint64_t>(env_int_param("MAX_IMAGE_MEGAPIXELS", 0, 0,
+                                          1 << 20)) *
+      1000000;
+  config.pixel_budget_bytes =
+      env_int_param("PIXEL_BUDGET_MB", 2048, 0, 1 << 20) * mb;
+  config.streaming_decode = env_int_param("STREAMING_DECODE", 1, 0, 1) != 0;
 
-  svr.Get("/health", [](const httplib::Request &, httplib::Response &res) {
-    res.set_content("OK", "text/plain");
+  // Time after which an image request's unfinished work is abandoned and
+  // the client gets a 504, 0 for none
+  int request_deadline_ms = env_int_param("REQUEST_DEADLINE_MS", 0, 0, 1 << 30);
+
+  // Percentage of requests traced, and how many of the latest spans are
+  // kept for /debug/trace
+  Tracer::instance().set_capacity(
+      env_int_param("TRACE_BUFFER_SPANS", 65536, 1, 1 << 24));
+  Tracer::instance().set_sample_percent(
+      env_int_param("TRACE_SAMPLE_PERCENT", 0, 0, 100));
+
+  // Encoder effort used when a request names no profile
+  EncodeProfile default_profile = EncodeProfile::BALANCED;
+  if (const char *profile = std::getenv("ENCODE_PROFILE")) {
+    if (!parse_encode_profile(profile, default_profile)) {
+      IMGBOOST_LOG(WARN, "main", "Invalid ENCODE_PROFILE, using balanced")
+          .field("value", profile);
+    }
+  }
+
+  TaskScheduler scheduler(config);
+
+  // One event loop thread serves every connection; requests waiting on a
+  // download or an encode hold no server thread
+  HttpServerConfig server_config;
+  server_config.max_connections =
+      env_int_param("HTTP_MAX_CONNECTIONS", 4096, 1, 1 << 20);
+  server_config.keep_alive_timeout =
+      env_int_param("HTTP_KEEP_ALIVE_TIMEOUT", 5, 0, 3600);
+  server_config.handler_threads =
+      env_int_param("HTTP_HANDLER_THREADS", 4, 1, 256);
+  HttpServer svr(server_config);
+
+  svr.get("/health", [](const HttpRequest &, HttpResponder respond) {
+    respond(text_response(200, "OK"));
   });
 
-  svr.Get("/", [&scheduler](const httplib::Request &req,
-                            httplib::Response &res) {
-    try {
-      auto src_param = req.get_param_value("src");
-      if (src_param.empty()) {
-        res.status = 400;
-        res.set_content("Missing 'src' parameter", "text/plain");
-        return;
-      }
+  svr.get("/stats", [&scheduler, &svr](const HttpRequest &,
+                                       HttpResponder respond) {
+    auto format = [](const std::string &prefix, const CacheStats &stats) {
+      std::string out;
+      out += prefix + "_hits " + std::to_string(stats.hits) + "\n";
+      out += prefix + "_misses " + std::to_string(stats.misses) + "\n";
+      out += prefix + "_insertions " + std::to_string(stats.insertions) + "\n";
+      out += prefix + "_evictions " + std::to_string(stats.evictions) + "\n";
+      out += prefix + "_entries " + std::to_string(stats.entries) + "\n";
+      out += prefix + "_bytes " + std::to_string(stats.bytes) + "\n";
+      out += prefix + "_capacity_bytes " + std::to_string(stats.capacity) +
+             "\n";
+      return out;
+    };
+    std::string body = format("cache", scheduler.cache_stats()) +
+                       format("disk_cache", scheduler.disk_cache_stats()) +
+                       format("source_cache", scheduler.source_cache_stats());
+    body += "source_cache_revalidations " +
+            std::to_string(scheduler.source_revalidations()) + "\n";
+    body += "coalesced_transforms " +
+            std::to_string(scheduler.coalesced_transforms()) + "\n";
+    body += "coalesced_downloads " +
+            std::to_string(scheduler.coalesced_downloads()) + "\n";
+    BufferPoolStats buffers = BufferPool::instance().stats();
+    body += "buffer_pool_hits " + std::to_string(buffers.hits) + "\n";
+    body += "buffer_pool_misses " + std::to_string(buffers.misses) + "\n";
+    body += "buffer_pool_shared_bytes " +
+            std::to_string(buffers.shared_bytes) + "\n";
+    ConnectionPoolStats connections = scheduler.connection_stats();
+    body += "origin_connections_created " +
+            std::to_string(connections.created) + "\n";
+    body += "origin_connections_reused " +
+            std::to_string(connections.reused) + "\n";
+    body += "origin_connection_waits " + std::to_string(connections.waited) +
+            "\n";
+    body += "dns_cache_hits " + std::to_string(connections.dns_hits) + "\n";
+    body += "dns_cache_misses " + std::to_string(connections.dns_misses) +
+            "\n";
+    body += "tls_sessions_resumed " + std::to_string(connections.tls_resumed) +
+            "\n";
+    auto format_stage = [](const std::string &prefix,
+                           const StageStats &stats) {
+      std::string out;
+      out += prefix + "_running " + std::to_string(stats.running) + "\n";
+      out += prefix + "_queued " + std::to_string(stats.queued) + "\n";
+      out += prefix + "_queued_bytes " + std::to_string(stats.queued_bytes) +
+             "\n";
+      out += prefix + "_rejected " + std::to_string(stats.rejected) + "\n";
+      uint64_t wait_ms = static_cast<uint64_t>(stats.estimated_wait * 1000);
+      out += prefix + "_estimated_wait_ms " + std::to_string(wait_ms) + "\n";
+      return out;
+    };
+    body += format_stage("download_stage", scheduler.download_stage_stats());
+    body +=
+        format_stage("processing_stage", scheduler.processing_stage_stats());
+    body += "shed_requests " + std::to_string(scheduler.shed_requests()) + "\n";
+    PixelBudgetStats pixels = scheduler.pixel_budget_stats();
+    body += "pixel_budget_capacity_bytes " + std::to_string(pixels.capacity) +
+            "\n";
+    body += "pixel_budget_in_use_bytes " + std::to_string(pixels.in_use) +
+            "\n";
+    body += "pixel_budget_waits " + std::to_string(pixels.waits) + "\n";
+    body += "pixel_budget_waiting " + std::to_string(pixels.waiting) + "\n";
+    HttpServerStats server = svr.stats();
+    body += "http_connections " + std::to_string(server.connections) + "\n";
+    body += "http_requests " + std::to_string(server.requests) + "\n";
+    body += "http_requests_in_flight " + std::to_string(server.in_flight) +
+            "\n";
+    LoggerStats log = Logger::instance().stats();
+    body += "log_written " + std::to_string(log.written) + "\n";
+    body += "log_dropped " + std::to_string(log.dropped) + "\n";
+    TracerStats trace = Tracer::instance().stats();
+    body += "trace_sampled_requests " + std::to_string(trace.sampled) + "\n";
+    body += "trace_spans " + std::to_string(trace.recorded) + "\n";
+    body += "trace_spans_overwritten " + std::to_string(trace.overwritten) +
+            "\n";
+    respond(text_response(200, std::move(body)));
+  });
 
-      int width = parse_int_param(req.get_param_value("width"), 0, 0, 8192);
-      int height = parse_int_param(req.get_param_value("height"), 0, 0, 8192);
-      int quality = parse_int_param(req.get_param_value("quality"), 80, 0, 100);
-
-      std::string image_url;
-      try {
-        std::string decoded_src = url_decode(src_param);
-        std::vector<uint8_t> url_bytes = base64_decode(decoded_src);
-        image_url = std::string(url_bytes.begin(), url_bytes.end());
-      } catch (const std::exception &e) {
-        res.status = 400;
-        res.set_content("Invalid base64 encoded URL", "text/plain");
+  // Latency histograms, error and byte counters and the gauges above
+  svr.get("/metrics", [&scheduler, &svr](const HttpRequest &,
+                                         HttpResponder respond) {
+    HttpResponse res;
+    res.set_content(Metrics::instance().render() +
+                        render_gauges(scheduler, svr),
+                    "text/plain; version=0.0.4");
+    respond(std::move(res));
+  });
+
+  // Reads, or with ?level= sets, the log level without a restart
+  svr.get("/debug/log", [](const HttpRequest &req, HttpResponder respond) {
+    if (req.has_param("level")) {
+      LogLevel level;
+      if (!parse_log_level(req.get_param_value("level"), level)) {
+        respond(bad_request("Invalid 'level' parameter"));
         return;
       }
+      Logger::instance().set_level(level);
+      IMGBOOST_LOG(INFO, "main", "Log level changed")
+          .field("level", log_level_name(level));
+    }
+    respond(text_response(
+        200, std::string(log_level_name(Logger::instance().level())) + "\n"));
+  });
+
+  // Retained spans as Chrome trace-event JSON for Perfetto; ?clear=1 also
+  // empties the buffer, and ?sample_percent= changes the sampling rate
+  svr.get("/debug/trace", [](const HttpRequest &req, HttpResponder respond) {
+    Tracer &tracer = Tracer::instance();
+    if (req.has_param("sample_percent")) {
+      tracer.set_sample_percent(
+          parse_int_param(req.get_param_value("sample_percent"), 0, 0, 100));
+      IMGBOOST_LOG(INFO, "main", "Trace sampling changed")
+          .field("sample_percent", tracer.sample_percent());
+      respond(text_response(200, "sample_percent " +
+                                     std::to_string(tracer.sample_percent()) +
+                                     "\n"));
+      return;
+    }
+    HttpResponse res;
+    res.set_content(tracer.render(req.get_param_value("clear") == "1"),
+                    "application/json");
+    respond(std::move(res));
+  });
 
-      std::cout << "[INFO] Processing request for: " << image_url << std::endl;
+  svr.get("/", [&scheduler, default_profile,
+                request_deadline_ms](const HttpRequest &req,
+                                     HttpResponder respond) {
+    auto src_param = req.get_param_value("src");
+    if (src_param.empty()) {
+      respond(bad_request("Missing 'src' parameter"));
+      return;
+    }
 
-      std::promise<ProcessingResult> promise;
-      std::future<ProcessingResult> future = promise.get_future();
+    int width = parse_int_param(req.get_param_value("width"), 0, 0, 8192);
+    int height = parse_int_param(req.get_param_value("height"), 0, 0, 8192);
+    int quality = parse_int_param(req.get_param_value("quality"), 80, 0, 100);
 
-      ImageOptions options(width, height, quality);
+    ImageOptions options(width, height, quality);
+    if (req.has_param("filter") &&
+        !parse_resample_filter(req.get_param_value("filter"), options.filter)) {
+      respond(bad_request("Invalid 'filter' parameter"));
+      return;
+    }
+    options.profile = default_profile;
+    if (req.has_param("profile") &&
+        !parse_encode_profile(req.get_param_value("profile"),
+                              options.profile)) {
+      respond(bad_request("Invalid 'profile' parameter"));
+      return;
+    }
 
-      // Submit async task
-      scheduler.process_image_async(image_url, options,
-                                    [&promise](ProcessingResult result) {
-                                      promise.set_value(std::move(result));
-                                    });
+    std::string image_url;
+    try {
+      image_url = decode_image_url(src_param);
+    } catch (const std::exception &e) {
+      respond(bad_request("Invalid base64 encoded URL"));
+      return;
+    }
 
-      // wait util task done
-      ProcessingResult result = future.get();
+    uint64_t request_id = next_request_id();
+    MetricClock::time_point started = MetricClock::now();
+    IMGBOOST_LOG(INFO, "main", "Processing request")
+        .field("request", request_id)
+        .field("url", image_url)
+        .field("width", width)
+        .field("height", height)
+        .field("quality", quality);
 
-      if (result.success) {
-        res.set_content(
-            reinterpret_cast<const char *>(result.output_data.data()),
-            result.output_data.size(), "image/webp");
-        res.set_header("Cache-Control", "public, max-age=31536000");
-        std::cout << "[INFO] Request completed successfully" << std::endl;
-      } else {
-        res.status = result.http_status;
-        res.set_content(result.error_message, "text/plain");
-        std::cerr << "[ERROR] " << result.error_message << std::endl;
-      }
+    // Set before the scheduler shares the token with its threads
+    if (request_deadline_ms > 0) {
+      req.cancel->set_deadline(started +
+                               std::chrono::milliseconds(request_deadline_ms));
+    }
+
+    // Answered from whichever thread finishes the task
+    scheduler.process_image_async(
+        image_url, options,
+        [respond, request_id, started](ProcessingResult result) {
+          if (!result.success) {
+            IMGBOOST_LOG(ERR, "main", "Request failed")
+                .field("request", request_id)
+                .field("status", result.http_status)
+                .field("error", result.error_message)
+                .field("duration_ms", elapsed_ms(started));
+            respond(text_response(result.http_status,
+                                  std::move(result.error_message),
+                                  result.retry_after));
+            return;
+          }
+          // The shared buffer (heap or mmap) is written as is, the encoded
+          // bytes are never copied into the response
+          HttpResponse res;
+          res.content_type = "image/webp";
+          res.body.push_back(std::move(result.output_data));
+          res.set_header("Cache-Control", "public, max-age=31536000");
+          size_t bytes = res.content_length();
+          Metrics::instance().add_served(bytes);
+          respond(std::move(res));
+          IMGBOOST_LOG(INFO, "main", "Request completed")
+              .field("request", request_id)
+              .field("bytes", bytes)
+              .field("duration_ms", elapsed_ms(started));
+        },
+        req.cancel);
+  });
+
+  svr.get("/srcset", [&scheduler, default_profile,
+                      request_deadline_ms](const HttpRequest &req,
+                                           HttpResponder respond) {
+    auto src_param = req.get_param_value("src");
+    if (src_param.empty()) {
+      respond(bad_request("Missing 'src' parameter"));
+      return;
+    }
 
+    std::vector<int> widths =
+        parse_int_list(req.get_param_value("widths"), 1, 8192, 16);
+    if (widths.empty()) {
+      respond(bad_request("Missing or invalid 'widths' parameter"));
+      return;
+    }
+    int quality = parse_int_param(req.get_param_value("quality"), 80, 0, 100);
+    EncodeProfile profile = default_profile;
+    if (req.has_param("profile") &&
+        !parse_encode_profile(req.get_param_value("profile"), profile)) {
+      respond(bad_request("Invalid 'profile' parameter"));
+      return;
+    }
+    bool manifest = req.get_param_value("format") == "manifest";
+
+    std::string image_url;
+    try {
+      image_url = decode_image_url(src_param);
     } catch (const std::exception &e) {
-      std::cerr << "[ERROR] Exception: " << e.what() << std::endl;
-      res.status = 500;
-      res.set_content(std::string("Internal error: ") + e.what(), "text/plain");
+      respond(bad_request("Invalid base64 encoded URL"));
+      return;
+    }
+
+    uint64_t request_id = next_request_id();
+    MetricClock::time_point started = MetricClock::now();
+    IMGBOOST_LOG(INFO, "main", "Processing srcset request")
+        .field("request", request_id)
+        .field("url", image_url)
+        .field("widths", widths.size())
+        .field("quality", quality);
+
+    if (request_deadline_ms > 0) {
+      req.cancel->set_deadline(started +
+                               std::chrono::milliseconds(request_deadline_ms));
     }
+
+    scheduler.process_srcset_async(
+        image_url, widths, quality, profile,
+        [respond, manifest, quality, profile, src_param, request_id,
+         started](SrcsetResult result) {
+          if (!result.success) {
+            IMGBOOST_LOG(ERR, "main", "Srcset request failed")
+                .field("request", request_id)
+                .field("status", result.http_status)
+                .field("error", result.error_message)
+                .field("duration_ms", elapsed_ms(started));
+            respond(text_response(result.http_status,
+                                  std::move(result.error_message),
+                                  result.retry_after));
+            return;
+          }
+
+          HttpResponse res;
+          if (manifest) {
+            // Every entry is now cached under the URL of the single request
+            std::string json = "{\"images\":[";
+            for (size_t i = 0; i < result.images.size(); ++i) {
+              const SrcsetImage &image = result.images[i];
+              if (i > 0)
+                json += ",";
+              json += "{\"width\":" + std::to_string(image.width) +
+                      ",\"bytes\":" + std::to_string(image.data.size()) +
+                      ",\"url\":\"/?src=" + url_encode(src_param) +
+                      "&width=" + std::to_string(image.width) +
+                      "&quality=" + std::to_string(quality) +
+                      "&profile=" + encode_profile_name(profile) + "\"}";
+            }
+            json += "]}";
+            res.set_content(std::move(json), "application/json");
+          } else {
+            set_multipart_content(res, result.images);
+            res.set_header("Cache-Control", "public, max-age=31536000");
+            Metrics::instance().add_served(res.content_length());
+          }
+          size_t bytes = res.content_length();
+          respond(std::move(res));
+          IMGBOOST_LOG(INFO, "main", "Srcset request completed")
+              .field("request", request_id)
+              .field("images", result.images.size())
+              .field("bytes", bytes)
+              .field("duration_ms", elapsed_ms(started));
+        },
+        req.cancel);
   });
 
-  svr.Get("/info", [](const httplib::Request &, httplib::Response &res) {
+  svr.get("/info", [](const HttpRequest &, HttpResponder respond) {
     std::string info = R"(
 img-boost - High-performance image processing server
 
 Usage:
-  /?src={base64_encoded_image_data}&width={width}&height={height}&quality={quality}
+  /?src={base64_encoded_image_data}&width={width}&height={height}&quality={quality}&filter={filter}&profile={profile}
 
 Parameters:
   - src: Base64 encoded image data (required)
   - width: Target width in pixels (optional, 0 = auto)
   - height: Target height in pixels (optional, 0 = auto)
   - quality: WebP quality 0-100 (optional, default = 80)
+  - filter: box, bilinear, bicubic or lanczos3 (optional, default = bilinear)
+  - profile: fast, balanced, max, lossless or auto (optional, default = server's ENCODE_PROFILE)
 
 Notes:
   - If only width or height is specified, the other dimension is calculated to maintain aspect ratio
@@ -113,22 +579,43 @@ Notes:
 Example:
   /?src={base64_data}&width=800&quality=85
 
+Responsive image sets:
+  /srcset?src={base64_data}&widths=320,640,1280&quality={quality}&profile={profile}&format={multipart|manifest}
+
+  Downloads and decodes once and returns every width as multipart/mixed, or
+  with format=manifest a JSON list of cached single-image URLs
+
 Health check:
   /health
+
+Cache counters:
+  /stats
+
+Prometheus metrics (stage latency histograms, errors, queues, cache ratios):
+  /metrics
+
+Log level (debug, info, warn, error or off), read or set at runtime:
+  /debug/log?level={level}
+
+Chrome trace-event JSON of sampled requests, for Perfetto or chrome://tracing:
+  /debug/trace?clear={0|1}
+  /debug/trace?sample_percent={0-100}
 )";
-    res.set_content(info, "text/plain");
+    respond(text_response(200, std::move(info)));
   });
 
-  std::cout << "img-boost server starting..." << std::endl;
-  std::cout << "Listening on " << host << ":" << port << std::endl;
-  std::cout << "Health check: http://" << host << ":" << port << "/health"
-            << std::endl;
-  std::cout << "API info: http://" << host << ":" << port << "/info"
-            << std::endl;
+  std::string base = "http://" + host + ":" + std::to_string(port);
+  IMGBOOST_LOG(INFO, "main", "img-boost server starting")
+      .field("host", host)
+      .field("port", port)
+      .field("health", base + "/health")
+      .field("info", base + "/info")
+      .field("log_level", log_level_name(Logger::instance().level()));
 
-  if (!svr.listen(host.c_str(), port)) {
-    std::cerr << "Failed to start server on " << host << ":" << port
-              << std::endl;
+  if (!svr.listen(host, port)) {
+    IMGBOOST_LOG(ERR, "main", "Failed to start server")
+        .field("host", host)
+        .field("port", port);
     return 1;
   }
 
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace imgboost {
+
+// Latency stages of one request. The queue stages are the time spent
+// waiting for a download or processing slot.
+enum class MetricStage {
+  DOWNLOAD_QUEUE,
+  DOWNLOAD,
+  PROCESSING_QUEUE,
+  DECODE,
+  RESIZE,
+  ENCODE,
+  TOTAL,
+  COUNT
+};
+
+// Input format label
+enum class MetricFormat { JPEG, PNG, WEBP, OTHER, COUNT };
+
+// Output size label, by output pixels: up to 320x320, 1024x1024, 2048x2048
+// and beyond
+enum class SizeBucket { SMALL, MEDIUM, LARGE, XLARGE, COUNT };
+
+enum class ErrorCause {
+  BAD_REQUEST, // rejected parameters
+  DOWNLOAD,    // origin unreachable or not a 200
+  TOO_LARGE,   // source above the pixel limit
+  PROCESSING,  // decode or encode failure
+  OVERLOADED,  // shed by admission control or a full queue
+  CANCELLED,   // client gone or deadline passed before the work finished
+  COUNT
+};
+
+inline SizeBucket size_bucket(int width, int height) {
+  uint64_t pixels = static_cast<uint64_t>(width) * static_cast<uint64_t>(height);
+  if (pixels <= 320 * 320) {
+    return SizeBucket::SMALL;
+  }
+  if (pixels <= 1024 * 1024) {
+    return SizeBucket::MEDIUM;
+  }
+  if (pixels <= 2048 * 2048) {
+    return SizeBucket::LARGE;
+  }
+  return SizeBucket::XLARGE;
+}
+
+using MetricClock = std::chrono::steady_clock;
+
+inline uint64_t elapsed_ns(MetricClock::time_point since) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(MetricClock::now() -
+                                                           since)
+          .count());
+}
+
+// Adds the time until it goes out of scope to *total; does nothing, not
+// even read the clock, when total is null
+class ScopedTimer {
+public:
+  explicit ScopedTimer(uint64_t *total) : total_(total) {
+    if (total_) {
+      start_ = MetricClock::now();
+    }
+  }
+  ~ScopedTimer() {
+    if (total_) {
+      *total_ += elapsed_ns(start_);
+    }
+  }
+
+  // Disable copy
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  uint64_t *total_;
+  MetricClock::time_point start_;
+};
+
+// Process-wide latency histograms and counters, exposed in the Prometheus
+// text format. Every thread records into a block of its own with plain
+// relaxed loads and stores, no locked instruction and no shared cache line;
+// a scrape sums the blocks. Blocks of exited threads go to the next new
+// thread with their counts intact, so totals never go backwards.
+class Metrics {
+public:
+  static constexpr size_t kBuckets = 15; // including +Inf
+
+  static Metrics &instance() {
+    static Metrics *metrics = new Metrics();
+    return *metrics;
+  }
+
+  // Disable copy
+  Metrics(const Metrics &) = delete;
+  Metrics &operator=(const Metrics &) = delete;
+
+  void observe(MetricStage stage, MetricFormat format, SizeBucket size,
+               uint64_t ns) {
+    Series &series = local().series[series_index(stage, format, size)];
+    add(series.buckets[bucket_index(ns)], 1);
+    add(series.sum_ns, ns);
+  }
+
+  void add_downloaded(uint64_t bytes) { add(local().downloaded, bytes); }
+  void add_served(uint64_t bytes) { add(local().served, bytes); }
+  void count_error(ErrorCause cause) {
+    add(local().errors[static_cast<size_t>(cause)], 1);
+  }
+
+  // Histograms and counters; gauges owned by other components are
+  // appended by the caller
+  std::string render() const {
+    Totals totals = merge();
+    std::string out;
+    out += "# HELP imgboost_stage_duration_seconds Time spent in each "
+           "request stage\n";
+    out += "# TYPE imgboost_stage_duration_seconds histogram\n";
+    for (size_t i = 0; i < kSeries; ++i) {
+      const TotalSeries &series = totals.series[i];
+      // Label combinations never observed are left out
+      if (series.buckets[kBuckets - 1] == 0) {
+        continue;
+      }
+      std::string labels = series_labels(i);
+      for (size_t b = 0; b < kBuckets; ++b) {
+        out += "imgboost_stage_duration_seconds_bucket{" + labels + ",le=\"" +
+               bucket_label(b) + "\"} " + std::to_string(series.buckets[b]) +
+               "\n";
+      }
+      out += "imgboost_stage_duration_seconds_sum{" + labels + "} " +
+             format_seconds(series.sum_ns) + "\n";
+      out += "imgboost_stage_duration_seconds_count{" + labels + "} " +
+             std::to_string(series.buckets[kBuckets - 1]) + "\n";
+    }
+
+    out += "# HELP imgboost_downloaded_bytes_total Source bytes received "
+           "from origins\n";
+    out += "# TYPE imgboost_downloaded_bytes_total counter\n";
+    out += "imgboost_downloaded_bytes_total " +
+           std::to_string(totals.downloaded) + "\n";
+    out += "# HELP imgboost_served_bytes_total Image bytes sent to clients\n";
+    out += "# TYPE imgboost_served_bytes_total counter\n";
+    out += "imgboost_served_bytes_total " + std::to_string(totals.served) +
+           "\n";
+    out += "# HELP imgboost_errors_total Failed requests by cause\n";
+    out += "# TYPE imgboost_errors_total counter\n";
+    for (size_t i = 0; i < static_cast<size_t>(ErrorCause::COUNT); ++i) {
+      out += std::string("imgboost_errors_total{cause=\"") +
+             kErrorNames[i] + "\"} " + std::to_string(totals.errors[i]) +
+             "\n";
+    }
+    return out;
+  }
+
+private:
+  static constexpr size_t kStages = static_cast<size_t>(MetricStage::COUNT);
+  static constexpr size_t kFormats = static_cast<size_t>(MetricFormat::COUNT);
+  static constexpr size_t kSizes = static_cast<size_t>(SizeBucket::COUNT);
+  static constexpr size_t kSeries = kStages * kFormats * kSizes;
+  static constexpr size_t kErrors = static_cast<size_t>(ErrorCause::COUNT);
+
+  // Upper bounds of the finite buckets, in nanoseconds
+  static constexpr uint64_t kBounds[kBuckets - 1] = {
+      500000,    1000000,   2500000,    5000000,    10000000,
+      25000000,  50000000,  100000000,  250000000,  500000000,
+      1000000000, 2500000000, 5000000000, 10000000000};
+
+  static constexpr const char *kStageNames[kStages] = {
+      "download_queue", "download", "processing_queue", "decode",
+      "resize",         "encode",   "total"};
+  static constexpr const char *kFormatNames[kFormats] = {"jpeg", "png",
+                                                         "webp", "other"};
+  static constexpr const char *kSizeNames[kSizes] = {"small", "medium",
+                                                     "large", "xlarge"};
+  static constexpr const char *kErrorNames[kErrors] = {
+      "bad_request", "download",   "too_large",
+      "processing",  "overloaded", "cancelled"};
+
+  // Buckets are cumulative only when rendered, each slot here counts the
+  // observations that fell into it alone
+  struct Series {
+    std::array<std::atomic<uint64_t>, kBuckets> buckets;
+    std::atomic<uint64_t> sum_ns;
+  };
+
+  struct alignas(64) Block {
+    Block() {
+      for (Series &s : series) {
+        for (std::atomic<uint64_t> &bucket : s.buckets) {
+          bucket.store(0, std::memory_order_relaxed);
+        }
+        s.sum_ns.store(0, std::memory_order_relaxed);
+      }
+      for (std::atomic<uint64_t> &error : errors) {
+        error.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    std::array<Series, kSeries> series;
+    std::atomic<uint64_t> downloaded{0};
+    std::atomic<uint64_t> served{0};
+    std::array<std::atomic<uint64_t>, kErrors> errors;
+  };
+
+  struct TotalSeries {
+    uint64_t buckets[kBuckets] = {}; // cumulative
+    uint64_t sum_ns = 0;
+  };
+
+  struct Totals {
+    std::vector<TotalSeries> series = std::vector<TotalSeries>(kSeries);
+    uint64_t downloaded = 0;
+    uint64_t served = 0;
+    uint64_t errors[kErrors] = {};
+  };
+
+  // Hands the thread's block back for reuse when the thread exits
+  struct Handle {
+    Block *block = nullptr;
+    ~Handle() {
+      if (block) {
+        Metrics::instance().release(block);
+      }
+    }
+  };
+
+  Metrics() = default;
+
+  // Only the owning thread writes a block, so no read-modify-write is needed
+  static void add(std::atomic<uint64_t> &slot, uint64_t value) {
+    slot.store(slot.load(std::memory_order_relaxed) + value,
+               std::memory_order_relaxed);
+  }
+
+  static size_t series_index(MetricStage stage, MetricFormat format,
+                             SizeBucket size) {
+    return (static_cast<size_t>(stage) * kFormats +
+            static_cast<size_t>(format)) *
+               kSizes +
+           static_cast<size_t>(size);
+  }
+
+  static size_t bucket_index(uint64_t ns) {
+    size_t i = 0;
+    while (i < kBuckets - 1 && ns > kBounds[i]) {
+      ++i;
+    }
+    return i;
+  }
+
+  static std::string series_labels(size_t index) {
+    size_t size = index % kSizes;
+    size_t format = index / kSizes % kFormats;
+    size_t stage = index / (kSizes * kFormats);
+    return std::string("stage=\"") + kStageNames[stage] + "\",format=\"" +
+           kFormatNames[format] + "\",size=\"" + kSizeNames[size] + "\"";
+  }
+
+  static std::string bucket_label(size_t b) {
+    return b == kBuckets - 1 ? "+Inf" : format_seconds(kBounds[b]);
+  }
+
+  static std::string format_seconds(uint64_t ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", static_cast<double>(ns) / 1e9);
+    return buf;
+  }
+
+  Block &local() {
+    static thread_local Handle handle;
+    if (!handle.block) {
+      handle.block = acquire();
+    }
+    return *handle.block;
+  }
+
+  Block *acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      Block *block = free_.back();
+      free_.pop_back();
+      return block;
+    }
+    blocks_.push_back(std::make_unique<Block>());
+    return blocks_.back().get();
+  }
+
+  void release(Block *block) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(block);
+  }
+
+  Totals merge() const {
+    Totals totals;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<Block> &block : blocks_) {
+      for (size_t i = 0; i < kSeries; ++i) {
+        const Series &series = block->series[i];
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < kBuckets; ++b) {
+          cumulative += series.buckets[b].load(std::memory_order_relaxed);
+          totals.series[i].buckets[b] += cumulative;
+        }
+        totals.series[i].sum_ns +=
+            series.sum_ns.load(std::memory_order_relaxed);
+      }
+      totals.downloaded += block->downloaded.load(std::memory_order_relaxed);
+      totals.served += block->served.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < kErrors; ++i) {
+        totals.errors[i] += block->errors[i].load(std::memory_order_relaxed);
+      }
+    }
+    return totals;
+  }
+
+  mutable std::mutex mutex_; // guards blocks_ and free_, never a recording
+  std::vector<std::unique_ptr<Block>> blocks_;
+  std::vector<Block *> free_;
+};
+
+} // namespace imgboost
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "logger.h"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+namespace imgboost {
+
+struct PixelBudgetStats {
+  uint64_t capacity = 0;
+  uint64_t in_use = 0;   // bytes held by running decodes
+  uint64_t waits = 0;    // reservations that had to wait for room
+  uint64_t waiting = 0;  // reservations waiting now
+};
+
+// Process-wide limit on decoded pixel memory. A decode reserves its
+// estimated peak footprint before it is queued and is only queued once the
+// budget has room, so several huge images arriving together run one after
+// another instead of all allocating at once. Nothing ever blocks on the
+// budget: a pool worker waiting for room could be holding the thread that
+// the tasks which would free it need. Reservations are granted in arrival
+// order, a large one is never starved by a stream of small ones.
+class PixelBudget {
+public:
+  // Returns its bytes to the budget when destroyed
+  class Reservation {
+  public:
+    Reservation() = default;
+    Reservation(PixelBudget *budget, size_t bytes)
+        : budget_(budget), bytes_(bytes) {}
+    Reservation(Reservation &&other) noexcept
+        : budget_(other.budget_), bytes_(other.bytes_) {
+      other.budget_ = nullptr;
+    }
+    Reservation &operator=(Reservation &&other) noexcept {
+      if (this != &other) {
+        reset();
+        budget_ = other.budget_;
+        bytes_ = other.bytes_;
+        other.budget_ = nullptr;
+      }
+      return *this;
+    }
+    ~Reservation() { reset(); }
+
+    // Cleared first: the release may grant waiters whose callbacks touch
+    // this object's owner
+    void reset() {
+      if (budget_) {
+        PixelBudget *budget = budget_;
+        budget_ = nullptr;
+        budget->release(bytes_);
+      }
+    }
+
+  private:
+    PixelBudget *budget_ = nullptr;
+    size_t bytes_ = 0;
+  };
+
+  // capacity_bytes == 0 disables the limit
+  explicit PixelBudget(size_t capacity_bytes) : capacity_(capacity_bytes) {}
+
+  // Disable copy
+  PixelBudget(const PixelBudget &) = delete;
+  PixelBudget &operator=(const PixelBudget &) = delete;
+
+  using Granted = std::function<void(Reservation)>;
+
+  // Calls granted with the reservation once bytes fit: right away on the
+  // calling thread when they fit now and nobody is waiting, otherwise on
+  // the thread whose release makes room. A request above the whole budget
+  // is clamped to it, so it still runs, alone.
+  void reserve_async(size_t bytes, Granted granted) {
+    if (capacity_ == 0) {
+      granted(Reservation());
+      return;
+    }
+    bytes = std::min(bytes, capacity_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!waiting_.empty() || in_use_ + bytes > capacity_) {
+        waits_++;
+        waiting_.push_back({bytes, std::move(granted)});
+        return;
+      }
+      in_use_ += bytes;
+    }
+    granted(Reservation(this, bytes));
+  }
+
+  // Never blocks: succeeds only when bytes fit now and nobody is waiting,
+  // so callers that can fall back do not jump the queue
+  bool try_reserve(size_t bytes, Reservation &reservation) {
+    if (capacity_ == 0) {
+      reservation = Reservation();
+      return true;
+    }
+    bytes = std::min(bytes, capacity_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!waiting_.empty() || in_use_ + bytes > capacity_) {
+        return false;
+      }
+      in_use_ += bytes;
+    }
+    // Outside the lock, an earlier reservation held here is released
+    reservation = Reservation(this, bytes);
+    return true;
+  }
+
+  PixelBudgetStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PixelBudgetStats stats;
+    stats.capacity = capacity_;
+    stats.in_use = in_use_;
+    stats.waits = waits_;
+    stats.waiting = waiting_.size();
+    return stats;
+  }
+
+private:
+  struct Waiter {
+    size_t bytes;
+    Granted granted;
+  };
+
+  void release(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    in_use_ -= bytes;
+    // One thread at a time runs the callbacks; a release meanwhile, e.g. a
+    // granted request that was cancelled, is picked up by its loop instead
+    // of recursing
+    if (granting_) {
+      return;
+    }
+    granting_ = true;
+    while (!waiting_.empty() &&
+           in_use_ + waiting_.front().bytes <= capacity_) {
+      Waiter waiter = std::move(waiting_.front());
+      waiting_.pop_front();
+      in_use_ += waiter.bytes;
+      lock.unlock();
+      try {
+        waiter.granted(Reservation(this, waiter.bytes));
+      } catch (const std::exception &e) {
+        IMGBOOST_LOG(ERR, "PixelBudget", "Granted callback threw")
+            .field("error", e.what());
+      }
+      lock.lock();
+    }
+    granting_ = false;
+  }
+
+  const size_t capacity_;
+  mutable std::mutex mutex_;
+  size_t in_use_ = 0;
+  std::deque<Waiter> waiting_; // front == oldest
+  bool granting_ = false;      // a release is running callbacks
+  uint64_t waits_ = 0;
+};
+
+} // namespace imgboost
@@ -0,0 +1,984 @@
+#include "resampler.h"
+#include "buffer_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||           \
+    defined(_M_IX86)
+#define IMGBOOST_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang need per-function target attributes to emit SSE4.1/AVX2 in a
+// translation unit built for the baseline ISA; MSVC accepts the intrinsics
+// anywhere.
+#if defined(__GNUC__) || defined(__clang__)
+#define IMGBOOST_TARGET(isa) __attribute__((target(isa)))
+#else
+#define IMGBOOST_TARGET(isa)
+#endif
+
+namespace imgboost {
+
+namespace {
+
+// Weights are 14-bit fixed point so they fit int16 lanes for pmaddwd
+const int kPrecisionBits = 14;
+const int32_t kRound = 1 << (kPrecisionBits - 1);
+
+const double kPi = 3.14159265358979323846;
+
+struct FilterDef {
+  double support;
+  double (*weight)(double x);
+};
+
+double box_filter(double x) { return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0; }
+
+double bilinear_filter(double x) {
+  x = std::fabs(x);
+  return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+// Keys cubic with a = -0.5 (Catmull-Rom)
+double bicubic_filter(double x) {
+  const double a = -0.5;
+  x = std::fabs(x);
+  if (x < 1.0)
+    return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+  if (x < 2.0)
+    return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+  return 0.0;
+}
+
+double sinc(double x) {
+  if (x == 0.0)
+    return 1.0;
+  x *= kPi;
+  return std::sin(x) / x;
+}
+
+double lanczos3_filter(double x) {
+  if (x > -3.0 && x < 3.0)
+    return sinc(x) * sinc(x / 3.0);
+  return 0.0;
+}
+
+FilterDef filter_def(ResampleFilter filter) {
+  switch (filter) {
+  case ResampleFilter::BOX:
+    return {0.5, box_filter};
+  case ResampleFilter::BICUBIC:
+    return {2.0, bicubic_filter};
+  case ResampleFilter::LANCZOS3:
+    return {3.0, lanczos3_filter};
+  case ResampleFilter::BILINEAR:
+  default:
+    return {1.0, bilinear_filter};
+  }
+}
+
+// Per output pixel: first source index, tap count, and `stride` weights
+struct Coefficients {
+  int in_size = 0; // source pixels per row, bounds the kernels' wide loads
+  int stride = 0;
+  std::vector<int> start;
+  std::vector<int> count;
+  std::vector<int16_t> weights;
+};
+
+Coefficients compute_coefficients(int in_size, int out_size,
+                                  ResampleFilter filter) {
+  FilterDef def = filter_def(filter);
+  double scale = static_cast<double>(in_size) / out_size;
+  // Downscaling stretches the filter over the source (area averaging)
+  double filter_scale = std::max(scale, 1.0);
+  double support = def.support * filter_scale;
+
+  Coefficients c;
+  c.in_size = in_size;
+  c.stride = static_cast<int>(std::ceil(support)) * 2 + 1;
+  c.start.resize(out_size);
+  c.count.resize(out_size);
+  c.weights.assign(static_cast<size_t>(out_size) * c.stride, 0);
+
+  std::vector<double> k(c.stride);
+  for (int i = 0; i < out_size; ++i) {
+    double center = (i + 0.5) * scale;
+    int lo = std::max(static_cast<int>(center - support + 0.5), 0);
+    int hi = std::min(static_cast<int>(center + support + 0.5), in_size);
+    int n = std::min(hi - lo, c.stride);
+
+    double total = 0.0;
+    for (int j = 0; j < n; ++j) {
+      k[j] = def.weight((j + lo - center + 0.5) / filter_scale);
+      total += k[j];
+    }
+
+    // Quantize, then push the rounding error into the largest tap so flat
+    // areas stay exactly flat
+    int16_t *w = &c.weights[static_cast<size_t>(i) * c.stride];
+    int sum = 0, largest = 0;
+    for (int j = 0; j < n; ++j) {
+      double normalized = total != 0.0 ? k[j] / total : 0.0;
+      w[j] = static_cast<int16_t>(
+          std::lround(normalized * (1 << kPrecisionBits)));
+      sum += w[j];
+      if (std::abs(w[j]) > std::abs(w[largest]))
+        largest = j;
+    }
+    if (n > 0)
+      w[largest] = static_cast<int16_t>(w[largest] + (1 << kPrecisionBits) - sum);
+
+    c.start[i] = lo;
+    c.count[i] = n;
+  }
+  return c;
+}
+
+inline uint8_t clamp_pixel(int32_t v) {
+  v >>= kPrecisionBits;
+  return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+inline int32_t weight_pair(int16_t a, int16_t b) {
+  return static_cast<int32_t>(static_cast<uint16_t>(a) |
+                              (static_cast<uint32_t>(static_cast<uint16_t>(b))
+                               << 16));
+}
+
+// Horizontal pass over source rows [row_begin, row_end)
+using HorizontalFn = void (*)(const uint8_t *src, int src_stride, uint8_t *dst,
+                              int dst_stride, int dst_width, int channels,
+                              const Coefficients &c, int row_begin,
+                              int row_end);
+
+// Vertical pass producing output rows [row_begin, row_end); rows are
+// processed as plain byte arrays, so any channel count works
+using VerticalFn = void (*)(const uint8_t *src, int src_stride, uint8_t *dst,
+                            int dst_stride, int row_bytes,
+                            const Coefficients &c, int row_begin, int row_end);
+
+void horizontal_scalar(const uint8_t *src, int src_stride, uint8_t *dst,
+                       int dst_stride, int dst_width, int channels,
+                       const Coefficients &c, int row_begin, int row_end) {
+  for (int y = row_begin; y < row_end; ++y) {
+    const uint8_t *in = src + static_cast<size_t>(y) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    for (int x = 0; x < dst_width; ++x) {
+      const int16_t *w = &c.weights[static_cast<size_t>(x) * c.stride];
+      const uint8_t *p = in + c.start[x] * channels;
+      int n = c.count[x];
+      for (int ch = 0; ch < channels; ++ch) {
+        int32_t acc = kRound;
+        for (int k = 0; k < n; ++k) {
+          acc += p[k * channels + ch] * w[k];
+        }
+        out[x * channels + ch] = clamp_pixel(acc);
+      }
+    }
+  }
+}
+
+void vertical_scalar(const uint8_t *src, int src_stride, uint8_t *dst,
+                     int dst_stride, int row_bytes, const Coefficients &c,
+                     int row_begin, int row_end) {
+  for (int y = row_begin; y < row_end; ++y) {
+    const int16_t *w = &c.weights[static_cast<size_t>(y) * c.stride];
+    const uint8_t *in = src + static_cast<size_t>(c.start[y]) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    int n = c.count[y];
+    for (int x = 0; x < row_bytes; ++x) {
+      int32_t acc = kRound;
+      for (int k = 0; k < n; ++k) {
+        acc += in[static_cast<size_t>(k) * src_stride + x] * w[k];
+      }
+      out[x] = clamp_pixel(acc);
+    }
+  }
+}
+
+// Whether every alpha byte of an RGBA run is 255
+using OpaqueFn = bool (*)(const uint8_t *rgba, size_t pixels);
+
+// Pixels ANDed together between checks, so a translucent image is usually
+// rejected within its first rows
+const size_t kOpaqueBlock = 4096;
+
+bool opaque_scalar(const uint8_t *rgba, size_t pixels) {
+  for (size_t i = 0; i < pixels; i += kOpaqueBlock) {
+    size_t end = std::min(pixels, i + kOpaqueBlock);
+    uint8_t all = 0xFF;
+    for (size_t j = i; j < end; ++j) {
+      all &= rgba[j * 4 + 3];
+    }
+    if (all != 0xFF)
+      return false;
+  }
+  return true;
+}
+
+#ifdef IMGBOOST_X86
+
+// Horizontal RGBA taps are taken in pairs: two pixels are shuffled into
+// (c0, c1) int16 pairs per channel and multiplied by (w0, w1) with pmaddwd.
+IMGBOOST_TARGET("sse4.1")
+inline __m128i rgba_pair_taps_sse41(const uint8_t *p, int32_t weights) {
+  const __m128i shuffle =
+      _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+  __m128i px = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return _mm_madd_epi16(_mm_shuffle_epi8(px, shuffle),
+                        _mm_set1_epi32(weights));
+}
+
+IMGBOOST_TARGET("sse4.1")
+inline void store_rgba_sse41(__m128i acc, uint8_t *out) {
+  acc = _mm_srai_epi32(acc, kPrecisionBits);
+  acc = _mm_packs_epi32(acc, acc);
+  acc = _mm_packus_epi16(acc, acc);
+  int32_t pixel = _mm_cvtsi128_si32(acc);
+  std::memcpy(out, &pixel, 4);
+}
+
+IMGBOOST_TARGET("sse4.1")
+inline __m128i rgba_single_tap_sse41(const uint8_t *p, int16_t weight) {
+  int32_t pixel;
+  std::memcpy(&pixel, p, 4);
+  __m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel));
+  return _mm_mullo_epi32(px, _mm_set1_epi32(weight));
+}
+
+// RGB taps use the same pairing with a zero fourth lane. A pair is loaded as
+// 8 bytes, 2 past the pair, and a pixel is stored as 4 bytes, 1 past it;
+// only loads near the end of the row and the last pixel's store are done
+// byte by byte instead. `readable` is the byte count from p to the row end.
+IMGBOOST_TARGET("sse4.1")
+inline __m128i rgb_pair_taps_sse41(__m128i px, int32_t weights) {
+  const __m128i shuffle =
+      _mm_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1);
+  return _mm_madd_epi16(_mm_shuffle_epi8(px, shuffle),
+                        _mm_set1_epi32(weights));
+}
+
+IMGBOOST_TARGET("sse4.1")
+inline __m128i rgb_load_pair_sse41(const uint8_t *p, int offset,
+                                   int readable) {
+  if (offset + 8 <= readable) {
+    return _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + offset));
+  }
+  uint64_t bits = 0;
+  std::memcpy(&bits, p + offset, 6);
+  return _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&bits));
+}
+
+IMGBOOST_TARGET("sse4.1")
+inline __m128i rgb_single_tap_sse41(const uint8_t *p, int offset, int readable,
+                                    int16_t weight) {
+  int32_t pixel = 0;
+  if (offset + 4 <= readable) {
+    std::memcpy(&pixel, p + offset, 4);
+  } else {
+    std::memcpy(&pixel, p + offset, 3);
+  }
+  __m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel));
+  // The fourth lane is never stored
+  return _mm_mullo_epi32(px, _mm_set1_epi32(weight));
+}
+
+IMGBOOST_TARGET("sse4.1")
+inline void store_rgb_sse41(__m128i acc, uint8_t *out, bool last) {
+  acc = _mm_srai_epi32(acc, kPrecisionBits);
+  acc = _mm_packs_epi32(acc, acc);
+  acc = _mm_packus_epi16(acc, acc);
+  int32_t pixel = _mm_cvtsi128_si32(acc);
+  if (last) {
+    std::memcpy(out, &pixel, 3);
+  } else {
+    std::memcpy(out, &pixel, 4);
+  }
+}
+
+// Pair and single taps [k, n) of one RGB output pixel
+IMGBOOST_TARGET("sse4.1")
+inline __m128i rgb_taps_sse41(__m128i acc, const uint8_t *p, const int16_t *w,
+                              int k, int n, int readable) {
+  for (; k + 1 < n; k += 2) {
+    acc = _mm_add_epi32(acc,
+                        rgb_pair_taps_sse41(rgb_load_pair_sse41(p, k * 3,
+                                                                readable),
+                                            weight_pair(w[k], w[k + 1])));
+  }
+  if (k < n) {
+    acc = _mm_add_epi32(acc, rgb_single_tap_sse41(p, k * 3, readable, w[k]));
+  }
+  return acc;
+}
+
+IMGBOOST_TARGET("sse4.1")
+void horizontal_rgb_sse41(const uint8_t *src, int src_stride, uint8_t *dst,
+                          int dst_stride, int dst_width, const Coefficients &c,
+                          int row_begin, int row_end) {
+  for (int y = row_begin; y < row_end; ++y) {
+    const uint8_t *in = src + static_cast<size_t>(y) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    for (int x = 0; x < dst_width; ++x) {
+      const int16_t *w = &c.weights[static_cast<size_t>(x) * c.stride];
+      const uint8_t *p = in + c.start[x] * 3;
+      int readable = (c.in_size - c.start[x]) * 3;
+      __m128i acc = rgb_taps_sse41(_mm_set1_epi32(kRound), p, w, 0, c.count[x],
+                                   readable);
+      store_rgb_sse41(acc, out + x * 3, x + 1 == dst_width);
+    }
+  }
+}
+
+IMGBOOST_TARGET("sse4.1")
+void horizontal_sse41(const uint8_t *src, int src_stride, uint8_t *dst,
+                      int dst_stride, int dst_width, int channels,
+                      const Coefficients &c, int row_begin, int row_end) {
+  if (channels == 3) {
+    horizontal_rgb_sse41(src, src_stride, dst, dst_stride, dst_width, c,
+                         row_begin, row_end);
+    return;
+  }
+  if (channels != 4) {
+    horizontal_scalar(src, src_stride, dst, dst_stride, dst_width, channels, c,
+                      row_begin, row_end);
+    return;
+  }
+  for (int y = row_begin; y < row_end; ++y) {
+    const uint8_t *in = src + static_cast<size_t>(y) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    for (int x = 0; x < dst_width; ++x) {
+      const int16_t *w = &c.weights[static_cast<size_t>(x) * c.stride];
+      const uint8_t *p = in + c.start[x] * 4;
+      int n = c.count[x];
+      __m128i acc = _mm_set1_epi32(kRound);
+      int k = 0;
+      for (; k + 1 < n; k += 2) {
+        acc = _mm_add_epi32(
+            acc, rgba_pair_taps_sse41(p + k * 4, weight_pair(w[k], w[k + 1])));
+      }
+      if (k < n) {
+        acc = _mm_add_epi32(acc, rgba_single_tap_sse41(p + k * 4, w[k]));
+      }
+      store_rgba_sse41(acc, out + x * 4);
+    }
+  }
+}
+
+// Vertical taps are also paired: bytes of two rows are interleaved into
+// (a, b) int16 pairs and multiplied by (wa, wb), 16 bytes per iteration.
+IMGBOOST_TARGET("sse4.1")
+void vertical_sse41(const uint8_t *src, int src_stride, uint8_t *dst,
+                    int dst_stride, int row_bytes, const Coefficients &c,
+                    int row_begin, int row_end) {
+  const __m128i zero = _mm_setzero_si128();
+  for (int y = row_begin; y < row_end; ++y) {
+    const int16_t *w = &c.weights[static_cast<size_t>(y) * c.stride];
+    const uint8_t *in = src + static_cast<size_t>(c.start[y]) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    int n = c.count[y];
+
+    int x = 0;
+    for (; x + 16 <= row_bytes; x += 16) {
+      __m128i acc0 = _mm_set1_epi32(kRound);
+      __m128i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+      for (int k = 0; k < n; k += 2) {
+        const uint8_t *row = in + static_cast<size_t>(k) * src_stride + x;
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row));
+        __m128i b = zero;
+        int32_t weights = weight_pair(w[k], 0);
+        if (k + 1 < n) {
+          b = _mm_loadu_si128(
+              reinterpret_cast<const __m128i *>(row + src_stride));
+          weights = weight_pair(w[k], w[k + 1]);
+        }
+        __m128i wv = _mm_set1_epi32(weights);
+        __m128i ab_lo = _mm_unpacklo_epi8(a, b);
+        __m128i ab_hi = _mm_unpackhi_epi8(a, b);
+        acc0 = _mm_add_epi32(acc0,
+                             _mm_madd_epi16(_mm_unpacklo_epi8(ab_lo, zero), wv));
+        acc1 = _mm_add_epi32(acc1,
+                             _mm_madd_epi16(_mm_unpackhi_epi8(ab_lo, zero), wv));
+        acc2 = _mm_add_epi32(acc2,
+                             _mm_madd_epi16(_mm_unpacklo_epi8(ab_hi, zero), wv));
+        acc3 = _mm_add_epi32(acc3,
+                             _mm_madd_epi16(_mm_unpackhi_epi8(ab_hi, zero), wv));
+      }
+      __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, kPrecisionBits),
+                                   _mm_srai_epi32(acc1, kPrecisionBits));
+      __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, kPrecisionBits),
+                                   _mm_srai_epi32(acc3, kPrecisionBits));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+                       _mm_packus_epi16(lo, hi));
+    }
+
+    for (; x < row_bytes; ++x) {
+      int32_t acc = kRound;
+      for (int k = 0; k < n; ++k) {
+        acc += in[static_cast<size_t>(k) * src_stride + x] * w[k];
+      }
+      out[x] = clamp_pixel(acc);
+    }
+  }
+}
+
+// Four RGB taps per iteration as in the RGBA kernel, while the high pair's
+// 8 byte load stays inside the row
+IMGBOOST_TARGET("avx2")
+void horizontal_rgb_avx2(const uint8_t *src, int src_stride, uint8_t *dst,
+                         int dst_stride, int dst_width, const Coefficients &c,
+                         int row_begin, int row_end) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1, 0, -1, 3, -1,
+      1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1);
+  for (int y = row_begin; y < row_end; ++y) {
+    const uint8_t *in = src + static_cast<size_t>(y) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    for (int x = 0; x < dst_width; ++x) {
+      const int16_t *w = &c.weights[static_cast<size_t>(x) * c.stride];
+      const uint8_t *p = in + c.start[x] * 3;
+      int n = c.count[x];
+      int readable = (c.in_size - c.start[x]) * 3;
+
+      __m256i acc256 = _mm256_setzero_si256();
+      int k = 0;
+      for (; k + 3 < n && k * 3 + 14 <= readable; k += 4) {
+        __m128i lo = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + k * 3));
+        __m128i hi =
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + k * 3 + 6));
+        __m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        __m256i wv = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_set1_epi32(weight_pair(w[k], w[k + 1]))),
+            _mm_set1_epi32(weight_pair(w[k + 2], w[k + 3])), 1);
+        acc256 = _mm256_add_epi32(
+            acc256, _mm256_madd_epi16(_mm256_shuffle_epi8(px, shuffle), wv));
+      }
+      __m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc256),
+                                  _mm256_extracti128_si256(acc256, 1));
+      acc = rgb_taps_sse41(_mm_add_epi32(acc, _mm_set1_epi32(kRound)), p, w, k,
+                           n, readable);
+      store_rgb_sse41(acc, out + x * 3, x + 1 == dst_width);
+    }
+  }
+}
+
+IMGBOOST_TARGET("avx2")
+void horizontal_avx2(const uint8_t *src, int src_stride, uint8_t *dst,
+                     int dst_stride, int dst_width, int channels,
+                     const Coefficients &c, int row_begin, int row_end) {
+  if (channels == 3) {
+    horizontal_rgb_avx2(src, src_stride, dst, dst_stride, dst_width, c,
+                        row_begin, row_end);
+    return;
+  }
+  if (channels != 4) {
+    horizontal_scalar(src, src_stride, dst, dst_stride, dst_width, channels, c,
+                      row_begin, row_end);
+    return;
+  }
+  const __m256i shuffle = _mm256_setr_epi8(
+      0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1, 0, -1, 4, -1, 1,
+      -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+  for (int y = row_begin; y < row_end; ++y) {
+    const uint8_t *in = src + static_cast<size_t>(y) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    for (int x = 0; x < dst_width; ++x) {
+      const int16_t *w = &c.weights[static_cast<size_t>(x) * c.stride];
+      const uint8_t *p = in + c.start[x] * 4;
+      int n = c.count[x];
+
+      // Four taps per iteration: pixels k, k+1 in the low lane and k+2, k+3
+      // in the high lane
+      __m256i acc256 = _mm256_setzero_si256();
+      int k = 0;
+      for (; k + 3 < n; k += 4) {
+        __m128i lo = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + k * 4));
+        __m128i hi =
+            _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + k * 4 + 8));
+        __m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        __m256i wv = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_set1_epi32(weight_pair(w[k], w[k + 1]))),
+            _mm_set1_epi32(weight_pair(w[k + 2], w[k + 3])), 1);
+        acc256 = _mm256_add_epi32(
+            acc256, _mm256_madd_epi16(_mm256_shuffle_epi8(px, shuffle), wv));
+      }
+      __m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc256),
+                                  _mm256_extracti128_si256(acc256, 1));
+      acc = _mm_add_epi32(acc, _mm_set1_epi32(kRound));
+      for (; k + 1 < n; k += 2) {
+        acc = _mm_add_epi32(
+            acc, rgba_pair_taps_sse41(p + k * 4, weight_pair(w[k], w[k + 1])));
+      }
+      if (k < n) {
+        acc = _mm_add_epi32(acc, rgba_single_tap_sse41(p + k * 4, w[k]));
+      }
+      store_rgba_sse41(acc, out + x * 4);
+    }
+  }
+}
+
+IMGBOOST_TARGET("avx2")
+void vertical_avx2(const uint8_t *src, int src_stride, uint8_t *dst,
+                   int dst_stride, int row_bytes, const Coefficients &c,
+                   int row_begin, int row_end) {
+  const __m256i zero = _mm256_setzero_si256();
+  for (int y = row_begin; y < row_end; ++y) {
+    const int16_t *w = &c.weights[static_cast<size_t>(y) * c.stride];
+    const uint8_t *in = src + static_cast<size_t>(c.start[y]) * src_stride;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+    int n = c.count[y];
+
+    // All unpack/pack steps work within 128-bit lanes, so the final pack
+    // restores the original byte order
+    int x = 0;
+    for (; x + 32 <= row_bytes; x += 32) {
+      __m256i acc0 = _mm256_set1_epi32(kRound);
+      __m256i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+      for (int k = 0; k < n; k += 2) {
+        const uint8_t *row = in + static_cast<size_t>(k) * src_stride + x;
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row));
+        __m256i b = zero;
+        int32_t weights = weight_pair(w[k], 0);
+        if (k + 1 < n) {
+          b = _mm256_loadu_si256(
+              reinterpret_cast<const __m256i *>(row + src_stride));
+          weights = weight_pair(w[k], w[k + 1]);
+        }
+        __m256i wv = _mm256_set1_epi32(weights);
+        __m256i ab_lo = _mm256_unpacklo_epi8(a, b);
+        __m256i ab_hi = _mm256_unpackhi_epi8(a, b);
+        acc0 = _mm256_add_epi32(
+            acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(ab_lo, zero), wv));
+        acc1 = _mm256_add_epi32(
+            acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(ab_lo, zero), wv));
+        acc2 = _mm256_add_epi32(
+            acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(ab_hi, zero), wv));
+        acc3 = _mm256_add_epi32(
+            acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(ab_hi, zero), wv));
+      }
+      __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(acc0, kPrecisionBits),
+                                      _mm256_srai_epi32(acc1, kPrecisionBits));
+      __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(acc2, kPrecisionBits),
+                                      _mm256_srai_epi32(acc3, kPrecisionBits));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x),
+                          _mm256_packus_epi16(lo, hi));
+    }
+
+    // Remaining bytes go through the SSE4.1 kernel on this row only
+    if (x < row_bytes) {
+      vertical_sse41(src + x, src_stride, dst + x, dst_stride, row_bytes - x,
+                     c, y, y + 1);
+    }
+  }
+}
+
+IMGBOOST_TARGET("sse4.1")
+bool opaque_sse41(const uint8_t *rgba, size_t pixels) {
+  // Color bytes are forced to ones, leaving only alpha to test
+  const __m128i color = _mm_set1_epi32(0x00FFFFFF);
+  const __m128i ones = _mm_set1_epi32(-1);
+  size_t vectors = pixels / 4 * 4;
+  size_t i = 0;
+  while (i < vectors) {
+    size_t end = std::min(vectors, i + kOpaqueBlock);
+    __m128i all = ones;
+    for (; i < end; i += 4) {
+      all = _mm_and_si128(
+          all, _mm_loadu_si128(reinterpret_cast<const __m128i *>(rgba + i * 4)));
+    }
+    if (!_mm_testc_si128(_mm_or_si128(all, color), ones))
+      return false;
+  }
+  return opaque_scalar(rgba + i * 4, pixels - i);
+}
+
+IMGBOOST_TARGET("avx2")
+bool opaque_avx2(const uint8_t *rgba, size_t pixels) {
+  const __m256i color = _mm256_set1_epi32(0x00FFFFFF);
+  const __m256i ones = _mm256_set1_epi32(-1);
+  size_t vectors = pixels / 8 * 8;
+  size_t i = 0;
+  while (i < vectors) {
+    size_t end = std::min(vectors, i + kOpaqueBlock);
+    __m256i all = ones;
+    for (; i < end; i += 8) {
+      all = _mm256_and_si256(
+          all,
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rgba + i * 4)));
+    }
+    if (!_mm256_testc_si256(_mm256_or_si256(all, color), ones))
+      return false;
+  }
+  return opaque_sse41(rgba + i * 4, pixels - i);
+}
+
+bool cpu_supports(const std::string &isa) {
+#if defined(__GNUC__) || defined(__clang__)
+  if (isa == "avx2")
+    return __builtin_cpu_supports("avx2");
+  if (isa == "sse4.1")
+    return __builtin_cpu_supports("sse4.1");
+  return false;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool sse41 = (info[2] & (1 << 19)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (isa == "sse4.1")
+    return sse41;
+  if (isa == "avx2") {
+    if (!osxsave || (_xgetbv(0) & 0x6) != 0x6)
+      return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+  }
+  return false;
+#else
+  (void)isa;
+  return false;
+#endif
+}
+
+#endif // IMGBOOST_X86
+
+struct Kernels {
+  const char *name;
+  HorizontalFn horizontal;
+  VerticalFn vertical;
+  OpaqueFn opaque;
+};
+
+Kernels kernels_for(const std::string &isa) {
+#ifdef IMGBOOST_X86
+  if (isa == "avx2")
+    return {"avx2", horizontal_avx2, vertical_avx2, opaque_avx2};
+  if (isa == "sse4.1")
+    return {"sse4.1", horizontal_sse41, vertical_sse41, opaque_sse41};
+#endif
+  (void)isa;
+  return {"scalar", horizontal_scalar, vertical_scalar, opaque_scalar};
+}
+
+Kernels detect_kernels() {
+#ifdef IMGBOOST_X86
+  if (cpu_supports("avx2"))
+    return kernels_for("avx2");
+  if (cpu_supports("sse4.1"))
+    return kernels_for("sse4.1");
+#endif
+  return kernels_for("scalar");
+}
+
+Kernels &active_kernels() {
+  static Kernels kernels = detect_kernels();
+  return kernels;
+}
+
+// Output pixels per stripe: small enough to spread a large image over the
+// pool, large enough that scheduling stays noise next to the filtering
+const size_t kStripePixels = 256 * 1024;
+const size_t kMaxStripes = 64;
+
+// Split rows [0, rows) into stripes and run fn(begin, end) on each
+template <typename Fn>
+void for_each_stripe(const ParallelFor &parallel, int rows, int row_pixels,
+                     Fn &&fn) {
+  size_t pixels = static_cast<size_t>(rows) * row_pixels;
+  size_t stripes = std::min(
+      {pixels / kStripePixels, kMaxStripes, static_cast<size_t>(rows)});
+  if (!parallel || stripes < 2) {
+    fn(0, rows);
+    return;
+  }
+  parallel(stripes, [&](size_t i) {
+    fn(static_cast<int>(rows * i / stripes),
+       static_cast<int>(rows * (i + 1) / stripes));
+  });
+}
+
+} // namespace
+
+bool parse_resample_filter(const std::string &name, ResampleFilter &filter) {
+  if (name == "box") {
+    filter = ResampleFilter::BOX;
+  } else if (name == "bilinear") {
+    filter = ResampleFilter::BILINEAR;
+  } else if (name == "bicubic") {
+    filter = ResampleFilter::BICUBIC;
+  } else if (name == "lanczos3") {
+    filter = ResampleFilter::LANCZOS3;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *resample_filter_name(ResampleFilter filter) {
+  switch (filter) {
+  case ResampleFilter::BOX:
+    return "box";
+  case ResampleFilter::BICUBIC:
+    return "bicubic";
+  case ResampleFilter::LANCZOS3:
+    return "lanczos3";
+  case ResampleFilter::BILINEAR:
+  default:
+    return "bilinear";
+  }
+}
+
+const char *resampler_isa() { return active_kernels().name; }
+
+bool rgba_opaque(const uint8_t *rgba, size_t pixels) {
+  return active_kernels().opaque(rgba, pixels);
+}
+
+void rgba_to_rgb(uint8_t *pixels, size_t count) {
+  // Every write lands at or before the pixel being read
+  for (size_t i = 0; i < count; ++i) {
+    std::memmove(pixels + i * 3, pixels + i * 4, 3);
+  }
+}
+
+void premultiply_alpha(uint8_t *rgba, size_t pixels) {
+  for (size_t i = 0; i < pixels; ++i, rgba += 4) {
+    uint32_t a = rgba[3];
+    if (a == 255)
+      continue;
+    for (int ch = 0; ch < 3; ++ch) {
+      // Exact round(c * a / 255)
+      uint32_t t = rgba[ch] * a + 128;
+      rgba[ch] = static_cast<uint8_t>((t + (t >> 8)) >> 8);
+    }
+  }
+}
+
+namespace {
+
+// 16-bit reciprocals of alpha, rounded up, and the rounding offsets that
+// make (p * scale + bias) >> 16 equal round(p * 255 / a) for every p and a
+struct UnpremultiplyTable {
+  uint32_t scale[256];
+  uint32_t bias[256];
+
+  UnpremultiplyTable() {
+    scale[0] = bias[0] = 0;
+    for (uint32_t a = 1; a < 256; ++a) {
+      scale[a] = ((255u << 16) + a - 1) / a;
+      bias[a] = ((a / 2) << 16) / a;
+    }
+  }
+};
+
+} // namespace
+
+void unpremultiply_alpha(const uint8_t *src, uint8_t *dst, size_t pixels) {
+  static const UnpremultiplyTable table;
+  for (size_t i = 0; i < pixels; ++i, src += 4, dst += 4) {
+    uint32_t a = src[3];
+    if (a == 255 || a == 0) {
+      // Fully transparent pixels keep their (zero) color
+      std::memmove(dst, src, 4);
+      continue;
+    }
+    for (int ch = 0; ch < 3; ++ch) {
+      uint32_t c = (src[ch] * table.scale[a] + table.bias[a]) >> 16;
+      dst[ch] = static_cast<uint8_t>(c > 255 ? 255 : c);
+    }
+    dst[3] = static_cast<uint8_t>(a);
+  }
+}
+
+bool select_resampler_isa(const std::string &isa) {
+  if (isa != "scalar") {
+#ifdef IMGBOOST_X86
+    if (!cpu_supports(isa))
+      return false;
+#else
+    return false;
+#endif
+  }
+  active_kernels() = kernels_for(isa);
+  return true;
+}
+
+struct RowResampler::Impl {
+  int src_width, src_height, dst_width, dst_height, channels;
+  RowSink sink;
+  Coefficients hc;     // empty when the width is unchanged
+  Coefficients vc;     // empty when the height is unchanged
+  Coefficients tap;    // vc of one output row, relative to the window
+  size_t row_bytes;    // dst_width * channels
+  PixelBuffer window;  // horizontally resized source rows [base, base + count)
+  PixelBuffer scratch; // one output row, or one resized row
+  int capacity = 0;    // rows the window holds
+  int base = 0;
+  int count = 0;
+  int pushed = 0;
+  int emitted = 0;
+
+  // Emits every output row whose source rows have all arrived
+  void drain() {
+    const Kernels &kernels = active_kernels();
+    while (emitted < dst_height &&
+           vc.start[emitted] + vc.count[emitted] <= pushed) {
+      tap.start[0] = vc.start[emitted] - base;
+      tap.count[0] = vc.count[emitted];
+      std::memcpy(tap.weights.data(),
+                  &vc.weights[static_cast<size_t>(emitted) * vc.stride],
+                  static_cast<size_t>(vc.stride) * sizeof(int16_t));
+      kernels.vertical(window.data(), static_cast<int>(row_bytes),
+                       scratch.data(), static_cast<int>(row_bytes),
+                       static_cast<int>(row_bytes), tap, 0, 1);
+      sink(emitted, scratch.data());
+      emitted++;
+    }
+  }
+
+  // Drops rows no later output reads, filter starts only move forward
+  void compact() {
+    int keep_from = emitted < dst_height ? vc.start[emitted] : pushed;
+    int drop = std::min(keep_from - base, count);
+    if (drop <= 0) {
+      return;
+    }
+    count -= drop;
+    std::memmove(window.data(), window.data() + drop * row_bytes,
+                 count * row_bytes);
+    base += drop;
+  }
+};
+
+RowResampler::RowResampler(int src_width, int src_height, int dst_width,
+                           int dst_height, int channels, ResampleFilter filter,
+                           RowSink sink)
+    : impl_(new Impl()) {
+  if (channels != 1 && channels != 3 && channels != 4) {
+    throw std::invalid_argument("resample: unsupported channel count");
+  }
+  Impl &d = *impl_;
+  d.src_width = src_width;
+  d.src_height = src_height;
+  d.dst_width = dst_width;
+  d.dst_height = dst_height;
+  d.channels = channels;
+  d.sink = std::move(sink);
+  d.row_bytes = static_cast<size_t>(dst_width) * channels;
+  d.scratch.resize(d.row_bytes);
+
+  if (src_width != dst_width) {
+    d.hc = compute_coefficients(src_width, dst_width, filter);
+  }
+  if (src_height != dst_height) {
+    d.vc = compute_coefficients(src_height, dst_height, filter);
+    d.tap.stride = d.vc.stride;
+    d.tap.start.resize(1);
+    d.tap.count.resize(1);
+    d.tap.weights.resize(d.vc.stride);
+    // One filter support of live rows plus as many again, so the window is
+    // compacted once every vc.stride rows rather than on every push
+    d.capacity = d.vc.stride * 2;
+    d.window.resize(static_cast<size_t>(d.capacity) * d.row_bytes);
+  }
+}
+
+RowResampler::~RowResampler() = default;
+
+void RowResampler::push(const uint8_t *row) {
+  Impl &d = *impl_;
+  if (d.pushed >= d.src_height) {
+    return;
+  }
+  const Kernels &kernels = active_kernels();
+  int y = d.pushed++;
+
+  if (d.src_height == d.dst_height) {
+    // Rows map one to one, only the width may change
+    if (d.src_width == d.dst_width) {
+      d.sink(y, row);
+    } else {
+      kernels.horizontal(row, 0, d.scratch.data(), 0, d.dst_width, d.channels,
+                         d.hc, 0, 1);
+      d.sink(y, d.scratch.data());
+    }
+    d.emitted = d.pushed;
+    return;
+  }
+
+  if (d.count == d.capacity) {
+    d.compact();
+  }
+  uint8_t *slot = d.window.data() + d.count * d.row_bytes;
+  if (d.src_width == d.dst_width) {
+    std::memcpy(slot, row, d.row_bytes);
+  } else {
+    kernels.horizontal(row, 0, slot, 0, d.dst_width, d.channels, d.hc, 0, 1);
+  }
+  d.count++;
+  d.drain();
+}
+
+int RowResampler::rows_emitted() const { return impl_->emitted; }
+int RowResampler::src_width() const { return impl_->src_width; }
+int RowResampler::src_height() const { return impl_->src_height; }
+int RowResampler::channels() const { return impl_->channels; }
+
+void resample(const uint8_t *src, int src_width, int src_height,
+              int src_stride, uint8_t *dst, int dst_width, int dst_height,
+              int dst_stride, int channels, ResampleFilter filter,
+              const ParallelFor &parallel) {
+  if (channels != 1 && channels != 3 && channels != 4) {
+    throw std::invalid_argument("resample: unsupported channel count");
+  }
+  const Kernels &kernels = active_kernels();
+
+  if (src_width == dst_width && src_height == dst_height) {
+    for (int y = 0; y < dst_height; ++y) {
+      std::memcpy(dst + static_cast<size_t>(y) * dst_stride,
+                  src + static_cast<size_t>(y) * src_stride,
+                  static_cast<size_t>(dst_width) * channels);
+    }
+    return;
+  }
+
+  // Horizontal pass (skipped when only the height changes)
+  PixelBuffer temp;
+  const uint8_t *vsrc = src;
+  int vsrc_stride = src_stride;
+  if (src_width != dst_width) {
+    Coefficients hc = compute_coefficients(src_width, dst_width, filter);
+    int temp_stride = dst_width * channels;
+    uint8_t *hdst = dst;
+    if (src_height != dst_height) {
+      temp.resize(static_cast<size_t>(temp_stride) * src_height);
+      hdst = temp.data();
+    } else {
+      temp_stride = dst_stride;
+    }
+    for_each_stripe(parallel, src_height, dst_width, [&](int begin, int end) {
+      kernels.horizontal(src, src_stride, hdst, temp_stride, dst_width,
+                         channels, hc, begin, end);
+    });
+    if (src_height == dst_height)
+      return;
+    vsrc = temp.data();
+    vsrc_stride = temp_stride;
+  }
+
+  // Vertical pass
+  Coefficients vc = compute_coefficients(src_height, dst_height, filter);
+  for_each_stripe(parallel, dst_height, dst_width, [&](int begin, int end) {
+    kernels.vertical(vsrc, vsrc_stride, dst, dst_stride, dst_width * channels,
+                     vc, begin, end);
+  });
+}
+
+} // namespace imgboost
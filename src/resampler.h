@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace imgboost {
+
+enum class ResampleFilter { BOX, BILINEAR, BICUBIC, LANCZOS3 };
+
+// "box", "bilinear", "bicubic" or "lanczos3"
+bool parse_resample_filter(const std::string &name, ResampleFilter &filter);
+const char *resample_filter_name(ResampleFilter filter);
+
+// Runs fn(0) .. fn(count - 1), possibly concurrently, and returns once all
+// calls are done (see ThreadPool::parallel_for)
+using ParallelFor =
+    std::function<void(size_t count, const std::function<void(size_t)> &fn)>;
+
+// Separable two-pass resampler for interleaved 8-bit images (1, 3 or 4
+// channels): a horizontal pass into a dst_width x src_height intermediate,
+// then a vertical pass. Filter weights are computed once per output column
+// and row as 14-bit fixed point, and the support is widened on downscale so
+// every source pixel contributes (area averaging). With a parallel runner
+// large passes are split into row stripes.
+void resample(const uint8_t *src, int src_width, int src_height,
+              int src_stride, uint8_t *dst, int dst_width, int dst_height,
+              int dst_stride, int channels, ResampleFilter filter,
+              const ParallelFor &parallel = nullptr);
+
+// Streaming form of resample() for images produced row by row, e.g. by a
+// scanline decoder. Each pushed source row is resized horizontally into a
+// small window of rows, and every output row is emitted as soon as all the
+// source rows under its vertical filter support have arrived. Memory is a
+// few rows regardless of the image height; the output is identical to
+// resample() with the same arguments.
+class RowResampler {
+public:
+  // Receives output rows in order, y from 0 to dst_height - 1. The row is
+  // only valid during the call.
+  using RowSink = std::function<void(int y, const uint8_t *row)>;
+
+  RowResampler(int src_width, int src_height, int dst_width, int dst_height,
+               int channels, ResampleFilter filter, RowSink sink);
+  ~RowResampler();
+
+  // Disable copy
+  RowResampler(const RowResampler &) = delete;
+  RowResampler &operator=(const RowResampler &) = delete;
+
+  // Source rows in order, top to bottom; rows past src_height are ignored.
+  // Allocates nothing, so it is safe to call from a decoder callback.
+  void push(const uint8_t *row);
+
+  // Output rows emitted so far, dst_height once every source row was pushed
+  int rows_emitted() const;
+
+  int src_width() const;
+  int src_height() const;
+  int channels() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// Alpha handling for interleaved RGBA. Resizing straight alpha lets the
+// color of transparent pixels bleed into their neighbours (dark fringes
+// around cut-outs); resizing premultiplied pixels and converting back
+// weights every color by its coverage.
+
+// Whether every alpha byte is 255, scanned with the active kernel set
+bool rgba_opaque(const uint8_t *rgba, size_t pixels);
+
+// Drops the alpha bytes in place, leaving 3 * count bytes of RGB
+void rgba_to_rgb(uint8_t *pixels, size_t count);
+
+void premultiply_alpha(uint8_t *rgba, size_t pixels);
+
+// src and dst may be the same buffer
+void unpremultiply_alpha(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+// Kernel set chosen by runtime CPU detection: "avx2", "sse4.1" or "scalar"
+const char *resampler_isa();
+
+// Force a kernel set, e.g. for benchmarks. Returns false if the CPU (or
+// build) does not support it.
+bool select_resampler_isa(const std::string &isa);
+
+} // namespace imgboost
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "image_processor.h"
+#include "shared_buffer.h"
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace imgboost {
+
+struct CacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t insertions = 0;
+  uint64_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+  size_t capacity = 0;
+};
+
+// Cache key for one transform of one source image
+inline std::string make_result_key(const std::string &image_url,
+                                   const ImageOptions &options) {
+  // Options never contain spaces, so the separator is unambiguous
+  return options.to_key() + " " + image_url;
+}
+
+// Sharded, byte-bounded cache of encoded outputs.
+//
+// Each shard is a segmented LRU: new entries land in a probation segment and
+// are only promoted to the protected segment on a second hit. A burst of
+// one-off requests therefore churns probation and leaves the hot set alone.
+class ResultCache {
+public:
+  explicit ResultCache(size_t max_bytes, size_t num_shards = 16)
+      : shards_(num_shards == 0 ? 1 : num_shards) {
+    size_t per_shard = max_bytes / shards_.size();
+    for (Shard &shard : shards_) {
+      shard.capacity = per_shard;
+      shard.protected_capacity = per_shard / 5 * 4;
+    }
+  }
+
+  // Disable copy
+  ResultCache(const ResultCache &) = delete;
+  ResultCache &operator=(const ResultCache &) = delete;
+
+  bool get(const std::string &key, SharedBuffer &value) {
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      shard.misses++;
+      return false;
+    }
+
+    auto entry = it->second;
+    if (entry->is_protected) {
+      shard.protected_list.splice(shard.protected_list.begin(),
+                                  shard.protected_list, entry);
+    } else {
+      // Second hit, promote out of probation
+      shard.protected_list.splice(shard.protected_list.begin(),
+                                  shard.probation_list, entry);
+      entry->is_protected = true;
+      shard.protected_bytes += entry->charge;
+      demote_overflow(shard);
+    }
+
+    shard.hits++;
+    value = entry->value;
+    return true;
+  }
+
+  void put(const std::string &key, SharedBuffer value) {
+    size_t charge = entry_charge(key, value);
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    // Entries that would flush a whole shard are not worth keeping
+    if (charge > shard.capacity) {
+      return;
+    }
+
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      remove_entry(shard, it->second);
+    }
+
+    shard.probation_list.push_front(Entry{key, std::move(value), charge, false});
+    shard.index[key] = shard.probation_list.begin();
+    shard.bytes += charge;
+    shard.insertions++;
+
+    while (shard.bytes > shard.capacity) {
+      evict_one(shard);
+    }
+  }
+
+  CacheStats stats() const {
+    CacheStats total;
+    for (const Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      total.hits += shard.hits;
+      total.misses += shard.misses;
+      total.insertions += shard.insertions;
+      total.evictions += shard.evictions;
+      total.entries += shard.index.size();
+      total.bytes += shard.bytes;
+      total.capacity += shard.capacity;
+    }
+    return total;
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    SharedBuffer value;
+    size_t charge;
+    bool is_protected;
+  };
+
+  using EntryList = std::list<Entry>;
+
+  struct Shard {
+    mutable std::mutex mutex;
+    EntryList probation_list;
+    EntryList protected_list;
+    std::unordered_map<std::string, EntryList::iterator> index;
+    size_t capacity = 0;
+    size_t protected_capacity = 0;
+    size_t bytes = 0;
+    size_t protected_bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    uint64_t evictions = 0;
+  };
+
+  // Approximate per-entry bookkeeping overhead (list node, index slot)
+  static constexpr size_t kEntryOverhead = 128;
+
+  static size_t entry_charge(const std::string &key,
+                             const SharedBuffer &value) {
+    return value.size() + key.size() * 2 + kEntryOverhead;
+  }
+
+  Shard &shard_for(const std::string &key) {
+    // Mix the hash so shard selection does not correlate with the bucket
+    // index used by the shard's own unordered_map
+    uint64_t h = std::hash<std::string>{}(key) * 0x9E3779B97F4A7C15ULL;
+    return shards_[(h >> 32) % shards_.size()];
+  }
+
+  // Move least recently used protected entries back to probation
+  void demote_overflow(Shard &shard) {
+    while (shard.protected_bytes > shard.protected_capacity &&
+           !shard.protected_list.empty()) {
+      auto victim = std::prev(shard.protected_list.end());
+      victim->is_protected = false;
+      shard.protected_bytes -= victim->charge;
+      shard.probation_list.splice(shard.probation_list.begin(),
+                                  shard.protected_list, victim);
+    }
+  }
+
+  void evict_one(Shard &shard) {
+    EntryList &list = shard.probation_list.empty() ? shard.protected_list
+                                                   : shard.probation_list;
+    remove_entry(shard, std::prev(list.end()));
+    shard.evictions++;
+  }
+
+  void remove_entry(Shard &shard, EntryList::iterator entry) {
+    shard.bytes -= entry->charge;
+    shard.index.erase(entry->key);
+    if (entry->is_protected) {
+      shard.protected_bytes -= entry->charge;
+      shard.protected_list.erase(entry);
+    } else {
+      shard.probation_list.erase(entry);
+    }
+  }
+
+  std::vector<Shard> shards_;
+};
+
+} // namespace imgboost
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace imgboost {
+
+// Immutable, reference counted byte range. Copies share the same storage, so
+// one encoded image can be handed to many responses without duplicating it.
+class SharedBuffer {
+public:
+  SharedBuffer() = default;
+  SharedBuffer(std::shared_ptr<const void> owner, const uint8_t *data,
+               size_t size)
+      : owner_(std::move(owner)), data_(data), size_(size) {}
+
+  static SharedBuffer from_vector(std::vector<uint8_t> &&bytes) {
+    auto owner = std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+    return SharedBuffer(owner, owner->data(), owner->size());
+  }
+
+  // Takes over e.g. an HTTP response body without copying it
+  static SharedBuffer from_string(std::string &&bytes) {
+    auto owner = std::make_shared<const std::string>(std::move(bytes));
+    return SharedBuffer(owner,
+                        reinterpret_cast<const uint8_t *>(owner->data()),
+                        owner->size());
+  }
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  std::shared_ptr<const void> owner_;
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace imgboost
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "cancel_token.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace imgboost {
+
+// Coalesces concurrent work on the same key. The first caller of join()
+// becomes the leader and runs the work; later callers only register their
+// callback. complete() hands the one result to every waiter, so results
+// should be cheap to copy (refcounted buffers, not byte vectors). Each
+// flight has a shared cancel token with every waiter's token as a member,
+// so the work stops only when no waiter wants it. A flight whose token is
+// already cancelled takes no new waiters: the next caller leads a fresh
+// flight, and the stale one still completes to its own waiters.
+template <typename Result> class SingleFlight {
+public:
+  using Callback = std::function<void(Result)>;
+
+  SingleFlight() = default;
+
+  // Disable copy
+  SingleFlight(const SingleFlight &) = delete;
+  SingleFlight &operator=(const SingleFlight &) = delete;
+
+  // Returns the flight's token if the caller is the leader and must start
+  // the work, null otherwise. The leader hands the token to the work and
+  // passes it back to complete(). A null cancel never gives up on the
+  // flight.
+  CancelTokenPtr join(const std::string &key, Callback callback,
+                      CancelTokenPtr cancel = nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = calls_.find(key);
+    if (it != calls_.end()) {
+      if (!it->second.cancel->cancelled()) {
+        it->second.waiters.push_back(std::move(callback));
+        it->second.cancel->add_member(std::move(cancel));
+        coalesced_++;
+        return nullptr;
+      }
+      // Its work is stopping; it completes from retired_ instead
+      retired_.emplace(key, std::move(it->second));
+      calls_.erase(it);
+    }
+    Call &call = calls_[key];
+    call.waiters.push_back(std::move(callback));
+    call.cancel = CancelToken::shared();
+    call.cancel->add_member(std::move(cancel));
+    return call.cancel;
+  }
+
+  // Deliver the result (success or error) to every waiter of the flight
+  // whose token is flight
+  void complete(const std::string &key, const CancelTokenPtr &flight,
+                const Result &result) {
+    std::vector<Callback> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = calls_.find(key);
+      if (it != calls_.end() && it->second.cancel == flight) {
+        waiters = std::move(it->second.waiters);
+        calls_.erase(it);
+      } else {
+        auto range = retired_.equal_range(key);
+        auto stale = std::find_if(
+            range.first, range.second,
+            [&flight](const auto &entry) {
+              return entry.second.cancel == flight;
+            });
+        if (stale == range.second)
+          return;
+        waiters = std::move(stale->second.waiters);
+        retired_.erase(stale);
+      }
+    }
+
+    // Outside the lock, a waiter may start new work on the same key
+    for (Callback &waiter : waiters) {
+      try {
+        waiter(result);
+      } catch (const std::exception &e) {
+        IMGBOOST_LOG(ERR, "SingleFlight", "Waiter callback threw")
+            .field("error", e.what());
+      }
+    }
+  }
+
+  size_t in_flight() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return calls_.size() + retired_.size();
+  }
+
+  // Number of callers that joined an existing call instead of leading one
+  uint64_t coalesced() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return coalesced_;
+  }
+
+private:
+  struct Call {
+    std::vector<Callback> waiters;
+    CancelTokenPtr cancel;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Call> calls_;
+  // Cancelled flights replaced by a fresh one, until their work completes
+  std::unordered_multimap<std::string, Call> retired_;
+  uint64_t coalesced_ = 0;
+};
+
+} // namespace imgboost
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "result_cache.h"
+#include "shared_buffer.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace imgboost {
+
+// Freshness information parsed from an origin response
+struct SourceFreshness {
+  bool cacheable = true;   // false on Cache-Control: no-store or private
+  bool has_max_age = false;
+  int64_t max_age = 0;     // seconds, already reduced by Age
+};
+
+// Parse Cache-Control and Age response headers. s-maxage wins over max-age
+// because this is a shared cache, whatever their order; no-cache means store
+// but always revalidate, and overrides both. no-store and private responses
+// are not stored. The field-name forms (no-cache="Set-Cookie",
+// private="...") only restrict the named headers, which are never cached.
+inline SourceFreshness parse_freshness(const std::string &cache_control,
+                                       const std::string &age) {
+  SourceFreshness freshness;
+  std::string cc = cache_control;
+  std::transform(cc.begin(), cc.end(), cc.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  bool no_cache = false;
+  bool has_s_maxage = false;
+  int64_t s_maxage = 0;
+  bool has_max_age = false;
+  int64_t max_age = 0;
+  size_t pos = 0;
+  while (pos < cc.size()) {
+    size_t end = cc.find(',', pos);
+    if (end == std::string::npos)
+      end = cc.size();
+    std::string directive = cc.substr(pos, end - pos);
+    pos = end + 1;
+
+    directive.erase(0, directive.find_first_not_of(" \t"));
+    directive.erase(directive.find_last_not_of(" \t") + 1);
+
+    if (directive == "no-store" || directive == "private") {
+      freshness.cacheable = false;
+    } else if (directive == "no-cache") {
+      no_cache = true;
+    } else if (directive.compare(0, 9, "s-maxage=") == 0) {
+      has_s_maxage = true;
+      s_maxage = std::atoll(directive.c_str() + 9);
+    } else if (directive.compare(0, 8, "max-age=") == 0) {
+      has_max_age = true;
+      max_age = std::atoll(directive.c_str() + 8);
+    }
+  }
+
+  if (no_cache) {
+    freshness.has_max_age = true;
+    freshness.max_age = 0;
+  } else if (has_s_maxage) {
+    freshness.has_max_age = true;
+    freshness.max_age = s_maxage;
+  } else if (has_max_age) {
+    freshness.has_max_age = true;
+    freshness.max_age = max_age;
+  }
+
+  if (freshness.has_max_age && !age.empty()) {
+    freshness.max_age -= std::atoll(age.c_str());
+  }
+  if (freshness.max_age < 0) {
+    freshness.max_age = 0;
+  }
+  return freshness;
+}
+
+struct SourceEntry {
+  SharedBuffer data;
+  std::string etag;
+  std::string last_modified;
+  std::chrono::steady_clock::time_point fresh_until;
+
+  bool is_fresh() const {
+    return std::chrono::steady_clock::now() < fresh_until;
+  }
+  bool can_revalidate() const {
+    return !etag.empty() || !last_modified.empty();
+  }
+};
+
+// Byte-bounded LRU of downloaded originals keyed by URL, kept apart from the
+// output caches so every size of one image reuses a single download.
+class SourceCache {
+public:
+  SourceCache(size_t max_bytes, int64_t default_ttl_seconds)
+      : max_bytes_(max_bytes), default_ttl_(default_ttl_seconds) {}
+
+  // Disable copy
+  SourceCache(const SourceCache &) = delete;
+  SourceCache &operator=(const SourceCache &) = delete;
+
+  // Returns the entry even when stale, the caller decides to revalidate
+  bool get(const std::string &url, SourceEntry &entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(url);
+    if (it == index_.end()) {
+      misses_++;
+      return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    entry = it->second->entry;
+    // Stale entries count as misses even when a 304 saves the body
+    if (entry.is_fresh()) {
+      hits_++;
+    } else {
+      misses_++;
+    }
+    return true;
+  }
+
+  // Only a fresh entry's body, counted as a hit; a stale or missing entry
+  // counts nothing, the get() that follows does
+  bool get_fresh(const std::string &url, SharedBuffer &data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(url);
+    if (it == index_.end() || !it->second->entry.is_fresh()) {
+      return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    data = it->second->entry.data;
+    hits_++;
+    return true;
+  }
+
+  void put(const std::string &url, SourceEntry entry,
+           const SourceFreshness &freshness) {
+    if (!freshness.cacheable)
+      return;
+    entry.fresh_until = expiry(freshness);
+    // Never fresh and nothing to revalidate with: it could only be refetched
+    if (!entry.is_fresh() && !entry.can_revalidate())
+      return;
+
+    size_t charge = entry.data.size() + url.size() + entry.etag.size() +
+                    entry.last_modified.size();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (charge > max_bytes_)
+      return;
+
+    auto it = index_.find(url);
+    if (it != index_.end()) {
+      remove(it->second);
+    }
+    lru_.push_front({url, std::move(entry), charge});
+    index_[url] = lru_.begin();
+    bytes_ += charge;
+    insertions_++;
+
+    while (bytes_ > max_bytes_) {
+      remove(std::prev(lru_.end()));
+      evictions_++;
+    }
+  }
+
+  // Extend a stale entry after the origin answered 304 Not Modified
+  void refresh(const std::string &url, const SourceFreshness &freshness) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    revalidations_++;
+    auto it = index_.find(url);
+    if (it == index_.end())
+      return;
+    if (!freshness.cacheable) {
+      remove(it->second);
+      return;
+    }
+    it->second->entry.fresh_until = expiry(freshness);
+  }
+
+  CacheStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CacheStats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.insertions = insertions_;
+    stats.evictions = evictions_;
+    stats.entries = index_.size();
+    stats.bytes = bytes_;
+    stats.capacity = max_bytes_;
+    return stats;
+  }
+
+  // Stale entries confirmed by a 304 instead of a full download
+  uint64_t revalidations() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return revalidations_;
+  }
+
+private:
+  struct Node {
+    std::string url;
+    SourceEntry entry;
+    size_t charge;
+  };
+
+  using NodeList = std::list<Node>;
+
+  std::chrono::steady_clock::time_point
+  expiry(const SourceFreshness &freshness) const {
+    int64_t ttl = freshness.has_max_age ? freshness.max_age : default_ttl_;
+    return std::chrono::steady_clock::now() + std::chrono::seconds(ttl);
+  }
+
+  void remove(NodeList::iterator node) {
+    bytes_ -= node->charge;
+    index_.erase(node->url);
+    lru_.erase(node);
+  }
+
+  size_t max_bytes_;
+  int64_t default_ttl_;
+
+  mutable std::mutex mutex_;
+  NodeList lru_; // front == most recently used
+  std::unordered_map<std::string, NodeList::iterator> index_;
+  size_t bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t insertions_ = 0;
+  uint64_t evictions_ = 0;
+  uint64_t revalidations_ = 0;
+};
+
+} // namespace imgboost
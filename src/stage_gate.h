@@ -0,0 +1,156 @@
+#pragma once
+
+#include "logger.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace imgboost {
+
+struct StageLimits {
+  size_t max_concurrency = 0;  // tasks running at once, 0 == thread count
+  size_t max_queued_bytes = 0; // estimated bytes waiting, 0 == unbounded
+};
+
+struct StageStats {
+  uint64_t running = 0;
+  uint64_t queued = 0;
+  uint64_t queued_bytes = 0;
+  uint64_t rejected = 0; // submissions refused because the queue was full
+  double estimated_wait = 0; // seconds a new task would wait for a slot
+};
+
+// Front of one pipeline stage. At most max_concurrency of its tasks run on
+// the pool at a time; the rest wait here in FIFO order, bounded by their
+// estimated size in bytes rather than their number, so a backlog of large
+// sources cannot grow memory without limit. The time tasks take per byte is
+// tracked to estimate how long the current backlog needs to drain.
+//
+// The gate must outlive the pool: tasks still queued in the pool at
+// shutdown call back into it. Its owner declares it first and resolves a
+// zero max_concurrency, since the pool is not constructed yet.
+class StageGate {
+public:
+  StageGate(ThreadPool &pool, const StageLimits &limits)
+      : pool_(pool), limits_(limits) {
+    limits_.max_concurrency = std::max<size_t>(limits_.max_concurrency, 1);
+  }
+
+  // Disable copy
+  StageGate(const StageGate &) = delete;
+  StageGate &operator=(const StageGate &) = delete;
+
+  // Runs task on the pool now or once a slot frees up. Returns false, without
+  // running it, when its bytes do not fit in the queue.
+  bool submit(size_t cost_bytes, Task task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (running_ >= limits_.max_concurrency) {
+        // An oversized task is still accepted into an empty queue
+        if (limits_.max_queued_bytes > 0 && !queue_.empty() &&
+            queued_bytes_ + cost_bytes > limits_.max_queued_bytes) {
+          rejected_++;
+          return false;
+        }
+        queued_bytes_ += cost_bytes;
+        queue_.push_back({cost_bytes, std::move(task)});
+        return true;
+      }
+      running_++;
+    }
+    dispatch({cost_bytes, std::move(task)});
+    return true;
+  }
+
+  // Seconds a task submitted now would wait before it starts
+  double estimated_wait() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return wait_locked();
+  }
+
+  // Queued tasks per concurrency slot, 0 while a slot is free
+  double backlog() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<double>(queue_.size()) /
+           static_cast<double>(limits_.max_concurrency);
+  }
+
+  StageStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    StageStats stats;
+    stats.running = running_;
+    stats.queued = queue_.size();
+    stats.queued_bytes = queued_bytes_;
+    stats.rejected = rejected_;
+    stats.estimated_wait = wait_locked();
+    return stats;
+  }
+
+private:
+  struct Item {
+    size_t cost;
+    Task task;
+  };
+
+  // Smoothing of the per-byte service time, weight of the newest sample
+  static constexpr double kAlpha = 0.1;
+
+  double wait_locked() const {
+    if (running_ < limits_.max_concurrency) {
+      return 0;
+    }
+    return static_cast<double>(queued_bytes_) * seconds_per_byte_ /
+           static_cast<double>(limits_.max_concurrency);
+  }
+
+  void dispatch(Item item) {
+    pool_.execute([this, item = std::move(item)]() mutable {
+      auto start = std::chrono::steady_clock::now();
+      try {
+        item.task();
+      } catch (const std::exception &e) {
+        IMGBOOST_LOG(ERR, "StageGate", "Task threw")
+            .field("error", e.what());
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      finish(item.cost, elapsed.count());
+    });
+  }
+
+  // Frees the slot, or hands it straight to the oldest queued task
+  void finish(size_t cost, double seconds) {
+    Item next;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      double sample = seconds / static_cast<double>(std::max<size_t>(cost, 1));
+      seconds_per_byte_ = seconds_per_byte_ == 0
+                              ? sample
+                              : seconds_per_byte_ * (1 - kAlpha) +
+                                    sample * kAlpha;
+      if (queue_.empty()) {
+        running_--;
+        return;
+      }
+      next = std::move(queue_.front());
+      queue_.pop_front();
+      queued_bytes_ -= next.cost;
+    }
+    dispatch(std::move(next));
+  }
+
+  ThreadPool &pool_;
+  StageLimits limits_;
+  mutable std::mutex mutex_;
+  std::deque<Item> queue_;
+  size_t running_ = 0;
+  size_t queued_bytes_ = 0;
+  uint64_t rejected_ = 0;
+  double seconds_per_byte_ = 0;
+};
+
+} // namespace imgboost
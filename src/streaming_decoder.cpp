@@ -0,0 +1,447 @@
+#include "streaming_decoder.h"
+#include <algorithm>
+#include <csetjmp>
+#include <jpeglib.h>
+#include <jerror.h>
+#include <png.h>
+#include <webp/decode.h>
+
+namespace imgboost {
+
+// A WebP header that is still not parseable after this much data is corrupt
+static const size_t kWebpMaxHeaderBytes = 64 * 1024;
+
+struct stream_jpeg_error_mgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+static void stream_jpeg_error_exit(j_common_ptr cinfo) {
+  stream_jpeg_error_mgr *err = (stream_jpeg_error_mgr *)cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+// Suspending source: running out of data makes libjpeg return to the
+// caller, which resumes from the same offset once more bytes arrived
+struct stream_jpeg_source_mgr {
+  struct jpeg_source_mgr pub;
+  size_t skip;  // bytes skip_input_data asked for beyond the buffer
+  bool eof;     // no more data will arrive
+};
+
+static const JOCTET kFakeEoi[2] = {0xFF, JPEG_EOI};
+
+static void stream_init_source(j_decompress_ptr) {}
+
+static boolean stream_fill_input_buffer(j_decompress_ptr cinfo) {
+  stream_jpeg_source_mgr *src = (stream_jpeg_source_mgr *)cinfo->src;
+  if (!src->eof) {
+    return FALSE;
+  }
+  // Truncated file: end it the way jpeg_mem_src does
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  src->pub.next_input_byte = kFakeEoi;
+  src->pub.bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void stream_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+  stream_jpeg_source_mgr *src = (stream_jpeg_source_mgr *)cinfo->src;
+  if (num_bytes <= 0) {
+    return;
+  }
+  size_t count = static_cast<size_t>(num_bytes);
+  if (count <= src->pub.bytes_in_buffer) {
+    src->pub.next_input_byte += count;
+    src->pub.bytes_in_buffer -= count;
+    return;
+  }
+  // Skipping cannot suspend, the rest is dropped from the next update
+  src->skip += count - src->pub.bytes_in_buffer;
+  src->pub.next_input_byte += src->pub.bytes_in_buffer;
+  src->pub.bytes_in_buffer = 0;
+}
+
+static void stream_term_source(j_decompress_ptr) {}
+
+struct StreamingDecoder::Jpeg {
+  enum class Phase { HEADER, START, SCANLINES, FINISH };
+
+  struct jpeg_decompress_struct cinfo;
+  stream_jpeg_error_mgr jerr;
+  stream_jpeg_source_mgr src;
+  Phase phase = Phase::HEADER;
+  size_t consumed = 0; // offset of the first byte libjpeg has not read
+
+  Jpeg() {
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = stream_jpeg_error_exit;
+    jpeg_create_decompress(&cinfo);
+
+    src.pub.init_source = stream_init_source;
+    src.pub.fill_input_buffer = stream_fill_input_buffer;
+    src.pub.skip_input_data = stream_skip_input_data;
+    src.pub.resync_to_restart = jpeg_resync_to_restart;
+    src.pub.term_source = stream_term_source;
+    src.pub.next_input_byte = nullptr;
+    src.pub.bytes_in_buffer = 0;
+    src.skip = 0;
+    src.eof = false;
+    cinfo.src = &src.pub;
+  }
+
+  ~Jpeg() { jpeg_destroy_decompress(&cinfo); }
+
+  // Points libjpeg at the unread part of the current buffer
+  void resume(const uint8_t *data, size_t size, bool eof) {
+    size_t skipped = std::min(src.skip, size - consumed);
+    consumed += skipped;
+    src.skip -= skipped;
+    src.pub.next_input_byte = data + consumed;
+    src.pub.bytes_in_buffer = size - consumed;
+    src.eof = eof;
+  }
+
+  // Remembers how far libjpeg got before it ran out of data
+  void suspend(const uint8_t *data) {
+    consumed = src.pub.next_input_byte - data;
+  }
+};
+
+struct StreamingDecoder::Png {
+  png_structp png_ptr = nullptr;
+  png_infop info_ptr = nullptr;
+  size_t fed = 0; // bytes already handed to libpng, which buffers partials
+
+  ~Png() {
+    if (png_ptr) {
+      png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : nullptr,
+                              nullptr);
+    }
+  }
+
+  // The callbacks run inside png_process_data: errors leave through
+  // png_error, never by throwing across libpng, and the decoder is only
+  // failed once it has returned
+  static void on_info(png_structp png_ptr, png_infop info_ptr) {
+    StreamingDecoder *decoder =
+        static_cast<StreamingDecoder *>(png_get_progressive_ptr(png_ptr));
+    ImageHeader header;
+    header.format = ImageFormat::PNG;
+    header.width = png_get_image_width(png_ptr, info_ptr);
+    header.height = png_get_image_height(png_ptr, info_ptr);
+    header.alpha =
+        (png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_ALPHA) != 0 ||
+        png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS) != 0;
+    bool accepted;
+    try {
+      accepted = decoder->accept_header(header);
+    } catch (const std::exception &) {
+      accepted = false;
+    }
+    if (!accepted) {
+      png_error(png_ptr, "Streaming decode abandoned");
+    }
+
+    // Same conversion to RGB or RGBA as ImageProcessor::decode
+    png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    if (bit_depth == 16)
+      png_set_strip_16(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+      png_set_expand_gray_1_2_4_to_8(png_ptr);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+      png_set_gray_to_rgb(png_ptr);
+    // Interlaced rows arrive once per pass and are combined in place
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    DecodedImage &image = decoder->image_;
+    image.width = image.source_width = header.width;
+    image.height = image.source_height = header.height;
+    image.channels = header.alpha ? 4 : 3;
+    bool allocated = true;
+    try {
+      image.pixels.resize(static_cast<size_t>(header.width) * header.height *
+                          image.channels);
+    } catch (const std::exception &) {
+      allocated = false;
+    }
+    if (!allocated) {
+      png_error(png_ptr, "Out of memory");
+    }
+  }
+
+  static void on_row(png_structp png_ptr, png_bytep new_row,
+                     png_uint_32 row_num, int) {
+    StreamingDecoder *decoder =
+        static_cast<StreamingDecoder *>(png_get_progressive_ptr(png_ptr));
+    DecodedImage &image = decoder->image_;
+    if (!new_row || row_num >= static_cast<png_uint_32>(image.height)) {
+      return;
+    }
+    size_t stride = static_cast<size_t>(image.width) * image.channels;
+    png_progressive_combine_row(png_ptr, image.pixels.data() + row_num * stride,
+                                new_row);
+  }
+
+  static void on_end(png_structp png_ptr, png_infop) {
+    StreamingDecoder *decoder =
+        static_cast<StreamingDecoder *>(png_get_progressive_ptr(png_ptr));
+    decoder->state_ = State::DONE;
+  }
+};
+
+struct StreamingDecoder::Webp {
+  WebPIDecoder *idec = nullptr;
+
+  ~Webp() {
+    if (idec) {
+      WebPIDelete(idec);
+    }
+  }
+};
+
+StreamingDecoder::StreamingDecoder(int req_width, int req_height,
+                                   HeaderCallback on_header)
+    : req_width_(req_width), req_height_(req_height),
+      on_header_(std::move(on_header)) {}
+
+StreamingDecoder::~StreamingDecoder() = default;
+
+void StreamingDecoder::update(const uint8_t *data, size_t size) {
+  if (state_ == State::DETECT) {
+    format_ = ImageProcessor().detect_format(data, size);
+    if (format_ == ImageFormat::UNKNOWN) {
+      // Not enough bytes yet, or not an image at all
+      if (size >= 12) {
+        fail();
+      }
+      return;
+    }
+    switch (format_) {
+    case ImageFormat::JPEG:
+      jpeg_ = std::make_unique<Jpeg>();
+      break;
+    case ImageFormat::PNG:
+      png_ = std::make_unique<Png>();
+      break;
+    default:
+      webp_ = std::make_unique<Webp>();
+      break;
+    }
+    state_ = State::DECODING;
+  }
+  if (state_ != State::DECODING) {
+    return;
+  }
+
+  switch (format_) {
+  case ImageFormat::JPEG:
+    update_jpeg(data, size, false);
+    break;
+  case ImageFormat::PNG:
+    update_png(data, size);
+    break;
+  default:
+    update_webp(data, size);
+    break;
+  }
+}
+
+bool StreamingDecoder::finish(const uint8_t *data, size_t size,
+                              DecodedImage &image) {
+  if (state_ == State::DECODING && format_ == ImageFormat::JPEG) {
+    // Let libjpeg see the end of the data, so a truncated file completes
+    // the same way the buffered decoder handles it
+    update_jpeg(data, size, true);
+  } else {
+    update(data, size);
+  }
+  if (state_ != State::DONE) {
+    fail();
+    return false;
+  }
+  strip_opaque_alpha(image_);
+  image = std::move(image_);
+  return true;
+}
+
+bool StreamingDecoder::accept_header(const ImageHeader &header) {
+  return header.width > 0 && header.height > 0 &&
+         (!on_header_ || on_header_(header));
+}
+
+void StreamingDecoder::fail() {
+  state_ = State::FAILED;
+  image_ = DecodedImage();
+  jpeg_.reset();
+  png_.reset();
+  webp_.reset();
+}
+
+void StreamingDecoder::update_jpeg(const uint8_t *data, size_t size,
+                                   bool eof) {
+  Jpeg &jpeg = *jpeg_;
+  jpeg.resume(data, size, eof);
+
+  if (setjmp(jpeg.jerr.setjmp_buffer)) {
+    fail();
+    return;
+  }
+
+  jpeg_decompress_struct &cinfo = jpeg.cinfo;
+  if (jpeg.phase == Jpeg::Phase::HEADER) {
+    if (jpeg_read_header(&cinfo, TRUE) == JPEG_SUSPENDED) {
+      jpeg.suspend(data);
+      return;
+    }
+    ImageHeader header;
+    header.format = ImageFormat::JPEG;
+    header.width = cinfo.image_width;
+    header.height = cinfo.image_height;
+    header.ycbcr = cinfo.jpeg_color_space == JCS_YCbCr ||
+                   cinfo.jpeg_color_space == JCS_GRAYSCALE;
+    if (!accept_header(header)) {
+      fail();
+      return;
+    }
+    image_.source_width = header.width;
+    image_.source_height = header.height;
+
+    // Same DCT scaling as ImageProcessor::decode
+    int num = ImageProcessor().jpeg_scale(header.width, header.height,
+                                          req_width_, req_height_);
+    if (num < 8) {
+      cinfo.scale_num = num;
+      cinfo.scale_denom = 8;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg.phase = Jpeg::Phase::START;
+  }
+
+  if (jpeg.phase == Jpeg::Phase::START) {
+    // Progressive files consume every scan here before returning TRUE
+    if (!jpeg_start_decompress(&cinfo)) {
+      jpeg.suspend(data);
+      return;
+    }
+    image_.width = cinfo.output_width;
+    image_.height = cinfo.output_height;
+    image_.channels = 3;
+    image_.pixels.resize(static_cast<size_t>(image_.width) * image_.height * 3);
+    jpeg.phase = Jpeg::Phase::SCANLINES;
+  }
+
+  if (jpeg.phase == Jpeg::Phase::SCANLINES) {
+    size_t stride = static_cast<size_t>(image_.width) * 3;
+    const int batch = 16;
+    JSAMPROW rows[batch];
+    while (cinfo.output_scanline < cinfo.output_height) {
+      JDIMENSION first = cinfo.output_scanline;
+      int count = std::min<int>(batch, cinfo.output_height - first);
+      for (int i = 0; i < count; ++i) {
+        rows[i] = image_.pixels.data() + (first + i) * stride;
+      }
+      if (jpeg_read_scanlines(&cinfo, rows, count) == 0) {
+        jpeg.suspend(data);
+        return;
+      }
+    }
+    jpeg.phase = Jpeg::Phase::FINISH;
+  }
+
+  if (!jpeg_finish_decompress(&cinfo)) {
+    jpeg.suspend(data);
+    return;
+  }
+  state_ = State::DONE;
+  jpeg_.reset();
+}
+
+void StreamingDecoder::update_png(const uint8_t *data, size_t size) {
+  Png &png = *png_;
+  if (!png.png_ptr) {
+    png.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr,
+                                         nullptr, nullptr);
+    if (png.png_ptr) {
+      png.info_ptr = png_create_info_struct(png.png_ptr);
+    }
+    if (!png.info_ptr) {
+      fail();
+      return;
+    }
+    png_set_progressive_read_fn(png.png_ptr, this, Png::on_info, Png::on_row,
+                                Png::on_end);
+  }
+
+  if (setjmp(png_jmpbuf(png.png_ptr))) {
+    fail();
+    return;
+  }
+
+  // libpng keeps what it cannot use yet, so only new bytes are passed
+  if (size > png.fed) {
+    size_t offset = png.fed;
+    png.fed = size;
+    png_process_data(png.png_ptr, png.info_ptr,
+                     const_cast<png_bytep>(data + offset), size - offset);
+  }
+  if (state_ == State::DONE) {
+    png_.reset();
+  }
+}
+
+void StreamingDecoder::update_webp(const uint8_t *data, size_t size) {
+  Webp &webp = *webp_;
+  if (!webp.idec) {
+    WebPBitstreamFeatures features;
+    VP8StatusCode status = WebPGetFeatures(data, size, &features);
+    if (status != VP8_STATUS_OK) {
+      if (status != VP8_STATUS_NOT_ENOUGH_DATA ||
+          size >= kWebpMaxHeaderBytes) {
+        fail();
+      }
+      return;
+    }
+    ImageHeader header;
+    header.format = ImageFormat::WEBP;
+    header.width = features.width;
+    header.height = features.height;
+    header.alpha = features.has_alpha != 0;
+    if (!accept_header(header)) {
+      fail();
+      return;
+    }
+
+    // libwebp decodes straight into the pooled buffer
+    image_.width = image_.source_width = header.width;
+    image_.height = image_.source_height = header.height;
+    image_.channels = header.alpha ? 4 : 3;
+    size_t stride = static_cast<size_t>(header.width) * image_.channels;
+    image_.pixels.resize(stride * header.height);
+    webp.idec = WebPINewRGB(header.alpha ? MODE_RGBA : MODE_RGB,
+                            image_.pixels.data(), image_.pixels.size(),
+                            static_cast<int>(stride));
+    if (!webp.idec) {
+      fail();
+      return;
+    }
+  }
+
+  // The whole prefix is passed each time; libwebp tolerates it moving
+  VP8StatusCode status = WebPIUpdate(webp.idec, data, size);
+  if (status == VP8_STATUS_OK) {
+    state_ = State::DONE;
+    webp_.reset();
+  } else if (status != VP8_STATUS_SUSPENDED) {
+    fail();
+  }
+}
+
+} // namespace imgboost
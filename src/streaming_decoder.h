@@ -0,0 +1,67 @@
+#pragma once
+
+#include "image_processor.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace imgboost {
+
+// Decodes an image while its bytes are still arriving: libjpeg through a
+// suspending source manager, libpng's progressive reader and libwebp's
+// incremental decoder. Each update() decodes as far as the data allows, so
+// by the time the download ends most of the decode is already done.
+//
+// Streaming is an optimization only: once the decoder fails or is
+// abandoned it ignores further data, and the caller decodes the complete
+// body the usual way.
+class StreamingDecoder {
+public:
+  // Called once the dimensions are known, before any pixel memory is
+  // allocated; returning false abandons the decode
+  using HeaderCallback = std::function<bool(const ImageHeader &)>;
+
+  // req_width/req_height as for ImageProcessor::decode
+  StreamingDecoder(int req_width, int req_height, HeaderCallback on_header);
+  ~StreamingDecoder();
+
+  // Disable copy
+  StreamingDecoder(const StreamingDecoder &) = delete;
+  StreamingDecoder &operator=(const StreamingDecoder &) = delete;
+
+  // data/size cover every byte received so far; the buffer may have moved
+  // since the previous call, but its prefix must be unchanged
+  void update(const uint8_t *data, size_t size);
+
+  // Called with the complete body. Returns true and moves the pixels into
+  // image when the whole image was decoded.
+  bool finish(const uint8_t *data, size_t size, DecodedImage &image);
+
+  bool failed() const { return state_ == State::FAILED; }
+
+private:
+  enum class State { DETECT, DECODING, DONE, FAILED };
+
+  struct Jpeg;
+  struct Png;
+  struct Webp;
+
+  bool accept_header(const ImageHeader &header);
+  void fail();
+  void update_jpeg(const uint8_t *data, size_t size, bool eof);
+  void update_png(const uint8_t *data, size_t size);
+  void update_webp(const uint8_t *data, size_t size);
+
+  int req_width_;
+  int req_height_;
+  HeaderCallback on_header_;
+  State state_ = State::DETECT;
+  ImageFormat format_ = ImageFormat::UNKNOWN;
+  DecodedImage image_;
+
+  std::unique_ptr<Jpeg> jpeg_;
+  std::unique_ptr<Png> png_;
+  std::unique_ptr<Webp> webp_;
+};
+
+} // namespace imgboost
@@ -1,43 +1,164 @@
 #pragma once
 
 #include "async_downloader.h"
+#include "disk_cache.h"
 #include "image_processor.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pixel_budget.h"
+#include "result_cache.h"
+#include "shared_buffer.h"
+#include "single_flight.h"
+#include "stage_gate.h"
+#include "streaming_decoder.h"
 #include "thread_pool.h"
+#include "tracer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <functional>
 #include <memory>
+#include <mutex>
 
 namespace imgboost {
 
 struct ProcessingResult {
   bool success;
-  std::vector<uint8_t> output_data;
+  SharedBuffer output_data;
   std::string error_message;
   int http_status; // HTTP response
+  int retry_after = 0; // seconds, set when the request was shed
 };
 
 using ProcessingCallback = std::function<void(ProcessingResult)>;
 
+struct SrcsetImage {
+  int width;
+  SharedBuffer data;
+};
+
+struct SrcsetResult {
+  bool success;
+  std::vector<SrcsetImage> images; // same order as the requested widths
+  std::string error_message;
+  int http_status;
+  int retry_after = 0;
+};
+
+using SrcsetCallback = std::function<void(SrcsetResult)>;
+
+struct SchedulerConfig {
+  size_t download_threads = 4;
+  size_t processing_threads = 0; // 0 == number of CPU cores
+  size_t cache_bytes = 0;        // 0 disables the in-memory result cache
+  std::string disk_cache_dir;    // empty disables the on-disk result cache
+  size_t disk_cache_bytes = 0;
+  size_t source_cache_bytes = 0; // 0 disables the downloaded source cache
+  int64_t source_default_ttl = 0; // seconds, when the origin sends none
+  ConnectionPoolConfig connections; // keep-alive limits and DNS cache TTL
+  StageLimits download_limits;      // 0 concurrency == download_threads
+  StageLimits processing_limits;    // 0 concurrency == processing threads
+  // New requests are shed with a 503 once the estimated queueing ahead of
+  // them exceeds this many seconds; 0 disables the check
+  double admission_deadline = 0;
+  uint64_t max_image_pixels = 0; // larger sources get a 413, 0 == no limit
+  size_t pixel_budget_bytes = 0; // decoded pixels in memory, 0 == unbounded
+  // Decode single-image sources while they download
+  bool streaming_decode = false;
+};
+
 class TaskScheduler {
 public:
-  TaskScheduler(size_t download_threads = 4, size_t processing_threads = 0)
-      : downloader_(download_threads),
-        processing_pool_(processing_threads == 0
-                             ? std::thread::hardware_concurrency()
-                             : processing_threads) {
-    std::cout << "[TaskScheduler] Initialized with " << download_threads
-              << " download threads and " << processing_pool_.size()
-              << " processing threads" << std::endl;
+  explicit TaskScheduler(const SchedulerConfig &config = SchedulerConfig())
+      : pixel_budget_(config.pixel_budget_bytes),
+        downloader_(config.download_threads, config.source_cache_bytes,
+                    config.source_default_ttl, config.connections,
+                    config.download_limits),
+        processing_gate_(processing_pool_, processing_limits(config)),
+        processing_pool_(processing_thread_count(config)),
+        admission_deadline_(config.admission_deadline),
+        max_image_pixels_(config.max_image_pixels),
+        streaming_decode_(config.streaming_decode) {
+    if (config.cache_bytes > 0) {
+      result_cache_ = std::make_unique<ResultCache>(config.cache_bytes);
+    }
+    if (!config.disk_cache_dir.empty() && config.disk_cache_bytes > 0) {
+      disk_cache_ = std::make_unique<DiskCache>(config.disk_cache_dir,
+                                                config.disk_cache_bytes);
+    }
+    IMGBOOST_LOG(INFO, "TaskScheduler", "Initialized")
+        .field("download_threads", config.download_threads)
+        .field("processing_threads", processing_pool_.size())
+        .field("cache_bytes", config.cache_bytes)
+        .field("disk_cache_bytes",
+               disk_cache_ ? config.disk_cache_bytes : size_t(0));
   }
 
-  // Asynchronous download => Synchronous conversion
+  // Asynchronous download => Synchronous conversion. Once cancel is
+  // cancelled, by the client leaving or its deadline, and so is every
+  // identical request sharing the work, queued stages are dropped and
+  // running ones stop early with a 504.
   void process_image_async(const std::string &image_url,
                            const ImageOptions &options,
-                           ProcessingCallback callback) {
+                           ProcessingCallback callback,
+                           CancelTokenPtr cancel = nullptr) {
+    RequestTimes times;
+    times.start = MetricClock::now();
+    times.trace = Tracer::instance().start_request();
+    if (times.trace) {
+      callback = traced(times, std::move(callback));
+    }
+    std::string cache_key = make_result_key(image_url, options);
+
+    // Cache hits are answered on the calling thread
+    SharedBuffer cached;
+    if (lookup_cached(cache_key, cached)) {
+      ProcessingResult result;
+      result.success = true;
+      result.output_data = std::move(cached);
+      result.http_status = 200;
+      callback(std::move(result));
+      return;
+    }
+
+    // Identical transforms already running share their result
+    CancelTokenPtr flight_cancel =
+        transforms_.join(cache_key, std::move(callback), std::move(cancel));
+    if (!flight_cancel) {
+      return;
+    }
+
+    // Only leaders add work, so only they are shed under overload
+    if (int retry_after = admission_retry_after()) {
+      transforms_.complete(
+          cache_key, flight_cancel,
+          overloaded<ProcessingResult>("Server overloaded", retry_after));
+      return;
+    }
+
+    // Decoded as it arrives when streaming; otherwise, and whenever the
+    // stream gives up, the processing task decodes the complete source
+    std::shared_ptr<StreamedSource> stream;
+    ChunkObserver observer;
+    if (streaming_decode_) {
+      stream = start_stream(options);
+      stream->trace = times.trace;
+      observer = [stream](const uint8_t *data, size_t size) {
+        stream->update(data, size);
+      };
+    }
+
     // Download
-    downloader_.download_async(image_url, [this, options, callback](
+    downloader_.download_async(image_url, [this, options, cache_key, stream,
+                                           times, flight_cancel](
                                               DownloadResult download_result) {
+      if (stream) {
+        stream->finish(download_result);
+      }
+
       // Process after download
       if (!download_result.success) {
+        count_download_error(download_result);
         ProcessingResult result;
         result.success = false;
         result.error_message =
@@ -45,34 +166,809 @@ public:
         result.http_status = download_result.status_code == 0
                                  ? 502
                                  : download_result.status_code;
-        callback(result);
+        result.retry_after = download_result.retry_after;
+        transforms_.complete(cache_key, flight_cancel, result);
         return;
       }
 
-      // Convert img in thread pool
-      processing_pool_.enqueue([download_result, options, callback]() {
-        ProcessingResult result;
+      if (flight_cancel->cancelled()) {
+        transforms_.complete(cache_key, flight_cancel,
+                             cancelled<ProcessingResult>());
+        return;
+      }
+
+      RequestTimes request_times = times;
+      request_times.download_queue = download_result.queue_ns;
+      request_times.download = download_result.fetch_ns;
+      request_times.queued = MetricClock::now();
+      SharedBuffer source = std::move(download_result.data);
+      if (stream && stream->ready) {
+        // Pixels were reserved when the header arrived
+        queue_transform(cache_key, options, std::move(source), stream,
+                        request_times, flight_cancel,
+                        PixelBudget::Reservation());
+        return;
+      }
+
+      // Pixels are reserved before the task is queued, never by a worker
+      // waiting on the pool whose tasks free them
+      size_t peak;
+      try {
+        ImageProcessor processor;
+        ImageHeader header = probe_source(processor, source);
+        peak = processor.estimate_peak_bytes(header, options.width,
+                                             options.height);
+      } catch (const std::exception &e) {
+        transforms_.complete(cache_key, flight_cancel,
+                             failed<ProcessingResult>(e));
+        return;
+      }
+      pixel_budget_.reserve_async(
+          peak, [this, cache_key, options, source, stream, request_times,
+                 flight_cancel](PixelBudget::Reservation pixels) {
+            queue_transform(cache_key, options, source, stream,
+                            request_times, flight_cancel, std::move(pixels));
+          });
+    }, observer, times.trace, flight_cancel);
+  }
+
+  // Several widths of one source: download and decode once, resize from the
+  // largest to the smallest reusing the previous step, and encode every size
+  // in parallel on the processing pool. Each output is also stored under the
+  // cache key of the equivalent single request (width only, auto height).
+  // Identical sets share one run, cancelled like a single transform.
+  void process_srcset_async(const std::string &image_url,
+                            const std::vector<int> &widths, int quality,
+                            EncodeProfile profile, SrcsetCallback callback,
+                            CancelTokenPtr cancel = nullptr) {
+    auto state = std::make_shared<SrcsetState>();
+    state->times.start = MetricClock::now();
+    state->times.trace = Tracer::instance().start_request();
+    if (state->times.trace) {
+      callback = traced(state->times, std::move(callback));
+    }
+    state->result.success = true;
+    state->result.http_status = 200;
+
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < widths.size(); ++i) {
+      ImageOptions options(widths[i], 0, quality);
+      options.profile = profile;
+      std::string key = make_result_key(image_url, options);
+      SharedBuffer cached;
+      if (lookup_cached(key, cached)) {
+        state->result.images.push_back({widths[i], std::move(cached)});
+      } else {
+        state->result.images.push_back({widths[i], SharedBuffer()});
+        missing.push_back(i);
+      }
+      state->keys.push_back(std::move(key));
+    }
+
+    if (missing.empty()) {
+      callback(std::move(state->result));
+      return;
+    }
+    // Largest first, the order the cascade builds them in
+    std::stable_sort(missing.begin(), missing.end(),
+                     [&state](size_t a, size_t b) {
+                       return state->result.images[a].width >
+                              state->result.images[b].width;
+                     });
+
+    std::string flight_key =
+        make_srcset_key(image_url, widths, quality, profile);
+    state->cancel =
+        srcsets_.join(flight_key, std::move(callback), std::move(cancel));
+    if (!state->cancel) {
+      return;
+    }
+    state->callback = [this, flight_key,
+                       flight = state->cancel](SrcsetResult result) {
+      srcsets_.complete(flight_key, flight, result);
+    };
+
+    if (int retry_after = admission_retry_after()) {
+      state->callback(
+          overloaded<SrcsetResult>("Server overloaded", retry_after));
+      return;
+    }
+    state->remaining = missing.size();
+
+    downloader_.download_async(image_url, [this, state, missing, quality,
+                                           profile](
+                                              DownloadResult download_result) {
+      if (!download_result.success) {
+        count_download_error(download_result);
+        state->result.success = false;
+        state->result.error_message =
+            "Download failed: " + download_result.error_message;
+        state->result.http_status = download_result.status_code == 0
+                                        ? 502
+                                        : download_result.status_code;
+        state->result.retry_after = download_result.retry_after;
+        state->callback(std::move(state->result));
+        return;
+      }
+
+      if (state->cancel->cancelled()) {
+        state->callback(cancelled<SrcsetResult>());
+        return;
+      }
+
+      state->times.download_queue = download_result.queue_ns;
+      state->times.download = download_result.fetch_ns;
+      state->times.queued = MetricClock::now();
+      SharedBuffer source = std::move(download_result.data);
+
+      // Reserved before the task is queued, as for single images
+      ImageHeader header;
+      size_t peak;
+      try {
+        ImageProcessor processor;
+        header = probe_source(processor, source);
+        peak = srcset_peak_bytes(processor, header, *state, missing);
+      } catch (const std::exception &e) {
+        state->callback(failed<SrcsetResult>(e));
+        return;
+      }
+      pixel_budget_.reserve_async(
+          peak, [this, state, missing, quality, profile, source,
+                 header](PixelBudget::Reservation pixels) {
+            state->pixels = std::move(pixels);
+            queue_srcset(state, missing, quality, profile, source, header);
+          });
+    }, nullptr, state->times.trace, state->cancel);
+  }
+
+  // Returns zeroed stats when the cache is disabled
+  CacheStats cache_stats() const {
+    return result_cache_ ? result_cache_->stats() : CacheStats();
+  }
+
+  CacheStats disk_cache_stats() const {
+    return disk_cache_ ? disk_cache_->stats() : CacheStats();
+  }
+
+  // Requests that joined an identical in-flight transform, srcset or
+  // download
+  uint64_t coalesced_transforms() const {
+    return transforms_.coalesced() + srcsets_.coalesced();
+  }
+  uint64_t coalesced_downloads() const { return downloader_.coalesced(); }
+
+  CacheStats source_cache_stats() const {
+    return downloader_.source_cache_stats();
+  }
+
+  StageStats download_stage_stats() const { return downloader_.stage_stats(); }
+  StageStats processing_stage_stats() const { return processing_gate_.stats(); }
+  ThreadPoolStats download_pool_stats() const {
+    return downloader_.pool_stats();
+  }
+  ThreadPoolStats processing_pool_stats() const {
+    return processing_pool_.stats();
+  }
+  // Requests answered with a 503 by admission control
+  uint64_t shed_requests() const { return shed_.load(); }
+
+  PixelBudgetStats pixel_budget_stats() const { return pixel_budget_.stats(); }
+  uint64_t source_revalidations() const {
+    return downloader_.source_revalidations();
+  }
+  ConnectionPoolStats connection_stats() const {
+    return downloader_.connection_stats();
+  }
+
+private:
+  // When a request arrived and how long it waited on the download stage;
+  // the processing task adds its own stages
+  struct RequestTimes {
+    MetricClock::time_point start;
+    MetricClock::time_point queued; // handed to the processing gate
+    uint64_t download_queue = 0;
+    uint64_t download = 0;
+    uint64_t trace = 0; // nonzero when the request is sampled for tracing
+  };
+
+  struct SrcsetState {
+    SrcsetResult result;
+    RequestTimes times;
+    // Labels of the largest output, under which the shared stages and the
+    // whole set's latency are recorded
+    MetricFormat format = MetricFormat::OTHER;
+    SizeBucket size = SizeBucket::SMALL;
+    std::vector<std::string> keys;
+    std::atomic<size_t> remaining{0}; // encodes not yet finished
+    std::mutex mutex;                  // guards result.success / error
+    SrcsetCallback callback;           // completes the flight
+    CancelTokenPtr cancel;             // the flight's token
+    // Held until the last encode is done. The encodes are queued on the
+    // pool, which is safe only because no worker ever waits on the budget.
+    PixelBudget::Reservation pixels;
+  };
+
+  // A single-image source decoded on the download thread as it arrives.
+  // The decode only runs under a pixel reservation it gets without waiting;
+  // when the budget is short, the image is too large or would be banded, or
+  // the data does not decode, it stops and the processing task decodes the
+  // complete source.
+  struct StreamedSource {
+    std::unique_ptr<StreamingDecoder> decoder;
+    PixelBudget::Reservation pixels;
+    DecodedImage image;
+    bool observed = false; // this request's download fed the decoder
+    bool ready = false;    // image holds the whole decode
+    uint64_t trace = 0;
+
+    void update(const uint8_t *data, size_t size) {
+      observed = true;
+      try {
+        decoder->update(data, size);
+      } catch (const std::exception &e) {
+        // The decoder state is unknown after a throw, stop using it
+        IMGBOOST_LOG(WARN, "TaskScheduler", "Streaming decode failed")
+            .field("error", e.what());
+        decoder.reset();
+      }
+    }
+
+    // Sources served from the cache, or fetched for another request, were
+    // never fed and are decoded the usual way
+    void finish(const DownloadResult &download) {
+      if (observed && decoder && download.success) {
+        ScopedSpan span(trace, "download", "stream_decode_finish");
         try {
+          ready = decoder->finish(download.data.data(), download.data.size(),
+                                  image);
+        } catch (const std::exception &e) {
+          IMGBOOST_LOG(WARN, "TaskScheduler", "Streaming decode failed")
+              .field("error", e.what());
+        }
+      }
+      decoder.reset();
+      if (!ready) {
+        pixels.reset();
+      }
+    }
+  };
+
+  std::shared_ptr<StreamedSource> start_stream(const ImageOptions &options) {
+    auto stream = std::make_shared<StreamedSource>();
+    // A raw pointer, the decoder lives inside the stream it would reference
+    StreamedSource *source = stream.get();
+    stream->decoder = std::make_unique<StreamingDecoder>(
+        options.width, options.height,
+        [this, source, options](const ImageHeader &header) {
+          // Oversized sources get their 413 from the buffered path
+          if (max_image_pixels_ > 0 && header.pixels() > max_image_pixels_) {
+            return false;
+          }
+          // Large sources are cheaper decoded in bands after the download
+          // than held whole while it runs
           ImageProcessor processor;
-          result.output_data = processor.process(download_result.data, options);
-          result.success = true;
-          result.http_status = 200;
+          if (processor.banded(header, options.width, options.height)) {
+            return false;
+          }
+          return pixel_budget_.try_reserve(
+              processor.estimate_peak_bytes(header, options.width,
+                                            options.height),
+              source->pixels);
+        });
+    return stream;
+  }
+
+  using PixelsPtr = std::shared_ptr<const PixelBuffer>;
+
+  static size_t processing_thread_count(const SchedulerConfig &config) {
+    return config.processing_threads == 0
+               ? std::thread::hardware_concurrency()
+               : config.processing_threads;
+  }
+
+  static StageLimits processing_limits(const SchedulerConfig &config) {
+    StageLimits limits = config.processing_limits;
+    if (limits.max_concurrency == 0) {
+      limits.max_concurrency = processing_thread_count(config);
+    }
+    return limits;
+  }
+
+  // Header probe before any decode, rejects sources above the pixel limit.
+  // The caller then reserves the estimated peak in the pixel budget.
+  ImageHeader probe_source(ImageProcessor &processor,
+                           const SharedBuffer &source) {
+    ImageHeader header = processor.probe(source.data(), source.size());
+    if (max_image_pixels_ > 0 && header.pixels() > max_image_pixels_) {
+      throw ImageTooLarge("Image too large: " + std::to_string(header.width) +
+                          "x" + std::to_string(header.height) + " exceeds " +
+                          std::to_string(max_image_pixels_) + " pixels");
+    }
+    return header;
+  }
+
+  // Seconds of queueing ahead of a new request when that exceeds the
+  // admission deadline, otherwise 0
+  int admission_retry_after() const {
+    if (admission_deadline_ <= 0) {
+      return 0;
+    }
+    double wait =
+        downloader_.estimated_wait() + processing_gate_.estimated_wait();
+    if (wait <= admission_deadline_) {
+      return 0;
+    }
+    return static_cast<int>(std::ceil(wait));
+  }
+
+  int processing_wait() const {
+    double wait = processing_gate_.estimated_wait();
+    return std::max(1, static_cast<int>(std::ceil(wait)));
+  }
+
+  static MetricFormat metric_format(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::JPEG:
+      return MetricFormat::JPEG;
+    case ImageFormat::PNG:
+      return MetricFormat::PNG;
+    case ImageFormat::WEBP:
+      return MetricFormat::WEBP;
+    default:
+      return MetricFormat::OTHER;
+    }
+  }
+
+  // Every stage but the total. Stages a request did not go through, such as
+  // a decode that finished while streaming or a resize to the source size,
+  // are not recorded
+  static void record_stages(MetricFormat format, SizeBucket size,
+                            const RequestTimes &times,
+                            MetricClock::time_point started,
+                            const StageTimings &timings) {
+    Metrics &metrics = Metrics::instance();
+    metrics.observe(MetricStage::DOWNLOAD_QUEUE, format, size,
+                    times.download_queue);
+    metrics.observe(MetricStage::DOWNLOAD, format, size, times.download);
+    metrics.observe(MetricStage::PROCESSING_QUEUE, format, size,
+                    static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            started - times.queued)
+                            .count()));
+    if (timings.decode > 0) {
+      metrics.observe(MetricStage::DECODE, format, size, timings.decode);
+    }
+    if (timings.resize > 0) {
+      metrics.observe(MetricStage::RESIZE, format, size, timings.resize);
+    }
+    if (timings.encode > 0) {
+      metrics.observe(MetricStage::ENCODE, format, size, timings.encode);
+    }
+  }
+
+  // Records the whole request, answered from the cache, a joined flight or
+  // its own work, as an async span before answering
+  template <typename Result>
+  static std::function<void(Result)>
+  traced(const RequestTimes &times, std::function<void(Result)> callback) {
+    return [trace = times.trace, start = times.start,
+            callback = std::move(callback)](Result result) {
+      Tracer::instance().record_async(trace, "request", start,
+                                      MetricClock::now());
+      callback(std::move(result));
+    };
+  }
+
+  // A full download queue is overload, a cancelled download nobody's
+  // fault, anything else the origin's
+  static void count_download_error(const DownloadResult &download) {
+    Metrics::instance().count_error(
+        download.cancelled          ? ErrorCause::CANCELLED
+        : download.retry_after > 0 ? ErrorCause::OVERLOADED
+                                    : ErrorCause::DOWNLOAD);
+  }
+
+  // Work stopped because every request of its flight was cancelled, by a
+  // hang-up or its deadline; a client still connected past its deadline
+  // gets the 504. Requests arriving after that lead a fresh flight.
+  template <typename Result> static Result cancelled() {
+    Metrics::instance().count_error(ErrorCause::CANCELLED);
+    Result result;
+    result.success = false;
+    result.error_message = "Request cancelled";
+    result.http_status = 504;
+    return result;
+  }
+
+  // A source rejected before its task is queued: 413 above the pixel
+  // limit, 500 when its header does not parse
+  template <typename Result> static Result failed(const std::exception &e) {
+    Result result;
+    result.success = false;
+    if (dynamic_cast<const ImageTooLarge *>(&e)) {
+      Metrics::instance().count_error(ErrorCause::TOO_LARGE);
+      result.error_message = e.what();
+      result.http_status = 413;
+    } else {
+      Metrics::instance().count_error(ErrorCause::PROCESSING);
+      result.error_message = std::string("Processing failed: ") + e.what();
+      result.http_status = 500;
+    }
+    return result;
+  }
+
+  template <typename Result>
+  Result overloaded(const std::string &message, int retry_after) {
+    shed_++;
+    Metrics::instance().count_error(ErrorCause::OVERLOADED);
+    Result result;
+    result.success = false;
+    result.error_message = message;
+    result.http_status = 503;
+    result.retry_after = retry_after;
+    return result;
+  }
+
+  bool lookup_cached(const std::string &cache_key, SharedBuffer &output) {
+    if (result_cache_ && result_cache_->get(cache_key, output)) {
+      return true;
+    }
+    // Disk hits are mapped, not read, and promoted to the memory tier
+    if (disk_cache_ && disk_cache_->get(cache_key, output)) {
+      if (result_cache_) {
+        result_cache_->put(cache_key, output);
+      }
+      return true;
+    }
+    return false;
+  }
 
-          std::cout << "[TaskScheduler] Processing completed, output size: "
-                    << result.output_data.size() << " bytes" << std::endl;
+  void store_cached(const std::string &cache_key, const SharedBuffer &output) {
+    if (result_cache_) {
+      result_cache_->put(cache_key, output);
+    }
+    if (disk_cache_) {
+      disk_cache_->put(cache_key, output);
+    }
+  }
+
+  // Hands a downloaded source to the processing gate, with the pixels it
+  // will need already reserved; queued bytes are the held source
+  void queue_transform(const std::string &cache_key,
+                       const ImageOptions &options, SharedBuffer source,
+                       const std::shared_ptr<StreamedSource> &stream,
+                       const RequestTimes &request_times,
+                       const CancelTokenPtr &flight_cancel,
+                       PixelBudget::Reservation pixels) {
+    size_t cost = source.size();
+    bool queued = processing_gate_.submit(
+        cost, [this, source = std::move(source), options, cache_key, stream,
+               request_times, flight_cancel,
+               pixels = std::move(pixels)]() mutable {
+          // Dropped without running once nobody waits for it
+          if (flight_cancel->cancelled()) {
+            transforms_.complete(cache_key, flight_cancel,
+                                 cancelled<ProcessingResult>());
+            return;
+          }
+          MetricClock::time_point started = MetricClock::now();
+          Tracer::instance().record_async(request_times.trace,
+                                          "processing_queue",
+                                          request_times.queued, started);
+          ScopedSpan span(request_times.trace, "processing", "process");
+          ProcessingResult result;
+          try {
+            StageTimings timings;
+            timings.trace = request_times.trace;
+            ImageProcessor processor(&processing_pool_);
+            processor.set_backlog(processing_gate_.backlog());
+            processor.set_timings(&timings);
+            processor.set_cancel(flight_cancel.get());
+            if (stream && stream->ready) {
+              // Only resize and encode are left, under the reservation
+              // taken when the header arrived
+              result.output_data = processor.process_decoded(
+                  std::move(stream->image), options);
+              stream->pixels.reset();
+            } else {
+              result.output_data =
+                  processor.process(source.data(), source.size(), options);
+            }
+            result.success = true;
+            result.http_status = 200;
+
+            store_cached(cache_key, result.output_data);
+            MetricFormat format = metric_format(
+                processor.detect_format(source.data(), source.size()));
+            SizeBucket size =
+                size_bucket(timings.output_width, timings.output_height);
+            record_stages(format, size, request_times, started, timings);
+            uint64_t total_ns = elapsed_ns(request_times.start);
+            Metrics::instance().observe(MetricStage::TOTAL, format, size,
+                                        total_ns);
+
+            IMGBOOST_LOG(INFO, "TaskScheduler", "Processing completed")
+                .field("bytes", result.output_data.size())
+                .field("duration_ms", total_ns / 1e6);
+          } catch (const RequestCancelled &) {
+            result = cancelled<ProcessingResult>();
+          } catch (const ImageTooLarge &e) {
+            Metrics::instance().count_error(ErrorCause::TOO_LARGE);
+            result.success = false;
+            result.error_message = e.what();
+            result.http_status = 413;
+          } catch (const std::exception &e) {
+            Metrics::instance().count_error(ErrorCause::PROCESSING);
+            result.success = false;
+            result.error_message =
+                std::string("Processing failed: ") + e.what();
+            result.http_status = 500;
+          }
+          pixels.reset();
+          // Cache insertion above happens first, so a request arriving after
+          // the flight ends finds the output in the cache
+          transforms_.complete(cache_key, flight_cancel, result);
+        });
+    if (!queued) {
+      transforms_.complete(cache_key, flight_cancel,
+                           overloaded<ProcessingResult>(
+                               "Processing queue full", processing_wait()));
+    }
+  }
+
+  // Hands a downloaded set to the processing gate once its pixels are
+  // reserved
+  void queue_srcset(const std::shared_ptr<SrcsetState> &state,
+                    const std::vector<size_t> &missing, int quality,
+                    EncodeProfile profile, const SharedBuffer &source,
+                    const ImageHeader &header) {
+    bool queued = processing_gate_.submit(
+        source.size(),
+        [this, state, missing, quality, profile, source, header]() {
+          // Dropped without running once nobody waits for it
+          if (state->cancel->cancelled()) {
+            state->callback(cancelled<SrcsetResult>());
+            return;
+          }
+          size_t scheduled = 0;
+          try {
+            build_srcset(state, missing, quality, profile, source, header,
+                         scheduled);
+          } catch (const RequestCancelled &) {
+            cancel_srcset(state);
+            for (size_t i = scheduled; i < missing.size(); ++i) {
+              finish_srcset_item(state);
+            }
+          } catch (const ImageTooLarge &e) {
+            Metrics::instance().count_error(ErrorCause::TOO_LARGE);
+            fail_srcset(state, e.what(), 413);
+            for (size_t i = scheduled; i < missing.size(); ++i) {
+              finish_srcset_item(state);
+            }
+          } catch (const std::exception &e) {
+            // Encodes already queued still finish, the rest are
+            // accounted here
+            Metrics::instance().count_error(ErrorCause::PROCESSING);
+            fail_srcset(state,
+                        std::string("Processing failed: ") + e.what());
+            for (size_t i = scheduled; i < missing.size(); ++i) {
+              finish_srcset_item(state);
+            }
+          }
+        });
+    if (!queued) {
+      state->pixels.reset();
+      state->callback(overloaded<SrcsetResult>("Processing queue full",
+                                               processing_wait()));
+    }
+  }
+
+  // The largest output's peak, plus a resized copy and encoder state for
+  // every smaller one, all alive until the last encode finishes; with
+  // alpha each encode also holds a straight copy. missing is largest first.
+  size_t srcset_peak_bytes(ImageProcessor &processor,
+                           const ImageHeader &header, const SrcsetState &state,
+                           const std::vector<size_t> &missing) {
+    size_t peak = processor.estimate_peak_bytes(
+        header, state.result.images[missing.front()].width, 0);
+    for (size_t i = 1; i < missing.size(); ++i) {
+      int width, height;
+      processor.calculate_dimensions(header.width, header.height,
+                                     state.result.images[missing[i]].width, 0,
+                                     width, height);
+      peak += static_cast<size_t>(width) * height * (header.alpha ? 12 : 8);
+    }
+    return peak;
+  }
+
+  // Runs on the processing pool: decode, cascade resizes, fan out encodes
+  void build_srcset(const std::shared_ptr<SrcsetState> &state,
+                    const std::vector<size_t> &missing, int quality,
+                    EncodeProfile profile, const SharedBuffer &source,
+                    const ImageHeader &header, size_t &scheduled) {
+    MetricClock::time_point started = MetricClock::now();
+    uint64_t trace = state->times.trace;
+    Tracer::instance().record_async(trace, "processing_queue",
+                                    state->times.queued, started);
+    ScopedSpan span(trace, "processing", "srcset_decode_resize");
+
+    StageTimings timings;
+    timings.trace = trace;
+    ImageProcessor processor(&processing_pool_);
+    processor.set_timings(&timings);
+    processor.set_cancel(state->cancel.get());
+    double backlog = processing_gate_.backlog();
+
+    // Decoding for the largest width lets JPEG scale in the DCT domain
+    DecodedImage image =
+        processor.decode(source.data(), source.size(),
+                         state->result.images[missing.front()].width, 0);
+
+    // Stages shared by the whole set are recorded once, under the largest
+    // output's size
+    int largest_width, largest_height;
+    processor.calculate_dimensions(
+        header.width, header.height,
+        state->result.images[missing.front()].width, 0, largest_width,
+        largest_height);
+    state->format = metric_format(header.format);
+    state->size = size_bucket(largest_width, largest_height);
+    record_stages(state->format, state->size, state->times, started,
+                  timings);
+    // With alpha, the whole cascade runs on premultiplied pixels and every
+    // encode converts its own copy back
+    int channels = image.channels;
+    if (channels == 4) {
+      premultiply_alpha(image.pixels.data(),
+                        static_cast<size_t>(image.width) * image.height);
+    }
+    auto source_pixels =
+        std::make_shared<PixelBuffer>(std::move(image.pixels));
+    int src_width = image.width, src_height = image.height;
+
+    PixelsPtr prev = source_pixels;
+    int prev_width = src_width, prev_height = src_height;
+
+    for (size_t index : missing) {
+      int dst_width, dst_height;
+      processor.calculate_dimensions(image.source_width, image.source_height,
+                                     state->result.images[index].width, 0,
+                                     dst_width, dst_height);
+
+      // Downscale from the previous (larger) step, never from an upscale
+      PixelsPtr base = source_pixels;
+      int base_width = src_width, base_height = src_height;
+      if (prev_width >= dst_width && prev_height >= dst_height &&
+          prev_width <= src_width) {
+        base = prev;
+        base_width = prev_width;
+        base_height = prev_height;
+      }
+
+      PixelsPtr pixels = base;
+      uint64_t resize_ns = 0;
+      if (state->cancel->cancelled()) {
+        throw RequestCancelled();
+      }
+      if (dst_width != base_width || dst_height != base_height) {
+        ScopedTimer timer(&resize_ns);
+        ScopedSpan resize_span(trace, "processing", "resize");
+        auto resized = std::make_shared<PixelBuffer>();
+        processor.resize_image(*base, base_width, base_height, channels,
+                               *resized, dst_width, dst_height);
+        pixels = std::move(resized);
+      }
+      prev = pixels;
+      prev_width = dst_width;
+      prev_height = dst_height;
+
+      processing_pool_.execute([this, state, index, pixels, channels,
+                                dst_width, dst_height, quality, profile,
+                                backlog, resize_ns]() {
+        try {
+          if (state->cancel->cancelled()) {
+            throw RequestCancelled();
+          }
+          StageTimings encode_timings;
+          encode_timings.trace = state->times.trace;
+          ImageProcessor encoder(&processing_pool_);
+          encoder.set_backlog(backlog);
+          encoder.set_timings(&encode_timings);
+          encoder.set_cancel(state->cancel.get());
+          SharedBuffer output;
+          if (channels == 4) {
+            size_t count = static_cast<size_t>(dst_width) * dst_height;
+            PixelBuffer straight(count * 4);
+            unpremultiply_alpha(pixels->data(), straight.data(), count);
+            output = encoder.encode_webp(straight, dst_width, dst_height, 4,
+                                         quality, profile);
+          } else {
+            output = encoder.encode_webp(*pixels, dst_width, dst_height, 3,
+                                         quality, profile);
+          }
+          store_cached(state->keys[index], output);
+          state->result.images[index].data = std::move(output);
+
+          SizeBucket size = size_bucket(dst_width, dst_height);
+          if (resize_ns > 0) {
+            Metrics::instance().observe(MetricStage::RESIZE, state->format,
+                                        size, resize_ns);
+          }
+          Metrics::instance().observe(MetricStage::ENCODE, state->format,
+                                      size, encode_timings.encode);
+        } catch (const RequestCancelled &) {
+          cancel_srcset(state);
         } catch (const std::exception &e) {
-          result.success = false;
-          result.error_message = std::string("Processing failed: ") + e.what();
-          result.http_status = 500;
+          Metrics::instance().count_error(ErrorCause::PROCESSING);
+          fail_srcset(state, std::string("Encoding failed: ") + e.what());
         }
-        callback(result);
+        finish_srcset_item(state);
       });
-    });
+      scheduled++;
+    }
   }
 
-private:
+  // The first failure is the one reported
+  bool fail_srcset(const std::shared_ptr<SrcsetState> &state,
+                   const std::string &message, int http_status = 500) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (!state->result.success) {
+      return false;
+    }
+    state->result.success = false;
+    state->result.error_message = message;
+    state->result.http_status = http_status;
+    return true;
+  }
+
+  // Counted once per set, however many of its encodes stop
+  void cancel_srcset(const std::shared_ptr<SrcsetState> &state) {
+    if (fail_srcset(state, "Request cancelled", 504)) {
+      Metrics::instance().count_error(ErrorCause::CANCELLED);
+    }
+  }
+
+  // Flight key of a whole set; widths keep their order, which is the
+  // order of the result
+  static std::string make_srcset_key(const std::string &image_url,
+                                     const std::vector<int> &widths,
+                                     int quality, EncodeProfile profile) {
+    std::string key = "srcset";
+    for (int width : widths) {
+      key += " " + std::to_string(width);
+    }
+    ImageOptions options(0, 0, quality);
+    options.profile = profile;
+    return key + " " + make_result_key(image_url, options);
+  }
+
+  // The last finishing encode delivers the whole set
+  void finish_srcset_item(const std::shared_ptr<SrcsetState> &state) {
+    if (state->remaining.fetch_sub(1) == 1) {
+      if (state->result.success) {
+        Metrics::instance().observe(MetricStage::TOTAL, state->format,
+                                    state->size,
+                                    elapsed_ns(state->times.start));
+      }
+      state->callback(std::move(state->result));
+    }
+  }
+
+  // Caches are declared first so they outlive the pools' worker threads
+  std::unique_ptr<ResultCache> result_cache_;
+  std::unique_ptr<DiskCache> disk_cache_;
+  SingleFlight<ProcessingResult> transforms_;
+  SingleFlight<SrcsetResult> srcsets_;
+  // Declared before the pools: tasks and download callbacks they drain on
+  // destruction release and request reservations
+  PixelBudget pixel_budget_;
   AsyncDownloader downloader_;
+  StageGate processing_gate_; // before the pool, see StageGate
   ThreadPool processing_pool_;
+  double admission_deadline_;
+  std::atomic<uint64_t> shed_{0};
+  uint64_t max_image_pixels_;
+  bool streaming_decode_;
 };
 
 } // namespace imgboost
@@ -1,47 +1,144 @@
 #pragma once
 
+#include "logger.h"
+#include "work_stealing_deque.h"
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace imgboost {
 
+struct ThreadPoolStats {
+  size_t threads = 0;
+  size_t busy = 0;    // workers running a task
+  size_t pending = 0; // tasks waiting for a worker
+};
+
+// Move-only void() callable. Callables up to kInlineSize bytes, which covers
+// the scheduler's closures, are stored in place, larger ones on the heap.
+class Task {
+public:
+  static constexpr size_t kInlineSize = 128;
+
+  Task() = default;
+
+  template <typename F, typename Fn = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<Fn, Task>::value>::type>
+  Task(F &&f) { // NOLINT: implicit like std::function
+    if constexpr (sizeof(Fn) <= kInlineSize &&
+                  alignof(Fn) <= alignof(std::max_align_t) &&
+                  std::is_nothrow_move_constructible<Fn>::value) {
+      new (storage_) Fn(std::forward<F>(f));
+      ops_ = &inline_ops<Fn>;
+    } else {
+      *reinterpret_cast<Fn **>(storage_) = new Fn(std::forward<F>(f));
+      ops_ = &heap_ops<Fn>;
+    }
+  }
+
+  Task(Task &&other) noexcept : ops_(other.ops_) {
+    if (ops_) {
+      ops_->move(storage_, other.storage_);
+      other.ops_ = nullptr;
+    }
+  }
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      reset();
+      ops_ = other.ops_;
+      if (ops_) {
+        ops_->move(storage_, other.storage_);
+        other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  ~Task() { reset(); }
+
+  void operator()() { ops_->invoke(storage_); }
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  void reset() {
+    if (ops_) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+private:
+  struct Ops {
+    void (*invoke)(void *);
+    void (*move)(void *dst, void *src); // leaves src destroyed
+    void (*destroy)(void *);
+  };
+
+  template <typename Fn> static Fn *inline_ptr(void *p) {
+    return std::launder(reinterpret_cast<Fn *>(p));
+  }
+  template <typename Fn> static Fn *&heap_ptr(void *p) {
+    return *reinterpret_cast<Fn **>(p);
+  }
+
+  template <typename Fn>
+  static constexpr Ops inline_ops = {
+      [](void *p) { (*inline_ptr<Fn>(p))(); },
+      [](void *dst, void *src) {
+        new (dst) Fn(std::move(*inline_ptr<Fn>(src)));
+        inline_ptr<Fn>(src)->~Fn();
+      },
+      [](void *p) { inline_ptr<Fn>(p)->~Fn(); }};
+
+  template <typename Fn>
+  static constexpr Ops heap_ops = {
+      [](void *p) { (*heap_ptr<Fn>(p))(); },
+      [](void *dst, void *src) { heap_ptr<Fn>(dst) = heap_ptr<Fn>(src); },
+      [](void *p) { delete heap_ptr<Fn>(p); }};
+
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+  const Ops *ops_ = nullptr;
+};
+
+// Work-stealing pool. Each worker owns a lock-free deque: tasks submitted
+// from a worker go to its own deque and run newest first, other threads
+// submit through a shared injection queue. Workers without work steal from
+// the others, oldest first, and park on a condition variable when the whole
+// pool is empty.
 class ThreadPool {
 public:
-  explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency())
-      : stop_(false) {
+  explicit ThreadPool(
+      size_t num_threads = std::thread::hardware_concurrency()) {
+    num_threads = std::max<size_t>(num_threads, 1);
     for (size_t i = 0; i < num_threads; ++i) {
-      workers_.emplace_back([this] {
-        while (true) {
-          std::function<void()> task;
-          {
-            std::unique_lock<std::mutex> lock(queue_mutex_);
-            condition_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
-
-            if (stop_ && tasks_.empty()) {
-              return;
-            }
-
-            task = std::move(tasks_.front());
-            tasks_.pop();
-          }
-          task();
-        }
-      });
+      queues_.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (size_t i = 0; i < num_threads; ++i) {
+      workers_.emplace_back([this, i] { worker_loop(i); });
     }
   }
 
+  // Queued tasks still run before the workers exit
   ~ThreadPool() {
     {
-      std::unique_lock<std::mutex> lock(queue_mutex_);
+      std::lock_guard<std::mutex> lock(park_mutex_);
       stop_ = true;
     }
-    condition_.notify_all();
+    park_condition_.notify_all();
     for (std::thread &worker : workers_) {
       if (worker.joinable()) {
         worker.join();
@@ -53,36 +150,297 @@ public:
   ThreadPool(const ThreadPool &) = delete;
   ThreadPool &operator=(const ThreadPool &) = delete;
 
+  // Fire and forget: no future, and no allocation for small callables once
+  // the calling thread's node cache is warm. Exceptions are logged.
+  void execute(Task task) {
+    TaskNode *node = TaskNode::acquire();
+    node->task = std::move(task);
+    submit(node);
+  }
+
   // Submit task to thread pool
   template <typename F, typename... Args>
   auto enqueue(F &&f, Args &&...args)
       -> std::future<typename std::invoke_result<F, Args...>::type> {
     using return_type = typename std::invoke_result<F, Args...>::type;
 
-    auto task = std::make_shared<std::packaged_task<return_type()>>(
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    std::packaged_task<return_type()> task(
+        [f = std::forward<F>(f),
+         args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+          return std::apply(std::move(f), std::move(args));
+        });
+    std::future<return_type> res = task.get_future();
+    execute([task = std::move(task)]() mutable { task(); });
+    return res;
+  }
 
-    std::future<return_type> res = task->get_future();
-    {
-      std::unique_lock<std::mutex> lock(queue_mutex_);
-      if (stop_) {
-        throw std::runtime_error("enqueue on stopped ThreadPool");
+  // Run fn(0) .. fn(count - 1), possibly in parallel, and return once every
+  // call has finished; the first exception thrown is rethrown here. Safe to
+  // call from a task on this pool: the caller works through the indices too
+  // and only waits for ones a running thread has already claimed, so helpers
+  // stuck behind other tasks never block it. Helpers are only posted for
+  // idle workers, so a saturated pool degrades to a plain loop.
+  void parallel_for(size_t count, const std::function<void(size_t)> &fn) {
+    if (count == 0) {
+      return;
+    }
+    size_t helpers = std::min(count - 1, idle());
+    if (helpers == 0) {
+      for (size_t i = 0; i < count; ++i) {
+        fn(i);
       }
-      tasks_.emplace([task]() { (*task)(); });
+      return;
+    }
+
+    // Shared so helpers that start after the call returned find it intact
+    auto job = std::make_shared<ParallelJob>();
+    job->fn = &fn;
+    job->count = count;
+    for (size_t i = 0; i < helpers; ++i) {
+      execute([job]() { job->run(); });
+    }
+
+    job->run();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&job] { return job->done == job->count; });
+    if (job->error) {
+      std::rethrow_exception(job->error);
     }
-    condition_.notify_one();
-    return res;
   }
 
   size_t size() const { return workers_.size(); }
 
+  // Tasks waiting for a worker
+  size_t pending() const {
+    int64_t queued = queued_.load(std::memory_order_relaxed);
+    return queued > 0 ? static_cast<size_t>(queued) : 0;
+  }
+
+  // Workers neither running a task nor about to pick up a queued one
+  size_t idle() const {
+    size_t claimed = busy_.load(std::memory_order_relaxed) + pending();
+    return claimed >= workers_.size() ? 0 : workers_.size() - claimed;
+  }
+
+  ThreadPoolStats stats() const {
+    ThreadPoolStats stats;
+    stats.threads = workers_.size();
+    stats.busy = busy_.load(std::memory_order_relaxed);
+    stats.pending = pending();
+    return stats;
+  }
+
 private:
+  struct TaskNode {
+    Task task;
+
+    // Nodes are recycled through a small per-thread cache, a node freed on
+    // one thread is reused by the next submission from that thread
+    static constexpr size_t kCacheSize = 256;
+
+    struct Cache {
+      std::vector<TaskNode *> nodes;
+      ~Cache() {
+        for (TaskNode *node : nodes) {
+          delete node;
+        }
+      }
+    };
+
+    static Cache &cache() {
+      static thread_local Cache cache;
+      return cache;
+    }
+
+    static TaskNode *acquire() {
+      Cache &c = cache();
+      if (c.nodes.empty()) {
+        return new TaskNode();
+      }
+      TaskNode *node = c.nodes.back();
+      c.nodes.pop_back();
+      return node;
+    }
+
+    static void release(TaskNode *node) {
+      node->task.reset();
+      Cache &c = cache();
+      if (c.nodes.size() < kCacheSize) {
+        c.nodes.push_back(node);
+      } else {
+        delete node;
+      }
+    }
+  };
+
+  struct alignas(64) WorkerQueue {
+    WorkStealingDeque<TaskNode> deque;
+  };
+
+  // Which pool and worker the current thread belongs to, if any
+  struct WorkerContext {
+    const ThreadPool *pool = nullptr;
+    size_t index = 0;
+  };
+
+  static WorkerContext &current_worker() {
+    static thread_local WorkerContext context;
+    return context;
+  }
+
+  struct ParallelJob {
+    const std::function<void(size_t)> *fn = nullptr;
+    size_t count = 0;
+    std::atomic<size_t> next{0};
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t done = 0; // guarded by mutex
+    std::exception_ptr error;
+
+    // fn is only touched for claimed indices, all of which finish before
+    // parallel_for returns
+    void run() {
+      size_t ran = 0;
+      for (size_t i = next++; i < count; i = next++) {
+        try {
+          (*fn)(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+        ran++;
+      }
+      if (ran > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done += ran;
+        if (done == count) {
+          finished.notify_all();
+        }
+      }
+    }
+  };
+
+  void submit(TaskNode *node) {
+    // Counted before it becomes visible so a worker never sees fewer queued
+    // tasks than it can find; a parked worker might spin briefly instead
+    queued_.fetch_add(1, std::memory_order_seq_cst);
+
+    WorkerContext &context = current_worker();
+    if (context.pool == this) {
+      queues_[context.index]->deque.push(node);
+    } else {
+      std::lock_guard<std::mutex> lock(inject_mutex_);
+      if (stop_) {
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        TaskNode::release(node);
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+      }
+      injected_.push_back(node);
+    }
+
+    // Pairs with the sleepers_/queued_ check in park(): either the parking
+    // worker sees the new task, or we see it parked and wake it
+    if (sleepers_.load(std::memory_order_seq_cst) > 0) {
+      { std::lock_guard<std::mutex> lock(park_mutex_); }
+      park_condition_.notify_one();
+    }
+  }
+
+  TaskNode *find_task(size_t index) {
+    if (TaskNode *node = queues_[index]->deque.pop()) {
+      return node;
+    }
+    {
+      std::lock_guard<std::mutex> lock(inject_mutex_);
+      if (!injected_.empty()) {
+        TaskNode *node = injected_.front();
+        injected_.pop_front();
+        return node;
+      }
+    }
+    // Start at a different victim each round to spread the thieves
+    size_t n = queues_.size();
+    size_t start = next_victim(n);
+    for (size_t k = 0; k < n; ++k) {
+      size_t victim = (start + k) % n;
+      if (victim == index) {
+        continue;
+      }
+      if (TaskNode *node = queues_[victim]->deque.steal()) {
+        return node;
+      }
+    }
+    return nullptr;
+  }
+
+  // Returns false once the pool is stopping and no work is left
+  bool park() {
+    std::unique_lock<std::mutex> lock(park_mutex_);
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    while (queued_.load(std::memory_order_seq_cst) <= 0) {
+      if (stop_) {
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+      }
+      park_condition_.wait(lock);
+    }
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void worker_loop(size_t index) {
+    current_worker() = {this, index};
+    while (true) {
+      TaskNode *node = find_task(index);
+      if (!node) {
+        if (!park()) {
+          return;
+        }
+        continue;
+      }
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+
+      busy_++;
+      try {
+        node->task();
+      } catch (const std::exception &e) {
+        IMGBOOST_LOG(ERR, "ThreadPool", "Task threw")
+            .field("error", e.what());
+      } catch (...) {
+        IMGBOOST_LOG(ERR, "ThreadPool", "Task threw an unknown exception");
+      }
+      busy_--;
+      TaskNode::release(node);
+    }
+  }
+
+  static size_t next_victim(size_t n) {
+    // xorshift, per thread
+    static thread_local uint32_t state = static_cast<uint32_t>(
+        std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state % n;
+  }
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
   std::vector<std::thread> workers_;
-  std::queue<std::function<void()>> tasks_;
 
-  std::mutex queue_mutex_;
-  std::condition_variable condition_;
-  bool stop_;
+  std::mutex inject_mutex_;
+  std::deque<TaskNode *> injected_; // submissions from outside the pool
+
+  std::mutex park_mutex_;
+  std::condition_variable park_condition_;
+  std::atomic<int> sleepers_{0};
+
+  std::atomic<int64_t> queued_{0};
+  std::atomic<size_t> busy_{0};
+  std::atomic<bool> stop_{false}; // set under park_mutex_
 };
 
 } // namespace imgboost
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace imgboost {
+
+struct TracerStats {
+  uint64_t sampled = 0;     // requests traced
+  uint64_t recorded = 0;    // spans recorded
+  uint64_t overwritten = 0; // spans lost to the ring wrapping around
+};
+
+// Per-request spans exported as Chrome trace-event JSON, which Perfetto and
+// chrome://tracing load. A sampled request gets a nonzero trace id; every
+// stage that sees the id records a span on the thread that ran it, so a
+// window of traffic shows each pool's threads busy or idle and which
+// stages overlap. Waits that run on no thread, the queues and the request
+// as a whole, are async spans grouped under the trace id. Only sampled
+// requests record, a handful of spans each, into one mutex-guarded ring
+// that keeps the most recent spans; an unsampled request costs one relaxed
+// load.
+class Tracer {
+public:
+  static Tracer &instance() {
+    static Tracer *tracer = new Tracer();
+    return *tracer;
+  }
+
+  // Disable copy
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  // 0 stops tracing, 100 traces every request
+  void set_sample_percent(int percent) {
+    sample_percent_.store(std::clamp(percent, 0, 100),
+                          std::memory_order_relaxed);
+  }
+  int sample_percent() const {
+    return sample_percent_.load(std::memory_order_relaxed);
+  }
+
+  // Spans kept for export; resizing drops the ones recorded so far
+  void set_capacity(size_t spans) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    spans_.assign(std::max<size_t>(spans, 1), Span());
+    next_ = 0;
+    size_ = 0;
+  }
+
+  // Trace id of a new request, 0 when it is not sampled. Sampled requests
+  // are spread evenly rather than drawn at random.
+  uint64_t start_request() {
+    uint64_t percent = static_cast<uint64_t>(
+        sample_percent_.load(std::memory_order_relaxed));
+    if (percent == 0) {
+      return 0;
+    }
+    uint64_t n = requests_.fetch_add(1, std::memory_order_relaxed);
+    if (n * percent / 100 == (n + 1) * percent / 100) {
+      return 0;
+    }
+    return next_trace_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // A stage that ran on the calling thread
+  void record(uint64_t trace, const char *category, const char *name,
+              MetricClock::time_point start, MetricClock::time_point end) {
+    push(trace, category, name, start, end, false);
+  }
+
+  // A wait or a request, which no thread runs from start to end
+  void record_async(uint64_t trace, const char *name,
+                    MetricClock::time_point start,
+                    MetricClock::time_point end) {
+    push(trace, "request", name, start, end, true);
+  }
+
+  TracerStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TracerStats stats = stats_;
+    stats.sampled = next_trace_.load(std::memory_order_relaxed) - 1;
+    return stats;
+  }
+
+  // The retained spans, oldest first, as a Chrome trace-event document.
+  // Threads are named after the category of their spans.
+  std::string render(bool clear = false) {
+    std::vector<Span> spans;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      spans.reserve(size_);
+      size_t first = (next_ + spans_.size() - size_) % spans_.size();
+      for (size_t i = 0; i < size_; ++i) {
+        spans.push_back(spans_[(first + i) % spans_.size()]);
+      }
+      if (clear) {
+        size_ = 0;
+      }
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    out += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+           "\"args\":{\"name\":\"img-boost\"}}";
+    std::map<uint32_t, const char *> threads;
+    for (const Span &span : spans) {
+      if (!span.async) {
+        threads.emplace(span.tid, span.category);
+      }
+    }
+    for (const auto &thread : threads) {
+      out += ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+             std::to_string(thread.first) + ",\"args\":{\"name\":\"" +
+             thread.second + " " + std::to_string(thread.first) + "\"}}";
+    }
+    for (const Span &span : spans) {
+      std::string common = std::string("\"name\":\"") + span.name +
+                           "\",\"cat\":\"" + span.category +
+                           "\",\"pid\":1,\"tid\":" + std::to_string(span.tid);
+      std::string args =
+          ",\"args\":{\"trace\":" + std::to_string(span.trace) + "}";
+      if (span.async) {
+        // Begin and end matched by name and id, one track per request
+        std::string id = ",\"id\":" + std::to_string(span.trace);
+        out += ",{" + common + ",\"ph\":\"b\",\"ts\":" +
+               format_us(span.start_ns) + id + args + "}";
+        out += ",{" + common + ",\"ph\":\"e\",\"ts\":" +
+               format_us(span.start_ns + span.duration_ns) + id + "}";
+      } else {
+        out += ",{" + common + ",\"ph\":\"X\",\"ts\":" +
+               format_us(span.start_ns) + ",\"dur\":" +
+               format_us(span.duration_ns) + args + "}";
+      }
+    }
+    out += "]}\n";
+    return out;
+  }
+
+private:
+  static constexpr size_t kDefaultCapacity = 65536;
+
+  // Names and categories are string literals
+  struct Span {
+    const char *category = "";
+    const char *name = "";
+    uint64_t trace = 0;
+    uint64_t start_ns = 0; // since the tracer was created
+    uint64_t duration_ns = 0;
+    uint32_t tid = 0;
+    bool async = false;
+  };
+
+  Tracer() : epoch_(MetricClock::now()), spans_(kDefaultCapacity) {}
+
+  // Small, stable thread numbers, easier to read than native ids
+  static uint32_t thread_number() {
+    static std::atomic<uint32_t> next{1};
+    static thread_local uint32_t number =
+        next.fetch_add(1, std::memory_order_relaxed);
+    return number;
+  }
+
+  static std::string format_us(uint64_t ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.3f", static_cast<double>(ns) / 1e3);
+    return buf;
+  }
+
+  static uint64_t since(MetricClock::time_point epoch,
+                        MetricClock::time_point t) {
+    return t < epoch ? 0
+                     : static_cast<uint64_t>(
+                           std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               t - epoch)
+                               .count());
+  }
+
+  void push(uint64_t trace, const char *category, const char *name,
+            MetricClock::time_point start, MetricClock::time_point end,
+            bool async) {
+    if (trace == 0) {
+      return;
+    }
+    Span span;
+    span.category = category;
+    span.name = name;
+    span.trace = trace;
+    span.start_ns = since(epoch_, start);
+    uint64_t end_ns = since(epoch_, end);
+    span.duration_ns = end_ns > span.start_ns ? end_ns - span.start_ns : 0;
+    span.tid = thread_number();
+    span.async = async;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    spans_[next_] = span;
+    next_ = (next_ + 1) % spans_.size();
+    if (size_ < spans_.size()) {
+      size_++;
+    } else {
+      stats_.overwritten++;
+    }
+    stats_.recorded++;
+  }
+
+  const MetricClock::time_point epoch_;
+  std::atomic<int> sample_percent_{0};
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> next_trace_{1};
+
+  mutable std::mutex mutex_; // guards the ring and stats_
+  std::vector<Span> spans_;
+  size_t next_ = 0; // slot of the next span
+  size_t size_ = 0; // spans retained
+  TracerStats stats_;
+};
+
+// Records the time until it goes out of scope as a span of the trace; does
+// nothing, not even read the clock, when trace is 0
+class ScopedSpan {
+public:
+  ScopedSpan(uint64_t trace, const char *category, const char *name)
+      : trace_(trace), category_(category), name_(name) {
+    if (trace_) {
+      start_ = MetricClock::now();
+    }
+  }
+  ~ScopedSpan() {
+    if (trace_) {
+      Tracer::instance().record(trace_, category_, name_, start_,
+                                MetricClock::now());
+    }
+  }
+
+  // Disable copy
+  ScopedSpan(const ScopedSpan &) = delete;
+  ScopedSpan &operator=(const ScopedSpan &) = delete;
+
+private:
+  uint64_t trace_;
+  const char *category_;
+  const char *name_;
+  MetricClock::time_point start_;
+};
+
+} // namespace imgboost
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -58,6 +61,32 @@ inline std::vector<uint8_t> base64_decode(const std::string &encoded_string) {
   return ret;
 }
 
+inline std::string base64_encode(const std::string &input) {
+  std::string out;
+  out.reserve((input.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    uint32_t n = (static_cast<uint8_t>(input[i]) << 16) |
+                 (static_cast<uint8_t>(input[i + 1]) << 8) |
+                 static_cast<uint8_t>(input[i + 2]);
+    out += base64_chars[(n >> 18) & 63];
+    out += base64_chars[(n >> 12) & 63];
+    out += base64_chars[(n >> 6) & 63];
+    out += base64_chars[n & 63];
+  }
+  if (i < input.size()) {
+    uint32_t n = static_cast<uint8_t>(input[i]) << 16;
+    if (i + 1 < input.size()) {
+      n |= static_cast<uint8_t>(input[i + 1]) << 8;
+    }
+    out += base64_chars[(n >> 18) & 63];
+    out += base64_chars[(n >> 12) & 63];
+    out += i + 1 < input.size() ? base64_chars[(n >> 6) & 63] : '=';
+    out += '=';
+  }
+  return out;
+}
+
 // URL decode
 inline std::string url_decode(const std::string &str) {
   std::string result;
@@ -78,6 +107,29 @@ inline std::string url_decode(const std::string &str) {
   return result;
 }
 
+// URL encode everything except unreserved characters (RFC 3986)
+inline std::string url_encode(const std::string &str) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string result;
+  for (unsigned char c : str) {
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      result += static_cast<char>(c);
+    } else {
+      result += '%';
+      result += hex[c >> 4];
+      result += hex[c & 0xF];
+    }
+  }
+  return result;
+}
+
+// Decode the 'src' query parameter (URL encoded base64) into the image URL
+inline std::string decode_image_url(const std::string &src_param) {
+  std::string decoded_src = url_decode(src_param);
+  std::vector<uint8_t> url_bytes = base64_decode(decoded_src);
+  return std::string(url_bytes.begin(), url_bytes.end());
+}
+
 // Parse with default value and upper and lower limits
 inline int parse_int_param(const std::string &value, int default_value,
                            int min_value, int max_value) {
@@ -96,4 +148,34 @@ inline int parse_int_param(const std::string &value, int default_value,
   }
 }
 
+// Parse a comma separated list such as "320,640,1280". Values are clamped,
+// duplicates dropped, and at most max_count entries are kept.
+inline std::vector<int> parse_int_list(const std::string &value,
+                                       int min_value, int max_value,
+                                       size_t max_count) {
+  std::vector<int> result;
+  size_t pos = 0;
+  while (pos < value.size() && result.size() < max_count) {
+    size_t end = value.find(',', pos);
+    if (end == std::string::npos)
+      end = value.size();
+    int v = parse_int_param(value.substr(pos, end - pos), -1, min_value,
+                            max_value);
+    if (v >= min_value &&
+        std::find(result.begin(), result.end(), v) == result.end()) {
+      result.push_back(v);
+    }
+    pos = end + 1;
+  }
+  return result;
+}
+
+// Read an integer environment variable, with the same rules as query params
+inline int env_int_param(const char *name, int default_value, int min_value,
+                         int max_value) {
+  const char *value = std::getenv(name);
+  return parse_int_param(value ? value : "", default_value, min_value,
+                         max_value);
+}
+
 } // namespace imgboost
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace imgboost {
+
+// Chase-Lev work-stealing deque of pointers (Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models"). The owning thread pushes
+// and pops at the bottom without locks; any thread may steal from the top.
+// Retired arrays are kept until destruction, a thief may still be reading
+// one after the owner has grown the deque.
+template <typename T> class WorkStealingDeque {
+public:
+  explicit WorkStealingDeque(int64_t capacity = 256)
+      : top_(0), bottom_(0) {
+    arrays_.push_back(std::make_unique<Array>(capacity));
+    array_.store(arrays_.back().get(), std::memory_order_relaxed);
+  }
+
+  // Disable copy
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  // Owner only
+  void push(T *item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array *a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      a = grow(a, t, b);
+    }
+    a->put(b, item);
+    // Publishes the item (and what it points to) to thieves
+    bottom_.store(b + 1, std::memory_order_release);
+  }
+
+  // Owner only, newest first. Returns nullptr when empty.
+  T *pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+
+    T *item = nullptr;
+    if (t <= b) {
+      item = a->get(b);
+      if (t == b) {
+        // Last item, race the thieves for it
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+          item = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Any thread, oldest first. Returns nullptr when empty or when it lost a
+  // race with another thief or the owner.
+  T *steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    Array *a = array_.load(std::memory_order_acquire);
+    T *item = a->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+  bool empty() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return b <= t;
+  }
+
+private:
+  struct Array {
+    explicit Array(int64_t cap)
+        : capacity(cap), mask(cap - 1),
+          slots(new std::atomic<T *>[static_cast<size_t>(cap)]) {}
+
+    T *get(int64_t i) const {
+      return slots[i & mask].load(std::memory_order_relaxed);
+    }
+    void put(int64_t i, T *item) {
+      slots[i & mask].store(item, std::memory_order_relaxed);
+    }
+
+    int64_t capacity; // power of two
+    int64_t mask;
+    std::unique_ptr<std::atomic<T *>[]> slots;
+  };
+
+  Array *grow(Array *old, int64_t t, int64_t b) {
+    arrays_.push_back(std::make_unique<Array>(old->capacity * 2));
+    Array *a = arrays_.back().get();
+    for (int64_t i = t; i < b; ++i) {
+      a->put(i, old->get(i));
+    }
+    array_.store(a, std::memory_order_release);
+    return a;
+  }
+
+  // Thieves and the owner hammer top_ and bottom_, keep them apart
+  alignas(64) std::atomic<int64_t> top_;
+  alignas(64) std::atomic<int64_t> bottom_;
+  alignas(64) std::atomic<Array *> array_;
+  std::vector<std::unique_ptr<Array>> arrays_; // owner only
+};
+
+} // namespace imgboost
@@ -0,0 +1,61 @@
+// Minimal assertions for the unit tests: a failed check prints where and
+// what, and the test keeps going so one run reports every failure.
+//
+//   int main() {
+//     CHECK(cache.get("a", value));
+//     CHECK_EQ(status, 400);
+//     return check_result();
+//   }
+
+#pragma once
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+namespace imgboost {
+namespace test {
+
+inline int &check_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline void check_failed(const char *file, int line, const std::string &what) {
+  check_failures()++;
+  std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what.c_str());
+}
+
+template <typename A, typename B>
+void check_equal(const A &actual, const B &expected, const char *file,
+                 int line, const char *expression) {
+  if (actual == expected) {
+    return;
+  }
+  std::ostringstream what;
+  what << expression << " is " << actual << ", expected " << expected;
+  check_failed(file, line, what.str());
+}
+
+// Exit status of the test executable
+inline int check_result() {
+  if (check_failures() > 0) {
+    std::fprintf(stderr, "%d check(s) failed\n", check_failures());
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace test
+} // namespace imgboost
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      ::imgboost::test::check_failed(__FILE__, __LINE__, #condition);          \
+    }                                                                          \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                             \
+  ::imgboost::test::check_equal((actual), (expected), __FILE__, __LINE__,      \
+                                #actual)
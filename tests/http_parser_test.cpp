@@ -0,0 +1,80 @@
+// parse_request_head: request line, header fields, query decoding,
+// keep-alive rules and the requests rejected before a handler runs.
+
+#include "check.h"
+#include "http_server.h"
+#include <string>
+
+using namespace imgboost;
+
+struct Parsed {
+  int status = 0;
+  HttpRequest request;
+  bool keep_alive = false;
+  std::string error;
+};
+
+static Parsed parse(const std::string &head) {
+  Parsed parsed;
+  parsed.status = parse_request_head(head, parsed.request, parsed.keep_alive,
+                                     parsed.error);
+  return parsed;
+}
+
+static void parses_request_line_and_query() {
+  Parsed p = parse("GET /image?url=https%3A%2F%2Fa.test%2Fx.jpg&w=320&q=80 "
+                   "HTTP/1.1\r\nHost: localhost");
+  CHECK_EQ(p.status, 0);
+  CHECK_EQ(p.request.method, "GET");
+  CHECK_EQ(p.request.path, "/image");
+  CHECK_EQ(p.request.get_param_value("url"), "https://a.test/x.jpg");
+  CHECK_EQ(p.request.get_param_value("w"), "320");
+  CHECK_EQ(p.request.get_param_value("q"), "80");
+  CHECK(!p.request.has_param("h"));
+  CHECK(p.keep_alive);
+}
+
+static void header_names_are_lower_case_and_values_trimmed() {
+  Parsed p = parse("HEAD / HTTP/1.1\r\nX-Trace-Id:   abc  \r\n"
+                   "ACCEPT: image/webp\r\nContent-Length: 0");
+  CHECK_EQ(p.status, 0);
+  CHECK_EQ(p.request.method, "HEAD");
+  CHECK_EQ(p.request.get_header_value("x-trace-id"), "abc");
+  CHECK_EQ(p.request.get_header_value("accept"), "image/webp");
+  CHECK_EQ(p.request.get_header_value("Accept"), "");
+}
+
+static void keep_alive_follows_version_and_connection() {
+  CHECK(parse("GET / HTTP/1.1").keep_alive);
+  CHECK(!parse("GET / HTTP/1.1\r\nConnection: close").keep_alive);
+  CHECK(!parse("GET / HTTP/1.1\r\nConnection: Close").keep_alive);
+  CHECK(!parse("GET / HTTP/1.0").keep_alive);
+  CHECK(parse("GET / HTTP/1.0\r\nConnection: keep-alive").keep_alive);
+}
+
+static void rejects_malformed_requests() {
+  CHECK_EQ(parse("GET").status, 400);
+  CHECK_EQ(parse("GET /").status, 400);
+  CHECK_EQ(parse("GET / HTTP/2.0").status, 400);
+  CHECK_EQ(parse("GET / SPDY/3").status, 400);
+  Parsed p = parse("GET / HTTP/1.1\r\nno colon here");
+  CHECK_EQ(p.status, 400);
+  CHECK_EQ(p.error, "Malformed header");
+  CHECK(!p.keep_alive);
+}
+
+static void rejects_request_bodies() {
+  CHECK_EQ(parse("POST / HTTP/1.1\r\nContent-Length: 12").status, 413);
+  CHECK_EQ(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked").status, 413);
+  // Never read, so the connection cannot be reused
+  CHECK(!parse("POST / HTTP/1.1\r\nContent-Length: 12").keep_alive);
+}
+
+int main() {
+  parses_request_line_and_query();
+  header_names_are_lower_case_and_values_trimmed();
+  keep_alive_follows_version_and_connection();
+  rejects_malformed_requests();
+  rejects_request_bodies();
+  return test::check_result();
+}
@@ -0,0 +1,148 @@
+// PixelBudget grants: reservations are granted in arrival order without
+// small ones jumping the queue, a release grants waiters from a single
+// loop rather than recursively, and an oversized request is clamped so it
+// still runs, alone.
+
+#include "check.h"
+#include "pixel_budget.h"
+#include <utility>
+#include <vector>
+
+using namespace imgboost;
+
+using Reservation = PixelBudget::Reservation;
+
+// Keeps every granted reservation and the order they arrived in
+struct Grants {
+  std::vector<int> order;
+  std::vector<Reservation> held;
+
+  // Releasing held[i] grants into held; it must not reallocate under it
+  Grants() { held.reserve(16); }
+
+  PixelBudget::Granted keep(int id) {
+    return [this, id](Reservation reservation) {
+      order.push_back(id);
+      held.push_back(std::move(reservation));
+    };
+  }
+};
+
+static void zero_capacity_grants_everything() {
+  PixelBudget budget(0);
+  Grants grants;
+  budget.reserve_async(1 << 30, grants.keep(0));
+  budget.reserve_async(1 << 30, grants.keep(1));
+  CHECK(grants.order == std::vector<int>({0, 1}));
+  Reservation reservation;
+  CHECK(budget.try_reserve(1 << 30, reservation));
+  CHECK_EQ(budget.stats().in_use, 0u);
+}
+
+static void waiters_are_granted_in_arrival_order() {
+  PixelBudget budget(100);
+  Grants grants;
+  budget.reserve_async(60, grants.keep(0));
+  CHECK(grants.order == std::vector<int>({0}));
+  budget.reserve_async(50, grants.keep(1));
+  // Fits, but must not overtake the waiting 50
+  budget.reserve_async(10, grants.keep(2));
+  Reservation reservation;
+  CHECK(!budget.try_reserve(10, reservation));
+  PixelBudgetStats stats = budget.stats();
+  CHECK_EQ(stats.in_use, 60u);
+  CHECK_EQ(stats.waiting, 2u);
+  CHECK_EQ(stats.waits, 2u);
+
+  // Freeing the 60 makes room for both, in order, on this thread
+  grants.held[0].reset();
+  CHECK(grants.order == std::vector<int>({0, 1, 2}));
+  stats = budget.stats();
+  CHECK_EQ(stats.in_use, 60u);
+  CHECK_EQ(stats.waiting, 0u);
+  CHECK(budget.try_reserve(40, reservation));
+  CHECK_EQ(budget.stats().in_use, 100u);
+}
+
+// A release grants only as far as the head of the queue fits
+static void large_head_blocks_until_it_fits() {
+  PixelBudget budget(100);
+  Grants grants;
+  budget.reserve_async(40, grants.keep(0));
+  budget.reserve_async(40, grants.keep(1));
+  budget.reserve_async(90, grants.keep(2));
+  budget.reserve_async(5, grants.keep(3));
+  grants.held[0].reset();
+  CHECK(grants.order == std::vector<int>({0, 1}));
+  grants.held[1].reset();
+  CHECK(grants.order == std::vector<int>({0, 1, 2, 3}));
+  CHECK_EQ(budget.stats().in_use, 95u);
+}
+
+static void oversized_request_runs_alone() {
+  PixelBudget budget(100);
+  Grants grants;
+  budget.reserve_async(1000, grants.keep(0));
+  CHECK(grants.order == std::vector<int>({0}));
+  CHECK_EQ(budget.stats().in_use, 100u);
+  budget.reserve_async(1, grants.keep(1));
+  CHECK_EQ(grants.order.size(), 1u);
+  grants.held[0].reset();
+  CHECK(grants.order == std::vector<int>({0, 1}));
+  CHECK_EQ(budget.stats().in_use, 1u);
+}
+
+// A granted request cancelled on the spot releases from inside the grant
+// loop; the loop picks that up instead of recursing into a second one
+static void release_inside_a_grant_does_not_recurse() {
+  PixelBudget budget(100);
+  Grants grants;
+  budget.reserve_async(100, grants.keep(0));
+  bool inside_cancelled = false;
+  bool granted_while_inside = false;
+  budget.reserve_async(100, [&](Reservation reservation) {
+    inside_cancelled = true;
+    reservation.reset();
+    inside_cancelled = false;
+  });
+  budget.reserve_async(100, [&](Reservation reservation) {
+    granted_while_inside = inside_cancelled;
+    grants.held.push_back(std::move(reservation));
+  });
+  grants.held[0].reset();
+  CHECK(!granted_while_inside);
+  CHECK_EQ(grants.held.size(), 2u);
+  PixelBudgetStats stats = budget.stats();
+  CHECK_EQ(stats.in_use, 100u);
+  CHECK_EQ(stats.waiting, 0u);
+}
+
+// Moving a reservation hands over its bytes; they are released once
+static void reservation_releases_once() {
+  PixelBudget budget(100);
+  Reservation a;
+  CHECK(budget.try_reserve(30, a));
+  Reservation b = std::move(a);
+  a.reset();
+  CHECK_EQ(budget.stats().in_use, 30u);
+  Reservation c;
+  c = std::move(b);
+  CHECK_EQ(budget.stats().in_use, 30u);
+  c.reset();
+  c.reset();
+  CHECK_EQ(budget.stats().in_use, 0u);
+  // Reserving into a held reservation swaps the old bytes for the new
+  CHECK(budget.try_reserve(20, c));
+  CHECK(budget.try_reserve(50, c));
+  CHECK_EQ(budget.stats().in_use, 50u);
+}
+
+int main() {
+  zero_capacity_grants_everything();
+  waiters_are_granted_in_arrival_order();
+  large_head_blocks_until_it_fits();
+  oversized_request_runs_alone();
+  release_inside_a_grant_does_not_recurse();
+  reservation_releases_once();
+  return test::check_result();
+}
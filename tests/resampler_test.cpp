@@ -0,0 +1,176 @@
+// The SIMD kernel sets against the scalar reference: every filter, channel
+// count and scale must produce the same bytes, through resample() and
+// RowResampler alike, and the opacity scan must agree. Kernel sets the CPU
+// lacks are skipped.
+
+#include "check.h"
+#include "resampler.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace imgboost;
+
+struct Case {
+  int src_width, src_height, dst_width, dst_height;
+};
+
+// Odd sizes leave remainders past every vector width
+static const Case kCases[] = {
+    {257, 131, 64, 33},   // strong downscale
+    {300, 200, 211, 147}, // mild downscale
+    {37, 23, 301, 97},    // upscale
+    {128, 96, 128, 48},   // vertical only
+    {97, 64, 31, 64},     // horizontal only
+    {1, 1, 5, 3},         // single pixel
+};
+
+static const ResampleFilter kFilters[] = {
+    ResampleFilter::BOX, ResampleFilter::BILINEAR, ResampleFilter::BICUBIC,
+    ResampleFilter::LANCZOS3};
+
+static const int kChannels[] = {1, 3, 4};
+
+static std::vector<uint8_t> noise(size_t bytes, uint32_t seed) {
+  std::vector<uint8_t> out(bytes);
+  uint32_t state = seed | 1;
+  for (uint8_t &byte : out) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    byte = static_cast<uint8_t>(state >> 24);
+  }
+  return out;
+}
+
+// Premultiplied RGBA with every alpha from 0 to 255
+static std::vector<uint8_t> premultiplied(size_t pixels, uint32_t seed) {
+  std::vector<uint8_t> rgba = noise(pixels * 4, seed);
+  for (size_t i = 0; i < pixels; ++i) {
+    rgba[i * 4 + 3] = static_cast<uint8_t>(i);
+  }
+  premultiply_alpha(rgba.data(), pixels);
+  return rgba;
+}
+
+static std::vector<uint8_t> resize(const Case &c,
+                                   const std::vector<uint8_t> &src,
+                                   int channels, ResampleFilter filter) {
+  std::vector<uint8_t> dst(static_cast<size_t>(c.dst_width) * c.dst_height *
+                           channels);
+  resample(src.data(), c.src_width, c.src_height, c.src_width * channels,
+           dst.data(), c.dst_width, c.dst_height, c.dst_width * channels,
+           channels, filter);
+  return dst;
+}
+
+static std::vector<uint8_t> resize_rows(const Case &c,
+                                        const std::vector<uint8_t> &src,
+                                        int channels, ResampleFilter filter) {
+  size_t row_bytes = static_cast<size_t>(c.dst_width) * channels;
+  std::vector<uint8_t> dst(row_bytes * c.dst_height);
+  RowResampler rows(c.src_width, c.src_height, c.dst_width, c.dst_height,
+                    channels, filter, [&](int y, const uint8_t *row) {
+                      std::memcpy(dst.data() + y * row_bytes, row, row_bytes);
+                    });
+  for (int y = 0; y < c.src_height; ++y) {
+    rows.push(src.data() + static_cast<size_t>(y) * c.src_width * channels);
+  }
+  CHECK_EQ(rows.rows_emitted(), c.dst_height);
+  return dst;
+}
+
+static std::string describe(const char *isa, const Case &c, int channels,
+                            ResampleFilter filter) {
+  char buf[128];
+  std::snprintf(buf, sizeof(buf), "%s %dx%d -> %dx%d, %d channels, %s", isa,
+                c.src_width, c.src_height, c.dst_width, c.dst_height, channels,
+                resample_filter_name(filter));
+  return buf;
+}
+
+static void check_same(const std::vector<uint8_t> &actual,
+                       const std::vector<uint8_t> &expected,
+                       const std::string &what) {
+  if (actual != expected) {
+    test::check_failed(__FILE__, __LINE__, what + " differs from scalar");
+  }
+}
+
+static void kernels_match_scalar(const char *isa) {
+  for (const Case &c : kCases) {
+    for (int channels : kChannels) {
+      size_t pixels = static_cast<size_t>(c.src_width) * c.src_height;
+      std::vector<uint8_t> src =
+          channels == 4 ? premultiplied(pixels, c.src_width)
+                        : noise(pixels * channels, c.src_height);
+      for (ResampleFilter filter : kFilters) {
+        select_resampler_isa("scalar");
+        std::vector<uint8_t> expected = resize(c, src, channels, filter);
+        CHECK(select_resampler_isa(isa));
+        std::string what = describe(isa, c, channels, filter);
+        check_same(resize(c, src, channels, filter), expected, what);
+        check_same(resize_rows(c, src, channels, filter), expected,
+                   what + " by rows");
+      }
+    }
+  }
+}
+
+// The opacity scan is the one alpha helper with SIMD kernels
+static void opaque_scan_matches(const char *isa) {
+  const size_t pixels = 1031;
+  std::vector<uint8_t> rgba = noise(pixels * 4, 5);
+  for (size_t i = 0; i < pixels; ++i) {
+    rgba[i * 4 + 3] = 255;
+  }
+  CHECK(select_resampler_isa(isa));
+  CHECK(rgba_opaque(rgba.data(), pixels));
+  // A translucent pixel anywhere, including the scalar tail
+  for (size_t at : {size_t(0), pixels / 2, pixels - 1}) {
+    rgba[at * 4 + 3] = 254;
+    if (rgba_opaque(rgba.data(), pixels)) {
+      test::check_failed(__FILE__, __LINE__,
+                         std::string(isa) + " missed translucent pixel " +
+                             std::to_string(at));
+    }
+    rgba[at * 4 + 3] = 255;
+  }
+}
+
+// Resizing a flat image leaves it flat, whatever the kernel rounding
+static void flat_stays_flat() {
+  Case c = {199, 101, 67, 250};
+  std::vector<uint8_t> src(static_cast<size_t>(c.src_width) * c.src_height * 3,
+                           173);
+  for (ResampleFilter filter : kFilters) {
+    std::vector<uint8_t> dst = resize(c, src, 3, filter);
+    bool flat = true;
+    for (uint8_t byte : dst) {
+      flat = flat && byte == 173;
+    }
+    if (!flat) {
+      test::check_failed(__FILE__, __LINE__,
+                         std::string(resample_filter_name(filter)) +
+                             " changed a flat image");
+    }
+  }
+}
+
+int main() {
+  std::printf("detected kernels: %s\n", resampler_isa());
+  for (const char *isa : {"sse4.1", "avx2"}) {
+    if (!select_resampler_isa(isa)) {
+      std::printf("%s: not supported, skipped\n", isa);
+      continue;
+    }
+    kernels_match_scalar(isa);
+    opaque_scan_matches(isa);
+  }
+  select_resampler_isa("scalar");
+  opaque_scan_matches("scalar");
+  flat_stays_flat();
+  return test::check_result();
+}
@@ -0,0 +1,107 @@
+// ResultCache eviction order: one-off entries leave through probation, a
+// second hit protects an entry, and protected overflow is demoted back.
+
+#include "check.h"
+#include "result_cache.h"
+#include <string>
+#include <vector>
+
+using namespace imgboost;
+
+// Every entry is charged its value, twice its two-character key and 128
+// bytes of bookkeeping
+static const size_t kValueBytes = 100;
+static const size_t kCharge = kValueBytes + 2 * 2 + 128;
+
+static SharedBuffer value() {
+  return SharedBuffer::from_vector(std::vector<uint8_t>(kValueBytes, 7));
+}
+
+static bool cached(ResultCache &cache, const std::string &key) {
+  SharedBuffer out;
+  return cache.get(key, out);
+}
+
+// One shard of five entries, four of which fit the protected segment
+static ResultCache five_entries() { return ResultCache(kCharge * 5, 1); }
+
+static void probation_evicts_least_recent() {
+  ResultCache cache = five_entries();
+  for (const char *key : {"k0", "k1", "k2", "k3", "k4"}) {
+    cache.put(key, value());
+  }
+  cache.put("k5", value());
+  CacheStats stats = cache.stats();
+  CHECK_EQ(stats.evictions, 1u);
+  CHECK_EQ(stats.entries, 5u);
+  CHECK(!cached(cache, "k0"));
+  for (const char *key : {"k1", "k2", "k3", "k4", "k5"}) {
+    CHECK(cached(cache, key));
+  }
+}
+
+static void second_hit_survives_a_scan() {
+  ResultCache cache = five_entries();
+  for (const char *key : {"k0", "k1", "k2", "k3", "k4"}) {
+    cache.put(key, value());
+  }
+  // k0 is the oldest, but promoted
+  CHECK(cached(cache, "k0"));
+  // A burst of one-off keys churns probation only
+  for (const char *key : {"s0", "s1", "s2", "s3", "s4", "s5"}) {
+    cache.put(key, value());
+  }
+  CHECK(cached(cache, "k0"));
+  for (const char *key : {"k1", "k2", "k3", "k4", "s0", "s1"}) {
+    CHECK(!cached(cache, key));
+  }
+  CHECK_EQ(cache.stats().evictions, 6u);
+}
+
+static void protected_overflow_is_demoted() {
+  ResultCache cache = five_entries();
+  for (const char *key : {"k0", "k1", "k2", "k3", "k4"}) {
+    cache.put(key, value());
+  }
+  // Promoting the fifth pushes the least recent protected entry, k0, back to
+  // the head of probation, where it is the only entry left
+  for (const char *key : {"k0", "k1", "k2", "k3", "k4"}) {
+    CHECK(cached(cache, key));
+  }
+  cache.put("n0", value());
+  CHECK(!cached(cache, "k0"));
+  for (const char *key : {"k1", "k2", "k3", "k4", "n0"}) {
+    CHECK(cached(cache, key));
+  }
+}
+
+static void replacing_a_key_keeps_one_entry() {
+  ResultCache cache = five_entries();
+  cache.put("k0", value());
+  cache.put("k0", SharedBuffer::from_vector(std::vector<uint8_t>(10, 1)));
+  CacheStats stats = cache.stats();
+  CHECK_EQ(stats.entries, 1u);
+  CHECK_EQ(stats.bytes, 10 + 2 * 2 + 128u);
+  SharedBuffer out;
+  CHECK(cache.get("k0", out));
+  CHECK_EQ(out.size(), 10u);
+}
+
+static void oversized_entry_is_not_stored() {
+  ResultCache cache = five_entries();
+  cache.put("k0", value());
+  cache.put("big", SharedBuffer::from_vector(
+                       std::vector<uint8_t>(kCharge * 5, 0)));
+  CHECK(!cached(cache, "big"));
+  CHECK(cached(cache, "k0"));
+  CHECK_EQ(cache.stats().evictions, 0u);
+}
+
+int main() {
+  probation_evicts_least_recent();
+  second_hit_survives_a_scan();
+  protected_overflow_is_demoted();
+  replacing_a_key_keeps_one_entry();
+  oversized_entry_is_not_stored();
+  return test::check_result();
+}
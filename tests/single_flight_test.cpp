@@ -0,0 +1,161 @@
+// SingleFlight coalescing and the CancelToken semantics it relies on: a
+// shared token is cancelled only once every member is, a null member pins
+// it, and a cancelled flight is never joined.
+
+#include "cancel_token.h"
+#include "check.h"
+#include "single_flight.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace imgboost;
+
+static void token_latches() {
+  CancelToken token;
+  CHECK(!token.cancelled());
+  token.cancel();
+  CHECK(token.cancelled());
+  CHECK(token.cancelled());
+}
+
+static void deadline_cancels() {
+  CancelToken past;
+  past.set_deadline(CancelToken::Clock::now() - std::chrono::seconds(1));
+  CHECK(past.cancelled());
+
+  CancelToken future;
+  future.set_deadline(CancelToken::Clock::now() + std::chrono::hours(1));
+  CHECK(!future.cancelled());
+}
+
+static void shared_token_waits_for_every_member() {
+  CancelTokenPtr shared = CancelToken::shared();
+  // Without members nothing has asked for the work to stop
+  CHECK(!shared->cancelled());
+
+  CancelTokenPtr a = std::make_shared<CancelToken>();
+  CancelTokenPtr b = std::make_shared<CancelToken>();
+  shared->add_member(a);
+  shared->add_member(b);
+  a->cancel();
+  CHECK(!shared->cancelled());
+  b->cancel();
+  CHECK(shared->cancelled());
+
+  // Latched: later members cannot revive it
+  shared->add_member(std::make_shared<CancelToken>());
+  CHECK(shared->cancelled());
+}
+
+static void null_member_pins_shared_token() {
+  CancelTokenPtr shared = CancelToken::shared();
+  CancelTokenPtr a = std::make_shared<CancelToken>();
+  shared->add_member(a);
+  shared->add_member(nullptr);
+  a->cancel();
+  CHECK(!shared->cancelled());
+}
+
+static void followers_share_the_leaders_result() {
+  SingleFlight<int> flight;
+  std::vector<int> results;
+  auto record = [&results](int result) { results.push_back(result); };
+
+  CancelTokenPtr leader = flight.join("key", record);
+  CHECK(leader != nullptr);
+  CHECK(flight.join("key", record) == nullptr);
+  CHECK(flight.join("key", record) == nullptr);
+  // Other keys fly on their own
+  CancelTokenPtr other = flight.join("other", record);
+  CHECK(other != nullptr);
+  CHECK_EQ(flight.in_flight(), 2u);
+  CHECK_EQ(flight.coalesced(), 2u);
+
+  flight.complete("key", leader, 7);
+  CHECK_EQ(results.size(), 3u);
+  for (int result : results) {
+    CHECK_EQ(result, 7);
+  }
+  CHECK_EQ(flight.in_flight(), 1u);
+
+  // Done flights take no waiters: the next caller leads again
+  CancelTokenPtr again = flight.join("key", record);
+  CHECK(again != nullptr);
+  CHECK(again != leader);
+  flight.complete("other", other, 1);
+  flight.complete("key", again, 2);
+  CHECK_EQ(flight.in_flight(), 0u);
+  CHECK_EQ(results.size(), 5u);
+}
+
+static void flight_cancelled_once_every_waiter_is() {
+  SingleFlight<int> flight;
+  CancelTokenPtr a = std::make_shared<CancelToken>();
+  CancelTokenPtr b = std::make_shared<CancelToken>();
+  CancelTokenPtr token = flight.join("key", [](int) {}, a);
+  flight.join("key", [](int) {}, b);
+  a->cancel();
+  CHECK(!token->cancelled());
+  b->cancel();
+  CHECK(token->cancelled());
+  flight.complete("key", token, 0);
+}
+
+static void cancelled_flight_is_not_joined() {
+  SingleFlight<int> flight;
+  int stale = 0, fresh = 0, follower = 0;
+  CancelTokenPtr gone = std::make_shared<CancelToken>();
+  CancelTokenPtr old_flight =
+      flight.join("key", [&stale](int result) { stale = result; }, gone);
+  gone->cancel();
+  CHECK(old_flight->cancelled());
+
+  // A live request leads a new flight rather than inherit the 504
+  CancelTokenPtr new_flight =
+      flight.join("key", [&fresh](int result) { fresh = result; });
+  CHECK(new_flight != nullptr);
+  CHECK(new_flight != old_flight);
+  CHECK(!new_flight->cancelled());
+  CHECK(flight.join("key", [&follower](int result) { follower = result; }) ==
+        nullptr);
+  CHECK_EQ(flight.in_flight(), 2u);
+
+  // Each flight's result reaches its own waiters only, in either order
+  flight.complete("key", new_flight, 200);
+  CHECK_EQ(fresh, 200);
+  CHECK_EQ(follower, 200);
+  CHECK_EQ(stale, 0);
+  flight.complete("key", old_flight, 504);
+  CHECK_EQ(stale, 504);
+  CHECK_EQ(flight.in_flight(), 0u);
+
+  // Completing a flight twice, or an unknown one, delivers nothing
+  flight.complete("key", old_flight, 1);
+  CHECK_EQ(stale, 504);
+}
+
+static void waiter_may_start_new_work() {
+  SingleFlight<int> flight;
+  CancelTokenPtr nested;
+  CancelTokenPtr token = flight.join("key", [&](int) {
+    nested = flight.join("key", [](int) {});
+  });
+  flight.complete("key", token, 0);
+  CHECK(nested != nullptr);
+  CHECK_EQ(flight.in_flight(), 1u);
+  flight.complete("key", nested, 0);
+}
+
+int main() {
+  token_latches();
+  deadline_cancels();
+  shared_token_waits_for_every_member();
+  null_member_pins_shared_token();
+  followers_share_the_leaders_result();
+  flight_cancelled_once_every_waiter_is();
+  cancelled_flight_is_not_joined();
+  waiter_may_start_new_work();
+  return test::check_result();
+}
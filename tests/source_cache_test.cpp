@@ -0,0 +1,140 @@
+// parse_freshness over the Cache-Control forms origins send, and the source
+// cache's fresh lookup that answers downloads before they are queued.
+
+#include "check.h"
+#include "source_cache.h"
+#include <string>
+#include <vector>
+
+using namespace imgboost;
+
+struct FreshnessCase {
+  const char *cache_control;
+  const char *age;
+  bool cacheable;
+  bool has_max_age;
+  int64_t max_age;
+};
+
+static const FreshnessCase kCases[] = {
+    // No directives: the heuristic TTL applies
+    {"", "", true, false, 0},
+    {"public", "", true, false, 0},
+    {"max-age=600", "", true, true, 600},
+    {"public, max-age=600", "", true, true, 600},
+    {"MAX-AGE=600", "", true, true, 600},
+    {"  max-age=600  ,public", "", true, true, 600},
+    // A shared cache prefers s-maxage, in either order
+    {"max-age=600, s-maxage=60", "", true, true, 60},
+    {"s-maxage=60, max-age=600", "", true, true, 60},
+    {"s-maxage=0, max-age=600", "", true, true, 0},
+    // no-cache stores but always revalidates, wherever it appears
+    {"no-cache", "", true, true, 0},
+    {"max-age=600, no-cache", "", true, true, 0},
+    {"no-cache, s-maxage=60", "", true, true, 0},
+    // Field-name forms only restrict the named headers
+    {"no-cache=\"Set-Cookie\", max-age=600", "", true, true, 600},
+    {"private=\"Set-Cookie\", max-age=600", "", true, true, 600},
+    // Not stored at all
+    {"no-store", "", false, false, 0},
+    {"max-age=600, no-store", "", false, true, 600},
+    {"private, max-age=600", "", false, true, 600},
+    {"Private", "", false, false, 0},
+    // Age reduces the lifetime, never below zero, and needs a max-age
+    {"max-age=600", "100", true, true, 500},
+    {"s-maxage=60, max-age=600", "100", true, true, 0},
+    {"max-age=600", "1000", true, true, 0},
+    {"", "100", true, false, 0},
+    {"max-age=-5", "", true, true, 0},
+};
+
+static void freshness_table() {
+  for (const FreshnessCase &c : kCases) {
+    SourceFreshness freshness = parse_freshness(c.cache_control, c.age);
+    std::string what = std::string("Cache-Control: ") + c.cache_control +
+                       ", Age: " + c.age;
+    if (freshness.cacheable != c.cacheable ||
+        freshness.has_max_age != c.has_max_age ||
+        (c.has_max_age && freshness.max_age != c.max_age)) {
+      test::check_failed(
+          __FILE__, __LINE__,
+          what + " gave cacheable=" + std::to_string(freshness.cacheable) +
+              " has_max_age=" + std::to_string(freshness.has_max_age) +
+              " max_age=" + std::to_string(freshness.max_age));
+    }
+  }
+}
+
+static SourceEntry entry(size_t bytes) {
+  SourceEntry entry;
+  entry.data = SharedBuffer::from_vector(std::vector<uint8_t>(bytes, 1));
+  entry.etag = "\"v1\"";
+  return entry;
+}
+
+static void fresh_lookup_skips_stale_entries() {
+  SourceCache cache(1 << 20, 60);
+  SharedBuffer data;
+  CHECK(!cache.get_fresh("https://a.test/missing.jpg", data));
+
+  cache.put("https://a.test/fresh.jpg", entry(10),
+            parse_freshness("max-age=600", ""));
+  cache.put("https://a.test/stale.jpg", entry(20),
+            parse_freshness("no-cache", ""));
+  cache.put("https://a.test/private.jpg", entry(30),
+            parse_freshness("private", ""));
+
+  CHECK(cache.get_fresh("https://a.test/fresh.jpg", data));
+  CHECK_EQ(data.size(), 10u);
+  // Stale entries stay for revalidation through get()
+  CHECK(!cache.get_fresh("https://a.test/stale.jpg", data));
+  SourceEntry stale;
+  CHECK(cache.get("https://a.test/stale.jpg", stale));
+  CHECK(!stale.is_fresh());
+  CHECK(stale.can_revalidate());
+  CHECK(!cache.get_fresh("https://a.test/private.jpg", data));
+
+  // Only the fresh hit and the get() of the stale entry are counted
+  CacheStats stats = cache.stats();
+  CHECK_EQ(stats.hits, 1u);
+  CHECK_EQ(stats.misses, 1u);
+  CHECK_EQ(stats.entries, 2u);
+}
+
+static void refresh_makes_stale_entry_fresh() {
+  SourceCache cache(1 << 20, 60);
+  cache.put("https://a.test/x.jpg", entry(10), parse_freshness("no-cache", ""));
+  SharedBuffer data;
+  CHECK(!cache.get_fresh("https://a.test/x.jpg", data));
+  cache.refresh("https://a.test/x.jpg", parse_freshness("max-age=60", ""));
+  CHECK(cache.get_fresh("https://a.test/x.jpg", data));
+  CHECK_EQ(cache.revalidations(), 1u);
+  // A 304 turning the response private drops the entry
+  cache.refresh("https://a.test/x.jpg", parse_freshness("private", ""));
+  CHECK_EQ(cache.stats().entries, 0u);
+}
+
+static void unvalidated_entry_needs_freshness() {
+  SourceCache cache(1 << 20, 0);
+  SourceEntry bare;
+  bare.data = SharedBuffer::from_vector(std::vector<uint8_t>(10, 1));
+  // No max-age and no validators: never reusable, so not stored
+  cache.put("https://a.test/bare.jpg", bare, parse_freshness("", ""));
+  CHECK_EQ(cache.stats().entries, 0u);
+  cache.put("https://a.test/bare.jpg", bare, parse_freshness("max-age=60", ""));
+  SharedBuffer data;
+  CHECK(cache.get_fresh("https://a.test/bare.jpg", data));
+  // With validators it is kept, but every use revalidates
+  cache.put("https://a.test/tagged.jpg", entry(10), parse_freshness("", ""));
+  CHECK(!cache.get_fresh("https://a.test/tagged.jpg", data));
+  SourceEntry stale;
+  CHECK(cache.get("https://a.test/tagged.jpg", stale));
+}
+
+int main() {
+  freshness_table();
+  fresh_lookup_skips_stale_entries();
+  refresh_makes_stale_entry_fresh();
+  unvalidated_entry_needs_freshness();
+  return test::check_result();
+}
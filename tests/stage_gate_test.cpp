@@ -0,0 +1,168 @@
+// StageGate admission: at most max_concurrency tasks run, the rest start in
+// submission order as slots free up, and the queue refuses work past its
+// byte bound except into an empty queue.
+
+#include "check.h"
+#include "stage_gate.h"
+#include "thread_pool.h"
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+using namespace imgboost;
+
+// Declared like the scheduler's stages: the gate first, so tasks still
+// draining from the pool at destruction find it intact
+struct Stage {
+  StageGate gate;
+  ThreadPool pool;
+
+  Stage(size_t threads, const StageLimits &limits)
+      : gate(pool, limits), pool(threads) {}
+};
+
+static StageLimits limits(size_t max_concurrency, size_t max_queued_bytes) {
+  StageLimits limits;
+  limits.max_concurrency = max_concurrency;
+  limits.max_queued_bytes = max_queued_bytes;
+  return limits;
+}
+
+// Tasks record their id in start order; held ones wait for release()
+class Recorder {
+public:
+  Recorder() : released_(release_.get_future().share()) {}
+
+  Task task(int id, bool held = false) {
+    return [this, id, held] {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        started_.push_back(id);
+      }
+      changed_.notify_all();
+      if (held) {
+        released_.wait();
+      }
+    };
+  }
+
+  void release() { release_.set_value(); }
+
+  void wait_for(size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [&] { return started_.size() >= count; });
+  }
+
+  std::vector<int> started() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return started_;
+  }
+
+private:
+  std::promise<void> release_;
+  std::shared_future<void> released_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::vector<int> started_;
+};
+
+// Four threads, but one slot: queued tasks start one at a time, oldest first
+static void queued_tasks_start_in_order() {
+  Recorder recorder;
+  {
+    Stage stage(4, limits(1, 0));
+    CHECK(stage.gate.submit(1, recorder.task(0, true)));
+    recorder.wait_for(1);
+    for (int id = 1; id <= 5; ++id) {
+      CHECK(stage.gate.submit(1, recorder.task(id)));
+    }
+    StageStats stats = stage.gate.stats();
+    CHECK_EQ(stats.running, 1u);
+    CHECK_EQ(stats.queued, 5u);
+    CHECK_EQ(stats.queued_bytes, 5u);
+    CHECK(stage.gate.backlog() == 5.0);
+    recorder.release();
+    recorder.wait_for(6);
+  }
+  CHECK(recorder.started() == std::vector<int>({0, 1, 2, 3, 4, 5}));
+}
+
+static void concurrency_cap_holds_back_extra_tasks() {
+  Recorder recorder;
+  {
+    Stage stage(4, limits(2, 0));
+    CHECK(stage.gate.estimated_wait() == 0);
+    for (int id = 0; id < 4; ++id) {
+      CHECK(stage.gate.submit(1, recorder.task(id, true)));
+    }
+    recorder.wait_for(2);
+    StageStats stats = stage.gate.stats();
+    CHECK_EQ(stats.running, 2u);
+    CHECK_EQ(stats.queued, 2u);
+    CHECK_EQ(recorder.started().size(), 2u);
+    recorder.release();
+    recorder.wait_for(4);
+  }
+}
+
+static void full_queue_rejects_by_bytes() {
+  Recorder recorder;
+  {
+    Stage stage(2, limits(1, 100));
+    // Running tasks are not counted against the queue
+    CHECK(stage.gate.submit(1000, recorder.task(0, true)));
+    recorder.wait_for(1);
+    CHECK(stage.gate.submit(60, recorder.task(1)));
+    CHECK(!stage.gate.submit(50, recorder.task(2)));
+    CHECK(stage.gate.submit(40, recorder.task(3)));
+    CHECK(!stage.gate.submit(1, recorder.task(4)));
+    StageStats stats = stage.gate.stats();
+    CHECK_EQ(stats.queued, 2u);
+    CHECK_EQ(stats.queued_bytes, 100u);
+    CHECK_EQ(stats.rejected, 2u);
+    recorder.release();
+    recorder.wait_for(3);
+  }
+  CHECK(recorder.started() == std::vector<int>({0, 1, 3}));
+}
+
+// A source larger than the whole bound must not be refused forever
+static void oversized_task_fits_an_empty_queue() {
+  Recorder recorder;
+  {
+    Stage stage(2, limits(1, 100));
+    CHECK(stage.gate.submit(1, recorder.task(0, true)));
+    recorder.wait_for(1);
+    CHECK(stage.gate.submit(500, recorder.task(1)));
+    CHECK(!stage.gate.submit(500, recorder.task(2)));
+    CHECK_EQ(stage.gate.stats().queued_bytes, 500u);
+    recorder.release();
+    recorder.wait_for(2);
+  }
+  CHECK(recorder.started() == std::vector<int>({0, 1}));
+}
+
+// A throwing task still frees its slot for the next one
+static void throwing_task_frees_its_slot() {
+  Recorder recorder;
+  {
+    Stage stage(2, limits(1, 0));
+    CHECK(stage.gate.submit(1, [] { throw std::runtime_error("stage test"); }));
+    CHECK(stage.gate.submit(1, recorder.task(0)));
+    recorder.wait_for(1);
+  }
+  CHECK_EQ(recorder.started().size(), 1u);
+}
+
+int main() {
+  // The throwing task's error log is expected
+  Logger::instance().set_level(LogLevel::OFF);
+  queued_tasks_start_in_order();
+  concurrency_cap_holds_back_extra_tasks();
+  full_queue_rejects_by_bytes();
+  oversized_task_fits_an_empty_queue();
+  throwing_task_frees_its_slot();
+  return test::check_result();
+}
@@ -0,0 +1,307 @@
+// The work-stealing deque under an owner racing several thieves, and the
+// ThreadPool built on it: every task submitted from outside, from a worker
+// or from inside a running task runs exactly once, parallel_for visits every
+// index once however it is nested, and destroying the pool drains its queue.
+
+#include "check.h"
+#include "thread_pool.h"
+#include "work_stealing_deque.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace imgboost;
+
+// One counter per item; each test checks they all ended at exactly one
+class Tally {
+public:
+  explicit Tally(size_t count) : counts_(count) {}
+
+  void hit(size_t i) { counts_[i].fetch_add(1, std::memory_order_relaxed); }
+
+  size_t size() const { return counts_.size(); }
+
+  void check_once(const char *what) const {
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      int count = counts_[i].load();
+      if (count != 1) {
+        test::check_failed(__FILE__, __LINE__,
+                           std::string(what) + ": item " + std::to_string(i) +
+                               " ran " + std::to_string(count) + " times");
+        return;
+      }
+    }
+  }
+
+private:
+  std::vector<std::atomic<int>> counts_;
+};
+
+// Blocks until count arrivals
+class Latch {
+public:
+  explicit Latch(size_t count) : count_(count) {}
+
+  void arrive() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--count_ == 0) {
+      done_.notify_all();
+    }
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return count_ == 0; });
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable done_;
+  size_t count_;
+};
+
+// The owner pushes in bursts past the initial capacity and pops some back
+// while thieves steal from the top; nothing is lost or taken twice
+static void deque_owner_and_thieves_take_each_item_once() {
+  const size_t kItems = 200000;
+  std::vector<size_t> items(kItems);
+  for (size_t i = 0; i < kItems; ++i) {
+    items[i] = i;
+  }
+  Tally tally(kItems);
+  WorkStealingDeque<size_t> deque(4);
+  std::atomic<bool> pushing{true};
+
+  std::vector<std::thread> thieves;
+  for (int t = 0; t < 4; ++t) {
+    thieves.emplace_back([&] {
+      while (pushing.load() || !deque.empty()) {
+        if (size_t *item = deque.steal()) {
+          tally.hit(*item);
+        }
+      }
+    });
+  }
+
+  size_t next = 0;
+  while (next < kItems) {
+    // Bursts of up to 1000 grow the deque several times over
+    size_t burst = std::min(kItems - next, 1 + next % 1000);
+    for (size_t i = 0; i < burst; ++i) {
+      deque.push(&items[next++]);
+    }
+    for (size_t i = 0; i < burst / 2; ++i) {
+      if (size_t *item = deque.pop()) {
+        tally.hit(*item);
+      }
+    }
+  }
+  while (size_t *item = deque.pop()) {
+    tally.hit(*item);
+  }
+  pushing = false;
+  for (std::thread &thief : thieves) {
+    thief.join();
+  }
+  CHECK(deque.empty());
+  tally.check_once("deque");
+}
+
+// Owner-only use is LIFO at the bottom
+static void deque_pops_newest_first() {
+  int a = 0, b = 1, c = 2;
+  WorkStealingDeque<int> deque(2);
+  deque.push(&a);
+  deque.push(&b);
+  deque.push(&c);
+  CHECK(deque.pop() == &c);
+  CHECK(deque.steal() == &a);
+  CHECK(deque.pop() == &b);
+  CHECK(deque.pop() == nullptr);
+  CHECK(deque.steal() == nullptr);
+}
+
+static void tasks_from_other_threads_run_once() {
+  const size_t kThreads = 4, kPerThread = 20000;
+  Tally tally(kThreads * kPerThread);
+  Latch done(tally.size());
+  {
+    ThreadPool pool(4);
+    std::vector<std::thread> submitters;
+    for (size_t t = 0; t < kThreads; ++t) {
+      submitters.emplace_back([&, t] {
+        for (size_t i = 0; i < kPerThread; ++i) {
+          size_t id = t * kPerThread + i;
+          pool.execute([&, id] {
+            tally.hit(id);
+            done.arrive();
+          });
+        }
+      });
+    }
+    for (std::thread &submitter : submitters) {
+      submitter.join();
+    }
+    done.wait();
+  }
+  tally.check_once("external submissions");
+}
+
+// Each task submits its children from the worker it runs on, down to a
+// fan-out tree of kNodes tasks, so the worker deques and stealing carry
+// nearly all of it
+static void tasks_from_running_tasks_run_once() {
+  const size_t kFanOut = 4, kNodes = 5461; // a full tree six levels deep
+  Tally tally(kNodes);
+  Latch done(kNodes);
+  // Outlives the pool, whose destructor joins tasks still returning from it
+  std::function<void(size_t)> visit;
+  {
+    ThreadPool pool(4);
+    // Node n's children are n * kFanOut + 1 .. n * kFanOut + kFanOut
+    visit = [&](size_t node) {
+      tally.hit(node);
+      for (size_t k = 1; k <= kFanOut; ++k) {
+        size_t child = node * kFanOut + k;
+        if (child < kNodes) {
+          pool.execute([&visit, child] { visit(child); });
+        }
+      }
+      done.arrive();
+    };
+    pool.execute([&visit] { visit(0); });
+    done.wait();
+  }
+  tally.check_once("nested submissions");
+}
+
+static void futures_carry_results_and_exceptions() {
+  ThreadPool pool(2);
+  std::future<int> sum = pool.enqueue([](int a, int b) { return a + b; }, 2, 3);
+  std::future<void> thrown =
+      pool.enqueue([] { throw std::runtime_error("boom"); });
+  CHECK_EQ(sum.get(), 5);
+  bool caught = false;
+  try {
+    thrown.get();
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  CHECK(caught);
+}
+
+// Tasks queued behind busy workers still run when the pool is destroyed,
+// including ones they submit while it drains
+static void destruction_drains_the_queue() {
+  const size_t kTasks = 10000;
+  Tally tally(kTasks * 2);
+  std::mutex gate;
+  std::unique_lock<std::mutex> hold(gate);
+  {
+    ThreadPool pool(2);
+    for (int i = 0; i < 2; ++i) {
+      pool.execute([&gate] { std::lock_guard<std::mutex> wait(gate); });
+    }
+    for (size_t i = 0; i < kTasks; ++i) {
+      pool.execute([&pool, &tally, i] {
+        tally.hit(i);
+        pool.execute([&tally, i] { tally.hit(kTasks + i); });
+      });
+    }
+    CHECK(pool.pending() > 0);
+    hold.unlock();
+  }
+  tally.check_once("drain");
+}
+
+static void parallel_for_visits_each_index_once() {
+  ThreadPool pool(4);
+  for (size_t count : {size_t(0), size_t(1), size_t(3), size_t(10000)}) {
+    Tally tally(count);
+    pool.parallel_for(count, [&](size_t i) { tally.hit(i); });
+    tally.check_once(("parallel_for of " + std::to_string(count)).c_str());
+  }
+}
+
+// Outer iterations run on workers and call parallel_for again, which must
+// neither deadlock nor lose indices when every worker is already busy
+static void nested_parallel_for_visits_each_index_once() {
+  const size_t kOuter = 64, kInner = 257;
+  Tally tally(kOuter * kInner);
+  ThreadPool pool(4);
+  pool.parallel_for(kOuter, [&](size_t i) {
+    pool.parallel_for(kInner, [&](size_t j) { tally.hit(i * kInner + j); });
+  });
+  tally.check_once("nested parallel_for");
+}
+
+// Several callers at once, from outside the pool and from tasks on it
+static void concurrent_parallel_for_visits_each_index_once() {
+  const size_t kCallers = 6, kCount = 5000;
+  Tally tally(kCallers * kCount);
+  Latch done(kCallers / 2);
+  ThreadPool pool(4);
+  std::vector<std::thread> callers;
+  for (size_t c = 0; c < kCallers; ++c) {
+    auto call = [&, c] {
+      pool.parallel_for(kCount,
+                        [&, c](size_t i) { tally.hit(c * kCount + i); });
+    };
+    if (c % 2 == 0) {
+      callers.emplace_back(call);
+    } else {
+      pool.execute([call, &done] {
+        call();
+        done.arrive();
+      });
+    }
+  }
+  for (std::thread &caller : callers) {
+    caller.join();
+  }
+  done.wait();
+  tally.check_once("concurrent parallel_for");
+}
+
+// The first exception is rethrown once every index has run
+static void parallel_for_rethrows_after_finishing() {
+  const size_t kCount = 1000;
+  Tally tally(kCount);
+  ThreadPool pool(4);
+  bool caught = false;
+  try {
+    pool.parallel_for(kCount, [&](size_t i) {
+      tally.hit(i);
+      if (i % 100 == 7) {
+        throw std::runtime_error("index " + std::to_string(i));
+      }
+    });
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  CHECK(caught);
+  tally.check_once("throwing parallel_for");
+}
+
+int main() {
+  deque_pops_newest_first();
+  deque_owner_and_thieves_take_each_item_once();
+  tasks_from_other_threads_run_once();
+  tasks_from_running_tasks_run_once();
+  futures_carry_results_and_exceptions();
+  destruction_drains_the_queue();
+  parallel_for_visits_each_index_once();
+  nested_parallel_for_visits_each_index_once();
+  concurrent_parallel_for_visits_each_index_once();
+  parallel_for_rethrows_after_finishing();
+  return test::check_result();
+}